@@ -0,0 +1,1798 @@
+#define _XOPEN_SOURCE 700
+/* For syscall */
+#define _DEFAULT_SOURCE
+
+#include <hashmap.h>
+#include <hashmap_typed.h>
+
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/**
+ * Benchmark harness for the hashmap.
+ *
+ * Every workload is run in a forked child process so that the reported peak
+ * RSS belongs to that workload alone. A workload is run twice on identical,
+ * pre-generated operation sequences: once untimed per operation to measure
+ * throughput and once with every operation timed to measure latency.
+ *
+ * Run `run_bench --help` for the available options.
+ */
+
+typedef enum KeyType {
+    KEYS_INT,
+    KEYS_STRING,
+} KeyType;
+
+typedef enum Distribution {
+    DIST_UNIFORM,
+    DIST_ZIPF,
+} Distribution;
+
+typedef enum OutputFormat {
+    FORMAT_CSV,
+    FORMAT_JSON,
+} OutputFormat;
+
+typedef enum OpKind {
+    OP_GET,
+    OP_INSERT,
+    OP_REMOVE,
+} OpKind;
+
+typedef struct Workload {
+    const char *name;
+    KeyType keys;
+    Distribution dist;
+    /* Percentages of gets, inserts and removes. Must add up to 100. */
+    unsigned int get_percent;
+    unsigned int insert_percent;
+    unsigned int remove_percent;
+    /* Percentage of gets that look up a key that was inserted */
+    unsigned int hit_percent;
+} Workload;
+
+typedef struct Config {
+    size_t size;
+    size_t ops;
+    double zipf_s;
+    /* Passed to `hashmap_create_with_options`, 0 for the default */
+    double max_load_factor;
+    /* Whether the map is created with room for all prefilled keys */
+    bool presize;
+    /* Passed to `hashmap_create_with_options`, 0 resizes all at once */
+    size_t resize_step;
+    /* Whether integer keys and values are stored in the map itself */
+    bool flat;
+    /* Passed to `hashmap_create_with_options`, ignored for flat maps */
+    bool scan_entries;
+    /* Whether integer keys use a map defined with `HASHMAP_DEFINE` */
+    bool typed;
+    /* Up to how many consecutive gets or inserts use the batch API */
+    size_t batch;
+    /* Whether large tables are allocated with `HUGE_PAGE_ALLOCATOR` */
+    bool huge_pages;
+    uint64_t seed;
+    OutputFormat format;
+} Config;
+
+typedef struct Op {
+    OpKind kind;
+    size_t key;
+} Op;
+
+typedef struct Result {
+    double ops_per_sec;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+    size_t max_probe;
+    double mean_probe;
+    long peak_rss_kb;
+    /* Per operation of the throughput pass, negative if not available */
+    double dtlb_misses_per_op;
+} Result;
+
+static const Workload PRESETS[] = {
+    { "get_hit_uniform",  KEYS_INT,    DIST_UNIFORM, 100,  0,  0, 100 },
+    { "get_miss_uniform", KEYS_INT,    DIST_UNIFORM, 100,  0,  0,   0 },
+    { "get_hit_zipf",     KEYS_INT,    DIST_ZIPF,    100,  0,  0, 100 },
+    { "insert_heavy",     KEYS_INT,    DIST_UNIFORM,  10, 80, 10, 100 },
+    { "insert_only",      KEYS_INT,    DIST_UNIFORM,   0,100,  0, 100 },
+    { "delete_heavy",     KEYS_INT,    DIST_UNIFORM,  10, 10, 80, 100 },
+    { "mixed",            KEYS_INT,    DIST_ZIPF,     50, 25, 25,  90 },
+    { "str_get_hit",      KEYS_STRING, DIST_UNIFORM, 100,  0,  0, 100 },
+    { "str_get_miss",     KEYS_STRING, DIST_UNIFORM, 100,  0,  0,   0 },
+    { "str_get_hit_zipf", KEYS_STRING, DIST_ZIPF,    100,  0,  0, 100 },
+    { "str_insert_heavy", KEYS_STRING, DIST_UNIFORM,  10, 80, 10, 100 },
+    { "str_delete_heavy", KEYS_STRING, DIST_UNIFORM,  10, 10, 80, 100 },
+    { "str_mixed",        KEYS_STRING, DIST_ZIPF,     50, 25, 25,  90 },
+};
+
+#define NUM_PRESETS (sizeof(PRESETS) / sizeof(PRESETS[0]))
+
+/**
+ * splitmix64, used as a small and fast pseudo random number generator.
+ */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Uniformly distributed random number in [0, bound).
+ */
+static size_t random_below(uint64_t *state, size_t bound) {
+    return (size_t)(next_random(state) % bound);
+}
+
+static double random_unit(uint64_t *state) {
+    return (double)(next_random(state) >> 11) / (double)(1ull << 53);
+}
+
+/**
+ * Tables of at least this many bytes are mapped in huge pages with
+ * `--huge-pages`.
+ */
+static size_t huge_page_threshold = (size_t)4 << 20;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * A simple hash for integer keys, the kind a typical user would write.
+ */
+static hash_t uint64_hash(Key *key) {
+    uint64_t k = *(uint64_t *)key;
+    return (hash_t)(k ^ (k >> 32));
+}
+
+static bool uint64_equal(Key *key1, Key *key2) {
+    return *(uint64_t *)key1 == *(uint64_t *)key2;
+}
+
+static hash_t typed_uint64_hash(uint64_t key) {
+    return (hash_t)(key ^ (key >> 32));
+}
+
+static bool typed_uint64_equal(uint64_t key1, uint64_t key2) {
+    return key1 == key2;
+}
+
+HASHMAP_DEFINE(U64Map, uint64_t, uint64_t, typed_uint64_hash, typed_uint64_equal)
+
+/**
+ * The map under test, either a `Hashmap` or, for `--typed`, a `U64Map`.
+ */
+typedef struct BenchMap {
+    Hashmap *map;
+    U64Map *typed;
+} BenchMap;
+
+/**
+ * The keys used by a workload.
+ *
+ * Key `i` is stored at `ints[i]` or `strings[i]`. Keys in [0, size) are
+ * inserted before the measurement, keys in [size, 2 * size) are never inserted
+ * and used for misses, keys from 2 * size onwards are used by inserts.
+ */
+typedef struct KeySet {
+    KeyType type;
+    size_t count;
+    uint64_t *ints;
+    char **strings;
+} KeySet;
+
+static Key *key_at(KeySet *keys, size_t i) {
+    if (keys->type == KEYS_INT) {
+        return &keys->ints[i];
+    } else {
+        return keys->strings[i];
+    }
+}
+
+static bool keyset_init(KeySet *keys, KeyType type, size_t count) {
+    keys->type = type;
+    keys->count = count;
+    keys->ints = NULL;
+    keys->strings = NULL;
+
+    if (type == KEYS_INT) {
+        keys->ints = malloc(count * sizeof(*keys->ints));
+        if (keys->ints == NULL) {
+            return false;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            /* Spread the keys out a bit, consecutive integers are too easy */
+            keys->ints[i] = (uint64_t)i * 0x9E3779B1ull;
+        }
+    } else {
+        keys->strings = malloc(count * sizeof(*keys->strings));
+        if (keys->strings == NULL) {
+            return false;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            char buffer[64];
+            int length = snprintf(buffer, sizeof(buffer), "benchmark-key-%zu", i);
+            assert(length > 0);
+            keys->strings[i] = malloc((size_t)length + 1);
+            if (keys->strings[i] == NULL) {
+                /* Only the strings allocated so far should be freed */
+                keys->count = i;
+                return false;
+            }
+            memcpy(keys->strings[i], buffer, (size_t)length + 1);
+        }
+    }
+    return true;
+}
+
+static void keyset_free(KeySet *keys) {
+    if (keys->strings != NULL) {
+        for (size_t i = 0; i < keys->count; ++i) {
+            free(keys->strings[i]);
+        }
+    }
+    free(keys->strings);
+    free(keys->ints);
+}
+
+/**
+ * Samples ranks in [0, n) where rank r has probability proportional to
+ * 1 / (r + 1)^s. Ranks are mapped to keys through a random permutation, so
+ * that the popular keys are not clustered together.
+ */
+typedef struct Zipf {
+    size_t n;
+    double *cdf;
+    size_t *permutation;
+} Zipf;
+
+static bool zipf_init(Zipf *zipf, size_t n, double s, uint64_t *rng) {
+    zipf->n = n;
+    zipf->cdf = malloc(n * sizeof(*zipf->cdf));
+    zipf->permutation = malloc(n * sizeof(*zipf->permutation));
+    if (zipf->cdf == NULL || zipf->permutation == NULL) {
+        return false;
+    }
+
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        sum += 1.0 / pow((double)(i + 1), s);
+        zipf->cdf[i] = sum;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        zipf->cdf[i] /= sum;
+        zipf->permutation[i] = i;
+    }
+    for (size_t i = n; i > 1; --i) {
+        size_t j = random_below(rng, i);
+        size_t tmp = zipf->permutation[i - 1];
+        zipf->permutation[i - 1] = zipf->permutation[j];
+        zipf->permutation[j] = tmp;
+    }
+    return true;
+}
+
+static size_t zipf_sample(Zipf *zipf, uint64_t *rng) {
+    double u = random_unit(rng);
+    size_t low = 0;
+    size_t high = zipf->n - 1;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (zipf->cdf[mid] < u) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return zipf->permutation[low];
+}
+
+static void zipf_free(Zipf *zipf) {
+    free(zipf->cdf);
+    free(zipf->permutation);
+}
+
+/**
+ * Pick one of the `size` initially inserted keys according to the
+ * distribution of the workload.
+ */
+static size_t pick_key(const Workload *workload, Zipf *zipf, size_t size, uint64_t *rng) {
+    if (workload->dist == DIST_ZIPF) {
+        return zipf_sample(zipf, rng);
+    } else {
+        return random_below(rng, size);
+    }
+}
+
+static Op *generate_ops(const Workload *workload, const Config *config, Zipf *zipf) {
+    Op *ops = malloc(config->ops * sizeof(*ops));
+    if (ops == NULL) {
+        return NULL;
+    }
+
+    uint64_t rng = config->seed;
+    size_t next_insert = 2 * config->size;
+    for (size_t i = 0; i < config->ops; ++i) {
+        unsigned int roll = (unsigned int)random_below(&rng, 100);
+        if (roll < workload->get_percent) {
+            ops[i].kind = OP_GET;
+            if (random_below(&rng, 100) < workload->hit_percent) {
+                ops[i].key = pick_key(workload, zipf, config->size, &rng);
+            } else {
+                ops[i].key = config->size + random_below(&rng, config->size);
+            }
+        } else if (roll < workload->get_percent + workload->insert_percent) {
+            ops[i].kind = OP_INSERT;
+            ops[i].key = next_insert;
+            next_insert += 1;
+        } else {
+            ops[i].kind = OP_REMOVE;
+            ops[i].key = pick_key(workload, zipf, config->size, &rng);
+        }
+    }
+    return ops;
+}
+
+static void bench_map_destroy(BenchMap *map) {
+    if (map->typed != NULL) {
+        U64Map_destroy(map->typed, NULL, NULL);
+    } else {
+        hashmap_destroy(map->map, NULL, NULL);
+    }
+}
+
+static bool prefill_typed(KeySet *keys, const Config *config, BenchMap *map) {
+    HashmapOptions options = {
+        .initial_capacity = config->presize ? config->size : 0,
+        .max_load_factor = config->max_load_factor,
+        .resize_step = config->resize_step,
+    };
+    if (config->huge_pages) {
+        map->typed = U64Map_create_with_allocator(options, HUGE_PAGE_ALLOCATOR(&huge_page_threshold));
+    } else {
+        map->typed = U64Map_create_with_options(options);
+    }
+    if (map->typed == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < config->size; ++i) {
+        if (!U64Map_insert(map->typed, keys->ints[i], keys->ints[i], NULL)) {
+            bench_map_destroy(map);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool prefill(KeySet *keys, const Config *config, BenchMap *bench_map) {
+    bench_map->map = NULL;
+    bench_map->typed = NULL;
+    if (config->typed && keys->type == KEYS_INT) {
+        return prefill_typed(keys, config, bench_map);
+    }
+
+    Hasher hasher;
+    if (keys->type == KEYS_INT) {
+        hasher = (Hasher) { .hash = uint64_hash, .equal = uint64_equal };
+    } else {
+        hasher = STRING_HASHER;
+    }
+
+    HashmapOptions options = {
+        .initial_capacity = config->presize ? config->size : 0,
+        .max_load_factor = config->max_load_factor,
+        .resize_step = config->resize_step,
+    };
+    if (config->flat && keys->type == KEYS_INT) {
+        /* The key is also used as the value, so both are 8 bytes */
+        hasher.equal = NULL;
+        options.key_size = sizeof(uint64_t);
+        options.value_size = sizeof(uint64_t);
+    } else {
+        options.scan_entries = config->scan_entries;
+    }
+    Hashmap *map;
+    if (config->huge_pages) {
+        map = hashmap_create_with_allocator(hasher, options, HUGE_PAGE_ALLOCATOR(&huge_page_threshold));
+    } else {
+        map = hashmap_create_with_options(hasher, options);
+    }
+    if (map == NULL) {
+        return false;
+    }
+    bench_map->map = map;
+    for (size_t i = 0; i < config->size; ++i) {
+        Key *key = key_at(keys, i);
+        if (!hashmap_insert(map, key, key, NULL)) {
+            bench_map_destroy(bench_map);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void bench_map_probe_stats(BenchMap *map, HashmapProbeStats *stats) {
+    if (map->typed == NULL) {
+        hashmap_probe_stats(map->map, stats);
+        return;
+    }
+
+    /* Entries that are still in the old table of a resize are not counted */
+    U64Map_table *table = &map->typed->table;
+    size_t total = 0;
+    stats->max_probe_length = 0;
+    for (size_t i = 0; i < table->capacity; ++i) {
+        if (table->ctrl[i] != HASHMAP_CTRL_EMPTY) {
+            size_t length = U64Map_distance(table, i) + 1;
+            total += length;
+            if (length > stats->max_probe_length) {
+                stats->max_probe_length = length;
+            }
+        }
+    }
+    stats->mean_probe_length = table->size == 0 ? 0.0 : (double)total / (double)table->size;
+}
+
+/**
+ * The result of every operation is folded into this, so that the compiler
+ * cannot optimize any lookups away.
+ */
+static volatile uintptr_t sink;
+
+static void run_typed_op(U64Map *map, KeySet *keys, Op *op) {
+    uint64_t key = keys->ints[op->key];
+    switch (op->kind) {
+        case OP_GET:
+            sink += (uintptr_t)U64Map_get(map, key);
+            break;
+        case OP_INSERT:
+            sink += (uintptr_t)U64Map_insert(map, key, key, NULL);
+            break;
+        case OP_REMOVE:
+            sink += (uintptr_t)U64Map_remove(map, key, NULL);
+            break;
+    }
+}
+
+static void run_op(BenchMap *bench_map, KeySet *keys, Op *op) {
+    if (bench_map->typed != NULL) {
+        run_typed_op(bench_map->typed, keys, op);
+        return;
+    }
+
+    Hashmap *map = bench_map->map;
+    Key *key = key_at(keys, op->key);
+    switch (op->kind) {
+        case OP_GET:
+            sink += (uintptr_t)hashmap_get(map, key);
+            break;
+        case OP_INSERT:
+            sink += (uintptr_t)hashmap_insert(map, key, key, NULL);
+            break;
+        case OP_REMOVE:
+            sink += (uintptr_t)hashmap_remove(map, key, NULL);
+            break;
+    }
+}
+
+#define MAX_BATCH 256
+
+/**
+ * Run the operations starting at `ops`, of which there are `remaining`.
+ *
+ * With `--batch`, consecutive gets and inserts are run together through
+ * `hashmap_get_many` and `hashmap_insert_many`. Returns the number of
+ * operations that were run.
+ */
+static size_t run_ops(BenchMap *bench_map, KeySet *keys, Op *ops, size_t remaining, const Config *config) {
+    size_t count = 1;
+    if (bench_map->typed == NULL && ops[0].kind != OP_REMOVE) {
+        size_t limit = config->batch < remaining ? config->batch : remaining;
+        while (count < limit && ops[count].kind == ops[0].kind) {
+            count += 1;
+        }
+    }
+    if (count == 1) {
+        run_op(bench_map, keys, &ops[0]);
+        return 1;
+    }
+
+    Key *batch_keys[MAX_BATCH];
+    Value *batch_values[MAX_BATCH];
+    for (size_t i = 0; i < count; ++i) {
+        batch_keys[i] = key_at(keys, ops[i].key);
+    }
+    if (ops[0].kind == OP_GET) {
+        hashmap_get_many(bench_map->map, batch_keys, count, batch_values);
+        for (size_t i = 0; i < count; ++i) {
+            sink += (uintptr_t)batch_values[i];
+        }
+    } else {
+        sink += (uintptr_t)hashmap_insert_many(bench_map->map, batch_keys, batch_keys, count, NULL);
+    }
+    return count;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t *sorted, size_t n, double p) {
+    size_t index = (size_t)(p * (double)(n - 1));
+    return sorted[index];
+}
+
+/**
+ * Open a counter of the dTLB load misses of this process, which starts
+ * disabled. Returns -1 if the counter is not available, e.g. in most virtual
+ * machines or if perf events are restricted.
+ */
+static int open_dtlb_counter(void) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static void enable_counter(int fd, bool enable) {
+#ifdef __linux__
+    if (fd >= 0) {
+        ioctl(fd, enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+    }
+#else
+    (void)fd;
+    (void)enable;
+#endif
+}
+
+/**
+ * Returns the value of the counter, or -1 if it is not available.
+ */
+static long long read_counter(int fd) {
+    long long count;
+    if (fd < 0 || read(fd, &count, sizeof(count)) != (ssize_t)sizeof(count)) {
+        return -1;
+    }
+    return count;
+}
+
+static bool run_workload(const Workload *workload, const Config *config, Result *result) {
+    uint64_t rng = config->seed ^ 0x5DEECE66Dull;
+
+    size_t num_keys = 2 * config->size + config->ops;
+    KeySet keys;
+    Zipf zipf = { 0, NULL, NULL };
+    Op *ops = NULL;
+    uint64_t *latencies = NULL;
+    bool success = false;
+
+    if (!keyset_init(&keys, workload->keys, num_keys)) {
+        goto cleanup;
+    }
+    if (workload->dist == DIST_ZIPF && !zipf_init(&zipf, config->size, config->zipf_s, &rng)) {
+        goto cleanup;
+    }
+    ops = generate_ops(workload, config, &zipf);
+    latencies = malloc(config->ops * sizeof(*latencies));
+    if (ops == NULL || latencies == NULL) {
+        goto cleanup;
+    }
+
+    /* Throughput pass */
+    BenchMap map;
+    if (!prefill(&keys, config, &map)) {
+        goto cleanup;
+    }
+    int dtlb_counter = open_dtlb_counter();
+    enable_counter(dtlb_counter, true);
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < config->ops;) {
+        i += run_ops(&map, &keys, &ops[i], config->ops - i, config);
+    }
+    uint64_t elapsed = now_ns() - start;
+    enable_counter(dtlb_counter, false);
+    long long dtlb_misses = read_counter(dtlb_counter);
+    if (dtlb_counter >= 0) {
+        close(dtlb_counter);
+    }
+    bench_map_destroy(&map);
+    result->ops_per_sec = (double)config->ops / ((double)elapsed / 1e9);
+    result->dtlb_misses_per_op = dtlb_misses < 0 ? -1.0 : (double)dtlb_misses / (double)config->ops;
+
+    /* Latency pass */
+    if (!prefill(&keys, config, &map)) {
+        goto cleanup;
+    }
+    for (size_t i = 0; i < config->ops;) {
+        uint64_t op_start = now_ns();
+        size_t count = run_ops(&map, &keys, &ops[i], config->ops - i, config);
+        /* Operations run as a batch share its latency */
+        uint64_t latency = (now_ns() - op_start) / count;
+        for (size_t j = 0; j < count; ++j) {
+            latencies[i + j] = latency;
+        }
+        i += count;
+    }
+    HashmapProbeStats probe_stats;
+    bench_map_probe_stats(&map, &probe_stats);
+    result->max_probe = probe_stats.max_probe_length;
+    result->mean_probe = probe_stats.mean_probe_length;
+    bench_map_destroy(&map);
+
+    qsort(latencies, config->ops, sizeof(*latencies), compare_u64);
+    result->p50_ns = percentile(latencies, config->ops, 0.5);
+    result->p99_ns = percentile(latencies, config->ops, 0.99);
+    result->p999_ns = percentile(latencies, config->ops, 0.999);
+    result->max_ns = latencies[config->ops - 1];
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    result->peak_rss_kb = usage.ru_maxrss;
+
+    success = true;
+
+cleanup:
+    free(latencies);
+    free(ops);
+    zipf_free(&zipf);
+    keyset_free(&keys);
+    return success;
+}
+
+static const char *key_type_name(KeyType type) {
+    switch (type) {
+        case KEYS_INT:
+            return "int";
+        case KEYS_STRING:
+            return "string";
+    }
+    return "unknown";
+}
+
+static const char *dist_name(Distribution dist) {
+    switch (dist) {
+        case DIST_UNIFORM:
+            return "uniform";
+        case DIST_ZIPF:
+            return "zipf";
+    }
+    return "unknown";
+}
+
+static void print_header(OutputFormat format) {
+    if (format == FORMAT_CSV) {
+        printf("workload,keys,dist,size,ops,get_pct,insert_pct,remove_pct,hit_pct,"
+                "ops_per_sec,p50_ns,p99_ns,p999_ns,max_ns,max_probe,mean_probe,peak_rss_kb,"
+                "dtlb_misses_per_op\n");
+    }
+}
+
+static void print_result(OutputFormat format, const Workload *w, const Config *c, const Result *r) {
+    if (format == FORMAT_CSV) {
+        printf("%s,%s,%s,%zu,%zu,%u,%u,%u,%u,%.0f,%llu,%llu,%llu,%llu,%zu,%.3f,%ld,%.3f\n",
+                w->name, key_type_name(w->keys), dist_name(w->dist), c->size, c->ops,
+                w->get_percent, w->insert_percent, w->remove_percent, w->hit_percent,
+                r->ops_per_sec,
+                (unsigned long long)r->p50_ns, (unsigned long long)r->p99_ns,
+                (unsigned long long)r->p999_ns, (unsigned long long)r->max_ns,
+                r->max_probe, r->mean_probe, r->peak_rss_kb, r->dtlb_misses_per_op);
+    } else {
+        printf("{\"workload\":\"%s\",\"keys\":\"%s\",\"dist\":\"%s\",\"size\":%zu,\"ops\":%zu,"
+                "\"get_pct\":%u,\"insert_pct\":%u,\"remove_pct\":%u,\"hit_pct\":%u,"
+                "\"ops_per_sec\":%.0f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+                "\"max_ns\":%llu,\"max_probe\":%zu,\"mean_probe\":%.3f,\"peak_rss_kb\":%ld,"
+                "\"dtlb_misses_per_op\":%.3f}\n",
+                w->name, key_type_name(w->keys), dist_name(w->dist), c->size, c->ops,
+                w->get_percent, w->insert_percent, w->remove_percent, w->hit_percent,
+                r->ops_per_sec,
+                (unsigned long long)r->p50_ns, (unsigned long long)r->p99_ns,
+                (unsigned long long)r->p999_ns, (unsigned long long)r->max_ns,
+                r->max_probe, r->mean_probe, r->peak_rss_kb, r->dtlb_misses_per_op);
+    }
+    fflush(stdout);
+}
+
+/**
+ * Run the workload in a child process, so that the peak RSS is measured for
+ * this workload only.
+ */
+static bool run_isolated(const Workload *workload, const Config *config) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        Result result = { 0.0, 0, 0, 0, 0, 0, 0.0, 0, -1.0 };
+        if (!run_workload(workload, config, &result)) {
+            fprintf(stderr, "workload %s failed\n", workload->name);
+            _exit(1);
+        }
+        print_result(config->format, workload, config, &result);
+        _exit(0);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * djb2, the string hash the library used before `hashmap_hash_bytes`, kept for
+ * comparison.
+ */
+static hash_t djb2_hash(Key *key) {
+    const unsigned char *str = key;
+    hash_t hash = 5381;
+    hash_t c;
+    while ((c = *str++)) {
+        hash = ((hash << 5) + hash) + c;
+    }
+    return hash;
+}
+
+static uint64_t hash_bench_seed = 0x9E3779B97F4A7C15ull;
+
+/* All keys of a run of the hash benchmark have this length */
+static size_t hash_bench_length;
+
+static hash_t known_length_hash(Key *key) {
+    return hashmap_hash_bytes(key, hash_bench_length, 0);
+}
+
+typedef struct HashCase {
+    const char *name;
+    Hasher hasher;
+} HashCase;
+
+/**
+ * Measure the throughput of the string hashes for keys of the given length,
+ * and the probe lengths when `count` such keys are inserted into a map.
+ */
+static bool run_hash_case(const HashCase *hash_case, size_t length, size_t count, uint64_t seed) {
+    char *keys = malloc(count * (length + 1));
+    if (keys == NULL) {
+        return false;
+    }
+    uint64_t rng = seed;
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_";
+    for (size_t i = 0; i < count; ++i) {
+        char *key = &keys[i * (length + 1)];
+        /* The first characters encode the index, so that all keys differ */
+        size_t index = i;
+        for (size_t j = 0; j < length; ++j) {
+            if (j < 8) {
+                key[j] = alphabet[index % 64];
+                index /= 64;
+            } else {
+                key[j] = alphabet[random_below(&rng, 64)];
+            }
+        }
+        key[length] = '\0';
+    }
+    hash_bench_length = length;
+
+    /* Hash a small set of keys repeatedly, so that we measure the hash itself */
+    size_t hot_count = count < 1024 ? count : 1024;
+    size_t rounds = 1 + ((size_t)256 << 20) / (hot_count * (length + 1));
+    hash_t hash_sum = 0;
+    uint64_t start = now_ns();
+    for (size_t round = 0; round < rounds; ++round) {
+        for (size_t i = 0; i < hot_count; ++i) {
+            Key *key = &keys[i * (length + 1)];
+            if (hash_case->hasher.hash_with_context != NULL) {
+                hash_sum += hash_case->hasher.hash_with_context(key, hash_case->hasher.context);
+            } else {
+                hash_sum += hash_case->hasher.hash(key);
+            }
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    sink += hash_sum;
+    double gb_per_sec = (double)(rounds * hot_count * length) / (double)elapsed;
+
+    Hashmap *map = hashmap_create(hash_case->hasher);
+    if (map == NULL) {
+        free(keys);
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        Key *key = &keys[i * (length + 1)];
+        hashmap_insert(map, key, key, NULL);
+    }
+    HashmapProbeStats stats;
+    hashmap_probe_stats(map, &stats);
+    hashmap_destroy(map, NULL, NULL);
+    free(keys);
+
+    printf("%s,%zu,%zu,%.3f,%zu,%.3f\n", hash_case->name, length, count, gb_per_sec,
+            stats.max_probe_length, stats.mean_probe_length);
+    return true;
+}
+
+/**
+ * Compare the string hashes, see `--hashes`.
+ */
+static bool run_hash_bench(const Config *config) {
+    const HashCase cases[] = {
+        { "djb2", { .hash = djb2_hash, .equal = string_equal } },
+        { "string_hash", STRING_HASHER },
+        { "string_hash_seeded", STRING_HASHER_SEEDED(&hash_bench_seed) },
+        { "hash_bytes_known_length", { .hash = known_length_hash, .equal = string_equal } },
+    };
+    const size_t lengths[] = { 4, 8, 16, 32, 64, 256, 1024, 4096 };
+
+    printf("hash,key_length,keys,gb_per_sec,max_probe,mean_probe\n");
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+        /* Keep the keys of long lengths below 256 MB */
+        size_t count = config->size;
+        if (count > ((size_t)256 << 20) / (lengths[i] + 1)) {
+            count = ((size_t)256 << 20) / (lengths[i] + 1);
+        }
+        for (size_t j = 0; j < sizeof(cases) / sizeof(cases[0]); ++j) {
+            if (!run_hash_case(&cases[j], lengths[i], count, config->seed)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Measure how long a full iteration over a map of `size` integer keys takes,
+ * after removing every `remove_every`-th key (none if it is 0).
+ */
+static bool run_scan_case(const Config *config, bool ordered, size_t remove_every) {
+    KeySet keys;
+    if (!keyset_init(&keys, KEYS_INT, config->size)) {
+        keyset_free(&keys);
+        return false;
+    }
+    Hasher hasher = { .hash = uint64_hash, .equal = uint64_equal };
+    HashmapOptions options = { .max_load_factor = config->max_load_factor, .ordered = ordered };
+    Hashmap *map = hashmap_create_with_options(hasher, options);
+    if (map == NULL) {
+        keyset_free(&keys);
+        return false;
+    }
+    for (size_t i = 0; i < config->size; ++i) {
+        if (!hashmap_insert(map, &keys.ints[i], &keys.ints[i], NULL)) {
+            hashmap_destroy(map, NULL, NULL);
+            keyset_free(&keys);
+            return false;
+        }
+    }
+    if (remove_every != 0) {
+        for (size_t i = 0; i < config->size; i += remove_every) {
+            hashmap_remove(map, &keys.ints[i], NULL);
+        }
+    }
+
+    /* Scan until at least `ops` entries have been visited */
+    size_t size = hashmap_size(map);
+    size_t rounds = size == 0 ? 1 : 1 + config->ops / size;
+    uint64_t sum = 0;
+    uint64_t start = now_ns();
+    for (size_t round = 0; round < rounds; ++round) {
+        HashmapIter iter;
+        HashmapEntry entry;
+        hashmap_iter_begin(map, &iter);
+        while (hashmap_iter_next(&iter, &entry)) {
+            sum += *(uint64_t *)entry.value;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    sink += sum;
+
+    printf("%s,%zu,%zu,%zu,%.3f\n", ordered ? "ordered" : "unordered", size, hashmap_capacity(map),
+            remove_every, (double)elapsed / (double)(rounds * (size == 0 ? 1 : size)));
+    hashmap_destroy(map, NULL, NULL);
+    keyset_free(&keys);
+    return true;
+}
+
+/**
+ * Compare full iterations over unordered and ordered maps, see `--scan`.
+ */
+static bool run_scan_bench(const Config *config) {
+    const size_t remove_every[] = { 0, 4, 2 };
+
+    printf("layout,size,capacity,removed_every,ns_per_entry\n");
+    for (size_t i = 0; i < sizeof(remove_every) / sizeof(remove_every[0]); ++i) {
+        if (!run_scan_case(config, false, remove_every[i])
+                || !run_scan_case(config, true, remove_every[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Measure building a map of `size` integer keys with `hashmap_build_parallel`
+ * using `threads` threads, or with `hashmap_insert` if `threads` is 0.
+ */
+static bool run_build_case(KeySet *keys, HashmapEntry *entries, size_t size, size_t threads) {
+    Hasher hasher = { .hash = uint64_hash, .equal = uint64_equal };
+    uint64_t start = now_ns();
+    Hashmap *map;
+    if (threads == 0) {
+        map = hashmap_create(hasher);
+        for (size_t i = 0; map != NULL && i < size; ++i) {
+            if (!hashmap_insert(map, &keys->ints[i], &keys->ints[i], NULL)) {
+                hashmap_destroy(map, NULL, NULL);
+                map = NULL;
+            }
+        }
+    } else {
+        map = hashmap_build_parallel(hasher, entries, size, threads);
+    }
+    uint64_t elapsed = now_ns() - start;
+    if (map == NULL) {
+        return false;
+    }
+
+    printf("%s,%zu,%zu,%.3f,%.3f\n", threads == 0 ? "insert" : "build_parallel", threads, size,
+            (double)elapsed / 1e6, (double)size / ((double)elapsed / 1e9));
+    hashmap_destroy(map, NULL, NULL);
+    return true;
+}
+
+/**
+ * Compare building a map with `hashmap_insert` to `hashmap_build_parallel`
+ * with an increasing number of threads, see `--build`.
+ */
+static bool run_build_bench(const Config *config) {
+    KeySet keys;
+    HashmapEntry *entries = malloc(config->size * sizeof(*entries));
+    if (entries == NULL || !keyset_init(&keys, KEYS_INT, config->size)) {
+        free(entries);
+        return false;
+    }
+    for (size_t i = 0; i < config->size; ++i) {
+        entries[i] = (HashmapEntry) { &keys.ints[i], &keys.ints[i] };
+    }
+
+    const size_t threads[] = { 0, 1, 2, 4, 8, 16 };
+    bool success = true;
+    printf("method,threads,size,ms,ops_per_sec\n");
+    for (size_t i = 0; success && i < sizeof(threads) / sizeof(threads[0]); ++i) {
+        success = run_build_case(&keys, entries, config->size, threads[i]);
+    }
+
+    keyset_free(&keys);
+    free(entries);
+    return success;
+}
+
+/**
+ * The largest number of threads `--threads` and `--ingest` run.
+ */
+#define MAX_READ_THREADS 16
+
+/**
+ * The state shared by the threads of the read scaling benchmark.
+ */
+typedef struct ReadBench {
+    KeySet *keys;
+    size_t size;
+    size_t ops_per_thread;
+    /* Either `map` guarded by `lock`, or `concurrent` */
+    Hashmap *map;
+    pthread_mutex_t lock;
+    ConcurrentHashmap *concurrent;
+    /* Set once all readers are done, to stop the writer */
+    bool done;
+} ReadBench;
+
+typedef struct ReadBenchThread {
+    ReadBench *bench;
+    uint64_t seed;
+    size_t found;
+} ReadBenchThread;
+
+static void *read_bench_reader(void *arg) {
+    ReadBenchThread *thread = arg;
+    ReadBench *bench = thread->bench;
+    uint64_t rng = thread->seed;
+    size_t found = 0;
+    for (size_t i = 0; i < bench->ops_per_thread; ++i) {
+        Key *key = &bench->keys->ints[random_below(&rng, bench->size)];
+        Value *value;
+        if (bench->concurrent != NULL) {
+            value = concurrent_hashmap_get(bench->concurrent, key);
+        } else {
+            pthread_mutex_lock(&bench->lock);
+            value = hashmap_get(bench->map, key);
+            pthread_mutex_unlock(&bench->lock);
+        }
+        found += value != NULL;
+    }
+    thread->found = found;
+    return NULL;
+}
+
+/**
+ * Insert and remove keys that are never looked up until the readers are done.
+ */
+static void *read_bench_writer(void *arg) {
+    ReadBench *bench = arg;
+    size_t i = 0;
+    while (!__atomic_load_n(&bench->done, __ATOMIC_ACQUIRE)) {
+        Key *key = &bench->keys->ints[bench->size + i % bench->size];
+        if (bench->concurrent != NULL) {
+            concurrent_hashmap_insert(bench->concurrent, key, key, NULL);
+            concurrent_hashmap_remove(bench->concurrent, key, NULL);
+        } else {
+            pthread_mutex_lock(&bench->lock);
+            hashmap_insert(bench->map, key, key, NULL);
+            hashmap_remove(bench->map, key, NULL);
+            pthread_mutex_unlock(&bench->lock);
+        }
+        i += 1;
+    }
+    return NULL;
+}
+
+/**
+ * Measure `ops` uniform lookup hits spread over `num_threads` threads, with a
+ * `Hashmap` behind a mutex or a `ConcurrentHashmap`, and optionally one more
+ * thread writing to the map at the same time.
+ */
+static bool run_read_case(const Config *config, KeySet *keys, bool concurrent, bool writer, size_t num_threads) {
+    ReadBench bench = { keys, config->size, config->ops / num_threads, NULL, PTHREAD_MUTEX_INITIALIZER, NULL, false };
+    assert(num_threads <= MAX_READ_THREADS);
+    Hasher hasher = { .hash = uint64_hash, .equal = uint64_equal };
+    if (concurrent) {
+        bench.concurrent = concurrent_hashmap_create(hasher);
+    } else {
+        bench.map = hashmap_create(hasher);
+    }
+    if (bench.concurrent == NULL && bench.map == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < config->size; ++i) {
+        Key *key = &keys->ints[i];
+        if (concurrent) {
+            concurrent_hashmap_insert(bench.concurrent, key, key, NULL);
+        } else {
+            hashmap_insert(bench.map, key, key, NULL);
+        }
+    }
+
+    ReadBenchThread threads[MAX_READ_THREADS];
+    pthread_t handles[MAX_READ_THREADS];
+    pthread_t writer_handle;
+    bool success = !writer || pthread_create(&writer_handle, NULL, read_bench_writer, &bench) == 0;
+    size_t started = 0;
+    uint64_t start = now_ns();
+    for (; success && started < num_threads; ++started) {
+        threads[started] = (ReadBenchThread) { &bench, config->seed + started, 0 };
+        success = pthread_create(&handles[started], NULL, read_bench_reader, &threads[started]) == 0;
+    }
+    size_t found = 0;
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(handles[i], NULL);
+        found += threads[i].found;
+    }
+    uint64_t elapsed = now_ns() - start;
+    __atomic_store_n(&bench.done, true, __ATOMIC_RELEASE);
+    if (writer) {
+        pthread_join(writer_handle, NULL);
+    }
+
+    if (success) {
+        assert(found == num_threads * bench.ops_per_thread && "Every lookup should hit");
+        double ops = (double)(num_threads * bench.ops_per_thread);
+        printf("%s,%s,%zu,%zu,%.0f\n", concurrent ? "concurrent" : "mutex", writer ? "yes" : "no", num_threads,
+                config->size, ops / ((double)elapsed / 1e9));
+    }
+    if (concurrent) {
+        concurrent_hashmap_destroy(bench.concurrent, NULL, NULL);
+    } else {
+        hashmap_destroy(bench.map, NULL, NULL);
+    }
+    return success;
+}
+
+/**
+ * Compare how lookups scale with the number of threads for a `Hashmap` behind
+ * a mutex and a `ConcurrentHashmap`, see `--threads`.
+ */
+static bool run_read_bench(const Config *config) {
+    KeySet keys;
+    if (!keyset_init(&keys, KEYS_INT, 2 * config->size)) {
+        keyset_free(&keys);
+        return false;
+    }
+
+    const size_t threads[] = { 1, 2, 4, 8, 16 };
+    bool success = true;
+    printf("map,writer,threads,size,ops_per_sec\n");
+    for (int writer = 0; writer <= 1; ++writer) {
+        for (size_t i = 0; success && i < sizeof(threads) / sizeof(threads[0]); ++i) {
+            success = run_read_case(config, &keys, false, writer, threads[i])
+                && run_read_case(config, &keys, true, writer, threads[i]);
+        }
+    }
+
+    keyset_free(&keys);
+    return success;
+}
+
+/**
+ * The state of a thread of the ingestion benchmark, which inserts the keys in
+ * [start, end) into `sharded`, or into `map` guarded by `lock`.
+ */
+typedef struct IngestThread {
+    KeySet *keys;
+    size_t start;
+    size_t end;
+    Hashmap *map;
+    pthread_mutex_t *lock;
+    ShardedHashmap *sharded;
+} IngestThread;
+
+static void *ingest_thread(void *arg) {
+    IngestThread *thread = arg;
+    for (size_t i = thread->start; i < thread->end; ++i) {
+        Key *key = &thread->keys->ints[i];
+        if (thread->sharded != NULL) {
+            sharded_hashmap_insert(thread->sharded, key, key, NULL);
+        } else {
+            pthread_mutex_lock(thread->lock);
+            hashmap_insert(thread->map, key, key, NULL);
+            pthread_mutex_unlock(thread->lock);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Measure inserting `size` keys from `num_threads` threads at once into a
+ * `Hashmap` behind a mutex, or into a `ShardedHashmap` with 4 shards per
+ * thread.
+ */
+static bool run_ingest_case(const Config *config, KeySet *keys, bool sharded, size_t num_threads) {
+    Hasher hasher = { .hash = uint64_hash, .equal = uint64_equal };
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    Hashmap *map = NULL;
+    ShardedHashmap *sharded_map = NULL;
+    if (sharded) {
+        sharded_map = sharded_hashmap_create(hasher, 4 * num_threads);
+    } else {
+        map = hashmap_create(hasher);
+    }
+    if (map == NULL && sharded_map == NULL) {
+        return false;
+    }
+
+    IngestThread threads[MAX_READ_THREADS];
+    pthread_t handles[MAX_READ_THREADS];
+    bool success = true;
+    size_t started = 0;
+    uint64_t start = now_ns();
+    for (; success && started < num_threads; ++started) {
+        threads[started] = (IngestThread) {
+            keys, config->size * started / num_threads, config->size * (started + 1) / num_threads,
+            map, &lock, sharded_map,
+        };
+        success = pthread_create(&handles[started], NULL, ingest_thread, &threads[started]) == 0;
+    }
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(handles[i], NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    if (success) {
+        size_t size = sharded ? sharded_hashmap_size(sharded_map) : hashmap_size(map);
+        assert(size == config->size && "Every key should be inserted");
+        printf("%s,%zu,%zu,%.0f\n", sharded ? "sharded" : "mutex", num_threads, size,
+                (double)config->size / ((double)elapsed / 1e9));
+    }
+    if (sharded) {
+        sharded_hashmap_destroy(sharded_map, NULL, NULL);
+    } else {
+        hashmap_destroy(map, NULL, NULL);
+    }
+    return success;
+}
+
+/**
+ * Compare inserting from many threads into a `Hashmap` behind a mutex and
+ * into a `ShardedHashmap`, see `--ingest`.
+ */
+static bool run_ingest_bench(const Config *config) {
+    KeySet keys;
+    if (!keyset_init(&keys, KEYS_INT, config->size)) {
+        keyset_free(&keys);
+        return false;
+    }
+
+    const size_t threads[] = { 1, 2, 4, 8, 16 };
+    bool success = true;
+    printf("map,threads,size,inserts_per_sec\n");
+    for (size_t i = 0; success && i < sizeof(threads) / sizeof(threads[0]); ++i) {
+        success = run_ingest_case(config, &keys, false, threads[i])
+            && run_ingest_case(config, &keys, true, threads[i]);
+    }
+
+    keyset_free(&keys);
+    return success;
+}
+
+/**
+ * Compare building a map of string keys by inserting every key to saving it
+ * with `hashmap_save` and opening it with `hashmap_open_mapped`, see
+ * `--snapshot`.
+ */
+static bool run_snapshot_bench(const Config *config) {
+    KeySet keys;
+    if (!keyset_init(&keys, KEYS_STRING, config->size)) {
+        keyset_free(&keys);
+        return false;
+    }
+    HashmapOptions options = { .key_copy_size = string_size, .value_copy_size = string_size };
+
+    uint64_t start = now_ns();
+    Hashmap *map = hashmap_create_with_options(STRING_HASHER, options);
+    for (size_t i = 0; map != NULL && i < config->size; ++i) {
+        if (!hashmap_insert(map, keys.strings[i], keys.strings[i], NULL)) {
+            hashmap_destroy(map, NULL, NULL);
+            map = NULL;
+        }
+    }
+    uint64_t insert_ns = now_ns() - start;
+
+    char path[] = "/tmp/hashmap_bench_XXXXXX";
+    int fd = map == NULL ? -1 : mkstemp(path);
+    if (fd < 0) {
+        if (map != NULL) {
+            hashmap_destroy(map, NULL, NULL);
+        }
+        keyset_free(&keys);
+        return false;
+    }
+    start = now_ns();
+    bool saved = hashmap_save(map, fd, NULL, NULL);
+    uint64_t save_ns = now_ns() - start;
+    off_t file_size = lseek(fd, 0, SEEK_END);
+    close(fd);
+    hashmap_destroy(map, NULL, NULL);
+
+    start = now_ns();
+    Hashmap *mapped = saved ? hashmap_open_mapped(STRING_HASHER, path) : NULL;
+    uint64_t open_ns = now_ns() - start;
+    unlink(path);
+    bool success = mapped != NULL;
+
+    /* The first lookups fault the pages of the file in */
+    start = now_ns();
+    for (size_t i = 0; success && i < config->size; ++i) {
+        success = hashmap_get(mapped, keys.strings[i]) != NULL;
+    }
+    uint64_t get_ns = now_ns() - start;
+
+    if (success) {
+        printf("step,size,file_bytes,ms\n");
+        printf("insert,%zu,0,%.3f\n", config->size, (double)insert_ns / 1e6);
+        printf("save,%zu,%lld,%.3f\n", config->size, (long long)file_size, (double)save_ns / 1e6);
+        printf("open_mapped,%zu,%lld,%.3f\n", config->size, (long long)file_size, (double)open_ns / 1e6);
+        printf("first_gets,%zu,%lld,%.3f\n", config->size, (long long)file_size, (double)get_ns / 1e6);
+    }
+    if (mapped != NULL) {
+        hashmap_destroy(mapped, NULL, NULL);
+    }
+    keyset_free(&keys);
+    return success;
+}
+
+/**
+ * Look up random keys of the first `config->size` keys, in a frozen map if
+ * `frozen` is not NULL. Returns the number of lookups that hit.
+ */
+static size_t run_frozen_gets(const Config *config, KeySet *keys, Hashmap *map, FrozenHashmap *frozen) {
+    uint64_t state = config->seed;
+    size_t found = 0;
+    for (size_t i = 0; i < config->ops; ++i) {
+        Key *key = &keys->ints[next_random(&state) % config->size];
+        found += (frozen != NULL ? frozen_hashmap_get(frozen, key) : hashmap_get(map, key)) != NULL;
+    }
+    return found;
+}
+
+/**
+ * Compare lookups of integer keys in a map before and after `hashmap_freeze`,
+ * see `--frozen`.
+ */
+static bool run_frozen_bench(const Config *config) {
+    KeySet keys;
+    if (!keyset_init(&keys, KEYS_INT, config->size)) {
+        keyset_free(&keys);
+        return false;
+    }
+    Hasher hasher = { .hash = uint64_hash, .equal = uint64_equal };
+    Hashmap *map = hashmap_create(hasher);
+    for (size_t i = 0; map != NULL && i < config->size; ++i) {
+        if (!hashmap_insert(map, &keys.ints[i], &keys.ints[i], NULL)) {
+            hashmap_destroy(map, NULL, NULL);
+            map = NULL;
+        }
+    }
+    if (map == NULL) {
+        keyset_free(&keys);
+        return false;
+    }
+    size_t capacity = hashmap_capacity(map);
+
+    uint64_t start = now_ns();
+    bool success = run_frozen_gets(config, &keys, map, NULL) == config->ops;
+    uint64_t get_ns = now_ns() - start;
+
+    start = now_ns();
+    FrozenHashmap *frozen = hashmap_freeze(map, 1);
+    uint64_t freeze_ns = now_ns() - start;
+    if (frozen == NULL) {
+        hashmap_destroy(map, NULL, NULL);
+        keyset_free(&keys);
+        return false;
+    }
+
+    start = now_ns();
+    success = success && run_frozen_gets(config, &keys, NULL, frozen) == config->ops;
+    uint64_t frozen_get_ns = now_ns() - start;
+
+    if (success) {
+        printf("map,size,slots,build_ms,gets_per_sec\n");
+        printf("hashmap,%zu,%zu,0,%.0f\n", config->size, capacity, (double)config->ops / ((double)get_ns / 1e9));
+        printf("frozen,%zu,%zu,%.3f,%.0f\n", config->size, config->size, (double)freeze_ns / 1e6,
+                (double)config->ops / ((double)frozen_get_ns / 1e9));
+    }
+    frozen_hashmap_destroy(frozen, NULL, NULL);
+    keyset_free(&keys);
+    return success;
+}
+
+/**
+ * Remove and insert again `config->ops` random keys of the first
+ * `config->size` keys. Returns false if an insertion failed.
+ */
+static bool run_clone_writes(const Config *config, KeySet *keys, Hashmap *map) {
+    uint64_t state = config->seed;
+    for (size_t i = 0; i < config->ops; ++i) {
+        Key *key = &keys->ints[next_random(&state) % config->size];
+        if (hashmap_remove(map, key, NULL) && !hashmap_insert(map, key, key, NULL)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Compare copying a map of integer keys by inserting every entry into a new
+ * map to `hashmap_clone`, and writes to a map that shares its pages with a
+ * clone to writes to the copy, see `--clone`.
+ */
+static bool run_clone_bench(const Config *config) {
+    KeySet keys;
+    if (!keyset_init(&keys, KEYS_INT, config->size)) {
+        keyset_free(&keys);
+        return false;
+    }
+    Hasher hasher = { .hash = uint64_hash, .equal = uint64_equal };
+    Hashmap *map = hashmap_create(hasher);
+    for (size_t i = 0; map != NULL && i < config->size; ++i) {
+        if (!hashmap_insert(map, &keys.ints[i], &keys.ints[i], NULL)) {
+            hashmap_destroy(map, NULL, NULL);
+            map = NULL;
+        }
+    }
+    if (map == NULL) {
+        keyset_free(&keys);
+        return false;
+    }
+
+    /* Presized, since inserting in table order into a growing map clusters */
+    uint64_t start = now_ns();
+    HashmapOptions options = { .initial_capacity = hashmap_size(map) };
+    Hashmap *copy = hashmap_create_with_options(hasher, options);
+    HashmapIter iter;
+    HashmapEntry entry;
+    hashmap_iter_begin(map, &iter);
+    while (copy != NULL && hashmap_iter_next(&iter, &entry)) {
+        if (!hashmap_insert(copy, entry.key, entry.value, NULL)) {
+            hashmap_destroy(copy, NULL, NULL);
+            copy = NULL;
+        }
+    }
+    uint64_t copy_ns = now_ns() - start;
+
+    start = now_ns();
+    Hashmap *clone = hashmap_clone(map);
+    uint64_t clone_ns = now_ns() - start;
+    bool success = copy != NULL && clone != NULL;
+
+    start = now_ns();
+    success = success && run_clone_writes(config, &keys, copy);
+    uint64_t copy_writes_ns = now_ns() - start;
+
+    /* The first writes to each page of the map copy it */
+    start = now_ns();
+    success = success && run_clone_writes(config, &keys, map);
+    uint64_t shared_writes_ns = now_ns() - start;
+
+    if (success) {
+        printf("step,size,ms\n");
+        printf("copy,%zu,%.3f\n", config->size, (double)copy_ns / 1e6);
+        printf("clone,%zu,%.3f\n", config->size, (double)clone_ns / 1e6);
+        printf("writes_to_copy,%zu,%.3f\n", config->size, (double)copy_writes_ns / 1e6);
+        printf("writes_shared,%zu,%.3f\n", config->size, (double)shared_writes_ns / 1e6);
+    }
+    if (clone != NULL) {
+        hashmap_destroy(clone, NULL, NULL);
+    }
+    if (copy != NULL) {
+        hashmap_destroy(copy, NULL, NULL);
+    }
+    hashmap_destroy(map, NULL, NULL);
+    keyset_free(&keys);
+    return success;
+}
+
+/**
+ * The kilobytes of memory of this process that are backed by huge pages,
+ * transparent or explicit, or -1 if that is not known.
+ */
+static long huge_page_kb(void) {
+    FILE *file = fopen("/proc/self/smaps_rollup", "r");
+    if (file == NULL) {
+        return -1;
+    }
+    long total = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        long kb;
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1
+                || sscanf(line, "Shared_Hugetlb: %ld kB", &kb) == 1
+                || sscanf(line, "Private_Hugetlb: %ld kB", &kb) == 1) {
+            total += kb;
+        }
+    }
+    fclose(file);
+    return total;
+}
+
+/**
+ * Compare lookups of integer keys in a presized map allocated with malloc and
+ * with `HUGE_PAGE_ALLOCATOR`, see `--pages`.
+ *
+ * `huge_kb` shows whether the kernel actually backed the table with huge
+ * pages. Where it stays 0, e.g. because transparent huge pages are disabled,
+ * both runs use normal pages and any difference is noise.
+ */
+static bool run_pages_bench(const Config *config) {
+    KeySet keys;
+    if (!keyset_init(&keys, KEYS_INT, config->size)) {
+        keyset_free(&keys);
+        return false;
+    }
+    Hasher hasher = { .hash = uint64_hash, .equal = uint64_equal };
+    HashmapOptions options = { .initial_capacity = config->size };
+
+    bool success = true;
+    printf("allocator,size,capacity,huge_kb,gets_per_sec,dtlb_misses_per_op\n");
+    for (int huge_pages = 0; huge_pages <= 1 && success; ++huge_pages) {
+        Hashmap *map;
+        if (huge_pages) {
+            map = hashmap_create_with_allocator(hasher, options, HUGE_PAGE_ALLOCATOR(&huge_page_threshold));
+        } else {
+            map = hashmap_create_with_options(hasher, options);
+        }
+        for (size_t j = 0; map != NULL && j < config->size; ++j) {
+            if (!hashmap_insert(map, &keys.ints[j], &keys.ints[j], NULL)) {
+                hashmap_destroy(map, NULL, NULL);
+                map = NULL;
+            }
+        }
+        if (map == NULL) {
+            success = false;
+            break;
+        }
+        long huge_kb = huge_page_kb();
+
+        int dtlb_counter = open_dtlb_counter();
+        enable_counter(dtlb_counter, true);
+        uint64_t start = now_ns();
+        success = run_frozen_gets(config, &keys, map, NULL) == config->ops;
+        uint64_t get_ns = now_ns() - start;
+        enable_counter(dtlb_counter, false);
+        long long dtlb_misses = read_counter(dtlb_counter);
+        if (dtlb_counter >= 0) {
+            close(dtlb_counter);
+        }
+
+        if (success) {
+            printf("%s,%zu,%zu,%ld,%.0f,%.3f\n", huge_pages ? "huge_pages" : "malloc", config->size, hashmap_capacity(map), huge_kb,
+                    (double)config->ops / ((double)get_ns / 1e9),
+                    dtlb_misses < 0 ? -1.0 : (double)dtlb_misses / (double)config->ops);
+        }
+        hashmap_destroy(map, NULL, NULL);
+    }
+    keyset_free(&keys);
+    return success;
+}
+
+static void print_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "\n"
+            "Options:\n"
+            "  --workload=NAME   Run only the preset NAME (default: all presets)\n"
+            "  --keys=int|string Override the key type\n"
+            "  --dist=uniform|zipf\n"
+            "                    Override the key distribution\n"
+            "  --zipf=S          Zipf exponent (default: 0.99)\n"
+            "  --mix=G:I:R       Override the get:insert:remove percentages\n"
+            "  --hit=P           Override the percentage of gets that hit\n"
+            "  --size=N          Number of keys inserted before measuring (default: 100000)\n"
+            "  --load=F          Maximum load factor of the map (default: the map's default)\n"
+            "  --presize         Create the map with room for all keys inserted before measuring\n"
+            "  --resize-step=N   Resize incrementally, moving N entries per operation\n"
+            "  --flat            Store integer keys and values in the map itself\n"
+            "  --scan-entries    Look up keys without the control bytes, see HashmapOptions\n"
+            "  --typed           Use a map defined with HASHMAP_DEFINE for integer keys\n"
+            "  --batch=N         Run up to N consecutive gets or inserts as one batch\n"
+            "  --huge-pages      Map tables larger than 4 MB in huge pages\n"
+            "  --hashes          Compare the string hashes instead of running workloads\n"
+            "  --scan            Compare iterating over unordered and ordered maps instead\n"
+            "  --build           Compare building a map with inserts and with threads instead\n"
+            "  --threads         Compare lookups from many threads with a mutex and a\n"
+            "                    ConcurrentHashmap instead\n"
+            "  --ingest          Compare inserts from many threads with a mutex and a\n"
+            "                    ShardedHashmap instead\n"
+            "  --snapshot        Compare building a map with inserts to saving it and\n"
+            "                    opening it with hashmap_open_mapped instead\n"
+            "  --frozen          Compare lookups before and after hashmap_freeze instead\n"
+            "  --clone           Compare copying a map to hashmap_clone and the writes\n"
+            "                    after it instead\n"
+            "  --pages           Compare lookups in a presized map allocated with malloc\n"
+            "                    and with HUGE_PAGE_ALLOCATOR instead\n"
+            "  --ops=N           Number of measured operations (default: 1000000)\n"
+            "  --seed=N          Random seed (default: 42)\n"
+            "  --format=csv|json Output format (default: csv)\n"
+            "\n"
+            "Presets:\n",
+            program);
+    for (size_t i = 0; i < NUM_PRESETS; ++i) {
+        fprintf(stderr, "  %s\n", PRESETS[i].name);
+    }
+}
+
+/**
+ * Returns the value of `--name=value` if `arg` is that option, NULL otherwise.
+ */
+static const char *option_value(const char *arg, const char *name) {
+    size_t length = strlen(name);
+    if (strncmp(arg, name, length) == 0 && arg[length] == '=') {
+        return arg + length + 1;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    Config config = {
+        .size = 100000,
+        .ops = 1000000,
+        .zipf_s = 0.99,
+        .max_load_factor = 0.0,
+        .presize = false,
+        .resize_step = 0,
+        .flat = false,
+        .scan_entries = false,
+        .typed = false,
+        .batch = 1,
+        .huge_pages = false,
+        .seed = 42,
+        .format = FORMAT_CSV,
+    };
+
+    const char *only = NULL;
+    Workload overrides = { NULL, KEYS_INT, DIST_UNIFORM, 0, 0, 0, 0 };
+    bool override_keys = false;
+    bool override_dist = false;
+    bool override_mix = false;
+    bool override_hit = false;
+    bool hashes = false;
+    bool scan = false;
+    bool build = false;
+    bool threads = false;
+    bool ingest = false;
+    bool snapshot = false;
+    bool frozen = false;
+    bool clone = false;
+    bool pages = false;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value;
+        if ((value = option_value(arg, "--workload")) != NULL) {
+            only = value;
+        } else if ((value = option_value(arg, "--keys")) != NULL) {
+            override_keys = true;
+            overrides.keys = strcmp(value, "string") == 0 ? KEYS_STRING : KEYS_INT;
+        } else if ((value = option_value(arg, "--dist")) != NULL) {
+            override_dist = true;
+            overrides.dist = strcmp(value, "zipf") == 0 ? DIST_ZIPF : DIST_UNIFORM;
+        } else if ((value = option_value(arg, "--zipf")) != NULL) {
+            config.zipf_s = strtod(value, NULL);
+        } else if ((value = option_value(arg, "--mix")) != NULL) {
+            override_mix = true;
+            if (sscanf(value, "%u:%u:%u", &overrides.get_percent,
+                        &overrides.insert_percent, &overrides.remove_percent) != 3
+                    || overrides.get_percent + overrides.insert_percent
+                        + overrides.remove_percent != 100) {
+                fprintf(stderr, "--mix must be G:I:R adding up to 100\n");
+                return 1;
+            }
+        } else if ((value = option_value(arg, "--hit")) != NULL) {
+            override_hit = true;
+            overrides.hit_percent = (unsigned int)strtoul(value, NULL, 10);
+        } else if ((value = option_value(arg, "--size")) != NULL) {
+            config.size = (size_t)strtoull(value, NULL, 10);
+        } else if ((value = option_value(arg, "--load")) != NULL) {
+            config.max_load_factor = strtod(value, NULL);
+        } else if (strcmp(arg, "--presize") == 0) {
+            config.presize = true;
+        } else if (strcmp(arg, "--flat") == 0) {
+            config.flat = true;
+        } else if (strcmp(arg, "--hashes") == 0) {
+            hashes = true;
+        } else if (strcmp(arg, "--ingest") == 0) {
+            ingest = true;
+        } else if (strcmp(arg, "--snapshot") == 0) {
+            snapshot = true;
+        } else if (strcmp(arg, "--frozen") == 0) {
+            frozen = true;
+        } else if (strcmp(arg, "--clone") == 0) {
+            clone = true;
+        } else if (strcmp(arg, "--pages") == 0) {
+            pages = true;
+        } else if (strcmp(arg, "--threads") == 0) {
+            threads = true;
+        } else if (strcmp(arg, "--build") == 0) {
+            build = true;
+        } else if (strcmp(arg, "--scan") == 0) {
+            scan = true;
+        } else if (strcmp(arg, "--scan-entries") == 0) {
+            config.scan_entries = true;
+        } else if (strcmp(arg, "--huge-pages") == 0) {
+            config.huge_pages = true;
+        } else if (strcmp(arg, "--typed") == 0) {
+            config.typed = true;
+        } else if ((value = option_value(arg, "--batch")) != NULL) {
+            config.batch = (size_t)strtoull(value, NULL, 10);
+        } else if ((value = option_value(arg, "--resize-step")) != NULL) {
+            config.resize_step = (size_t)strtoull(value, NULL, 10);
+        } else if ((value = option_value(arg, "--ops")) != NULL) {
+            config.ops = (size_t)strtoull(value, NULL, 10);
+        } else if ((value = option_value(arg, "--seed")) != NULL) {
+            config.seed = (uint64_t)strtoull(value, NULL, 10);
+        } else if ((value = option_value(arg, "--format")) != NULL) {
+            config.format = strcmp(value, "json") == 0 ? FORMAT_JSON : FORMAT_CSV;
+        } else {
+            print_usage(argv[0]);
+            return strcmp(arg, "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    if (config.size == 0 || config.ops == 0) {
+        fprintf(stderr, "--size and --ops must be positive\n");
+        return 1;
+    }
+    if (config.batch == 0 || config.batch > MAX_BATCH) {
+        fprintf(stderr, "--batch must be between 1 and %d\n", MAX_BATCH);
+        return 1;
+    }
+
+    if (hashes) {
+        return run_hash_bench(&config) ? 0 : 1;
+    }
+    if (scan) {
+        return run_scan_bench(&config) ? 0 : 1;
+    }
+    if (build) {
+        return run_build_bench(&config) ? 0 : 1;
+    }
+    if (threads) {
+        return run_read_bench(&config) ? 0 : 1;
+    }
+    if (ingest) {
+        return run_ingest_bench(&config) ? 0 : 1;
+    }
+    if (snapshot) {
+        return run_snapshot_bench(&config) ? 0 : 1;
+    }
+    if (frozen) {
+        return run_frozen_bench(&config) ? 0 : 1;
+    }
+    if (clone) {
+        return run_clone_bench(&config) ? 0 : 1;
+    }
+    if (pages) {
+        return run_pages_bench(&config) ? 0 : 1;
+    }
+
+    print_header(config.format);
+
+    bool all_succeeded = true;
+    bool any_selected = false;
+    for (size_t i = 0; i < NUM_PRESETS; ++i) {
+        if (only != NULL && strcmp(only, PRESETS[i].name) != 0) {
+            continue;
+        }
+        any_selected = true;
+
+        Workload workload = PRESETS[i];
+        if (override_keys) {
+            workload.keys = overrides.keys;
+        }
+        if (override_dist) {
+            workload.dist = overrides.dist;
+        }
+        if (override_mix) {
+            workload.get_percent = overrides.get_percent;
+            workload.insert_percent = overrides.insert_percent;
+            workload.remove_percent = overrides.remove_percent;
+        }
+        if (override_hit) {
+            workload.hit_percent = overrides.hit_percent;
+        }
+
+        if (!run_isolated(&workload, &config)) {
+            all_succeeded = false;
+        }
+    }
+
+    if (!any_selected) {
+        fprintf(stderr, "Unknown workload: %s\n", only);
+        return 1;
+    }
+
+    return all_succeeded ? 0 : 1;
+}
@@ -11,11 +11,20 @@ typedef void Key;
 typedef void Value;
 typedef uint32_t hash_t;
 typedef hash_t (*HashFunction)(Key *key);
+typedef hash_t (*ContextHashFunction)(Key *key, void *context);
 typedef bool (*CompareFunction)(Key *key1, Key *key2);
+typedef size_t (*SizeFunction)(void *data);
 
 typedef struct Hasher {
     HashFunction hash;
     CompareFunction equal;
+    /**
+     * If not NULL, this is called with `context` instead of `hash`, e.g. to
+     * hash with a seed (see `STRING_HASHER_SEEDED`). `context` has to stay
+     * valid for as long as the hashmap is used.
+     */
+    ContextHashFunction hash_with_context;
+    void *context;
 } Hasher;
 
 typedef struct HashmapEntry {
@@ -23,11 +32,303 @@ typedef struct HashmapEntry {
     Value *value;
 } HashmapEntry;
 
+/**
+ * An iterator over the key-value pairs of a hashmap, see `hashmap_iter_begin`.
+ */
+typedef struct HashmapIter {
+    Hashmap *map;
+    size_t index;
+} HashmapIter;
+
+/**
+ * What `hashmap_entry` found for a key.
+ */
+typedef enum HashmapEntryState {
+    /* The key is not in the hashmap yet, see `hashmap_slot_insert` */
+    HASHMAP_VACANT,
+    /* The key is in the hashmap, see `hashmap_slot_value` */
+    HASHMAP_OCCUPIED,
+    /* The hashmap could not grow to make room for the key */
+    HASHMAP_FAILED,
+} HashmapEntryState;
+
+/**
+ * The place of a key in a hashmap, see `hashmap_entry`.
+ *
+ * The fields are only meant to be used by the hashmap itself.
+ */
+typedef struct HashmapSlot {
+    Hashmap *map;
+    Key *key;
+    hash_t hash;
+    /* The entry holding the key, or NULL if the slot is vacant */
+    void *entry;
+} HashmapSlot;
+
+/**
+ * Combines `value` into the value `existing` points to, see `hashmap_upsert`.
+ */
+typedef void (*CombineFunction)(Value *existing, Value *value);
+
+/**
+ * Writes the bytes `hashmap_save` stores for a key or value to `buffer`.
+ *
+ * Returns the number of bytes needed, and only writes them if that is at most
+ * `capacity`, like snprintf. The bytes are read back by `hashmap_open_mapped`
+ * in another process, so they must not contain pointers.
+ */
+typedef size_t (*SerializeFunction)(void *data, void *buffer, size_t capacity);
+
+/**
+ * A key of `length` bytes at `data`, see `SLICE_HASHER`.
+ *
+ * The bytes do not need to be NUL terminated and may contain NUL bytes, so a
+ * slice can point into a larger buffer, e.g. a token in a memory mapped file.
+ */
+typedef struct Slice {
+    const void *data;
+    size_t length;
+} Slice;
+
+/**
+ * Options for `hashmap_create_with_options`.
+ *
+ * Fields that are 0 take their default value, so only the options of interest
+ * need to be set, e.g. `(HashmapOptions) { .initial_capacity = 1000000 }`.
+ */
+typedef struct HashmapOptions {
+    /**
+     * Number of entries the hashmap should be able to hold without growing.
+     * By default, no memory is allocated until the first insertion.
+     */
+    size_t initial_capacity;
+    /**
+     * Maximum ratio of entries to capacity before the hashmap grows.
+     * Must be strictly between 0 and 1. Default is 0.875.
+     */
+    double max_load_factor;
+    /**
+     * Factor by which the capacity grows when the hashmap is full.
+     * Must be greater than 1. The capacity is always a power of two, so this
+     * is rounded up to the next power of two. Default is 2.
+     */
+    double growth_factor;
+    /**
+     * Ratio of entries to capacity below which `hashmap_remove` shrinks the
+     * hashmap. Must be less than the maximum load factor divided by the
+     * growth factor, so that a hashmap does not shrink right after growing.
+     * Default is 0, i.e. the hashmap never shrinks on its own.
+     */
+    double min_load_factor;
+    /**
+     * If not 0, the hashmap resizes incrementally: the old entries are kept
+     * in place, and every insert, get and remove moves up to `resize_step`
+     * slots of them to the new entries. This bounds the latency of every
+     * single operation, at the cost of lookups checking both while a resize
+     * is in progress. Default is 0, i.e. all entries are moved at once.
+     */
+    size_t resize_step;
+    /**
+     * If not 0, the hashmap is flat: keys of `key_size` bytes and values of
+     * `value_size` bytes are copied into the hashmap on insertion, instead of
+     * the hashmap storing the `Key *` and `Value *` pointers it is given. This
+     * saves a separate allocation per key and value and a pointer dereference
+     * per lookup.
+     *
+     * Pointers to keys and values handed out by a flat hashmap point into the
+     * hashmap itself, so they are only valid until the next operation on it.
+     *
+     * In a flat hashmap, `hasher.equal` may be NULL to compare keys with
+     * memcmp, and `hasher.hash` may be NULL to hash the bytes of the key.
+     * Either requires keys without padding bytes.
+     * Default is 0, i.e. the hashmap stores pointers.
+     */
+    size_t key_size;
+    /**
+     * The size of the values of a flat hashmap, see `key_size`. May be 0 to
+     * use the hashmap as a set, in which case the values passed to
+     * `hashmap_insert` may be NULL. Must be 0 if `key_size` is 0.
+     */
+    size_t value_size;
+    /**
+     * If not NULL, the hashmap owns its keys: when a new key is inserted, the
+     * `key_copy_size(key)` bytes at `key` are copied into memory owned by the
+     * hashmap, and the copy is stored instead, e.g. with `string_size` for
+     * strings. Copies are taken from large chunks of memory that are freed
+     * all at once by `hashmap_destroy`, instead of with one allocation per
+     * key. Removing a key does not free its copy, it stays valid until the
+     * hashmap is destroyed. See also `hashmap_arena_stats`.
+     * Cannot be combined with `key_size`. Default is NULL.
+     */
+    SizeFunction key_copy_size;
+    /**
+     * Same as `key_copy_size`, but for values.
+     */
+    SizeFunction value_copy_size;
+    /**
+     * If true, the hashmap is ordered: the key-value pairs are stored in a
+     * dense array in the order they were inserted, and the hash table only
+     * holds small indices into that array. Iterating then visits the pairs in
+     * insertion order and only has to read `hashmap_size` consecutive entries
+     * instead of the whole table, at the cost of one more memory access per
+     * lookup. Removed pairs keep their place in the array until it is full,
+     * when it is compacted or the hashmap grows.
+     * Cannot be combined with `resize_step`. Default is false.
+     */
+    bool ordered;
+    /**
+     * If true, lookups compare the hashes stored in the entries one by one,
+     * instead of first comparing a group of control bytes at once. The
+     * control bytes are kept in a separate array, so they cost a second cache
+     * miss per lookup in maps too large for the cache. Scanning the entries
+     * avoids it, which makes finding keys that are in such maps faster, in
+     * particular with a lower `max_load_factor`. Looking up missing keys
+     * reads more entries, so it is usually slower. Inserting and removing
+     * look up the key the same way, but still update the control bytes.
+     * Cannot be combined with `key_size` or `ordered`. Default is false.
+     */
+    bool scan_entries;
+} HashmapOptions;
+
+/**
+ * Memory allocation functions for `hashmap_create_with_allocator`.
+ *
+ * `alloc` returns `size` bytes aligned for any type, or NULL if they cannot be
+ * allocated. `free` releases memory returned by `alloc` and is given the size
+ * it was allocated with, so that allocators which do not keep track of sizes,
+ * e.g. pools or memory mapped regions, can be used. Both are passed `context`,
+ * which has to stay valid until the hashmap is destroyed.
+ */
+typedef struct HashmapAllocator {
+    void *(*alloc)(size_t size, void *context);
+    void (*free)(void *pointer, size_t size, void *context);
+    void *context;
+} HashmapAllocator;
+
+/**
+ * Allocation function of `HUGE_PAGE_ALLOCATOR`.
+ *
+ * Allocations of at least the `size_t` `threshold` points to, and of at least
+ * one huge page (2 MB), are mapped with mmap, in explicit huge pages if the
+ * system has reserved any, or else aligned to huge pages and marked with
+ * `MADV_HUGEPAGE` so that transparent huge pages can back them. Smaller
+ * allocations, and all allocations on systems other than Linux, use malloc.
+ */
+void *hashmap_huge_page_alloc(size_t size, void *threshold);
+
+/**
+ * Free function of `HUGE_PAGE_ALLOCATOR`.
+ */
+void hashmap_huge_page_free(void *pointer, size_t size, void *threshold);
+
+/**
+ * Allocator for `hashmap_create_with_allocator` that backs large tables with
+ * huge pages, see `hashmap_huge_page_alloc`.
+ *
+ * On hashmaps much larger than the caches, almost every lookup misses the TLB
+ * with 4 KB pages, and a single 2 MB page covers as much memory as 512 of
+ * them. `threshold` has to point to a `size_t` that stays valid for as long as
+ * the hashmap is used. Since every mapping is rounded up to whole huge pages,
+ * a threshold of a few MB keeps the memory overhead small.
+ */
+#define HUGE_PAGE_ALLOCATOR(threshold) ((HashmapAllocator) { \
+    .alloc = hashmap_huge_page_alloc,                        \
+    .free = hashmap_huge_page_free,                          \
+    .context = (threshold),                                  \
+})
+
+/**
+ * Probe length statistics, see `hashmap_probe_stats`.
+ *
+ * The probe length of an entry is the number of entries that have to be looked
+ * at to find it, i.e. its distance from its preferred index plus one.
+ */
+typedef struct HashmapProbeStats {
+    size_t max_probe_length;
+    double mean_probe_length;
+} HashmapProbeStats;
+
+/**
+ * The number of buckets of the probe length histograms of `HashmapStats`.
+ */
+#define HASHMAP_PROBE_HISTOGRAM_SIZE 16
+
+/**
+ * Statistics about a hashmap, see `hashmap_stats`.
+ *
+ * The counters are only kept if the implementation is compiled with
+ * `HASHMAP_STATS` defined, and are 0 otherwise. They count everything since
+ * the hashmap was created or `hashmap_stats_reset` was last called.
+ */
+typedef struct HashmapStats {
+    /* Whether the counters below `max_cluster_length` are kept */
+    bool enabled;
+    size_t size;
+    size_t capacity;
+    double load_factor;
+    /* The longest run of consecutive occupied entries */
+    size_t max_cluster_length;
+    /*
+     * How many probes for a key found it (`hit_probe_lengths`) or not
+     * (`miss_probe_lengths`) after looking at `i + 1` entries, with bucket
+     * `HASHMAP_PROBE_HISTOGRAM_SIZE - 1` counting all longer probes as well.
+     * Inserting a new key probes for it first, so it counts as a miss.
+     */
+    uint64_t hit_probe_lengths[HASHMAP_PROBE_HISTOGRAM_SIZE];
+    uint64_t miss_probe_lengths[HASHMAP_PROBE_HISTOGRAM_SIZE];
+    /* The number of times the table was replaced, and the time spent moving entries */
+    uint64_t resizes;
+    uint64_t rehash_ns;
+    /* The number of times keys were hashed and compared */
+    uint64_t hash_calls;
+    uint64_t equal_calls;
+    /* The number of entries `hashmap_remove` shifted back to fill the gap */
+    uint64_t backward_shifts;
+} HashmapStats;
+
+/**
+ * Hash `length` bytes at `data` with the given seed.
+ *
+ * This is a fast general purpose hash (wyhash) that reads the data 8 or 16
+ * bytes at a time. It can be used by hash functions for keys whose length is
+ * known, e.g. structs or strings that store their length.
+ */
+hash_t hashmap_hash_bytes(const void *data, size_t length, uint64_t seed);
+
+/**
+ * Memory statistics of the keys and values the hashmap owns, see
+ * `HashmapOptions.key_copy_size`.
+ */
+typedef struct HashmapArenaStats {
+    /* The number of chunks the copies are taken from */
+    size_t num_chunks;
+    /* The total size of the chunks in bytes */
+    size_t allocated_bytes;
+    /* The bytes taken by copies, including those of removed pairs */
+    size_t used_bytes;
+} HashmapArenaStats;
+
+/**
+ * The size of a string including its terminator, for use as
+ * `HashmapOptions.key_copy_size` or `value_copy_size`.
+ */
+size_t string_size(Key *key);
+
 /**
  * Default hash function for strings used in `STRING_HASHER`.
+ *
+ * This is `hashmap_hash_bytes` of the string without its terminator, with a
+ * seed of 0.
  */
 hash_t string_hash(Key *key);
 
+/**
+ * Hash function for strings used in `STRING_HASHER_SEEDED`.
+ *
+ * `seed` has to point to a `uint64_t`.
+ */
+hash_t string_hash_seeded(Key *key, void *seed);
+
 /**
  * Default equality function for strings used in `STRING_HASHER`.
  */
@@ -41,21 +342,109 @@ bool string_equal(Key *key1, Key *key2);
     .equal = string_equal,        \
 })
 
+/**
+ * Hasher for strings that hashes with the `uint64_t` `seed` points to.
+ *
+ * With a random seed that is kept secret, an attacker cannot choose keys that
+ * all collide to slow the hashmap down. `seed` has to stay valid for as long
+ * as the hashmap is used.
+ */
+#define STRING_HASHER_SEEDED(seed) ((Hasher) { \
+    .hash_with_context = string_hash_seeded,   \
+    .context = (seed),                         \
+    .equal = string_equal,                     \
+})
+
+/**
+ * Hash function for `Slice` keys used in `SLICE_HASHER`.
+ *
+ * This is `hashmap_hash_bytes` of the bytes of the slice with a seed of 0, so
+ * a slice has the same hash as a string with the same characters.
+ */
+hash_t slice_hash(Key *key);
+
+/**
+ * Hash function for `Slice` keys used in `SLICE_HASHER_SEEDED`.
+ *
+ * `seed` has to point to a `uint64_t`.
+ */
+hash_t slice_hash_seeded(Key *key, void *seed);
+
+/**
+ * Equality function for `Slice` keys used in `SLICE_HASHER`.
+ *
+ * Only compares the bytes if the lengths are equal. The hashmap compares the
+ * hashes before calling this, so it is only called for likely matches.
+ */
+bool slice_equal(Key *key1, Key *key2);
+
+/**
+ * Hasher for keys that point to a `Slice`.
+ *
+ * With a flat hashmap with a `key_size` of `sizeof(Slice)`, the slices are
+ * copied into the hashmap, so only the bytes they point to have to outlive
+ * it.
+ */
+#define SLICE_HASHER ((Hasher) { \
+    .hash = slice_hash,          \
+    .equal = slice_equal,        \
+})
+
+/**
+ * Hasher for `Slice` keys that hashes with the `uint64_t` `seed` points to,
+ * see `STRING_HASHER_SEEDED`.
+ */
+#define SLICE_HASHER_SEEDED(seed) ((Hasher) { \
+    .hash_with_context = slice_hash_seeded,   \
+    .context = (seed),                        \
+    .equal = slice_equal,                     \
+})
+
 /**
  * Create a new hashmap with the given hash function.
  *
  * Returns NULL if the hashmap could not be created.
  * You should call `hashmap_destroy` when you are done with the hashmap.
- * The hash map does not take ownership of any keys or values
+ * The hash map does not take ownership of any keys or values, see
+ * `HashmapOptions.key_copy_size` for a hashmap that does.
  */
 Hashmap *hashmap_create(Hasher hasher);
 
+/**
+ * Create a new hashmap with the given hash function and options.
+ *
+ * Behaves like `hashmap_create`, but allows tuning the capacity and growth of
+ * the hashmap, see `HashmapOptions`.
+ *
+ * Returns NULL if the options are invalid or the hashmap could not be created.
+ */
+Hashmap *hashmap_create_with_options(Hasher hasher, HashmapOptions options);
+
+/**
+ * Create a new hashmap with the given hash function and options, whose memory
+ * is allocated with `allocator` instead of malloc and free.
+ *
+ * All memory of the hashmap goes through the allocator: the hashmap itself,
+ * its entries and the keys and values it owns. This allows placing large
+ * hashmaps e.g. in huge pages or in memory local to a NUMA node, or freeing a
+ * hashmap together with the rest of a request. When growing the hashmap
+ * fails because `alloc` returns NULL, the hashmap is left unchanged, just as
+ * when malloc fails.
+ *
+ * Returns NULL if the options or the allocator are invalid or the hashmap could
+ * not be created.
+ */
+Hashmap *hashmap_create_with_allocator(Hasher hasher, HashmapOptions options, HashmapAllocator allocator);
+
 /**
  * Insert a key-value pair into the hashmap.
  *
- * `value` may not be NULL.
+ * `value` may not be NULL, unless the hashmap is flat with a `value_size` of 0.
  * `entry` may be NULL if you do not need the entry.
  *
+ * For flat hashmaps, the bytes `key` and `value` point to are copied, so they
+ * do not need to outlive the call.
+ *
  * There are 3 possible outcomes:
  *  1. The key-value pair is successfully inserted. In this case `*entry` will
  *     be set to the newly inserted value and true will be returned.
@@ -73,21 +462,140 @@ bool hashmap_insert(Hashmap *map, Key *key, Value *value, Value **entry);
  * Get the value associated with the given key.
  *
  * Returns NULL if the key is not in the hashmap.
+ * For flat hashmaps, the returned value points into the hashmap, see
+ * `HashmapOptions.key_size`.
  */
 Value *hashmap_get(Hashmap *map, Key *key);
 
+/**
+ * Look up a key once, to then either read or change its value, or insert it.
+ *
+ * If the key is in the hashmap, `HASHMAP_OCCUPIED` is returned, and its value
+ * can be read with `hashmap_slot_value` and replaced with
+ * `hashmap_slot_set_value`. Otherwise, `HASHMAP_VACANT` is returned, and the
+ * key can be inserted with `hashmap_slot_insert` without looking it up again.
+ * The hashmap grows before probing, like `hashmap_insert`, so this returns
+ * `HASHMAP_FAILED` if it cannot grow.
+ *
+ * `slot` is only valid until the next operation on the hashmap.
+ *
+ * Example of counting words in a hashmap that stores pointers to counts:
+ * ```c
+ * HashmapSlot slot;
+ * if (hashmap_entry(map, word, &slot) == HASHMAP_OCCUPIED) {
+ *     *(size_t *)hashmap_slot_value(&slot) += 1;
+ * } else {
+ *     hashmap_slot_insert(&slot, new_count(1), NULL);
+ * }
+ * ```
+ */
+HashmapEntryState hashmap_entry(Hashmap *map, Key *key, HashmapSlot *slot);
+
+/**
+ * The value of an occupied slot. For flat hashmaps, it points into the
+ * hashmap and can be changed in place.
+ */
+Value *hashmap_slot_value(HashmapSlot *slot);
+
+/**
+ * Replace the value of an occupied slot.
+ *
+ * Flat hashmaps copy the value in place. If the hashmap owns its values, the
+ * new value is copied as well, and the copy of the old one stays valid until
+ * the hashmap is destroyed. Otherwise, the caller is responsible for freeing
+ * the old value, see `hashmap_slot_value`.
+ *
+ * Returns false if the copy could not be allocated, in which case the value is
+ * left unchanged.
+ */
+bool hashmap_slot_set_value(HashmapSlot *slot, Value *value);
+
+/**
+ * Insert the key of a vacant slot with the given value, without probing for it
+ * again. Returns the same as `hashmap_insert` would have for the key.
+ *
+ * The slot is not valid anymore afterwards.
+ */
+bool hashmap_slot_insert(HashmapSlot *slot, Value *value, Value **entry);
+
+/**
+ * Insert the key-value pair if the key is not in the hashmap yet, or else call
+ * `combine` with the existing value and `value`, with a single lookup.
+ *
+ * This is meant for aggregations, e.g. summing up values per key in a flat
+ * hashmap, where `combine` adds `value` to the value stored in the hashmap.
+ *
+ * Returns `HASHMAP_VACANT` if the pair was inserted, `HASHMAP_OCCUPIED` if it
+ * was combined, and `HASHMAP_FAILED` if the hashmap could not grow or the key
+ * or value could not be copied.
+ */
+HashmapEntryState hashmap_upsert(Hashmap *map, Key *key, Value *value, CombineFunction combine);
+
+/**
+ * Get the values associated with `n` keys at once.
+ *
+ * Sets `values[i]` to the value of `keys[i]`, or NULL if the key is not in the
+ * hashmap, like `hashmap_get` would.
+ *
+ * This is faster than calling `hashmap_get` for each key on large hashmaps,
+ * since the memory of many keys is loaded at the same time instead of waiting
+ * for one cache miss after the other.
+ */
+void hashmap_get_many(Hashmap *map, Key **keys, size_t n, Value **values);
+
+/**
+ * Insert `n` key-value pairs at once, like calling `hashmap_insert` for
+ * `keys[i]` and `values[i]` in order.
+ *
+ * `inserted` may be NULL. Otherwise, `inserted[i]` is set to whether the pair
+ * was inserted, i.e. whether its key was neither in the hashmap nor earlier in
+ * `keys`.
+ *
+ * The hashmap first grows to hold `n` more key-value pairs, see
+ * `hashmap_reserve`, and uses the same prefetching as `hashmap_get_many`.
+ *
+ * Returns false if the hashmap could not grow, in which case nothing is
+ * inserted.
+ */
+bool hashmap_insert_many(Hashmap *map, Key **keys, Value **values, size_t n, bool *inserted);
+
+/**
+ * Create a hashmap with the default options that holds the `n` key-value pairs
+ * in `entries`, using up to `nthreads` threads.
+ *
+ * The result is the same as inserting the pairs in order with
+ * `hashmap_insert`: if a key occurs more than once, only its first pair is
+ * inserted. The caller still owns the keys and values, and `entries` may be
+ * freed afterwards.
+ *
+ * The hashmap is sized for `n` pairs up front, so it never grows while it is
+ * built. The keys are hashed in parallel and grouped by the part of the table
+ * they belong to, and every thread fills in its own parts of the table. Hence
+ * the hash and equality functions of `hasher` have to be safe to call from
+ * several threads at once. Without POSIX threads, or with `nthreads` at most
+ * 1, all the work is done by the calling thread.
+ *
+ * Returns NULL if the memory could not be allocated.
+ */
+Hashmap *hashmap_build_parallel(Hasher hasher, HashmapEntry *entries, size_t n, size_t nthreads);
+
 /**
  * Remove the key-value pair associated with the given key.
  *
  * `key` may not be NULL.
  * `entry` may be NULL if you do not need the entry.
  *
- * The caller is responsible for freeing the key and value.
+ * The caller is responsible for freeing the key and value, unless the hashmap
+ * owns them.
+ *
+ * If a minimum load factor was set with `hashmap_create_with_options`, this
+ * may shrink the hashmap.
  *
  * Returns true if the key-value pair was removed, false otherwise.
  * If the key-value pair was removed, `entry` will be set to the removed
  * key-value pair. Otherwise, the value of `entry` is undefined and should not
- * be used.
+ * be used. For flat hashmaps, `entry` points to a copy of the removed key and
+ * value that is valid until the next operation on the hashmap.
  */
 bool hashmap_remove(Hashmap *map, Key *key, HashmapEntry *entry);
 
@@ -96,16 +604,374 @@ bool hashmap_remove(Hashmap *map, Key *key, HashmapEntry *entry);
  */
 size_t hashmap_size(Hashmap *map);
 
+/**
+ * Get the number of entries the hashmap has allocated memory for.
+ *
+ * The hashmap grows before the number of key-value pairs exceeds the capacity
+ * times the maximum load factor.
+ */
+size_t hashmap_capacity(Hashmap *map);
+
+/**
+ * Make sure that the hashmap can hold `n` key-value pairs without growing.
+ *
+ * This always moves all entries right away, even if `resize_step` is set.
+ *
+ * Returns false if the memory could not be allocated, in which case the
+ * hashmap is left unchanged.
+ */
+bool hashmap_reserve(Hashmap *map, size_t n);
+
+/**
+ * Shrink the capacity of the hashmap to the smallest one that can hold its
+ * current key-value pairs. An empty hashmap frees all of its entries.
+ *
+ * Returns false if the memory could not be allocated, in which case the
+ * hashmap is left unchanged.
+ */
+bool hashmap_shrink_to_fit(Hashmap *map);
+
+/**
+ * Compute the maximum and mean probe length over all entries in the hashmap.
+ *
+ * This looks at every entry and is meant for diagnostics, e.g. to spot bad
+ * hash functions. For an empty hashmap, both are 0.
+ */
+void hashmap_probe_stats(Hashmap *map, HashmapProbeStats *stats);
+
+/**
+ * Get the statistics of the hashmap, see `HashmapStats`.
+ *
+ * The counters are meant to be cheap enough to keep in production, e.g. to
+ * spot hash functions that lead to long probes, and cost nothing unless the
+ * implementation is compiled with `HASHMAP_STATS`. Computing
+ * `max_cluster_length` looks at every entry.
+ *
+ * Keys hashed and compared in several threads at once, e.g. by
+ * `hashmap_build_parallel`, are counted with atomic operations. The probes of
+ * lookups in a `ConcurrentHashmap` are not in the histograms.
+ */
+void hashmap_stats(Hashmap *map, HashmapStats *stats);
+
+/**
+ * Set all counters of `hashmap_stats` back to 0.
+ */
+void hashmap_stats_reset(Hashmap *map);
+
+/**
+ * Start iterating over the key-value pairs of the hashmap.
+ *
+ * The pairs are visited in insertion order if the hashmap is ordered (see
+ * `HashmapOptions.ordered`), and in no particular order otherwise. The
+ * hashmap may not be modified until the iteration is done, but looking up
+ * keys is allowed. If the hashmap is resizing incrementally, the resize is
+ * finished first.
+ *
+ * Example:
+ * ```c
+ * HashmapIter iter;
+ * HashmapEntry entry;
+ * hashmap_iter_begin(map, &iter);
+ * while (hashmap_iter_next(&iter, &entry)) {
+ *     printf("%s: %s\n", (char *)entry.key, (char *)entry.value);
+ * }
+ * ```
+ */
+void hashmap_iter_begin(Hashmap *map, HashmapIter *iter);
+
+/**
+ * Advance the iterator to the next key-value pair.
+ *
+ * Returns false if all pairs have been visited. Otherwise, true is returned
+ * and `entry` is set to the next pair. For flat hashmaps, `entry` points into
+ * the hashmap, see `HashmapOptions.key_size`.
+ */
+bool hashmap_iter_next(HashmapIter *iter, HashmapEntry *entry);
+
+/**
+ * Get the memory statistics of the keys and values the hashmap owns. All of
+ * them are 0 if it does not own any.
+ */
+void hashmap_arena_stats(Hashmap *map, HashmapArenaStats *stats);
+
 /**
  * Destroy the hashmap.
  *
  * If `destroy_key` is not NULL, it will be called on each key.
  * If `destroy_value` is not NULL, it will be called on each value.
+ * Keys and values the hashmap owns are freed by the hashmap itself, so these
+ * must not free them.
  *
  * After calling this function, the hashmap is no longer valid and should not
  * be used again.
  */
 void hashmap_destroy(Hashmap *map, void (*destroy_key)(Key *), void (*destroy_value)(Value *));
 
-#endif
+/**
+ * Make a read-only copy of the hashmap without copying its entries.
+ *
+ * The entries are split into pages of up to 1024 entries that the hashmap and
+ * the clone share until the hashmap writes to them: inserting, removing or
+ * changing a value through `hashmap_entry` first copies the pages it writes
+ * to, so the clone keeps seeing the entries as they were when it was made.
+ * Making a clone only copies one pointer per page. A hashmap in the middle of
+ * an incremental resize finishes the resize first, and while pages are
+ * shared, the hashmap resizes all at once.
+ *
+ * The clone may be read from and destroyed in another thread while the
+ * hashmap is modified, as long as the allocator is thread-safe. Clones can be
+ * cloned again, but not inserted into or removed from.
+ *
+ * Keys and values are shared as well: keys and values the hashmap owns stay
+ * alive until the last clone is destroyed, and only the last of the hashmap
+ * and its clones to be destroyed may be given functions to destroy the keys
+ * and values. The values of flat hashmaps returned by `hashmap_get` or while
+ * iterating may be in shared pages and must not be changed in place, use
+ * `hashmap_entry` instead.
+ *
+ * While pages are shared, inserting may return `HASHMAP_FAILED` and removing
+ * may return false if a page could not be copied, in which case the hashmap
+ * is unchanged.
+ *
+ * Returns NULL if the memory could not be allocated. Mapped hashmaps cannot
+ * be cloned.
+ */
+Hashmap *hashmap_clone(Hashmap *map);
+
+/**
+ * A read-only hashmap in which every key has a slot of its own, see
+ * `hashmap_freeze`.
+ */
+typedef struct FrozenHashmap FrozenHashmap;
+
+/**
+ * Turn a hashmap that is only read from now on into a `FrozenHashmap`.
+ *
+ * The entries are placed with a minimal perfect hash function that is built
+ * from the cached hashes, so the keys are not hashed again. There are exactly
+ * as many slots as keys, and the function takes about 1 byte per key. A
+ * lookup looks at a single slot and only compares keys if the cached hash of
+ * the slot matches. Keys whose hashes are equal are kept apart in a small
+ * sorted array.
+ *
+ * The keys are split into partitions of about 65536 keys, which are built
+ * independently by `nthreads` threads on POSIX systems, see
+ * `hashmap_build_parallel`.
+ *
+ * The hashmap is consumed: on success, it may not be used anymore, and its
+ * keys and values, including those it owns, belong to the frozen hashmap.
+ * Returns NULL if the memory could not be allocated, in which case the hashmap
+ * is left unchanged.
+ */
+FrozenHashmap *hashmap_freeze(Hashmap *map, size_t nthreads);
+
+/**
+ * Get the value of a key in a frozen hashmap, see `hashmap_get`.
+ *
+ * For frozen flat hashmaps, the returned value stays valid until the frozen
+ * hashmap is destroyed. Lookups may run in many threads at once.
+ */
+Value *frozen_hashmap_get(FrozenHashmap *map, Key *key);
+
+/**
+ * Get the number of key-value pairs in a frozen hashmap.
+ */
+size_t frozen_hashmap_size(FrozenHashmap *map);
+
+/**
+ * Destroy a frozen hashmap, see `hashmap_destroy`.
+ */
+void frozen_hashmap_destroy(FrozenHashmap *map, void (*destroy_key)(Key *), void (*destroy_value)(Value *));
 
+/**
+ * Write the hashmap to the file `fd` refers to, so that it can be opened with
+ * `hashmap_open_mapped` without inserting every key again.
+ *
+ * The file holds the entries and control bytes as they are laid out in
+ * memory, including the cached hashes, followed by the bytes of the keys and
+ * values, and is checksummed. Flat hashmaps are written as they are.
+ * Otherwise, every key is written with `key_serializer` and every value with
+ * `value_serializer`. Either may be NULL if the hashmap owns its keys or
+ * values, which are then written as they were copied, see
+ * `HashmapOptions.key_copy_size`.
+ *
+ * The file is written from its start, whatever the current offset of `fd`,
+ * and truncated to the written size, so `fd` has to refer to a regular file.
+ * If the hashmap is resizing incrementally, the resize is finished first.
+ *
+ * Returns false if a serializer is missing or the file could not be written.
+ *
+ * Only available on POSIX systems.
+ */
+bool hashmap_save(Hashmap *map, int fd, SerializeFunction key_serializer, SerializeFunction value_serializer);
+
+/**
+ * Open a hashmap written by `hashmap_save` by mapping the file read-only.
+ *
+ * Nothing is copied or deserialized: lookups probe the entries in the file,
+ * and the keys and values they return point into it. Opening only reads the
+ * file once to verify its checksum, plus the entries to check that every key
+ * and value they refer to is within the file. Processes that open the same
+ * file share its pages.
+ *
+ * `hasher` has to hash and compare the serialized keys the same way the
+ * hasher of the saved hashmap did with the original ones, since the cached
+ * hashes are used as they are. This is checked for one key.
+ *
+ * The hashmap is read-only: it can be used with `hashmap_get`,
+ * `hashmap_get_many`, iteration and the statistics functions, but may not be
+ * inserted into or removed from. `hashmap_destroy` unmaps the file, and has to
+ * be called with NULL for `destroy_key` and `destroy_value`.
+ *
+ * Returns NULL if the file cannot be mapped, is corrupted, was written by a
+ * different version or a platform with a different byte order or entry
+ * layout, or `hasher` does not match.
+ *
+ * Only available on POSIX systems.
+ */
+Hashmap *hashmap_open_mapped(Hasher hasher, const char *path);
+
+/**
+ * A hashmap whose lookups can run in many threads at once, while insertions
+ * and removals take turns.
+ *
+ * `concurrent_hashmap_get` usually does not take a lock: it probes the table
+ * directly and retries if a writer changed the table in the meantime. Writers
+ * are serialized by a single lock. Tables that are replaced when the hashmap
+ * resizes are only freed once no lookup can still be reading them, so there
+ * is no need to lock around lookups at all.
+ *
+ * Only available with POSIX threads and GCC or Clang.
+ */
+typedef struct ConcurrentHashmap ConcurrentHashmap;
+
+/**
+ * Create a concurrent hashmap with the default options.
+ *
+ * The hash and equality functions of `hasher` have to be safe to call from
+ * several threads at once, and are called on keys that may be removed
+ * concurrently, see `concurrent_hashmap_remove`.
+ *
+ * Returns NULL if the memory could not be allocated.
+ */
+ConcurrentHashmap *concurrent_hashmap_create(Hasher hasher);
+
+/**
+ * Insert a key-value pair like `hashmap_insert`, but safe to call from any
+ * thread. Waits for other insertions and removals, but not for lookups.
+ */
+bool concurrent_hashmap_insert(ConcurrentHashmap *map, Key *key, Value *value, Value **entry);
+
+/**
+ * Get the value associated with the given key, or NULL if the key is not in
+ * the hashmap, like `hashmap_get`.
+ *
+ * This can be called from any number of threads at once, also while other
+ * threads insert and remove keys. Lookups do not wait for each other. A
+ * lookup that overlaps with an insertion or removal retries, and after a few
+ * retries it takes the lock and waits for the writers like they wait for each
+ * other. So this is not lock-free, but it cannot retry forever while the
+ * hashmap is written to continuously.
+ *
+ * The equality function is only called on keys that were in the hashmap at
+ * some point during the lookup.
+ */
+Value *concurrent_hashmap_get(ConcurrentHashmap *map, Key *key);
+
+/**
+ * Remove a key-value pair like `hashmap_remove`, but safe to call from any
+ * thread. Waits for other insertions and removals, but not for lookups.
+ *
+ * Lookups that started before the removal may still compare the removed key
+ * and return the removed value. Call `concurrent_hashmap_synchronize` before
+ * freeing them.
+ */
+bool concurrent_hashmap_remove(ConcurrentHashmap *map, Key *key, HashmapEntry *entry);
+
+/**
+ * Wait until all lookups that were running when this was called are done.
+ *
+ * After this, no lookup uses the keys and values removed before the call
+ * anymore, so they can be freed.
+ */
+void concurrent_hashmap_synchronize(ConcurrentHashmap *map);
+
+/**
+ * Get the number of key-value pairs in the hashmap.
+ */
+size_t concurrent_hashmap_size(ConcurrentHashmap *map);
+
+/**
+ * Destroy the hashmap like `hashmap_destroy`.
+ *
+ * No other thread may use the hashmap anymore.
+ */
+void concurrent_hashmap_destroy(ConcurrentHashmap *map, void (*destroy_key)(Key *), void (*destroy_value)(Value *));
+
+/**
+ * A hashmap for many threads that insert and remove keys at the same time.
+ *
+ * The key-value pairs are split over a number of independent hashmaps, the
+ * shards, by their hash. Every shard has its own lock and grows on its own, so
+ * threads only wait for each other when they use the same shard at the same
+ * time. Unlike `ConcurrentHashmap`, lookups lock their shard as well.
+ *
+ * Only available with POSIX threads.
+ */
+typedef struct ShardedHashmap ShardedHashmap;
+
+/**
+ * Create a sharded hashmap with the default options and `num_shards` shards,
+ * rounded up to a power of two. A few times the number of threads that use
+ * the hashmap at once is a good choice.
+ *
+ * The hash and equality functions of `hasher` have to be safe to call from
+ * several threads at once.
+ *
+ * Returns NULL if `num_shards` is 0 or larger than 4096, or if the memory
+ * could not be allocated.
+ */
+ShardedHashmap *sharded_hashmap_create(Hasher hasher, size_t num_shards);
+
+/**
+ * Insert a key-value pair like `hashmap_insert`, but safe to call from any
+ * thread.
+ *
+ * `*entry` points to the value of the pair. It may be used as long as no other
+ * thread removes the pair.
+ */
+bool sharded_hashmap_insert(ShardedHashmap *map, Key *key, Value *value, Value **entry);
+
+/**
+ * Get the value associated with the given key like `hashmap_get`, but safe to
+ * call from any thread.
+ */
+Value *sharded_hashmap_get(ShardedHashmap *map, Key *key);
+
+/**
+ * Remove a key-value pair like `hashmap_remove`, but safe to call from any
+ * thread.
+ */
+bool sharded_hashmap_remove(ShardedHashmap *map, Key *key, HashmapEntry *entry);
+
+/**
+ * Get the number of key-value pairs in all shards.
+ *
+ * The shards are counted one after the other, so while other threads insert
+ * or remove keys, this is only approximate.
+ */
+size_t sharded_hashmap_size(ShardedHashmap *map);
+
+/**
+ * Get the number of shards, i.e. `num_shards` rounded up to a power of two.
+ */
+size_t sharded_hashmap_num_shards(ShardedHashmap *map);
+
+/**
+ * Destroy all shards like `hashmap_destroy`.
+ *
+ * No other thread may use the hashmap anymore.
+ */
+void sharded_hashmap_destroy(ShardedHashmap *map, void (*destroy_key)(Key *), void (*destroy_value)(Value *));
+
+#endif
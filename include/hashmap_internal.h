@@ -0,0 +1,524 @@
+
+#ifndef HASHMAP_INTERNAL_H
+#define HASHMAP_INTERNAL_H
+
+#include <hashmap.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * The parts of the hash table that `Hashmap` (src/hashmap.c) and the typed
+ * maps of `HASHMAP_DEFINE` (hashmap_typed.h) share. This is not part of the
+ * API, it is only a header so that the typed maps can inline it.
+ *
+ * Both use the same layout: every entry has a control byte in a separate
+ * array, which is either `HASHMAP_CTRL_EMPTY` or holds 7 bits of the hash of
+ * the entry (see `hashmap_hash_tag`). When probing, the control bytes of a
+ * whole group of consecutive entries are compared at once, and the entries
+ * themselves are only looked at if their control byte matches. Since entries
+ * are removed with backward shifting, the table never contains tombstones, so
+ * there is no "deleted" control byte.
+ *
+ * The first `HASHMAP_GROUP_WIDTH - 1` control bytes are mirrored after the
+ * last one, so that a group can be loaded starting at any entry without
+ * wrapping around.
+ *
+ * The table algorithms (`hashmap_table_probe`, `hashmap_table_place` and
+ * `hashmap_table_erase`) only access the table through the functions in
+ * `HashmapTableFunctions`. They are always inlined, so every caller gets a
+ * copy that is specialized for its layout.
+ */
+
+#if defined(__GNUC__)
+#define HASHMAP_ALWAYS_INLINE __attribute__((always_inline)) inline
+#else
+#define HASHMAP_ALWAYS_INLINE inline
+#endif
+
+typedef uint8_t hashmap_ctrl_t;
+
+#define HASHMAP_CTRL_EMPTY ((hashmap_ctrl_t)0x80)
+
+#if defined(__AVX2__)
+#define HASHMAP_GROUP_WIDTH 32
+#elif defined(__SSE2__)
+#define HASHMAP_GROUP_WIDTH 16
+#else
+#define HASHMAP_GROUP_WIDTH 8
+#endif
+
+/**
+ * A bit mask with bit `i` set if the `i`-th control byte of a group matches.
+ */
+typedef uint32_t hashmap_group_mask_t;
+
+/**
+ * The initial capacity of a table.
+ *
+ * The capacity is always a power of two, so that the index of a hash can be
+ * computed with a mask instead of a division.
+ */
+#define HASHMAP_INITIAL_CAPACITY 8
+
+/**
+ * The default maximum load factor.
+ *
+ * The load factor (alpha) is the ratio of the number of entries to the capacity.
+ *
+ * When the load factor exceeds the maximum, the table is resized. Because
+ * probing mostly only touches the control bytes, a table can be filled up to
+ * 7/8 without lookups slowing down much.
+ */
+#define HASHMAP_DEFAULT_MAX_LOAD_FACTOR 0.875
+
+/**
+ * The default factor by which the capacity grows when a table is resized.
+ */
+#define HASHMAP_DEFAULT_GROWTH_FACTOR 2
+
+/**
+ * The murmur3 32 bit finalizer.
+ *
+ * Mixes all bits of the user supplied hash into the low bits, which are the
+ * only ones used to compute the index. Without this, weak hash functions such
+ * as djb2 would cluster heavily.
+ */
+static inline hash_t hashmap_mix_hash(hash_t hash) {
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/**
+ * The control byte of an entry with the given hash.
+ *
+ * The top 7 bits are used, since the low bits already determine the index.
+ */
+static inline hashmap_ctrl_t hashmap_hash_tag(hash_t hash) {
+    return (hashmap_ctrl_t)(hash >> 25);
+}
+
+/**
+ * Index of the lowest set bit. `mask` may not be 0.
+ */
+static inline unsigned int hashmap_lowest_bit(hashmap_group_mask_t mask) {
+#if defined(__GNUC__)
+    return (unsigned int)__builtin_ctz(mask);
+#else
+    unsigned int index = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        index += 1;
+    }
+    return index;
+#endif
+}
+
+/**
+ * Returns a mask of the control bytes in the group starting at `group` that
+ * are equal to `tag`.
+ */
+static inline hashmap_group_mask_t hashmap_group_match(const hashmap_ctrl_t *group, hashmap_ctrl_t tag) {
+#if defined(__AVX2__)
+    __m256i ctrl = _mm256_loadu_si256((const __m256i *)group);
+    __m256i match = _mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8((char)tag));
+    return (hashmap_group_mask_t)_mm256_movemask_epi8(match);
+#elif defined(__SSE2__)
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    __m128i match = _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag));
+    return (hashmap_group_mask_t)_mm_movemask_epi8(match);
+#else
+    hashmap_group_mask_t mask = 0;
+    for (unsigned int i = 0; i < HASHMAP_GROUP_WIDTH; ++i) {
+        if (group[i] == tag) {
+            mask |= (hashmap_group_mask_t)1 << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+/**
+ * Returns a mask of the empty entries in the group starting at `group`.
+ */
+static inline hashmap_group_mask_t hashmap_group_match_empty(const hashmap_ctrl_t *group) {
+#if defined(__AVX2__)
+    /* HASHMAP_CTRL_EMPTY is the only control byte with the high bit set */
+    __m256i ctrl = _mm256_loadu_si256((const __m256i *)group);
+    return (hashmap_group_mask_t)_mm256_movemask_epi8(ctrl);
+#elif defined(__SSE2__)
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (hashmap_group_mask_t)_mm_movemask_epi8(ctrl);
+#else
+    return hashmap_group_match(group, HASHMAP_CTRL_EMPTY);
+#endif
+}
+
+/**
+ * The number of bytes of the control bytes of a table with the given
+ * capacity, including the mirrored ones.
+ */
+static inline size_t hashmap_ctrl_size(size_t capacity) {
+    return capacity + HASHMAP_GROUP_WIDTH - 1;
+}
+
+/**
+ * Set a control byte of a contiguous array of control bytes, including its
+ * mirrored copies.
+ */
+static inline void hashmap_set_ctrl(hashmap_ctrl_t *ctrl, size_t capacity, size_t index, hashmap_ctrl_t value) {
+    ctrl[index] = value;
+    /* Small tables may be mirrored more than once */
+    for (size_t i = index + capacity; i < capacity + HASHMAP_GROUP_WIDTH - 1; i += capacity) {
+        ctrl[i] = value;
+    }
+}
+
+/**
+ * The `malloc` based allocator that maps use unless they are given another
+ * one, see `HashmapAllocator`.
+ */
+static inline void *hashmap_default_alloc(size_t size, void *context) {
+    (void)context;
+    return malloc(size);
+}
+
+static inline void hashmap_default_free(void *pointer, size_t size, void *context) {
+    (void)size;
+    (void)context;
+    free(pointer);
+}
+
+/**
+ * The load factors and growth factor of a map, see `HashmapOptions`.
+ */
+typedef struct HashmapSizing {
+    double max_load_factor;
+    /* 0 if the map should never shrink automatically */
+    double min_load_factor;
+    /* Always a power of two, so that the capacity stays a power of two */
+    size_t growth_factor;
+    /* The largest capacity whose memory size does not overflow */
+    size_t max_capacity;
+} HashmapSizing;
+
+/**
+ * Fill in `sizing` from `options`, with the defaults for fields that are 0.
+ *
+ * Returns false if the options are invalid, see `HashmapOptions`.
+ */
+static inline bool hashmap_sizing_init(HashmapSizing *sizing, const HashmapOptions *options, size_t max_capacity) {
+    double max_load_factor = options->max_load_factor;
+    if (max_load_factor == 0.0) {
+        max_load_factor = HASHMAP_DEFAULT_MAX_LOAD_FACTOR;
+    } else if (!(max_load_factor > 0.0 && max_load_factor < 1.0)) {
+        return false;
+    }
+
+    size_t growth_factor = HASHMAP_DEFAULT_GROWTH_FACTOR;
+    if (options->growth_factor != 0.0) {
+        if (!(options->growth_factor > 1.0)) {
+            return false;
+        }
+        /* Round up to a power of two */
+        while ((double)growth_factor < options->growth_factor) {
+            if (growth_factor > max_capacity / 2) {
+                return false;
+            }
+            growth_factor *= 2;
+        }
+    }
+
+    double min_load_factor = options->min_load_factor;
+    if (!(min_load_factor >= 0.0 && min_load_factor < max_load_factor / (double)growth_factor)) {
+        return false;
+    }
+
+    sizing->max_load_factor = max_load_factor;
+    sizing->min_load_factor = min_load_factor;
+    sizing->growth_factor = growth_factor;
+    sizing->max_capacity = max_capacity;
+    return true;
+}
+
+/**
+ * The maximum number of entries a table with the given capacity can hold.
+ *
+ * There is always at least one empty entry left, so that probing terminates.
+ */
+static inline size_t hashmap_max_size(const HashmapSizing *sizing, size_t capacity) {
+    if (capacity == 0) {
+        return 0;
+    }
+    size_t max_size = (size_t)((double)capacity * sizing->max_load_factor);
+    if (max_size >= capacity) {
+        max_size = capacity - 1;
+    }
+    return max_size;
+}
+
+/**
+ * The number of entries below which a table with the given capacity shrinks.
+ */
+static inline size_t hashmap_min_size(const HashmapSizing *sizing, size_t capacity) {
+    if (capacity <= HASHMAP_INITIAL_CAPACITY) {
+        return 0;
+    }
+    return (size_t)((double)capacity * sizing->min_load_factor);
+}
+
+/**
+ * The smallest valid capacity that can hold `size` entries, at least `minimum`.
+ *
+ * Returns 0 if there is no such capacity.
+ */
+static inline size_t hashmap_capacity_for_size(const HashmapSizing *sizing, size_t size, size_t minimum) {
+    size_t capacity = HASHMAP_INITIAL_CAPACITY;
+    while (capacity < minimum || hashmap_max_size(sizing, capacity) < size) {
+        if (capacity > sizing->max_capacity / 2) {
+            return 0;
+        }
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+/**
+ * The capacity a full table with the given capacity grows to, so that it can
+ * hold `size` entries.
+ *
+ * Returns 0 if there is no such capacity.
+ */
+static inline size_t hashmap_grown_capacity(const HashmapSizing *sizing, size_t capacity, size_t size) {
+    size_t minimum;
+    if (capacity == 0) {
+        minimum = HASHMAP_INITIAL_CAPACITY;
+    } else if (capacity > sizing->max_capacity / sizing->growth_factor) {
+        minimum = sizing->max_capacity;
+    } else {
+        minimum = capacity * sizing->growth_factor;
+    }
+    return hashmap_capacity_for_size(sizing, size, minimum);
+}
+
+/**
+ * The capacity a table that dropped below its minimum size shrinks to.
+ *
+ * The table shrinks to the smallest capacity at which it is at most half as
+ * full as the maximum load factor allows, so that a few insertions do not make
+ * it grow right away.
+ */
+static inline size_t hashmap_shrunk_capacity(const HashmapSizing *sizing, size_t size) {
+    return hashmap_capacity_for_size(sizing, 2 * size, HASHMAP_INITIAL_CAPACITY);
+}
+
+/**
+ * Whether the entry at the given index of the old table of an incremental
+ * resize has already been moved.
+ *
+ * The entries are moved in index order, starting at `migration_start`, which
+ * was empty when the resize started. `migrated` is the number of entries that
+ * have been looked at so far.
+ */
+static inline bool hashmap_is_migrated(size_t old_capacity, size_t migration_start, size_t migrated, size_t index) {
+    return ((index - migration_start) & (old_capacity - 1)) < migrated;
+}
+
+/**
+ * Where to start probing for a hash in the old table of an incremental resize.
+ *
+ * Moving entries out of the old table leaves gaps in the probe sequences of
+ * the entries that are still there, so if the preferred index was already
+ * moved, we have to start probing where the remaining entries begin. Because
+ * `migration_start` was empty, no cluster wraps around into the entries that
+ * have been moved.
+ */
+static inline size_t hashmap_old_table_start(size_t old_capacity, size_t migration_start, size_t migrated,
+        hash_t hash) {
+    size_t preferred_index = hash & (old_capacity - 1);
+    if (hashmap_is_migrated(old_capacity, migration_start, migrated, preferred_index)) {
+        return (migration_start + migrated) & (old_capacity - 1);
+    }
+    return preferred_index;
+}
+
+/**
+ * How the table algorithms below access a table. `table` is whatever the
+ * caller passes to them.
+ */
+typedef struct HashmapTableFunctions {
+    /*
+     * The control bytes of the group of entries starting at `position`. If
+     * they are not contiguous, they may be copied into `buffer` instead.
+     */
+    const hashmap_ctrl_t *(*group)(void *table, size_t position, hashmap_ctrl_t *buffer);
+    hashmap_ctrl_t (*ctrl)(void *table, size_t index);
+    /* Sets a control byte, including its mirrored copies */
+    void (*set_ctrl)(void *table, size_t index, hashmap_ctrl_t ctrl);
+    /* The hash stored in an initialized entry */
+    hash_t (*hash)(void *table, size_t index);
+    /* Copies the entry at `from` over the one at `to` */
+    void (*move)(void *table, size_t to, size_t from);
+} HashmapTableFunctions;
+
+/**
+ * Whether the entry at `index` holds the key the caller is looking for. Only
+ * called for entries whose control byte matches the hash.
+ */
+typedef bool (*HashmapMatchFunction)(void *context, void *table, size_t index);
+
+/**
+ * The distance of an initialized entry from its preferred index.
+ *
+ * The distance is not stored, but computed from the cached hash.
+ */
+static HASHMAP_ALWAYS_INLINE size_t hashmap_table_distance(const HashmapTableFunctions *functions, void *table,
+        size_t capacity, size_t index) {
+    return (index - functions->hash(table, index)) & (capacity - 1);
+}
+
+/**
+ * Look for the entry that `matches` in a table, starting at `position`.
+ *
+ * `position` is usually the preferred index of the hash. It may only be a
+ * later index if there are no entries with that preferred index before it.
+ *
+ * If the entry is found, true is returned and `*index` is set to its index.
+ * Otherwise, false is returned and `*index` is set to the last index that was
+ * looked at, which gives the length of the probe.
+ *
+ * The table may not have capacity 0.
+ */
+static HASHMAP_ALWAYS_INLINE bool hashmap_table_probe(const HashmapTableFunctions *functions, void *table,
+        size_t capacity, hash_t hash, size_t position, HashmapMatchFunction matches, void *context,
+        size_t *index) {
+    size_t mask = capacity - 1;
+    hashmap_ctrl_t tag = hashmap_hash_tag(hash);
+    size_t preferred_index = hash & mask;
+
+    hashmap_ctrl_t buffer[HASHMAP_GROUP_WIDTH];
+    for (;;) {
+        const hashmap_ctrl_t *group = functions->group(table, position, buffer);
+        hashmap_group_mask_t match = hashmap_group_match(group, tag);
+        hashmap_group_mask_t empty = hashmap_group_match_empty(group);
+
+        if (empty != 0) {
+            /* Entries after the first empty one belong to another cluster */
+            match &= (empty & (~empty + 1)) - 1;
+        }
+
+        while (match != 0) {
+            size_t i = (position + hashmap_lowest_bit(match)) & mask;
+            if (functions->hash(table, i) == hash && matches(context, table, i)) {
+                *index = i;
+                return true;
+            }
+            match &= match - 1;
+        }
+
+        if (empty != 0) {
+            *index = (position + hashmap_lowest_bit(empty)) & mask;
+            return false;
+        }
+
+        /*
+         * Because of the Robin Hood ordering, once an entry is closer to its
+         * preferred index than we are to ours, our key cannot come after it.
+         * Checking the last entry of the group is enough to know whether we
+         * need to look at the next group.
+         */
+        size_t last = (position + HASHMAP_GROUP_WIDTH - 1) & mask;
+        if (hashmap_table_distance(functions, table, capacity, last) < ((last - preferred_index) & mask)) {
+            *index = last;
+            return false;
+        }
+
+        position = (position + HASHMAP_GROUP_WIDTH) & mask;
+    }
+}
+
+/**
+ * Make room for an entry with the given hash in a table that is known not to
+ * contain its key.
+ *
+ * This uses Robin Hood insertion: walking from the preferred index of the
+ * entry, the new entry goes before the first entry that is closer to its
+ * preferred index than the new one would be, and the entries from there up to
+ * the next empty one are shifted back by one. This keeps the entries of a
+ * cluster ordered by their preferred index and the probe lengths short.
+ *
+ * The slot is determined from the hash alone, so no key is compared. This is
+ * also used to move entries into a freshly allocated table when the capacity
+ * changes.
+ *
+ * The table has to have at least one empty entry after placing this one.
+ *
+ * Returns the index of the new entry. Its control byte is set, but the caller
+ * has to fill in the entry itself and count it.
+ */
+static HASHMAP_ALWAYS_INLINE size_t hashmap_table_place(const HashmapTableFunctions *functions, void *table,
+        size_t capacity, hash_t hash) {
+    size_t mask = capacity - 1;
+    size_t index = hash & mask;
+    size_t distance = 0;
+    while (functions->ctrl(table, index) != HASHMAP_CTRL_EMPTY
+            && hashmap_table_distance(functions, table, capacity, index) >= distance) {
+        index = (index + 1) & mask;
+        distance += 1;
+    }
+
+    size_t empty = index;
+    while (functions->ctrl(table, empty) != HASHMAP_CTRL_EMPTY) {
+        empty = (empty + 1) & mask;
+    }
+    while (empty != index) {
+        size_t previous = (empty - 1) & mask;
+        functions->move(table, empty, previous);
+        functions->set_ctrl(table, empty, functions->ctrl(table, previous));
+        empty = previous;
+    }
+
+    functions->set_ctrl(table, index, hashmap_hash_tag(hash));
+    return index;
+}
+
+/**
+ * Remove the entry at the given index from a table.
+ *
+ * Instead of leaving a tombstone, the entries that come after the removed
+ * entry are shifted backwards, so that there are no gaps in their probe
+ * sequences. Because of the Robin Hood ordering, this stops at the first entry
+ * that is already at its preferred index.
+ *
+ * Returns the index of the entry that is left over at the end, which the
+ * caller has to mark as empty. The number of shifted entries is the distance
+ * from `index` to it.
+ */
+static HASHMAP_ALWAYS_INLINE size_t hashmap_table_erase(const HashmapTableFunctions *functions, void *table,
+        size_t capacity, size_t index) {
+    size_t mask = capacity - 1;
+    size_t to_replace = index;
+    for (size_t current = (to_replace + 1) & mask;
+            functions->ctrl(table, current) != HASHMAP_CTRL_EMPTY
+                && hashmap_table_distance(functions, table, capacity, current) != 0;
+            current = (current + 1) & mask) {
+        functions->move(table, to_replace, current);
+        functions->set_ctrl(table, to_replace, functions->ctrl(table, current));
+        to_replace = current;
+    }
+    return to_replace;
+}
+
+#endif
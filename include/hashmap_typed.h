@@ -0,0 +1,416 @@
+
+#ifndef HASHMAP_TYPED_H
+#define HASHMAP_TYPED_H
+
+#include <hashmap.h>
+#include <hashmap_internal.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Type specialized hashmaps.
+ *
+ * `HASHMAP_DEFINE(name, K, V, hash_fn, equal_fn)` defines a hashmap type `name`
+ * with keys of type `K` and values of type `V`, together with the functions
+ * `name_create`, `name_create_with_options`, `name_create_with_allocator`,
+ * `name_insert`, `name_get`, `name_remove`, `name_size`, `name_capacity`,
+ * `name_reserve` and `name_destroy`. They behave like their `hashmap_*`
+ * counterparts in hashmap.h, but take keys and values by value and store them
+ * in the hashmap itself.
+ *
+ * `hash_fn` has to be a function or function-like macro `hash_t hash_fn(K key)`
+ * and `equal_fn` one of the form `bool equal_fn(K key1, K key2)`. Since they
+ * are called directly instead of through a function pointer, the compiler can
+ * inline them into the probing loop.
+ *
+ * The maps share their layout and algorithms with `Hashmap`, see
+ * hashmap_internal.h: control bytes that are compared a group at a time,
+ * Robin Hood insertion and backward shift deletion. They take the same
+ * `HashmapOptions` and `HashmapAllocator`, but since the keys and values are
+ * always stored in the map, `key_size`, `value_size`, `key_copy_size`,
+ * `value_copy_size`, `ordered` and `scan_entries` have to be 0, otherwise
+ * creating the map fails.
+ *
+ * For example, a map from `uint64_t` to `double` can be defined with
+ *
+ *     static hash_t u64_hash(uint64_t key) { return (hash_t)(key ^ (key >> 32)); }
+ *     static bool u64_equal(uint64_t a, uint64_t b) { return a == b; }
+ *     HASHMAP_DEFINE(U64Map, uint64_t, double, u64_hash, u64_equal)
+ *
+ * after which `U64Map *map = U64Map_create();` creates a map.
+ */
+
+#define HASHMAP_DEFINE(name, K, V, hash_fn, equal_fn)                                               \
+                                                                                                    \
+typedef struct name##_entry {                                                                       \
+    K key;                                                                                          \
+    V value;                                                                                        \
+} name##_entry;                                                                                     \
+                                                                                                    \
+typedef struct name##_slot {                                                                        \
+    name##_entry entry;                                                                             \
+    hash_t hash;                                                                                    \
+} name##_slot;                                                                                      \
+                                                                                                    \
+typedef struct name##_table {                                                                       \
+    size_t size;                                                                                    \
+    size_t capacity;                                                                                \
+    /* `slots` and `ctrl` share a single allocation */                                              \
+    name##_slot *slots;                                                                             \
+    hashmap_ctrl_t *ctrl;                                                                           \
+} name##_table;                                                                                     \
+                                                                                                    \
+/* See `Hashmap` in hashmap.c, which resizes the same way */                                        \
+typedef struct name {                                                                               \
+    size_t max_size;                                                                                \
+    size_t min_size;                                                                                \
+    HashmapSizing sizing;                                                                           \
+    size_t resize_step;                                                                             \
+    HashmapAllocator allocator;                                                                     \
+    name##_table table;                                                                             \
+    /* The table whose entries are still being moved, see `hashmap_migrate` */                      \
+    name##_table old_table;                                                                         \
+    size_t migration_start;                                                                         \
+    size_t migrated;                                                                                \
+} name;                                                                                             \
+                                                                                                    \
+static inline const hashmap_ctrl_t *name##_table_group(void *table, size_t position,                \
+        hashmap_ctrl_t *buffer) {                                                                   \
+    (void)buffer;                                                                                   \
+    return &((name##_table *)table)->ctrl[position];                                                \
+}                                                                                                   \
+                                                                                                    \
+static inline hashmap_ctrl_t name##_table_ctrl(void *table, size_t index) {                         \
+    return ((name##_table *)table)->ctrl[index];                                                    \
+}                                                                                                   \
+                                                                                                    \
+static inline void name##_table_set_ctrl(void *table, size_t index, hashmap_ctrl_t ctrl) {          \
+    name##_table *t = table;                                                                        \
+    hashmap_set_ctrl(t->ctrl, t->capacity, index, ctrl);                                            \
+}                                                                                                   \
+                                                                                                    \
+static inline hash_t name##_table_hash(void *table, size_t index) {                                 \
+    return ((name##_table *)table)->slots[index].hash;                                              \
+}                                                                                                   \
+                                                                                                    \
+static inline void name##_table_move(void *table, size_t to, size_t from) {                         \
+    name##_table *t = table;                                                                        \
+    t->slots[to] = t->slots[from];                                                                  \
+}                                                                                                   \
+                                                                                                    \
+static const HashmapTableFunctions name##_table_functions = {                                       \
+    .group = name##_table_group,                                                                    \
+    .ctrl = name##_table_ctrl,                                                                      \
+    .set_ctrl = name##_table_set_ctrl,                                                              \
+    .hash = name##_table_hash,                                                                      \
+    .move = name##_table_move,                                                                      \
+};                                                                                                  \
+                                                                                                    \
+static inline bool name##_matches(void *key, void *table, size_t index) {                           \
+    return equal_fn(*(K *)key, ((name##_table *)table)->slots[index].entry.key);                    \
+}                                                                                                   \
+                                                                                                    \
+static inline size_t name##_distance(name##_table *table, size_t index) {                           \
+    return hashmap_table_distance(&name##_table_functions, table, table->capacity, index);          \
+}                                                                                                   \
+                                                                                                    \
+static inline size_t name##_table_bytes(size_t capacity) {                                          \
+    return capacity * sizeof(name##_slot) + hashmap_ctrl_size(capacity);                            \
+}                                                                                                   \
+                                                                                                    \
+static inline bool name##_table_init(name *map, name##_table *table, size_t capacity) {             \
+    table->size = 0;                                                                                \
+    table->capacity = capacity;                                                                     \
+    table->slots = NULL;                                                                            \
+    table->ctrl = NULL;                                                                             \
+    if (capacity != 0) {                                                                            \
+        table->slots = map->allocator.alloc(name##_table_bytes(capacity),                           \
+            map->allocator.context);                                                                \
+        if (table->slots == NULL) {                                                                 \
+            return false;                                                                           \
+        }                                                                                           \
+        table->ctrl = (hashmap_ctrl_t *)(table->slots + capacity);                                  \
+        memset(table->ctrl, HASHMAP_CTRL_EMPTY, hashmap_ctrl_size(capacity));                       \
+    }                                                                                               \
+    return true;                                                                                    \
+}                                                                                                   \
+                                                                                                    \
+static inline void name##_table_free(name *map, name##_table *table) {                              \
+    if (table->capacity != 0) {                                                                     \
+        map->allocator.free(table->slots, name##_table_bytes(table->capacity),                      \
+            map->allocator.context);                                                                \
+    }                                                                                               \
+    table->size = 0;                                                                                \
+    table->capacity = 0;                                                                            \
+    table->slots = NULL;                                                                            \
+    table->ctrl = NULL;                                                                             \
+}                                                                                                   \
+                                                                                                    \
+static inline name *name##_create_with_allocator(HashmapOptions options,                            \
+        HashmapAllocator allocator) {                                                               \
+    if (allocator.alloc == NULL || allocator.free == NULL) {                                        \
+        return NULL;                                                                                \
+    }                                                                                               \
+    /* Keys and values are always stored in the slots */                                            \
+    if (options.key_size != 0 || options.value_size != 0 || options.key_copy_size != NULL           \
+            || options.value_copy_size != NULL || options.ordered || options.scan_entries) {        \
+        return NULL;                                                                                \
+    }                                                                                               \
+                                                                                                    \
+    HashmapSizing sizing;                                                                           \
+    size_t max_capacity = ((size_t)-1 - HASHMAP_GROUP_WIDTH) / (sizeof(name##_slot) + 1);           \
+    if (!hashmap_sizing_init(&sizing, &options, max_capacity)) {                                    \
+        return NULL;                                                                                \
+    }                                                                                               \
+    size_t capacity = 0;                                                                            \
+    if (options.initial_capacity != 0) {                                                            \
+        capacity = hashmap_capacity_for_size(&sizing, options.initial_capacity,                     \
+            HASHMAP_INITIAL_CAPACITY);                                                              \
+        if (capacity == 0) {                                                                        \
+            return NULL;                                                                            \
+        }                                                                                           \
+    }                                                                                               \
+                                                                                                    \
+    name *map = allocator.alloc(sizeof(*map), allocator.context);                                   \
+    if (map == NULL) {                                                                              \
+        return NULL;                                                                                \
+    }                                                                                               \
+    map->sizing = sizing;                                                                           \
+    map->resize_step = options.resize_step;                                                         \
+    map->allocator = allocator;                                                                     \
+    map->max_size = hashmap_max_size(&sizing, capacity);                                            \
+    map->min_size = hashmap_min_size(&sizing, capacity);                                            \
+    map->migration_start = 0;                                                                       \
+    map->migrated = 0;                                                                              \
+    name##_table_init(map, &map->old_table, 0);                                                     \
+    if (!name##_table_init(map, &map->table, capacity)) {                                           \
+        allocator.free(map, sizeof(*map), allocator.context);                                       \
+        return NULL;                                                                                \
+    }                                                                                               \
+    return map;                                                                                     \
+}                                                                                                   \
+                                                                                                    \
+static inline name *name##_create_with_options(HashmapOptions options) {                            \
+    HashmapAllocator allocator = {                                                                  \
+        .alloc = hashmap_default_alloc,                                                             \
+        .free = hashmap_default_free,                                                               \
+        .context = NULL,                                                                            \
+    };                                                                                              \
+    return name##_create_with_allocator(options, allocator);                                        \
+}                                                                                                   \
+                                                                                                    \
+static inline name *name##_create(void) {                                                           \
+    HashmapOptions options = { 0 };                                                                 \
+    return name##_create_with_options(options);                                                     \
+}                                                                                                   \
+                                                                                                    \
+static inline bool name##_find(name *map, K key, hash_t hash, name##_table **table,                 \
+        size_t *index) {                                                                            \
+    if (map->table.size != 0 && hashmap_table_probe(&name##_table_functions, &map->table,           \
+            map->table.capacity, hash, hash & (map->table.capacity - 1), name##_matches, &key,      \
+            index)) {                                                                               \
+        *table = &map->table;                                                                       \
+        return true;                                                                                \
+    }                                                                                               \
+    if (map->old_table.size != 0) {                                                                 \
+        size_t start = hashmap_old_table_start(map->old_table.capacity, map->migration_start,       \
+            map->migrated, hash);                                                                   \
+        if (hashmap_table_probe(&name##_table_functions, &map->old_table,                           \
+                map->old_table.capacity, hash, start, name##_matches, &key, index)) {               \
+            *table = &map->old_table;                                                               \
+            return true;                                                                            \
+        }                                                                                           \
+    }                                                                                               \
+    return false;                                                                                   \
+}                                                                                                   \
+                                                                                                    \
+static inline size_t name##_place(name##_table *table, hash_t hash) {                               \
+    size_t index = hashmap_table_place(&name##_table_functions, table, table->capacity, hash);      \
+    table->size += 1;                                                                               \
+    return index;                                                                                   \
+}                                                                                                   \
+                                                                                                    \
+static inline void name##_erase(name##_table *table, size_t index) {                                \
+    size_t to_replace = hashmap_table_erase(&name##_table_functions, table, table->capacity,        \
+        index);                                                                                     \
+    hashmap_set_ctrl(table->ctrl, table->capacity, to_replace, HASHMAP_CTRL_EMPTY);                 \
+    table->size -= 1;                                                                               \
+}                                                                                                   \
+                                                                                                    \
+/* Incremental resizing, see `hashmap_migrate` in hashmap.c */                                      \
+static inline void name##_migrate(name *map, size_t count) {                                        \
+    name##_table *old_table = &map->old_table;                                                      \
+    if (old_table->capacity == 0) {                                                                 \
+        return;                                                                                     \
+    }                                                                                               \
+    size_t mask = old_table->capacity - 1;                                                          \
+    while (count > 0 && old_table->size != 0) {                                                     \
+        size_t i = (map->migration_start + map->migrated) & mask;                                   \
+        if (old_table->ctrl[i] != HASHMAP_CTRL_EMPTY) {                                             \
+            name##_slot *slot = &old_table->slots[i];                                               \
+            map->table.slots[name##_place(&map->table, slot->hash)] = *slot;                        \
+            hashmap_set_ctrl(old_table->ctrl, old_table->capacity, i, HASHMAP_CTRL_EMPTY);          \
+            old_table->size -= 1;                                                                   \
+        }                                                                                           \
+        map->migrated += 1;                                                                         \
+        count -= 1;                                                                                 \
+    }                                                                                               \
+    if (old_table->size == 0) {                                                                     \
+        name##_table_free(map, old_table);                                                          \
+        map->migration_start = 0;                                                                   \
+        map->migrated = 0;                                                                          \
+    }                                                                                               \
+}                                                                                                   \
+                                                                                                    \
+static inline bool name##_resize(name *map, size_t new_capacity, bool incremental) {                \
+    /* Finish the previous resize first, there are never more than two tables */                    \
+    name##_migrate(map, (size_t)-1);                                                                \
+                                                                                                    \
+    name##_table old_table = map->table;                                                            \
+    if (!name##_table_init(map, &map->table, new_capacity)) {                                       \
+        map->table = old_table;                                                                     \
+        return false;                                                                               \
+    }                                                                                               \
+    map->max_size = hashmap_max_size(&map->sizing, new_capacity);                                   \
+    map->min_size = hashmap_min_size(&map->sizing, new_capacity);                                   \
+                                                                                                    \
+    if (incremental && map->resize_step != 0 && old_table.size != 0) {                              \
+        /* Start moving entries after an empty one, see `hashmap_old_table_start` */                \
+        size_t start = 0;                                                                           \
+        while (old_table.ctrl[start] != HASHMAP_CTRL_EMPTY) {                                       \
+            start += 1;                                                                             \
+        }                                                                                           \
+        map->old_table = old_table;                                                                 \
+        map->migration_start = start;                                                               \
+        map->migrated = 0;                                                                          \
+    } else {                                                                                        \
+        for (size_t i = 0; i < old_table.capacity; ++i) {                                           \
+            if (old_table.ctrl[i] != HASHMAP_CTRL_EMPTY) {                                          \
+                map->table.slots[name##_place(&map->table, old_table.slots[i].hash)]                \
+                    = old_table.slots[i];                                                           \
+            }                                                                                       \
+        }                                                                                           \
+        name##_table_free(map, &old_table);                                                         \
+    }                                                                                               \
+    return true;                                                                                    \
+}                                                                                                   \
+                                                                                                    \
+static inline size_t name##_size(name *map) {                                                       \
+    return map->table.size + map->old_table.size;                                                   \
+}                                                                                                   \
+                                                                                                    \
+static inline size_t name##_capacity(name *map) {                                                   \
+    return map->table.capacity;                                                                     \
+}                                                                                                   \
+                                                                                                    \
+static inline bool name##_reserve(name *map, size_t n) {                                            \
+    if (n <= map->max_size) {                                                                       \
+        return true;                                                                                \
+    }                                                                                               \
+    size_t capacity = hashmap_capacity_for_size(&map->sizing, n, HASHMAP_INITIAL_CAPACITY);         \
+    if (capacity == 0) {                                                                            \
+        return false;                                                                               \
+    }                                                                                               \
+    return name##_resize(map, capacity, false);                                                     \
+}                                                                                                   \
+                                                                                                    \
+static inline bool name##_insert(name *map, K key, V value, V **entry) {                            \
+    name##_migrate(map, map->resize_step);                                                          \
+                                                                                                    \
+    hash_t h = hashmap_mix_hash(hash_fn(key));                                                      \
+    name##_table *table;                                                                            \
+    size_t index;                                                                                   \
+    if (name##_find(map, key, h, &table, &index)) {                                                 \
+        if (entry != NULL) {                                                                        \
+            *entry = &table->slots[index].entry.value;                                              \
+        }                                                                                           \
+        return false;                                                                               \
+    }                                                                                               \
+                                                                                                    \
+    size_t size = name##_size(map);                                                                 \
+    if (size + 1 > map->max_size) {                                                                 \
+        size_t capacity = hashmap_grown_capacity(&map->sizing, map->table.capacity, size + 1);      \
+        if (capacity == 0 || !name##_resize(map, capacity, true)) {                                 \
+            if (entry != NULL) {                                                                    \
+                *entry = NULL;                                                                      \
+            }                                                                                       \
+            return false;                                                                           \
+        }                                                                                           \
+    }                                                                                               \
+                                                                                                    \
+    table = &map->table;                                                                            \
+    index = name##_place(table, h);                                                                 \
+    table->slots[index].entry.key = key;                                                            \
+    table->slots[index].entry.value = value;                                                        \
+    table->slots[index].hash = h;                                                                   \
+    if (entry != NULL) {                                                                            \
+        *entry = &table->slots[index].entry.value;                                                  \
+    }                                                                                               \
+    return true;                                                                                    \
+}                                                                                                   \
+                                                                                                    \
+static inline V *name##_get(name *map, K key) {                                                     \
+    name##_migrate(map, map->resize_step);                                                          \
+                                                                                                    \
+    name##_table *table;                                                                            \
+    size_t index;                                                                                   \
+    if (!name##_find(map, key, hashmap_mix_hash(hash_fn(key)), &table, &index)) {                   \
+        return NULL;                                                                                \
+    }                                                                                               \
+    return &table->slots[index].entry.value;                                                        \
+}                                                                                                   \
+                                                                                                    \
+static inline bool name##_remove(name *map, K key, name##_entry *entry) {                           \
+    name##_migrate(map, map->resize_step);                                                          \
+                                                                                                    \
+    name##_table *table;                                                                            \
+    size_t index;                                                                                   \
+    if (!name##_find(map, key, hashmap_mix_hash(hash_fn(key)), &table, &index)) {                   \
+        return false;                                                                               \
+    }                                                                                               \
+    if (entry != NULL) {                                                                            \
+        *entry = table->slots[index].entry;                                                         \
+    }                                                                                               \
+    name##_erase(table, index);                                                                     \
+    if (table == &map->old_table && table->size == 0) {                                             \
+        /* That was the last entry that still had to be moved */                                    \
+        name##_migrate(map, 0);                                                                     \
+    }                                                                                               \
+                                                                                                    \
+    /* Shrink below the minimum load factor, see `hashmap_shrunk_capacity` */                       \
+    size_t size = name##_size(map);                                                                 \
+    if (size < map->min_size && map->old_table.capacity == 0) {                                     \
+        size_t capacity = hashmap_shrunk_capacity(&map->sizing, size);                              \
+        if (capacity != 0 && capacity < map->table.capacity) {                                      \
+            name##_resize(map, capacity, true);                                                     \
+        }                                                                                           \
+    }                                                                                               \
+    return true;                                                                                    \
+}                                                                                                   \
+                                                                                                    \
+static inline void name##_table_destroy(name *map, name##_table *table, void (*destroy_key)(K),     \
+        void (*destroy_value)(V)) {                                                                 \
+    for (size_t i = 0; i < table->capacity; ++i) {                                                  \
+        if (table->ctrl[i] != HASHMAP_CTRL_EMPTY) {                                                 \
+            if (destroy_key != NULL) {                                                              \
+                destroy_key(table->slots[i].entry.key);                                             \
+            }                                                                                       \
+            if (destroy_value != NULL) {                                                            \
+                destroy_value(table->slots[i].entry.value);                                         \
+            }                                                                                       \
+        }                                                                                           \
+    }                                                                                               \
+    name##_table_free(map, table);                                                                  \
+}                                                                                                   \
+                                                                                                    \
+static inline void name##_destroy(name *map, void (*destroy_key)(K), void (*destroy_value)(V)) {    \
+    name##_table_destroy(map, &map->table, destroy_key, destroy_value);                             \
+    name##_table_destroy(map, &map->old_table, destroy_key, destroy_value);                         \
+    HashmapAllocator allocator = map->allocator;                                                    \
+    allocator.free(map, sizeof(*map), allocator.context);                                           \
+}
+
+#endif
@@ -1,401 +1,4659 @@
+/* For MAP_ANONYMOUS and madvise */
+#define _DEFAULT_SOURCE
 
 #include <hashmap.h>
+#include <hashmap_internal.h>
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#ifdef HASHMAP_STATS
+#include <time.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HASHMAP_PTHREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/* `hashmap_save` and `hashmap_open_mapped` need POSIX file I/O and mmap */
+#if defined(__unix__) || defined(__APPLE__)
+#define HASHMAP_SNAPSHOTS
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* `ConcurrentHashmap` needs the atomic builtins of GCC and Clang */
+#if defined(HASHMAP_PTHREADS) && defined(__GNUC__)
+#define HASHMAP_CONCURRENT
+#endif
+
+/* For rare paths that should not take up registers and stack in the common ones */
+#if defined(__GNUC__)
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
 #ifdef CONSISTENCY_CHECKS
 #define VALIDATE_HASHMAP(map) validate_hashmap(map)
 #else
 #define VALIDATE_HASHMAP(map) ((void)0)
 #endif
 
+/*
+ * With HASHMAP_STATS, the counters of `hashmap_stats` are kept in
+ * `Hashmap.stats`. Otherwise, counting does nothing and the compiler removes
+ * it, see `hashmap_stats`.
+ */
+#ifdef HASHMAP_STATS
+#define COUNT(map, counter, n) stats_add(&(map)->stats.counter, (n))
+#define COUNT_PROBE(map, histogram, length) stats_add(&(map)->stats.histogram[probe_bucket(length)], 1)
+#define STATS_NOW() stats_now_ns()
+#else
+#define COUNT(map, counter, n) ((void)(n))
+#define COUNT_PROBE(map, histogram, length) ((void)0)
+#define STATS_NOW() ((uint64_t)0)
+#endif
+
+/**
+ * The number of keys `hashmap_get_many` and `hashmap_insert_many` hash and
+ * prefetch before probing for any of them.
+ *
+ * This should be large enough to keep many cache misses in flight at once,
+ * but small enough that the prefetched lines are not evicted before use.
+ */
+#define BATCH_SIZE 16
+
+/**
+ * The maximum number of threads `hashmap_build_parallel` uses.
+ */
+#define MAX_BUILD_THREADS 256
+
+/**
+ * The smallest number of table entries `hashmap_build_parallel` gives a thread
+ * to fill in at once. Keys only spill over into the next region near its end,
+ * so larger regions leave less work for the calling thread at the end.
+ */
+#define MIN_BUILD_REGION_CAPACITY 4096
+
+/**
+ * The average number of keys per partition of a `FrozenHashmap`. Partitions
+ * are built independently, and the slots of one fit into the L2 cache.
+ */
+#define FROZEN_PARTITION_SIZE 65536
+
+/**
+ * The average number of keys per bucket of a `FrozenHashmap`, see
+ * `frozen_place`. Larger buckets need fewer pilots, but take longer to place.
+ */
+#define FROZEN_BUCKET_SIZE 4
+
+/**
+ * The number of entries per page once a table or the dense entries of an
+ * ordered map are shared with a clone, see `SharedPage`. A power of two.
+ */
+#define SHARED_PAGE_SLOTS 1024
+
+/**
+ * The maximum number of shards of a `ShardedHashmap`.
+ */
+#define MAX_SHARDS 4096
+
+/**
+ * The number of lookup counters of a `ConcurrentHashmap` per epoch.
+ */
+#define READER_STRIPES 64
+
+/**
+ * How often `concurrent_hashmap_get` probes the table without the lock before
+ * it takes the lock, so that continuous writes cannot make a lookup retry
+ * forever.
+ */
+#define CONCURRENT_GET_ATTEMPTS 16
+
+/**
+ * The size of a cache line on most CPUs, see `ReaderCounter` and `Shard`.
+ */
+#define CACHE_LINE_SIZE 64
+
+/**
+ * The size of the first chunk of the arena that owned keys and values are
+ * copied into. Every following chunk is twice as large as the previous one.
+ */
+#define ARENA_INITIAL_CHUNK_SIZE 4096
+
+/**
+ * The size of the huge pages `hashmap_huge_page_alloc` maps memory with.
+ *
+ * This is the size of the huge pages on x86-64 and of the transparent huge
+ * pages on most other architectures.
+ */
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+/**
+ * The first 8 bytes of a file written by `hashmap_save`, "HMAPSNAP" in little
+ * endian. Read with the wrong byte order, they do not match.
+ */
+#define SNAPSHOT_MAGIC 0x50414e5350414d48ull
+
+/**
+ * The version of the file format of `hashmap_save`. Files of other versions
+ * cannot be opened.
+ */
+#define SNAPSHOT_VERSION 2
+
+/**
+ * The sections of a file written by `hashmap_save` start at multiples of this.
+ */
+#define SNAPSHOT_ALIGNMENT 64
+
+/**
+ * The checksum of a file written by `hashmap_save` is chained over blocks of
+ * this many bytes, so that it can be computed while writing.
+ */
+#define SNAPSHOT_BLOCK_SIZE ((size_t)64 << 10)
+
+/**
+ * The number of mirrored control bytes `hashmap_save` writes after the last
+ * one. This is enough for the largest `GROUP_WIDTH`, so files can be opened
+ * regardless of which SIMD instructions the reading process was compiled for.
+ */
+#define SNAPSHOT_MIRRORED_CTRL (32 - 1)
+
+/*
+ * The control bytes and the table algorithms are shared with the typed maps
+ * of hashmap_typed.h, see hashmap_internal.h.
+ */
+typedef hashmap_ctrl_t ctrl_t;
+
+#define CTRL_EMPTY HASHMAP_CTRL_EMPTY
+#define GROUP_WIDTH HASHMAP_GROUP_WIDTH
+
+/**
+ * The largest alignment of keys and values stored in an entry.
+ */
+#define MAX_ALIGNMENT 8
+
+/**
+ * A page of entries that a map shares with its clones, see `hashmap_clone`.
+ *
+ * Once a map is cloned, the entries of its table and dense entries are split
+ * into pages of `SHARED_PAGE_SLOTS` consecutive indices, which hold the
+ * entries together with their control bytes or live flags. A page is used by
+ * `refs` tables or dense arrays, and it is only written to while `refs` is 1:
+ * a map copies a shared page before writing to it, see `pages_unshare`, so
+ * the pages a clone sees never change.
+ */
+typedef struct SharedPage {
+    size_t refs;
+    struct SharedBlock *block;
+    unsigned char *entries;
+    /* The control bytes of a table page, the live flags of a dense page */
+    unsigned char *flags;
+} SharedPage;
+
+/**
+ * The memory of one or more `SharedPage`s: all entries of a table or dense
+ * array that was split into pages, or a single page that was copied. It is
+ * freed once none of its pages are used anymore.
+ */
+typedef struct SharedBlock {
+    size_t used_pages;
+    size_t num_pages;
+    /* The memory of the pages, NULL if it is part of the block itself */
+    void *memory;
+    size_t memory_size;
+    SharedPage pages[];
+} SharedBlock;
+
+/**
+ * The entries of a hash map.
+ *
+ * Every entry starts with the hash of its key as returned by `hashmap_hash`,
+ * followed by the key and the value at `key_offset` and `value_offset` (see
+ * `Hashmap`). In flat maps, the key and value bytes are stored right in the
+ * entry, otherwise the entry holds the `Key *` and `Value *` pointers.
+ *
+ * A table with capacity 0 has no memory allocated.
+ */
+typedef struct Table {
+    size_t size;
+    size_t capacity;
+    /* The number of bytes between consecutive entries */
+    size_t entry_size;
+    /* `entries` and `ctrl` share a single allocation, see `table_size` */
+    unsigned char *entries;
+    ctrl_t *ctrl;
+    /*
+     * NULL unless the table is shared with a clone. Then, `entries` and `ctrl`
+     * are NULL, and index `i` is in page `i >> page_shift`, see `SharedPage`.
+     */
+    SharedPage **pages;
+    unsigned int page_shift;
+    /* Whether empty entries are zeroed, see `table_scan` */
+    bool zero_empty;
+} Table;
+
+/**
+ * The size of the table entries of ordered maps, which hold the hash and the
+ * 32 bit position of the entry in `Dense` instead of the key and value.
+ */
+#define ORDERED_SLOT_SIZE (sizeof(hash_t) + sizeof(uint32_t))
+
+/**
+ * The entries of an ordered map, in the order they were inserted.
+ *
+ * The table of an ordered map only points into `entries`, so a full scan only
+ * has to look at `size` consecutive entries. Removing an entry only clears its
+ * flag in `live`, removed entries are dropped when the map is rebuilt, see
+ * `hashmap_rebuild`. `entries` and `live` share a single allocation.
+ */
+typedef struct Dense {
+    /* The number of entries appended so far, including removed ones */
+    size_t size;
+    /* Always the maximum size of the table, see `increase_capacity_if_necessary` */
+    size_t capacity;
+    size_t entry_size;
+    unsigned char *entries;
+    bool *live;
+    /* NULL unless the entries are shared with a clone, see `Table` */
+    SharedPage **pages;
+    unsigned int page_shift;
+} Dense;
+
+/**
+ * A chunk of memory that keys and values are copied into, see `Arena`.
+ */
+typedef struct ArenaChunk {
+    struct ArenaChunk *previous;
+    /* The number of maps whose keys and values are in the chunk, see `hashmap_clone` */
+    size_t refs;
+    size_t capacity;
+    size_t used;
+    unsigned char data[];
+} ArenaChunk;
+
+/**
+ * A bump allocator for the keys and values the map owns.
+ *
+ * Allocations are never freed on their own, the whole arena is freed at once
+ * when the map is destroyed. Clones share the chunks of the arena as it was
+ * when they were made, which are freed once neither uses them.
+ */
+typedef struct Arena {
+    /* The chunk allocations are taken from, NULL if nothing was allocated */
+    ArenaChunk *chunk;
+    size_t num_chunks;
+    size_t allocated_bytes;
+    size_t used_bytes;
+} Arena;
+
+struct Hashmap {
+    /* The map grows when inserting would make the size exceed `max_size` */
+    size_t max_size;
+    /* The map shrinks when removing makes the size drop below `min_size` */
+    size_t min_size;
+    /* The load factors and growth factor, see `HashmapOptions` */
+    HashmapSizing sizing;
+    /* 0 if the map should resize all at once, see `hashmap_migrate` */
+    size_t resize_step;
+    /* NULL in flat maps that hash the key bytes, see `hashmap_hash` */
+    HashFunction hash;
+    /* If not NULL, used instead of `hash`, see `Hasher` */
+    ContextHashFunction hash_with_context;
+    void *context;
+    /* NULL in flat maps that compare keys with memcmp, see `keys_equal` */
+    CompareFunction equal;
+    /* Whether keys and values are stored in the entries, see `Table` */
+    bool flat;
+    /* The size of the stored keys and values, i.e. of pointers if not flat */
+    size_t key_size;
+    size_t value_size;
+    size_t key_offset;
+    size_t value_offset;
+    size_t entry_size;
+    /* Whether the entries are kept in insertion order in `dense` */
+    bool ordered;
+    /* Whether lookups use `table_scan` instead of the control bytes */
+    bool scan_entries;
+    /* The size of the table entries, `entry_size` unless the map is ordered */
+    size_t slot_size;
+    /*
+     * In flat maps, `hashmap_remove` copies the removed entry here, since its
+     * key and value are overwritten in the table. NULL otherwise.
+     */
+    unsigned char *removed;
+    /* If not NULL, the map copies its keys or values into `arena` */
+    SizeFunction key_copy_size;
+    SizeFunction value_copy_size;
+    Arena arena;
+    /* Used for all memory of the map, including the map itself */
+    HashmapAllocator allocator;
+    /*
+     * The file the map was opened from with `hashmap_open_mapped`, NULL
+     * otherwise. Mapped maps are read-only, their tables and dense entries
+     * point into the mapping.
+     */
+    unsigned char *mapping;
+    size_t mapping_size;
+    /* Set for mapped maps and clones, see `hashmap_clone` */
+    bool read_only;
+#ifdef HASHMAP_STATS
+    /* Only the counters are kept up to date, see `hashmap_stats` */
+    HashmapStats stats;
+#endif
+    Table table;
+    /* The entries the table points to in ordered maps, empty otherwise */
+    Dense dense;
+    /*
+     * While resizing incrementally, the table whose entries are still being
+     * moved to `table`. Otherwise, its capacity is 0.
+     *
+     * The entries are moved in index order, starting at `migration_start`,
+     * which was empty when the resize started. `migrated` is the number of
+     * entries that have been looked at so far.
+     */
+    Table old_table;
+    size_t migration_start;
+    size_t migrated;
+};
+
+#ifdef HASHMAP_STATS
+/**
+ * Add to a counter of `HashmapStats`. Atomic, since keys may be hashed and
+ * compared in several threads, see `hashmap_build_parallel`.
+ */
+static void stats_add(uint64_t *counter, uint64_t n) {
+#if defined(__GNUC__)
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+#else
+    *counter += n;
+#endif
+}
+
+/**
+ * The bucket of the probe length histograms a probe length belongs to.
+ */
+static size_t probe_bucket(size_t length) {
+    assert(length != 0);
+    return length < HASHMAP_PROBE_HISTOGRAM_SIZE ? length - 1 : HASHMAP_PROBE_HISTOGRAM_SIZE - 1;
+}
+
+static uint64_t stats_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+#endif
+
+/**
+ * Take a reference to a shared page or arena chunk, see `hashmap_clone`.
+ * Atomic, since a clone may be read and destroyed in another thread than the
+ * map it was made from.
+ */
+static void refs_acquire(size_t *refs) {
+#if defined(__GNUC__)
+    __atomic_fetch_add(refs, 1, __ATOMIC_RELAXED);
+#else
+    *refs += 1;
+#endif
+}
+
+/**
+ * Drop a reference taken with `refs_acquire`. Returns true if it was the last.
+ */
+static bool refs_release(size_t *refs) {
+#if defined(__GNUC__)
+    return __atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL) == 0;
+#else
+    *refs -= 1;
+    return *refs == 0;
+#endif
+}
+
+static size_t refs_load(size_t *refs) {
+#if defined(__GNUC__)
+    return __atomic_load_n(refs, __ATOMIC_ACQUIRE);
+#else
+    return *refs;
+#endif
+}
+
+/**
+ * The hash of a key as stored in the map.
+ */
+static hash_t hashmap_hash(Hashmap *map, Key *key) {
+    COUNT(map, hash_calls, 1);
+    if (map->hash_with_context != NULL) {
+        return hashmap_mix_hash(map->hash_with_context(key, map->context));
+    }
+    if (map->hash == NULL) {
+        return hashmap_mix_hash(hashmap_hash_bytes(key, map->key_size, 0));
+    }
+    return hashmap_mix_hash(map->hash(key));
+}
+
+/**
+ * The entry at `index` of entries that are split into pages of `1 << shift`
+ * entries, see `SharedPage`.
+ */
+static unsigned char *page_entry(SharedPage **pages, unsigned int shift, size_t entry_size, size_t index) {
+    return pages[index >> shift]->entries + (index & (((size_t)1 << shift) - 1)) * entry_size;
+}
+
+/**
+ * The control byte or live flag at `index`, see `page_entry`.
+ */
+static unsigned char *page_flag(SharedPage **pages, unsigned int shift, size_t index) {
+    return pages[index >> shift]->flags + (index & (((size_t)1 << shift) - 1));
+}
+
+static unsigned char *table_entry(Table *table, size_t index) {
+    if (table->pages != NULL) {
+        return page_entry(table->pages, table->page_shift, table->entry_size, index);
+    }
+    return table->entries + index * table->entry_size;
+}
+
+/**
+ * The cached hash at the start of an entry.
+ */
+static hash_t entry_hash(const unsigned char *entry) {
+    hash_t hash;
+    memcpy(&hash, entry, sizeof(hash));
+    return hash;
+}
+
+static void set_entry_hash(unsigned char *entry, hash_t hash) {
+    memcpy(entry, &hash, sizeof(hash));
+}
+
+/**
+ * The key or value pointer stored at `field` in an entry of a non-flat map.
+ *
+ * The entries of mapped maps store the offset of the key or value in the
+ * mapping instead, see `hashmap_open_mapped`.
+ */
+static void *entry_pointer(Hashmap *map, const unsigned char *field) {
+    if (map->mapping != NULL) {
+        uintptr_t offset;
+        memcpy(&offset, field, sizeof(offset));
+        return map->mapping + offset;
+    }
+    void *pointer;
+    memcpy(&pointer, field, sizeof(pointer));
+    return pointer;
+}
+
+/**
+ * The key of an entry, as it was passed to `hashmap_insert` for non-flat maps
+ * and pointing into the entry for flat maps.
+ */
+static Key *entry_key(Hashmap *map, unsigned char *entry) {
+    if (map->flat) {
+        return entry + map->key_offset;
+    }
+    return entry_pointer(map, entry + map->key_offset);
+}
+
+/**
+ * The value of an entry, see `entry_key`.
+ */
+static Value *entry_value(Hashmap *map, unsigned char *entry) {
+    if (map->flat) {
+        return entry + map->value_offset;
+    }
+    return entry_pointer(map, entry + map->value_offset);
+}
+
+/**
+ * Fill in an entry with the given hash, key and value.
+ */
+static void entry_init(Hashmap *map, unsigned char *entry, hash_t hash, Key *key, Value *value) {
+    set_entry_hash(entry, hash);
+    if (map->flat) {
+        memcpy(entry + map->key_offset, key, map->key_size);
+        if (map->value_size != 0) {
+            memcpy(entry + map->value_offset, value, map->value_size);
+        }
+    } else {
+        memcpy(entry + map->key_offset, &key, sizeof(key));
+        memcpy(entry + map->value_offset, &value, sizeof(value));
+    }
+}
+
+/**
+ * Whether `key` is the key of `entry`.
+ */
+static bool keys_equal(Hashmap *map, Key *key, unsigned char *entry) {
+    COUNT(map, equal_calls, 1);
+    if (map->equal == NULL) {
+        return memcmp(key, entry + map->key_offset, map->key_size) == 0;
+    }
+    return map->equal(key, entry_key(map, entry));
+}
+
+static unsigned char *dense_entry(Dense *dense, size_t position) {
+    if (dense->pages != NULL) {
+        return page_entry(dense->pages, dense->page_shift, dense->entry_size, position);
+    }
+    return dense->entries + position * dense->entry_size;
+}
+
+/**
+ * Whether the dense entry at `position` has not been removed.
+ */
+static bool dense_live(Dense *dense, size_t position) {
+    if (dense->pages != NULL) {
+        return *page_flag(dense->pages, dense->page_shift, position) != 0;
+    }
+    return dense->live[position];
+}
+
+static void set_dense_live(Dense *dense, size_t position, bool live) {
+    if (dense->pages != NULL) {
+        assert(refs_load(&dense->pages[position >> dense->page_shift]->refs) == 1
+                && "Shared pages should be copied before writing to them");
+        *page_flag(dense->pages, dense->page_shift, position) = live;
+    } else {
+        dense->live[position] = live;
+    }
+}
+
+/**
+ * The position in `dense` a table entry of an ordered map points to.
+ */
+static size_t slot_position(const unsigned char *slot) {
+    uint32_t position;
+    memcpy(&position, slot + sizeof(hash_t), sizeof(position));
+    return position;
+}
+
+static void set_slot_position(unsigned char *slot, size_t position) {
+    assert(position <= UINT32_MAX);
+    uint32_t truncated = (uint32_t)position;
+    memcpy(slot + sizeof(hash_t), &truncated, sizeof(truncated));
+}
+
+/**
+ * The entry holding the key and value of a table entry, which is the table
+ * entry itself unless the map is ordered.
+ */
+static unsigned char *slot_entry(Hashmap *map, unsigned char *slot) {
+    if (map->ordered) {
+        return dense_entry(&map->dense, slot_position(slot));
+    }
+    return slot;
+}
+
+/**
+ * The preferred index of an entry with the given hash.
+ */
+static size_t table_index(Table *table, hash_t hash) {
+    assert(table->capacity != 0 && (table->capacity & (table->capacity - 1)) == 0
+            && "The capacity should be a power of two");
+    return hash & (table->capacity - 1);
+}
+
+/**
+ * The control byte of the entry at `index`.
+ */
+static ctrl_t *table_ctrl(Table *table, size_t index) {
+    if (table->pages != NULL) {
+        return page_flag(table->pages, table->page_shift, index);
+    }
+    return &table->ctrl[index];
+}
+
+/**
+ * Copy the control bytes of the group of entries starting at `position` into
+ * `buffer`, see `table_group`.
+ */
+NOINLINE static const ctrl_t *table_gather_group(Table *table, size_t position, ctrl_t *buffer) {
+    for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+        buffer[i] = *table_ctrl(table, (position + i) & (table->capacity - 1));
+    }
+    return buffer;
+}
+
+/**
+ * The control bytes of the group of entries starting at `position`.
+ *
+ * Shared tables do not mirror any control bytes, so a group that does not fit
+ * into the page of `position` is gathered into `buffer` instead.
+ */
+static const ctrl_t *table_group(Table *table, size_t position, ctrl_t *buffer) {
+    if (table->pages == NULL) {
+        return &table->ctrl[position];
+    }
+    size_t page_slots = (size_t)1 << table->page_shift;
+    if ((position & (page_slots - 1)) + GROUP_WIDTH <= page_slots) {
+        return table_ctrl(table, position);
+    }
+    return table_gather_group(table, position, buffer);
+}
+
+static bool is_initialized(Table *table, size_t index) {
+    return *table_ctrl(table, index) != CTRL_EMPTY;
+}
+
+/**
+ * The distance of an initialized entry from its preferred index.
+ *
+ * The distance is not stored, but computed from the cached hash.
+ */
+static size_t probe_distance(Table *table, size_t index) {
+    assert(is_initialized(table, index));
+    return (index - table_index(table, entry_hash(table_entry(table, index)))) & (table->capacity - 1);
+}
+
+/**
+ * Set the control byte of an entry, including its mirrored copies.
+ */
+static void set_ctrl(Table *table, size_t index, ctrl_t ctrl) {
+    if (table->pages != NULL) {
+        assert(refs_load(&table->pages[index >> table->page_shift]->refs) == 1
+                && "Shared pages should be copied before writing to them");
+        *table_ctrl(table, index) = ctrl;
+        return;
+    }
+    hashmap_set_ctrl(table->ctrl, table->capacity, index, ctrl);
+}
+
+static void mark_uninitialized(Table *table, size_t index) {
+    set_ctrl(table, index, CTRL_EMPTY);
+    if (table->zero_empty) {
+        memset(table_entry(table, index), 0, table->entry_size);
+    }
+}
+
 /**
- * The initial capacity of the hash map.
+ * The number of bytes needed for the entries and control bytes of a table
+ * with the given capacity.
  */
-#define INITIAL_CAPACITY 8
+static size_t table_size(size_t capacity, size_t entry_size) {
+    return capacity * entry_size + hashmap_ctrl_size(capacity);
+}
+
+/**
+ * The largest capacity whose `table_size` does not overflow.
+ *
+ * The dense entries of an ordered map have to fit as well, and their positions
+ * have to fit into 32 bits.
+ */
+static size_t max_capacity(Hashmap *map) {
+    size_t capacity = ((size_t)-1 - GROUP_WIDTH) / (map->slot_size + 1);
+    if (map->ordered) {
+        size_t dense_capacity = (size_t)-1 / (map->entry_size + 1);
+        if (capacity > dense_capacity) {
+            capacity = dense_capacity;
+        }
+        if (capacity > UINT32_MAX) {
+            capacity = UINT32_MAX;
+        }
+    }
+    return capacity;
+}
+
+/**
+ * Allocate an empty table with the given capacity with the allocator of the
+ * map.
+ *
+ * Returns true if the allocation was successful, false otherwise.
+ */
+static bool table_init(Hashmap *map, Table *table, size_t capacity) {
+    size_t entry_size = map->slot_size;
+    table->size = 0;
+    table->capacity = capacity;
+    table->entry_size = entry_size;
+    table->pages = NULL;
+    table->page_shift = 0;
+    table->zero_empty = map->scan_entries;
+
+    if (capacity == 0) {
+        table->entries = NULL;
+        table->ctrl = NULL;
+    } else {
+        table->entries = map->allocator.alloc(table_size(capacity, entry_size), map->allocator.context);
+        if (table->entries == NULL) {
+            return false;
+        }
+        table->ctrl = (ctrl_t *)(table->entries + capacity * entry_size);
+        memset(table->ctrl, CTRL_EMPTY, hashmap_ctrl_size(capacity));
+        if (table->zero_empty) {
+            memset(table->entries, 0, capacity * entry_size);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Allocate an empty `Dense` for `capacity` entries of an ordered map.
+ *
+ * Returns true if the allocation was successful, false otherwise.
+ */
+static bool dense_init(Hashmap *map, Dense *dense, size_t capacity) {
+    dense->size = 0;
+    dense->capacity = capacity;
+    dense->entry_size = map->entry_size;
+    dense->entries = NULL;
+    dense->live = NULL;
+    dense->pages = NULL;
+    dense->page_shift = 0;
+    if (capacity != 0) {
+        dense->entries = map->allocator.alloc(capacity * (map->entry_size + 1), map->allocator.context);
+        if (dense->entries == NULL) {
+            return false;
+        }
+        dense->live = (bool *)(dense->entries + capacity * map->entry_size);
+    }
+    return true;
+}
+
+/**
+ * The number of pages of `1 << shift` entries that `capacity` entries are
+ * split into, the last one may not be full.
+ */
+static size_t num_pages(size_t capacity, unsigned int shift) {
+    return (capacity + ((size_t)1 << shift) - 1) >> shift;
+}
+
+/**
+ * The size of a `SharedBlock` with the given number of pages, without the
+ * memory of the pages.
+ */
+static size_t shared_block_size(size_t count) {
+    size_t size = sizeof(SharedBlock) + count * sizeof(SharedPage);
+    return (size + MAX_ALIGNMENT - 1) & ~(size_t)(MAX_ALIGNMENT - 1);
+}
+
+/**
+ * Drop a reference to a page, freeing its block if no page of it is used
+ * anymore.
+ */
+static void shared_page_release(Hashmap *map, SharedPage *page) {
+    if (!refs_release(&page->refs)) {
+        return;
+    }
+    SharedBlock *block = page->block;
+    if (!refs_release(&block->used_pages)) {
+        return;
+    }
+    size_t block_size = shared_block_size(block->num_pages);
+    if (block->memory != NULL) {
+        map->allocator.free(block->memory, block->memory_size, map->allocator.context);
+    } else {
+        block_size += block->memory_size;
+    }
+    map->allocator.free(block, block_size, map->allocator.context);
+}
+
+/**
+ * Drop the references of a table or dense array to its pages.
+ */
+static void pages_release(Hashmap *map, SharedPage **pages, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        shared_page_release(map, pages[i]);
+    }
+    map->allocator.free(pages, count * sizeof(*pages), map->allocator.context);
+}
+
+/**
+ * Split `capacity` entries and their flags into pages, see `SharedPage`.
+ * `memory` is the allocation they are in, which is freed with the pages.
+ *
+ * Returns false if the memory could not be allocated, in which case nothing
+ * is changed.
+ */
+static bool pages_split(Hashmap *map, unsigned char *entries, unsigned char *flags, size_t capacity,
+        size_t entry_size, void *memory, size_t memory_size, SharedPage ***pages, unsigned int *shift) {
+    unsigned int page_shift = 0;
+    while (((size_t)1 << page_shift) < capacity && ((size_t)1 << page_shift) < SHARED_PAGE_SLOTS) {
+        page_shift += 1;
+    }
+    size_t page_slots = (size_t)1 << page_shift;
+    size_t count = num_pages(capacity, page_shift);
+
+    SharedPage **directory = map->allocator.alloc(count * sizeof(*directory), map->allocator.context);
+    if (directory == NULL) {
+        return false;
+    }
+    SharedBlock *block = map->allocator.alloc(shared_block_size(count), map->allocator.context);
+    if (block == NULL) {
+        map->allocator.free(directory, count * sizeof(*directory), map->allocator.context);
+        return false;
+    }
+    block->used_pages = count;
+    block->num_pages = count;
+    block->memory = memory;
+    block->memory_size = memory_size;
+    for (size_t i = 0; i < count; ++i) {
+        block->pages[i] = (SharedPage) { 1, block, entries + i * page_slots * entry_size, flags + i * page_slots };
+        directory[i] = &block->pages[i];
+    }
+    *pages = directory;
+    *shift = page_shift;
+    return true;
+}
+
+/**
+ * Share the pages of a table or dense array with a clone, which gets its own
+ * copy of `pages` in `*clone`.
+ *
+ * Returns false if the memory could not be allocated.
+ */
+static bool pages_clone(Hashmap *map, SharedPage **pages, size_t count, SharedPage ***clone) {
+    *clone = NULL;
+    if (pages == NULL) {
+        return true;
+    }
+    *clone = map->allocator.alloc(count * sizeof(*pages), map->allocator.context);
+    if (*clone == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        refs_acquire(&pages[i]->refs);
+        (*clone)[i] = pages[i];
+    }
+    return true;
+}
+
+/**
+ * Make sure that the page holding `index` is not shared, copying it if it is.
+ * The last page of `capacity` entries may hold fewer than the others.
+ *
+ * Returns false if the copy could not be allocated.
+ */
+static bool pages_unshare(Hashmap *map, SharedPage **pages, unsigned int shift, size_t capacity,
+        size_t entry_size, size_t index) {
+    SharedPage *page = pages[index >> shift];
+    if (refs_load(&page->refs) == 1) {
+        return true;
+    }
+
+    size_t page_slots = (size_t)1 << shift;
+    size_t first = index & ~(page_slots - 1);
+    size_t count = capacity - first < page_slots ? capacity - first : page_slots;
+    size_t memory_size = page_slots * (entry_size + 1);
+    SharedBlock *block = map->allocator.alloc(shared_block_size(1) + memory_size, map->allocator.context);
+    if (block == NULL) {
+        return false;
+    }
+    unsigned char *memory = (unsigned char *)block + shared_block_size(1);
+    block->used_pages = 1;
+    block->num_pages = 1;
+    block->memory = NULL;
+    block->memory_size = memory_size;
+    block->pages[0] = (SharedPage) { 1, block, memory, memory + page_slots * entry_size };
+    memcpy(block->pages[0].entries, page->entries, count * entry_size);
+    memcpy(block->pages[0].flags, page->flags, count);
+
+    pages[index >> shift] = &block->pages[0];
+    shared_page_release(map, page);
+    return true;
+}
+
+static void dense_free(Hashmap *map, Dense *dense) {
+    if (dense->pages != NULL) {
+        pages_release(map, dense->pages, num_pages(dense->capacity, dense->page_shift));
+    } else if (dense->capacity != 0) {
+        map->allocator.free(dense->entries, dense->capacity * (dense->entry_size + 1), map->allocator.context);
+    }
+    dense->size = 0;
+    dense->capacity = 0;
+    dense->entries = NULL;
+    dense->live = NULL;
+    dense->pages = NULL;
+}
+
+static void table_free(Hashmap *map, Table *table) {
+    if (table->pages != NULL) {
+        pages_release(map, table->pages, num_pages(table->capacity, table->page_shift));
+    } else if (table->capacity != 0) {
+        map->allocator.free(table->entries, table_size(table->capacity, table->entry_size),
+                map->allocator.context);
+    }
+    table->size = 0;
+    table->capacity = 0;
+    table->entries = NULL;
+    table->ctrl = NULL;
+    table->pages = NULL;
+}
+
+/**
+ * Split the entries of a table into pages that can be shared with a clone,
+ * unless they already are.
+ *
+ * Returns false if the memory could not be allocated.
+ */
+static bool table_share(Hashmap *map, Table *table) {
+    if (table->pages != NULL || table->capacity == 0) {
+        return true;
+    }
+    if (!pages_split(map, table->entries, table->ctrl, table->capacity, table->entry_size, table->entries,
+                table_size(table->capacity, table->entry_size), &table->pages, &table->page_shift)) {
+        return false;
+    }
+    table->entries = NULL;
+    table->ctrl = NULL;
+    return true;
+}
+
+/**
+ * Same as `table_share`, for dense entries.
+ */
+static bool dense_share(Hashmap *map, Dense *dense) {
+    if (dense->pages != NULL || dense->capacity == 0) {
+        return true;
+    }
+    if (!pages_split(map, dense->entries, (unsigned char *)dense->live, dense->capacity, dense->entry_size,
+                dense->entries, dense->capacity * (dense->entry_size + 1), &dense->pages, &dense->page_shift)) {
+        return false;
+    }
+    dense->entries = NULL;
+    dense->live = NULL;
+    return true;
+}
+
+/**
+ * Make sure that the entry at `index` can be written to, see `pages_unshare`.
+ */
+static bool table_unshare(Hashmap *map, Table *table, size_t index) {
+    return table->pages == NULL
+        || pages_unshare(map, table->pages, table->page_shift, table->capacity, table->entry_size, index);
+}
+
+/**
+ * Make sure that the entries from `index` up to the next empty one can be
+ * written to, since inserting or removing at `index` may shift all of them.
+ */
+static bool table_unshare_cluster(Hashmap *map, Table *table, size_t index) {
+    if (table->pages == NULL) {
+        return true;
+    }
+    for (;;) {
+        if (!table_unshare(map, table, index)) {
+            return false;
+        }
+        if (!is_initialized(table, index)) {
+            return true;
+        }
+        index = (index + 1) & (table->capacity - 1);
+    }
+}
+
+static bool dense_unshare(Hashmap *map, Dense *dense, size_t position) {
+    return dense->pages == NULL
+        || pages_unshare(map, dense->pages, dense->page_shift, dense->capacity, dense->entry_size, position);
+}
+
+/**
+ * Copy all pages of the map that are still shared, see `hashmap_insert_many`.
+ */
+static bool hashmap_unshare_all(Hashmap *map) {
+    Table *table = &map->table;
+    for (size_t i = 0; table->pages != NULL && i < table->capacity; i += (size_t)1 << table->page_shift) {
+        if (!table_unshare(map, table, i)) {
+            return false;
+        }
+    }
+    Dense *dense = &map->dense;
+    for (size_t i = 0; dense->pages != NULL && i < dense->capacity; i += (size_t)1 << dense->page_shift) {
+        if (!dense_unshare(map, dense, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Hint the CPU to load the first control bytes and entry that probing for the
+ * given hash looks at.
+ *
+ * This is a macro, since GCC considers a function that only prefetches to
+ * have no effect and drops the calls to it.
+ */
+#if defined(__GNUC__)
+#define PREFETCH_PROBE(table, hash) \
+    do { \
+        size_t prefetch_index = table_index((table), (hash)); \
+        __builtin_prefetch(table_ctrl((table), prefetch_index)); \
+        __builtin_prefetch(table_entry((table), prefetch_index)); \
+    } while (0)
+#else
+#define PREFETCH_PROBE(table, hash) ((void)(table), (void)(hash))
+#endif
+
+/**
+ * `table_probe` comparing the cached hashes of the entries one by one instead
+ * of the control bytes, see `HashmapOptions.scan_entries`.
+ *
+ * Every probe touches the control bytes and then the entries, which are in
+ * different cache lines. For large maps that do not fit into the cache, that
+ * is one more cache miss per lookup than reading the entries alone, which
+ * costs more than comparing a few more hashes. Empty entries are recognized by
+ * their key pointer, which is zeroed for them, see `Table`.
+ */
+static bool table_scan(Hashmap *map, Table *table, Key *key, hash_t hash, size_t position, size_t *index) {
+    assert(table->zero_empty && table->pages == NULL && !map->flat && !map->ordered);
+
+    size_t mask = table->capacity - 1;
+    size_t preferred_index = table_index(table, hash);
+    for (size_t i = position;; i = (i + 1) & mask) {
+        unsigned char *entry = table->entries + i * table->entry_size;
+        Key *entry_key_pointer;
+        memcpy(&entry_key_pointer, entry + map->key_offset, sizeof(entry_key_pointer));
+        if (entry_key_pointer == NULL) {
+            COUNT_PROBE(map, miss_probe_lengths, ((i - preferred_index) & mask) + 1);
+            return false;
+        }
+
+        hash_t current_hash = entry_hash(entry);
+        if (current_hash == hash && keys_equal(map, key, entry)) {
+            COUNT_PROBE(map, hit_probe_lengths, ((i - preferred_index) & mask) + 1);
+            *index = i;
+            return true;
+        }
+        /* See the Robin Hood check of `hashmap_table_probe` */
+        if (((i - table_index(table, current_hash)) & mask) < ((i - preferred_index) & mask)) {
+            COUNT_PROBE(map, miss_probe_lengths, ((i - preferred_index) & mask) + 1);
+            return false;
+        }
+    }
+}
+
+static const ctrl_t *table_functions_group(void *table, size_t position, ctrl_t *buffer) {
+    return table_group(table, position, buffer);
+}
+
+static ctrl_t table_functions_ctrl(void *table, size_t index) {
+    return *table_ctrl(table, index);
+}
+
+static void table_functions_set_ctrl(void *table, size_t index, ctrl_t ctrl) {
+    set_ctrl(table, index, ctrl);
+}
+
+static hash_t table_functions_hash(void *table, size_t index) {
+    return entry_hash(table_entry(table, index));
+}
+
+static void table_functions_move(void *table, size_t to, size_t from) {
+    Table *t = table;
+    memcpy(table_entry(t, to), table_entry(t, from), t->entry_size);
+}
+
+/**
+ * How the table algorithms of hashmap_internal.h access a `Table`, which may
+ * be split into pages.
+ */
+static const HashmapTableFunctions table_functions = {
+    .group = table_functions_group,
+    .ctrl = table_functions_ctrl,
+    .set_ctrl = table_functions_set_ctrl,
+    .hash = table_functions_hash,
+    .move = table_functions_move,
+};
+
+/**
+ * The key `table_probe_groups` looks for.
+ */
+typedef struct ProbeKey {
+    Hashmap *map;
+    Key *key;
+} ProbeKey;
+
+static bool probe_key_matches(void *context, void *table, size_t index) {
+    ProbeKey *probe_key = context;
+    return keys_equal(probe_key->map, probe_key->key, slot_entry(probe_key->map, table_entry(table, index)));
+}
+
+/**
+ * `table_probe` comparing the control bytes of a whole group at once, see
+ * `hashmap_table_probe`.
+ */
+NOINLINE static bool table_probe_groups(Hashmap *map, Table *table, Key *key, hash_t hash, size_t position, size_t *index) {
+    /* The entries are in another cache line than the control bytes */
+    PREFETCH_PROBE(table, hash);
+
+    ProbeKey probe_key = { map, key };
+    size_t last;
+    bool found = hashmap_table_probe(&table_functions, table, table->capacity, hash, position, probe_key_matches,
+        &probe_key, &last);
+    if (found) {
+        COUNT_PROBE(map, hit_probe_lengths, ((last - table_index(table, hash)) & (table->capacity - 1)) + 1);
+        *index = last;
+        return true;
+    }
+    COUNT_PROBE(map, miss_probe_lengths, ((last - table_index(table, hash)) & (table->capacity - 1)) + 1);
+    return false;
+}
+
+/**
+ * Look for the entry with the given key and hash in a table, starting at
+ * `position`.
+ *
+ * `position` is usually the preferred index of the key. It may only be a later
+ * index if there are no entries with the key's preferred index before it.
+ *
+ * If the key is found, true is returned and `*index` is set to the index of
+ * its entry. Otherwise, false is returned and `*index` is left untouched.
+ *
+ * The table may not have capacity 0.
+ */
+static bool table_probe(Hashmap *map, Table *table, Key *key, hash_t hash, size_t position, size_t *index) {
+    assert(table->capacity != 0);
+
+    /* Shared pages are not contiguous, so those are probed as usual */
+    if (map->scan_entries && table->pages == NULL) {
+        return table_scan(map, table, key, hash, position, index);
+    }
+    return table_probe_groups(map, table, key, hash, position, index);
+}
+
+/**
+ * Make room for an entry with the given hash in a table that is known not to
+ * contain its key, see `hashmap_table_place`.
+ *
+ * Returns the index of the new entry. Its control byte is set, but the caller
+ * has to fill in the entry itself.
+ */
+static size_t table_place(Table *table, hash_t hash) {
+    assert(table->size + 1 < table->capacity && "There should always be some capacity left");
+
+    size_t index = hashmap_table_place(&table_functions, table, table->capacity, hash);
+    table->size += 1;
+    return index;
+}
+
+/**
+ * Copy an entry of another table into a table that does not contain its key.
+ */
+static void table_move(Table *table, unsigned char *entry) {
+    size_t index = table_place(table, entry_hash(entry));
+    memcpy(table_entry(table, index), entry, table->entry_size);
+}
+
+/**
+ * Fill in the entry at `index` that `table_place` returned. For ordered maps,
+ * the key and value are appended to `dense` and the table entry points there.
+ *
+ * Returns the entry holding the key and value, see `slot_entry`.
+ */
+static unsigned char *slot_init(Hashmap *map, Table *table, size_t index, hash_t hash, Key *key, Value *value) {
+    unsigned char *slot = table_entry(table, index);
+    if (!map->ordered) {
+        entry_init(map, slot, hash, key, value);
+        return slot;
+    }
+
+    Dense *dense = &map->dense;
+    assert(dense->size < dense->capacity && "There should always be room for a new dense entry");
+    size_t position = dense->size;
+    unsigned char *entry = dense_entry(dense, position);
+    entry_init(map, entry, hash, key, value);
+    set_dense_live(dense, position, true);
+    dense->size += 1;
+
+    set_entry_hash(slot, hash);
+    set_slot_position(slot, position);
+    return entry;
+}
+
+/**
+ * Remove the entry at the given index from a table, see `hashmap_table_erase`.
+ *
+ * Returns the number of entries that were shifted back.
+ */
+static size_t table_erase(Table *table, size_t index) {
+    assert(is_initialized(table, index));
+
+    size_t to_replace = hashmap_table_erase(&table_functions, table, table->capacity, index);
+    mark_uninitialized(table, to_replace);
+    table->size -= 1;
+    return (to_replace - index) & (table->capacity - 1);
+}
+
+static bool is_resizing(Hashmap *map) {
+    return map->old_table.capacity != 0;
+}
+
+/**
+ * Where to start probing for a hash in `old_table`, see
+ * `hashmap_old_table_start`.
+ */
+static size_t old_table_start(Hashmap *map, hash_t hash) {
+    assert(is_resizing(map));
+    return hashmap_old_table_start(map->old_table.capacity, map->migration_start, map->migrated, hash);
+}
+
+/**
+ * Look for the entry with the given key and hash in both tables, without
+ * moving any entries.
+ *
+ * Returns NULL if the key is not in the map. Otherwise, the entry holding the
+ * key and value is returned (see `slot_entry`), and `*table` and `*index` are
+ * set to its location in the tables.
+ */
+static unsigned char *hashmap_entry_find_hashed(Hashmap *map, Key *key, hash_t hash, Table **table, size_t *index) {
+    assert(key != NULL);
+
+    if (map->table.size != 0
+            && table_probe(map, &map->table, key, hash, table_index(&map->table, hash), index)) {
+        *table = &map->table;
+        return slot_entry(map, table_entry(&map->table, *index));
+    }
+    if (map->old_table.size != 0
+            && table_probe(map, &map->old_table, key, hash, old_table_start(map, hash), index)) {
+        *table = &map->old_table;
+        return slot_entry(map, table_entry(&map->old_table, *index));
+    }
+    return NULL;
+}
+
+/**
+ * Same as `hashmap_entry_find_hashed`, but hashes the key only if the map is
+ * not empty.
+ */
+static unsigned char *hashmap_entry_find(Hashmap *map, Key *key, Table **table, size_t *index) {
+    assert(key != NULL);
+
+    if (map->table.size == 0 && map->old_table.size == 0) {
+        return NULL;
+    }
+    return hashmap_entry_find_hashed(map, key, hashmap_hash(map, key), table, index);
+}
+
+#ifdef CONSISTENCY_CHECKS
+static void validate_table(Hashmap *map, Table *table) {
+    if (table->capacity == 0) {
+        assert(table->size == 0 && "If capacity is 0, size should be 0");
+        assert(table->entries == NULL && "If capacity is 0, entries should be NULL");
+        assert(table->ctrl == NULL && "If capacity is 0, ctrl should be NULL");
+        assert(table->pages == NULL && "If capacity is 0, there should be no pages");
+        return;
+    }
+
+    assert(table->size < table->capacity && "There should always be an empty entry");
+    assert(table->entry_size == map->slot_size && "Entry size should match the map");
+    assert(table->zero_empty == map->scan_entries && "Only scanned tables should zero empty entries");
+    if (table->pages != NULL) {
+        assert(table->entries == NULL && table->ctrl == NULL && "Shared tables should only have pages");
+        for (size_t i = 0; i < num_pages(table->capacity, table->page_shift); ++i) {
+            assert(refs_load(&table->pages[i]->refs) != 0 && "Pages in use should be referenced");
+        }
+    } else {
+        assert(table->entries != NULL && "If capacity is not 0, entries should not be NULL");
+        assert(table->ctrl == (ctrl_t *)(table->entries + table->capacity * table->entry_size)
+                && "The control bytes should directly follow the entries");
+        for (size_t i = table->capacity; i < table->capacity + GROUP_WIDTH - 1; ++i) {
+            assert(table->ctrl[i] == table->ctrl[i % table->capacity]
+                    && "Mirrored control bytes should match");
+        }
+    }
+
+    size_t initialized_entries = 0;
+    for (size_t i = 0; i < table->capacity; ++i) {
+        if (is_initialized(table, i)) {
+            unsigned char *entry = slot_entry(map, table_entry(table, i));
+            initialized_entries += 1;
+            size_t next = (i + 1) & (table->capacity - 1);
+            assert((!is_initialized(table, next) || probe_distance(table, next) <= probe_distance(table, i) + 1)
+                    && "Entries should be in Robin Hood order");
+            assert(entry_key(map, entry) != NULL && "Initialized entry should have a key");
+            assert(entry_hash(entry) == hashmap_hash(map, entry_key(map, entry))
+                    && "Hash should match");
+            assert(*table_ctrl(table, i) == hashmap_hash_tag(entry_hash(entry))
+                    && "Control byte should match the hash");
+            assert((!map->ordered || entry_hash(table_entry(table, i)) == entry_hash(entry))
+                    && "The table should cache the hash of the dense entry");
+            /* If the entry is initialized, we should be able to find it */
+            Table *found_table;
+            size_t found_index;
+            unsigned char *found = hashmap_entry_find(map, entry_key(map, entry), &found_table, &found_index);
+            assert(found == entry && "Initialized entry should be retrievable");
+        } else if (table->zero_empty) {
+            assert(entry_key(map, table_entry(table, i)) == NULL && "Empty entries should be zeroed");
+        }
+    }
+    assert(initialized_entries == table->size
+            && "Number of initialized entries should be equal to the size");
+}
+
+static void validate_hashmap(Hashmap *map) {
+    /* We need to guard against infinite recursion */
+    static bool recursion_guard = false;
+    if (recursion_guard) {
+        return;
+    }
+    recursion_guard = true;
+
+    assert(hashmap_size(map) <= map->max_size && "Size should never exceed the maximum size");
+    assert(map->max_size == hashmap_max_size(&map->sizing, map->table.capacity)
+            && "Maximum size should match the capacity");
+    assert(map->min_size == hashmap_min_size(&map->sizing, map->table.capacity)
+            && "Minimum size should match the capacity");
+    HashmapSizing *sizing = &map->sizing;
+    assert(sizing->max_load_factor > 0.0 && sizing->max_load_factor < 1.0
+            && "Maximum load factor should be between 0 and 1");
+    assert(sizing->min_load_factor >= 0.0
+            && sizing->min_load_factor < sizing->max_load_factor / (double)sizing->growth_factor
+            && "Minimum load factor should be below the load factor after growing");
+    assert(sizing->growth_factor >= 2 && (sizing->growth_factor & (sizing->growth_factor - 1)) == 0
+            && "Growth factor should be a power of two");
+    assert(sizing->max_capacity == max_capacity(map) && "Maximum capacity should match the entry layout");
+    assert((map->flat || map->hash != NULL || map->hash_with_context != NULL)
+            && "Only flat maps may hash the key bytes");
+    assert((map->flat || map->equal != NULL) && "Only flat maps may compare keys with memcmp");
+    assert((map->flat || map->value_size == sizeof(Value *)) && "Non-flat maps should store pointers");
+    assert((map->flat == (map->removed != NULL)) && "Only flat maps need a buffer for removed entries");
+    assert(map->key_offset >= sizeof(hash_t) && map->value_offset >= map->key_offset + map->key_size
+            && map->entry_size >= map->value_offset + map->value_size
+            && "Hash, key and value should not overlap");
+
+    validate_table(map, &map->table);
+    validate_table(map, &map->old_table);
+
+    if (map->ordered) {
+        assert(map->slot_size == ORDERED_SLOT_SIZE && "Ordered maps should store positions");
+        assert(map->resize_step == 0 && "Ordered maps should resize all at once");
+        assert(map->dense.capacity == map->max_size && "Dense entries should fill the table");
+        assert(map->dense.size <= map->dense.capacity && "Dense size should not exceed the capacity");
+        size_t live_entries = 0;
+        for (size_t i = 0; i < map->dense.size; ++i) {
+            live_entries += dense_live(&map->dense, i);
+        }
+        assert(live_entries == hashmap_size(map) && "Every entry should be live in dense once");
+        for (size_t i = 0; i < map->table.capacity; ++i) {
+            if (is_initialized(&map->table, i)) {
+                size_t position = slot_position(table_entry(&map->table, i));
+                assert(position < map->dense.size && dense_live(&map->dense, position)
+                        && "Table entries should point to live dense entries");
+            }
+        }
+    } else {
+        assert(map->slot_size == map->entry_size && "Unordered maps should store entries in the table");
+        assert(map->dense.capacity == 0 && "Unordered maps should not have dense entries");
+    }
+
+    if (is_resizing(map)) {
+        assert(map->resize_step != 0 && "Only incremental resizes should leave an old table");
+        assert(map->old_table.pages == NULL && "Shared tables should be resized all at once");
+        assert(map->old_table.size != 0 && "A finished resize should free the old table");
+        for (size_t i = 0; i < map->old_table.capacity; ++i) {
+            bool migrated = hashmap_is_migrated(map->old_table.capacity, map->migration_start, map->migrated, i);
+            assert((!migrated || !is_initialized(&map->old_table, i)) && "Moved entries should be empty");
+        }
+    }
+
+    recursion_guard = false;
+}
+#endif
+
+/**
+ * Initialize a hash map with a given capacity.
+ *
+ * `sizing`, `resize_step` and the entry layout (see `hashmap_init_layout`) have to be set already.
+ *
+ * Returns true if the initialization was successful, false otherwise.
+ * If the initialization fails, the hash map is left in an undefined state.
+ */
+static bool hashmap_init_with_capacity(Hashmap *hashmap, Hasher hasher, size_t capacity) {
+    hashmap->max_size = hashmap_max_size(&hashmap->sizing, capacity);
+    hashmap->min_size = hashmap_min_size(&hashmap->sizing, capacity);
+    hashmap->hash = hasher.hash;
+    hashmap->hash_with_context = hasher.hash_with_context;
+    hashmap->context = hasher.context;
+    hashmap->equal = hasher.equal;
+    hashmap->migration_start = 0;
+    hashmap->migrated = 0;
+
+    bool success = table_init(hashmap, &hashmap->old_table, 0);
+    assert(success && "initializing a table with capacity 0 should always succeed");
+    if (!table_init(hashmap, &hashmap->table, capacity)) {
+        return false;
+    }
+    size_t dense_capacity = hashmap->ordered ? hashmap->max_size : 0;
+    if (!dense_init(hashmap, &hashmap->dense, dense_capacity)) {
+        table_free(hashmap, &hashmap->table);
+        return false;
+    }
+
+    VALIDATE_HASHMAP(hashmap);
+
+    return true;
+}
+
+/**
+ * Move up to `count` entries of `old_table` to `table`, see `hashmap_migrate`.
+ */
+NOINLINE static void hashmap_migrate_entries(Hashmap *map, size_t count) {
+    uint64_t rehash_start = STATS_NOW();
+    Table *old_table = &map->old_table;
+    size_t mask = old_table->capacity - 1;
+    while (count > 0 && old_table->size != 0) {
+        size_t i = (map->migration_start + map->migrated) & mask;
+        if (is_initialized(old_table, i)) {
+            table_move(&map->table, table_entry(old_table, i));
+            mark_uninitialized(old_table, i);
+            old_table->size -= 1;
+        }
+        map->migrated += 1;
+        count -= 1;
+    }
+    COUNT(map, rehash_ns, STATS_NOW() - rehash_start);
+
+    if (old_table->size == 0) {
+        table_free(map, old_table);
+        map->migration_start = 0;
+        map->migrated = 0;
+    }
+}
+
+/**
+ * Move up to `count` entries of `old_table` to `table`, if the map is resizing.
+ *
+ * When resizing incrementally, the old and the new table coexist and every
+ * operation moves a few entries, so that no single operation has to move all
+ * of them. Lookups check both tables until all entries have been moved.
+ *
+ * `count` is the number of entries of `old_table` that are looked at, whether
+ * they are initialized or not, so the work per call is bounded.
+ */
+static void hashmap_migrate(Hashmap *map, size_t count) {
+    if (is_resizing(map)) {
+        hashmap_migrate_entries(map, count);
+    }
+}
+
+/**
+ * Move the entries of an ordered map into a newly allocated table with the
+ * given capacity and new dense entries, dropping the removed ones.
+ *
+ * Returns true on success. If the memory cannot be allocated, false is
+ * returned and the map is left unchanged.
+ */
+static bool hashmap_rebuild(Hashmap *map, size_t new_capacity) {
+    Table new_table;
+    if (!table_init(map, &new_table, new_capacity)) {
+        return false;
+    }
+    Dense new_dense;
+    if (!dense_init(map, &new_dense, hashmap_max_size(&map->sizing, new_capacity))) {
+        table_free(map, &new_table);
+        return false;
+    }
+
+    for (size_t i = 0; i < map->dense.size; ++i) {
+        if (dense_live(&map->dense, i)) {
+            unsigned char *entry = dense_entry(&map->dense, i);
+            size_t position = new_dense.size;
+            memcpy(dense_entry(&new_dense, position), entry, map->entry_size);
+            new_dense.live[position] = true;
+            new_dense.size += 1;
+
+            hash_t hash = entry_hash(entry);
+            unsigned char *slot = table_entry(&new_table, table_place(&new_table, hash));
+            set_entry_hash(slot, hash);
+            set_slot_position(slot, position);
+        }
+    }
+    assert(new_table.size == map->table.size && "after moving, the size should still be the same");
+
+    table_free(map, &map->table);
+    dense_free(map, &map->dense);
+    map->table = new_table;
+    map->dense = new_dense;
+    map->max_size = hashmap_max_size(&map->sizing, new_capacity);
+    map->min_size = hashmap_min_size(&map->sizing, new_capacity);
+    return true;
+}
+
+/**
+ * Move all entries into a newly allocated table with the given capacity.
+ *
+ * The new capacity has to be able to hold all entries. If `incremental` is
+ * true and the map has a `resize_step`, the entries are moved over the course
+ * of the following operations, see `hashmap_migrate`.
+ *
+ * Returns true on success. If the new table cannot be allocated, false is
+ * returned and the map is left unchanged.
+ */
+static bool hashmap_resize(Hashmap *map, size_t new_capacity, bool incremental) {
+    VALIDATE_HASHMAP(map);
+    assert(!map->read_only && "Mapped maps and clones are read-only");
+
+    if (map->ordered) {
+        uint64_t rehash_start = STATS_NOW();
+        bool success = hashmap_rebuild(map, new_capacity);
+        COUNT(map, resizes, success);
+        COUNT(map, rehash_ns, STATS_NOW() - rehash_start);
+        VALIDATE_HASHMAP(map);
+        return success;
+    }
+
+    /* Finish the previous resize first, there are never more than two tables */
+    hashmap_migrate(map, (size_t)-1);
+
+    uint64_t rehash_start = STATS_NOW();
+    Table new_table;
+    if (!table_init(map, &new_table, new_capacity)) {
+        VALIDATE_HASHMAP(map);
+        return false;
+    }
+    assert(map->table.size <= hashmap_max_size(&map->sizing, new_capacity)
+            && "The new capacity should be able to hold all entries");
+
+    Table old_table = map->table;
+    map->table = new_table;
+    map->max_size = hashmap_max_size(&map->sizing, new_capacity);
+    map->min_size = hashmap_min_size(&map->sizing, new_capacity);
+
+    /* Moving entries out of a shared table would copy its pages first */
+    if (incremental && map->resize_step != 0 && old_table.size != 0 && old_table.pages == NULL) {
+        /* Start moving entries after an empty one, see `old_table_start` */
+        size_t start = 0;
+        while (is_initialized(&old_table, start)) {
+            start += 1;
+        }
+        map->old_table = old_table;
+        map->migration_start = start;
+        map->migrated = 0;
+    } else {
+        /* Move all the elements into the newly allocated memory right away */
+        for (size_t i = 0; i < old_table.capacity; ++i) {
+            if (is_initialized(&old_table, i)) {
+                table_move(&map->table, table_entry(&old_table, i));
+            }
+        }
+        assert(map->table.size == old_table.size
+                && "after moving, the size should still be the same");
+        table_free(map, &old_table);
+    }
+    COUNT(map, resizes, 1);
+    COUNT(map, rehash_ns, STATS_NOW() - rehash_start);
+
+    VALIDATE_HASHMAP(map);
+    return true;
+}
+
+/**
+ * Make room for one more entry.
+ *
+ * The dense entries of an ordered map can run out while the table still has
+ * room, because removed entries keep their place. If at most half of them
+ * are left, the map is rebuilt with the same capacity to drop the removed
+ * ones, otherwise it grows as if it was full, so that rebuilding takes
+ * amortized constant time per insertion.
+ */
+static bool increase_capacity_if_necessary(Hashmap *map) {
+    VALIDATE_HASHMAP(map);
+
+    size_t size = hashmap_size(map);
+    bool dense_full = map->ordered && map->dense.size == map->dense.capacity;
+    if (size + 1 <= map->max_size && !dense_full) {
+        return true;
+    }
+
+    size_t capacity = map->table.capacity;
+    if (dense_full && size + 1 <= map->max_size && size <= map->max_size / 2) {
+        return hashmap_resize(map, capacity, false);
+    }
+
+    size_t new_capacity = hashmap_grown_capacity(&map->sizing, capacity, size + 1);
+    if (new_capacity == 0) {
+        return false;
+    }
+    return hashmap_resize(map, new_capacity, true);
+}
+
+/**
+ * Shrink the map if removals made it drop below its minimum load factor, see
+ * `hashmap_shrunk_capacity`. If the smaller table cannot be allocated, the map
+ * simply stays as it is.
+ */
+static void decrease_capacity_if_necessary(Hashmap *map) {
+    VALIDATE_HASHMAP(map);
+
+    size_t size = hashmap_size(map);
+    if (size >= map->min_size || is_resizing(map)) {
+        return;
+    }
+
+    size_t new_capacity = hashmap_shrunk_capacity(&map->sizing, size);
+    if (new_capacity != 0 && new_capacity < map->table.capacity) {
+        hashmap_resize(map, new_capacity, true);
+    }
+}
+
+/**
+ * The 128 bit product of `*a` and `*b`, with the low half stored in `*a` and
+ * the high half in `*b`.
+ */
+static void multiply_128(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+    __extension__ typedef unsigned __int128 uint128_t;
+    uint128_t product = (uint128_t)*a * *b;
+    *a = (uint64_t)product;
+    *b = (uint64_t)(product >> 64);
+#else
+    uint64_t a_high = *a >> 32;
+    uint64_t a_low = (uint32_t)*a;
+    uint64_t b_high = *b >> 32;
+    uint64_t b_low = (uint32_t)*b;
+    uint64_t high_high = a_high * b_high;
+    uint64_t high_low = a_high * b_low;
+    uint64_t low_high = a_low * b_high;
+    uint64_t low_low = a_low * b_low;
+    uint64_t middle = high_low + (low_low >> 32) + (uint32_t)low_high;
+    *a = (middle << 32) | (uint32_t)low_low;
+    *b = high_high + (middle >> 32) + (low_high >> 32);
+#endif
+}
+
+static uint64_t multiply_mix(uint64_t a, uint64_t b) {
+    multiply_128(&a, &b);
+    return a ^ b;
+}
+
+static uint64_t read_64(const unsigned char *bytes) {
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint64_t read_32(const unsigned char *bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+/**
+ * This is wyhash (https://github.com/wangyi-fudan/wyhash), which reads 8 or
+ * 16 bytes at a time and mixes them with 64 x 64 -> 128 bit multiplications.
+ *
+ * Keys shorter than 16 bytes are read with a few overlapping loads instead of
+ * byte by byte.
+ */
+hash_t hashmap_hash_bytes(const void *data, size_t length, uint64_t seed) {
+    static const uint64_t secret[4] = {
+        0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull,
+    };
+    const unsigned char *bytes = data;
+    uint64_t a;
+    uint64_t b;
+
+    seed ^= multiply_mix(seed ^ secret[0], secret[1]);
+    if (length <= 16) {
+        if (length >= 4) {
+            size_t offset = (length >> 3) << 2;
+            a = (read_32(bytes) << 32) | read_32(bytes + offset);
+            b = (read_32(bytes + length - 4) << 32) | read_32(bytes + length - 4 - offset);
+        } else if (length > 0) {
+            a = ((uint64_t)bytes[0] << 16) | ((uint64_t)bytes[length >> 1] << 8) | bytes[length - 1];
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
+        }
+    } else {
+        size_t remaining = length;
+        if (remaining > 48) {
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+            do {
+                seed = multiply_mix(read_64(bytes) ^ secret[1], read_64(bytes + 8) ^ seed);
+                seed1 = multiply_mix(read_64(bytes + 16) ^ secret[2], read_64(bytes + 24) ^ seed1);
+                seed2 = multiply_mix(read_64(bytes + 32) ^ secret[3], read_64(bytes + 40) ^ seed2);
+                bytes += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (remaining > 16) {
+            seed = multiply_mix(read_64(bytes) ^ secret[1], read_64(bytes + 8) ^ seed);
+            bytes += 16;
+            remaining -= 16;
+        }
+        a = read_64(bytes + remaining - 16);
+        b = read_64(bytes + remaining - 8);
+    }
+
+    a ^= secret[1];
+    b ^= seed;
+    multiply_128(&a, &b);
+    uint64_t hash = multiply_mix(a ^ secret[0] ^ length, b ^ secret[1]);
+    return (hash_t)(hash ^ (hash >> 32));
+}
+
+hash_t string_hash(void *key) {
+    return hashmap_hash_bytes(key, strlen(key), 0);
+}
+
+hash_t string_hash_seeded(void *key, void *seed) {
+    return hashmap_hash_bytes(key, strlen(key), *(uint64_t *)seed);
+}
+
+bool string_equal(void *key1, void *key2) {
+    return strcmp((char *)key1, (char *)key2) == 0;
+}
+
+size_t string_size(void *key) {
+    return strlen(key) + 1;
+}
+
+hash_t slice_hash(void *key) {
+    Slice *slice = key;
+    return hashmap_hash_bytes(slice->data, slice->length, 0);
+}
+
+hash_t slice_hash_seeded(void *key, void *seed) {
+    Slice *slice = key;
+    return hashmap_hash_bytes(slice->data, slice->length, *(uint64_t *)seed);
+}
+
+bool slice_equal(void *key1, void *key2) {
+    Slice *slice1 = key1;
+    Slice *slice2 = key2;
+    return slice1->length == slice2->length
+        && (slice1->length == 0 || memcmp(slice1->data, slice2->data, slice1->length) == 0);
+}
+
+/**
+ * The alignment of a key or value of the given size.
+ *
+ * The size of a type is always a multiple of its alignment, so the largest
+ * power of two that divides the size is enough.
+ */
+static size_t alignment_for_size(size_t size) {
+    size_t alignment = size & (~size + 1);
+    if (alignment == 0 || alignment > MAX_ALIGNMENT) {
+        return size == 0 ? 1 : MAX_ALIGNMENT;
+    }
+    return alignment;
+}
+
+static size_t align_up(size_t offset, size_t alignment) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+/**
+ * Make sure that the current chunk of the arena has at least `size` bytes
+ * left, allocating a new chunk if necessary.
+ *
+ * Returns false if the new chunk could not be allocated.
+ */
+static bool arena_reserve(Arena *arena, const HashmapAllocator *allocator, size_t size) {
+    ArenaChunk *chunk = arena->chunk;
+    if (chunk != NULL && chunk->capacity - chunk->used >= size) {
+        return true;
+    }
+
+    size_t capacity = ARENA_INITIAL_CHUNK_SIZE;
+    if (chunk != NULL && chunk->capacity <= ((size_t)-1 - sizeof(ArenaChunk)) / 2) {
+        capacity = 2 * chunk->capacity;
+    }
+    if (capacity < size) {
+        capacity = size;
+    }
+    if (capacity > (size_t)-1 - sizeof(ArenaChunk)) {
+        return false;
+    }
+
+    ArenaChunk *new_chunk = allocator->alloc(sizeof(ArenaChunk) + capacity, allocator->context);
+    if (new_chunk == NULL) {
+        return false;
+    }
+    new_chunk->previous = chunk;
+    new_chunk->refs = 1;
+    new_chunk->capacity = capacity;
+    new_chunk->used = 0;
+    arena->chunk = new_chunk;
+    arena->num_chunks += 1;
+    arena->allocated_bytes += capacity;
+    return true;
+}
+
+/**
+ * The number of bytes to reserve so that `size` bytes can be allocated.
+ *
+ * Returns 0 if that would overflow.
+ */
+static size_t arena_size_with_padding(size_t size) {
+    size_t alignment = alignment_for_size(size);
+    if (size > (size_t)-1 - alignment) {
+        return 0;
+    }
+    return size + alignment - 1;
+}
+
+/**
+ * Allocate `size` bytes from the arena, aligned for their size.
+ *
+ * Returns NULL if a new chunk could not be allocated.
+ */
+static void *arena_alloc(Arena *arena, const HashmapAllocator *allocator, size_t size) {
+    size_t reserved = arena_size_with_padding(size);
+    if (reserved == 0 || !arena_reserve(arena, allocator, reserved)) {
+        return NULL;
+    }
+
+    ArenaChunk *chunk = arena->chunk;
+    size_t offset = align_up(chunk->used, alignment_for_size(size));
+    chunk->used = offset + size;
+    arena->used_bytes += size;
+    return chunk->data + offset;
+}
+
+/**
+ * Share the chunks of the arena with a clone, see `hashmap_clone`.
+ */
+static void arena_share(Arena *arena) {
+    for (ArenaChunk *chunk = arena->chunk; chunk != NULL; chunk = chunk->previous) {
+        refs_acquire(&chunk->refs);
+    }
+}
+
+/**
+ * Free the chunks of the arena that no clone uses anymore.
+ */
+static void arena_free(Arena *arena, const HashmapAllocator *allocator) {
+    ArenaChunk *chunk = arena->chunk;
+    while (chunk != NULL) {
+        ArenaChunk *previous = chunk->previous;
+        if (refs_release(&chunk->refs)) {
+            allocator->free(chunk, sizeof(ArenaChunk) + chunk->capacity, allocator->context);
+        }
+        chunk = previous;
+    }
+    arena->chunk = NULL;
+    arena->num_chunks = 0;
+    arena->allocated_bytes = 0;
+    arena->used_bytes = 0;
+}
+
+/**
+ * Replace `*key` and `*value` by copies in the arena if the map owns them.
+ *
+ * Returns false if the copies could not be allocated. Nothing is leaked in
+ * that case, the arena just keeps the memory for the next allocation.
+ */
+static bool hashmap_copy_owned(Hashmap *map, Key **key, Value **value) {
+    Key *key_copy = *key;
+    Value *value_copy = *value;
+    if (map->key_copy_size != NULL) {
+        size_t size = map->key_copy_size(*key);
+        key_copy = arena_alloc(&map->arena, &map->allocator, size);
+        if (key_copy == NULL) {
+            return false;
+        }
+        memcpy(key_copy, *key, size);
+    }
+    if (map->value_copy_size != NULL) {
+        size_t size = map->value_copy_size(*value);
+        value_copy = arena_alloc(&map->arena, &map->allocator, size);
+        if (value_copy == NULL) {
+            return false;
+        }
+        memcpy(value_copy, *value, size);
+    }
+    *key = key_copy;
+    *value = value_copy;
+    return true;
+}
+
+/**
+ * Make sure that copying all the given keys and values into the arena cannot
+ * fail, see `hashmap_insert_many`.
+ */
+static bool hashmap_reserve_owned(Hashmap *map, Key **keys, Value **values, size_t n) {
+    size_t total = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size_t sizes[2] = { 0, 0 };
+        if (map->key_copy_size != NULL) {
+            sizes[0] = arena_size_with_padding(map->key_copy_size(keys[i]));
+            if (sizes[0] == 0) {
+                return false;
+            }
+        }
+        if (map->value_copy_size != NULL) {
+            sizes[1] = arena_size_with_padding(map->value_copy_size(values[i]));
+            if (sizes[1] == 0) {
+                return false;
+            }
+        }
+        for (size_t j = 0; j < 2; ++j) {
+            if (sizes[j] > (size_t)-1 - total) {
+                return false;
+            }
+            total += sizes[j];
+        }
+    }
+    return total == 0 || arena_reserve(&map->arena, &map->allocator, total);
+}
+
+/**
+ * Set up the layout of the entries, see `Table`.
+ *
+ * Returns false if the key and value sizes are invalid.
+ */
+static bool hashmap_init_layout(Hashmap *map, Hasher hasher, size_t key_size, size_t value_size, bool ordered) {
+    map->flat = key_size != 0;
+    if (map->flat) {
+        /* Leave plenty of room, so that computing the layout cannot overflow */
+        if (key_size > ((size_t)-1) / 4 || value_size > ((size_t)-1) / 4) {
+            return false;
+        }
+    } else {
+        if (value_size != 0 || (hasher.hash == NULL && hasher.hash_with_context == NULL)
+                || hasher.equal == NULL) {
+            return false;
+        }
+        key_size = sizeof(Key *);
+        value_size = sizeof(Value *);
+    }
+
+    size_t key_alignment = alignment_for_size(key_size);
+    size_t value_alignment = alignment_for_size(value_size);
+    size_t entry_alignment = sizeof(hash_t);
+    if (key_alignment > entry_alignment) {
+        entry_alignment = key_alignment;
+    }
+    if (value_alignment > entry_alignment) {
+        entry_alignment = value_alignment;
+    }
+
+    map->key_size = key_size;
+    map->value_size = value_size;
+    map->key_offset = align_up(sizeof(hash_t), key_alignment);
+    map->value_offset = align_up(map->key_offset + key_size, value_alignment);
+    map->entry_size = align_up(map->value_offset + value_size, entry_alignment);
+    map->ordered = ordered;
+    map->slot_size = ordered ? ORDERED_SLOT_SIZE : map->entry_size;
+    return true;
+}
+
+/**
+ * The number of bytes `hashmap_huge_page_alloc` maps for `size` bytes, a
+ * multiple of the huge page size. Returns 0 if that would overflow.
+ */
+static size_t huge_page_length(size_t size) {
+    if (size > SIZE_MAX - (HUGE_PAGE_SIZE - 1)) {
+        return 0;
+    }
+    return align_up(size, HUGE_PAGE_SIZE);
+}
+
+/**
+ * Whether `hashmap_huge_page_alloc` maps `size` bytes instead of using malloc.
+ */
+static bool uses_huge_pages(size_t size, void *threshold) {
+#ifdef __linux__
+    return size >= HUGE_PAGE_SIZE && size >= *(size_t *)threshold;
+#else
+    (void)size;
+    (void)threshold;
+    return false;
+#endif
+}
+
+void *hashmap_huge_page_alloc(size_t size, void *threshold) {
+    if (!uses_huge_pages(size, threshold)) {
+        return malloc(size);
+    }
+
+#ifdef __linux__
+    size_t length = huge_page_length(size);
+    if (length == 0 || length > SIZE_MAX - HUGE_PAGE_SIZE) {
+        return NULL;
+    }
+
+#ifdef MAP_HUGETLB
+    /* This only succeeds if the system has reserved huge pages */
+    void *pages = mmap(NULL, length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (pages != MAP_FAILED) {
+        return pages;
+    }
+#endif
+
+    /*
+     * Otherwise, ask for transparent huge pages. They can only back memory that
+     * is aligned to the huge page size, so map one more huge page than needed
+     * and unmap the unaligned parts at both ends.
+     */
+    unsigned char *mapping = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    size_t head = (HUGE_PAGE_SIZE - (uintptr_t)mapping % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+    if (head != 0) {
+        munmap(mapping, head);
+    }
+    munmap(mapping + head + length, HUGE_PAGE_SIZE - head);
+#ifdef MADV_HUGEPAGE
+    /* Only a hint, the memory is usable without huge pages as well */
+    madvise(mapping + head, length, MADV_HUGEPAGE);
+#endif
+    return mapping + head;
+#else
+    return malloc(size);
+#endif
+}
+
+void hashmap_huge_page_free(void *pointer, size_t size, void *threshold) {
+    if (!uses_huge_pages(size, threshold)) {
+        free(pointer);
+        return;
+    }
+#ifdef __linux__
+    munmap(pointer, huge_page_length(size));
+#endif
+}
+
+Hashmap *hashmap_create(Hasher hasher) {
+    HashmapOptions options = { 0 };
+    return hashmap_create_with_options(hasher, options);
+}
+
+Hashmap *hashmap_create_with_options(Hasher hasher, HashmapOptions options) {
+    HashmapAllocator allocator = {
+        .alloc = hashmap_default_alloc,
+        .free = hashmap_default_free,
+        .context = NULL,
+    };
+    return hashmap_create_with_allocator(hasher, options, allocator);
+}
+
+/**
+ * Free the map itself and its `removed` buffer, but not its tables or arena.
+ */
+static void hashmap_free_header(Hashmap *hashmap) {
+    HashmapAllocator allocator = hashmap->allocator;
+    if (hashmap->removed != NULL) {
+        allocator.free(hashmap->removed, hashmap->entry_size, allocator.context);
+    }
+    allocator.free(hashmap, sizeof(*hashmap), allocator.context);
+}
+
+Hashmap *hashmap_create_with_allocator(Hasher hasher, HashmapOptions options, HashmapAllocator allocator) {
+    if (allocator.alloc == NULL || allocator.free == NULL) {
+        return NULL;
+    }
+
+    /* Flat maps already copy their keys and values */
+    if (options.key_size != 0 && (options.key_copy_size != NULL || options.value_copy_size != NULL)) {
+        return NULL;
+    }
+    /* Ordered maps have to rebuild all entries at once, see `hashmap_rebuild` */
+    if (options.ordered && options.resize_step != 0) {
+        return NULL;
+    }
+    /* Only key pointers can tell empty entries apart, see `table_scan` */
+    if (options.scan_entries && (options.key_size != 0 || options.ordered)) {
+        return NULL;
+    }
+
+    Hashmap *hashmap = allocator.alloc(sizeof(*hashmap), allocator.context);
+    if (hashmap == NULL) {
+        return NULL;
+    }
+    hashmap->allocator = allocator;
+    hashmap->removed = NULL;
+    hashmap->mapping = NULL;
+    hashmap->mapping_size = 0;
+    hashmap->read_only = false;
+    if (!hashmap_init_layout(hashmap, hasher, options.key_size, options.value_size, options.ordered)) {
+        hashmap_free_header(hashmap);
+        return NULL;
+    }
+
+    if (!hashmap_sizing_init(&hashmap->sizing, &options, max_capacity(hashmap))) {
+        hashmap_free_header(hashmap);
+        return NULL;
+    }
+
+    if (hashmap->flat) {
+        hashmap->removed = allocator.alloc(hashmap->entry_size, allocator.context);
+        if (hashmap->removed == NULL) {
+            hashmap_free_header(hashmap);
+            return NULL;
+        }
+    }
+
+    hashmap->resize_step = options.resize_step;
+    hashmap->scan_entries = options.scan_entries;
+    hashmap->key_copy_size = options.key_copy_size;
+    hashmap->value_copy_size = options.value_copy_size;
+    hashmap->arena = (Arena) { NULL, 0, 0, 0 };
+#ifdef HASHMAP_STATS
+    memset(&hashmap->stats, 0, sizeof(hashmap->stats));
+#endif
+
+    size_t capacity = 0;
+    if (options.initial_capacity != 0) {
+        capacity = hashmap_capacity_for_size(&hashmap->sizing, options.initial_capacity, HASHMAP_INITIAL_CAPACITY);
+        if (capacity == 0) {
+            hashmap_free_header(hashmap);
+            return NULL;
+        }
+    }
+
+    if (!hashmap_init_with_capacity(hashmap, hasher, capacity)) {
+        hashmap_free_header(hashmap);
+        return NULL;
+    }
+
+    VALIDATE_HASHMAP(hashmap);
+    return hashmap;
+}
+
+/**
+ * Same as `hashmap_entry`, for a key whose hash is already known.
+ */
+static HashmapEntryState hashmap_entry_hashed(Hashmap *map, Key *key, hash_t hash, HashmapSlot *slot) {
+    VALIDATE_HASHMAP(map);
+
+    assert(key != NULL);
+    assert(!map->read_only && "Mapped maps and clones are read-only");
+
+    hashmap_migrate(map, map->resize_step);
+
+    if (!increase_capacity_if_necessary(map)) {
+        VALIDATE_HASHMAP(map);
+        return HASHMAP_FAILED;
+    }
+
+    slot->map = map;
+    slot->key = key;
+    slot->hash = hash;
+
+    Table *table = &map->table;
+    size_t index;
+    bool found = table_probe(map, table, key, hash, table_index(table, hash), &index);
+    if (!found && is_resizing(map)) {
+        table = &map->old_table;
+        found = table_probe(map, table, key, hash, old_table_start(map, hash), &index);
+    }
+
+    /* The slot may be written to, so it must not be shared with a clone */
+    bool unshared;
+    if (found && map->ordered) {
+        unshared = dense_unshare(map, &map->dense, slot_position(table_entry(table, index)));
+    } else if (found) {
+        unshared = table_unshare(map, table, index);
+    } else {
+        unshared = table_unshare_cluster(map, &map->table, table_index(&map->table, hash))
+            && (!map->ordered || dense_unshare(map, &map->dense, map->dense.size));
+    }
+    if (!unshared) {
+        VALIDATE_HASHMAP(map);
+        return HASHMAP_FAILED;
+    }
+
+    if (found) {
+        slot->entry = slot_entry(map, table_entry(table, index));
+        return HASHMAP_OCCUPIED;
+    }
+    slot->entry = NULL;
+    return HASHMAP_VACANT;
+}
+
+HashmapEntryState hashmap_entry(Hashmap *map, Key *key, HashmapSlot *slot) {
+    assert(key != NULL);
+    return hashmap_entry_hashed(map, key, hashmap_hash(map, key), slot);
+}
+
+Value *hashmap_slot_value(HashmapSlot *slot) {
+    assert(slot->entry != NULL && "Only occupied slots have a value");
+    return entry_value(slot->map, slot->entry);
+}
+
+bool hashmap_slot_set_value(HashmapSlot *slot, Value *value) {
+    Hashmap *map = slot->map;
+    assert(slot->entry != NULL && "Only occupied slots have a value");
+    assert((value != NULL || (map->flat && map->value_size == 0))
+            && "Only flat maps without values may set a NULL value");
+
+    unsigned char *entry = slot->entry;
+    if (map->flat) {
+        if (map->value_size != 0) {
+            memcpy(entry + map->value_offset, value, map->value_size);
+        }
+        return true;
+    }
+    if (map->value_copy_size != NULL) {
+        size_t size = map->value_copy_size(value);
+        Value *copy = arena_alloc(&map->arena, &map->allocator, size);
+        if (copy == NULL) {
+            return false;
+        }
+        memcpy(copy, value, size);
+        value = copy;
+    }
+    memcpy(entry + map->value_offset, &value, sizeof(value));
+    return true;
+}
+
+bool hashmap_slot_insert(HashmapSlot *slot, Value *value, Value **entry) {
+    Hashmap *map = slot->map;
+    Key *key = slot->key;
+    assert(slot->entry == NULL && "Only vacant slots can be inserted into");
+    assert((value != NULL || (map->flat && map->value_size == 0))
+            && "Only flat maps without values may insert a NULL value");
+
+    if (!hashmap_copy_owned(map, &key, &value)) {
+        if (entry != NULL) {
+            *entry = NULL;
+        }
+        VALIDATE_HASHMAP(map);
+        return false;
+    }
+    /* The map grew in `hashmap_entry`, so this only walks the control bytes */
+    unsigned char *new_entry = slot_init(map, &map->table, table_place(&map->table, slot->hash), slot->hash, key, value);
+
+    if (entry != NULL) {
+        *entry = entry_value(map, new_entry);
+    }
+
+    VALIDATE_HASHMAP(map);
+    return true;
+}
+
+HashmapEntryState hashmap_upsert(Hashmap *map, Key *key, Value *value, CombineFunction combine) {
+    HashmapSlot slot;
+    HashmapEntryState state = hashmap_entry(map, key, &slot);
+    if (state == HASHMAP_OCCUPIED) {
+        combine(hashmap_slot_value(&slot), value);
+        VALIDATE_HASHMAP(map);
+    } else if (state == HASHMAP_VACANT && !hashmap_slot_insert(&slot, value, NULL)) {
+        state = HASHMAP_FAILED;
+    }
+    return state;
+}
+
+/**
+ * Same as `hashmap_insert`, for a key whose hash is already known.
+ */
+static bool hashmap_insert_hashed(Hashmap *map, Key *key, hash_t hash, Value *value, Value **entry) {
+    assert((value != NULL || (map->flat && map->value_size == 0))
+            && "Only flat maps without values may insert a NULL value");
+
+    HashmapSlot slot;
+    HashmapEntryState state = hashmap_entry_hashed(map, key, hash, &slot);
+    if (state == HASHMAP_VACANT) {
+        return hashmap_slot_insert(&slot, value, entry);
+    }
+
+    /* Either an entry with the same key already exists, or the map could not grow */
+    if (entry != NULL) {
+        *entry = state == HASHMAP_OCCUPIED ? hashmap_slot_value(&slot) : NULL;
+    }
+    VALIDATE_HASHMAP(map);
+    return false;
+}
+
+bool hashmap_insert(Hashmap *map, Key *key, Value *value, Value **entry) {
+    assert(key != NULL);
+    return hashmap_insert_hashed(map, key, hashmap_hash(map, key), value, entry);
+}
+
+Value *hashmap_get(Hashmap *map, Key *key) {
+    assert(key != NULL);
+
+    hashmap_migrate(map, map->resize_step);
+
+    Table *table;
+    size_t index;
+    unsigned char *entry = hashmap_entry_find(map, key, &table, &index);
+    if (entry == NULL) {
+        return NULL;
+    } else {
+        return entry_value(map, entry);
+    }
+}
+
+/**
+ * Same as `hashmap_get`, for a key whose hash is already known.
+ */
+static Value *hashmap_get_hashed(Hashmap *map, Key *key, hash_t hash) {
+    assert(key != NULL);
+
+    hashmap_migrate(map, map->resize_step);
+
+    Table *table;
+    size_t index;
+    unsigned char *entry = hashmap_entry_find_hashed(map, key, hash, &table, &index);
+    if (entry == NULL) {
+        return NULL;
+    } else {
+        return entry_value(map, entry);
+    }
+}
+
+/**
+ * The number of entries `n` operations would migrate, see `hashmap_migrate`.
+ */
+static size_t migrate_count(Hashmap *map, size_t n) {
+    if (map->resize_step != 0 && n > (size_t)-1 / map->resize_step) {
+        return (size_t)-1;
+    }
+    return n * map->resize_step;
+}
+
+void hashmap_get_many(Hashmap *map, Key **keys, size_t n, Value **values) {
+    VALIDATE_HASHMAP(map);
+
+    /* Do the work of `n` single lookups up front, so that nothing moves later */
+    hashmap_migrate(map, migrate_count(map, n));
+
+    if (is_resizing(map) || map->table.size == 0) {
+        for (size_t i = 0; i < n; ++i) {
+            Table *table;
+            size_t index;
+            unsigned char *entry = hashmap_entry_find(map, keys[i], &table, &index);
+            values[i] = entry == NULL ? NULL : entry_value(map, entry);
+        }
+        return;
+    }
+
+    Table *table = &map->table;
+    hash_t hashes[BATCH_SIZE];
+    for (size_t start = 0; start < n; start += BATCH_SIZE) {
+        size_t count = n - start < BATCH_SIZE ? n - start : BATCH_SIZE;
+
+        /* Start loading all the entries before waiting for any of them */
+        for (size_t i = 0; i < count; ++i) {
+            assert(keys[start + i] != NULL);
+            hashes[i] = hashmap_hash(map, keys[start + i]);
+            PREFETCH_PROBE(table, hashes[i]);
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            size_t index;
+            Key *key = keys[start + i];
+            if (table_probe(map, table, key, hashes[i], table_index(table, hashes[i]), &index)) {
+                values[start + i] = entry_value(map, slot_entry(map, table_entry(table, index)));
+            } else {
+                values[start + i] = NULL;
+            }
+        }
+    }
+}
+
+bool hashmap_insert_many(Hashmap *map, Key **keys, Value **values, size_t n, bool *inserted) {
+    VALIDATE_HASHMAP(map);
+    assert(!map->read_only && "Mapped maps and clones are read-only");
+
+    /* Growing once up front means that none of the insertions can fail */
+    size_t size = hashmap_size(map);
+    if (n > (size_t)-1 - size || !hashmap_reserve(map, size + n)
+            || !hashmap_reserve_owned(map, keys, values, n) || !hashmap_unshare_all(map)) {
+        return false;
+    }
+
+    hashmap_migrate(map, migrate_count(map, n));
+
+    if (is_resizing(map)) {
+        for (size_t i = 0; i < n; ++i) {
+            bool success = hashmap_insert(map, keys[i], values[i], NULL);
+            if (inserted != NULL) {
+                inserted[i] = success;
+            }
+        }
+        VALIDATE_HASHMAP(map);
+        return true;
+    }
+
+    Table *table = &map->table;
+    hash_t hashes[BATCH_SIZE];
+    for (size_t start = 0; start < n; start += BATCH_SIZE) {
+        size_t count = n - start < BATCH_SIZE ? n - start : BATCH_SIZE;
+
+        for (size_t i = 0; i < count; ++i) {
+            assert(keys[start + i] != NULL);
+            hashes[i] = hashmap_hash(map, keys[start + i]);
+            PREFETCH_PROBE(table, hashes[i]);
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            size_t index;
+            Key *key = keys[start + i];
+            Value *value = values[start + i];
+            assert((value != NULL || (map->flat && map->value_size == 0))
+                    && "Only flat maps without values may insert a NULL value");
+
+            /* Keys earlier in the batch are found here as well */
+            bool found = table_probe(map, table, key, hashes[i], table_index(table, hashes[i]), &index);
+            if (!found) {
+                bool success = hashmap_copy_owned(map, &key, &value);
+                assert(success && "The arena should have been reserved");
+                slot_init(map, table, table_place(table, hashes[i]), hashes[i], key, value);
+            }
+            if (inserted != NULL) {
+                inserted[start + i] = !found;
+            }
+        }
+    }
+
+    VALIDATE_HASHMAP(map);
+    return true;
+}
+
+/**
+ * The state shared by the threads of `hashmap_build_parallel`.
+ *
+ * The table is split into `num_regions` regions of consecutive entries, and
+ * every key belongs to the region of its preferred index. The threads take
+ * turns owning the regions, so thread `t` fills in the regions `t`,
+ * `t + num_threads`, ... and no two threads ever write to the same entry.
+ */
+typedef struct ParallelBuild {
+    Hashmap *map;
+    HashmapEntry *entries;
+    size_t n;
+    size_t num_threads;
+    size_t num_regions;
+    /* The number of table entries in each region */
+    size_t region_capacity;
+    /* The hash of every key in `entries` */
+    hash_t *hashes;
+    /*
+     * The indices into `entries`, grouped by region and in input order within
+     * a region. Region `r` starts at `region_starts[r]`, and the last one is
+     * followed by `region_starts[num_regions] == n`.
+     */
+    size_t *order;
+    size_t *region_starts;
+    /*
+     * First the number of keys per thread and region, then where the thread
+     * writes the indices of those keys to `order`, see `build_partition`.
+     */
+    size_t *counts;
+    /* The number of entries each region holds after `build_place` */
+    size_t *placed;
+    /*
+     * The number of keys of each region that did not fit into it. Their
+     * indices are moved to the start of the region in `order`.
+     */
+    size_t *deferred;
+} ParallelBuild;
+
+typedef struct BuildThread {
+    ParallelBuild *build;
+    size_t thread;
+} BuildThread;
+
+/**
+ * The index of the first of `n` items that the given one of `num_threads`
+ * threads works on.
+ */
+static size_t chunk_start(size_t n, size_t num_threads, size_t thread) {
+    size_t remainder = n % num_threads;
+    return n / num_threads * thread + (thread < remainder ? thread : remainder);
+}
+
+static size_t build_region(ParallelBuild *build, hash_t hash) {
+    return table_index(&build->map->table, hash) / build->region_capacity;
+}
+
+/**
+ * Hash the keys of a thread's chunk of `entries` and count how many of them
+ * belong to each region.
+ */
+static void *build_hash(void *arg) {
+    BuildThread *thread = arg;
+    ParallelBuild *build = thread->build;
+    size_t *counts = &build->counts[thread->thread * build->num_regions];
+    size_t end = chunk_start(build->n, build->num_threads, thread->thread + 1);
+    for (size_t i = chunk_start(build->n, build->num_threads, thread->thread); i < end; ++i) {
+        assert(build->entries[i].key != NULL);
+        assert(build->entries[i].value != NULL);
+        build->hashes[i] = hashmap_hash(build->map, build->entries[i].key);
+        counts[build_region(build, build->hashes[i])] += 1;
+    }
+    return NULL;
+}
+
+/**
+ * Write the indices of a thread's chunk of `entries` to the regions of
+ * `order`, starting at the offsets `build_partition` stored in `counts`.
+ */
+static void *build_scatter(void *arg) {
+    BuildThread *thread = arg;
+    ParallelBuild *build = thread->build;
+    size_t *offsets = &build->counts[thread->thread * build->num_regions];
+    size_t end = chunk_start(build->n, build->num_threads, thread->thread + 1);
+    for (size_t i = chunk_start(build->n, build->num_threads, thread->thread); i < end; ++i) {
+        build->order[offsets[build_region(build, build->hashes[i])]++] = i;
+    }
+    return NULL;
+}
+
+/**
+ * Turn the number of keys per thread and region into the offsets the threads
+ * write the indices of their keys to. The regions are laid out one after the
+ * other, and within a region the chunks of the threads are in order, so that
+ * every region keeps the input order.
+ */
+static void build_partition(ParallelBuild *build) {
+    size_t offset = 0;
+    for (size_t region = 0; region < build->num_regions; ++region) {
+        build->region_starts[region] = offset;
+        for (size_t thread = 0; thread < build->num_threads; ++thread) {
+            size_t *count = &build->counts[thread * build->num_regions + region];
+            size_t region_count = *count;
+            *count = offset;
+            offset += region_count;
+        }
+    }
+    build->region_starts[build->num_regions] = offset;
+    assert(offset == build->n && "Every key should belong to a region");
+}
+
+typedef enum RegionResult {
+    REGION_INSERTED,
+    REGION_DUPLICATE,
+    REGION_FULL,
+} RegionResult;
+
+/**
+ * Insert an entry into the region of the table that ends at `end` and contains
+ * the preferred index of `hash`, like `hashmap_insert` followed by
+ * `table_place` would, but without looking at or moving any entry at or after
+ * `end`.
+ *
+ * Since no entry ever leaves its region, the regions can be filled in
+ * independently. If the region has no room left after the preferred index,
+ * nothing is changed and `REGION_FULL` is returned. Does not update the size
+ * of the table.
+ */
+static RegionResult region_insert(Hashmap *map, Table *table, size_t end, hash_t hash, Key *key, Value *value) {
+    size_t index = table_index(table, hash);
+    size_t distance = 0;
+    while (index < end && is_initialized(table, index) && probe_distance(table, index) >= distance) {
+        unsigned char *entry = table_entry(table, index);
+        if (entry_hash(entry) == hash && keys_equal(map, key, entry)) {
+            return REGION_DUPLICATE;
+        }
+        index += 1;
+        distance += 1;
+    }
+
+    size_t empty = index;
+    while (empty < end && is_initialized(table, empty)) {
+        empty += 1;
+    }
+    if (empty == end) {
+        return REGION_FULL;
+    }
+    for (; empty != index; --empty) {
+        memcpy(table_entry(table, empty), table_entry(table, empty - 1), table->entry_size);
+        set_ctrl(table, empty, *table_ctrl(table, empty - 1));
+    }
+
+    set_ctrl(table, index, hashmap_hash_tag(hash));
+    entry_init(map, table_entry(table, index), hash, key, value);
+    return REGION_INSERTED;
+}
+
+/**
+ * Insert the keys of a thread's regions in input order. The keys that do not
+ * fit into their region are left for `hashmap_build_parallel` to insert.
+ */
+static void *build_place(void *arg) {
+    BuildThread *thread = arg;
+    ParallelBuild *build = thread->build;
+    Table *table = &build->map->table;
+    for (size_t region = thread->thread; region < build->num_regions; region += build->num_threads) {
+        size_t end = (region + 1) * build->region_capacity;
+        size_t start = build->region_starts[region];
+        size_t placed = 0;
+        size_t deferred = 0;
+        for (size_t i = start; i < build->region_starts[region + 1]; ++i) {
+            HashmapEntry *entry = &build->entries[build->order[i]];
+            RegionResult result = region_insert(build->map, table, end, build->hashes[build->order[i]],
+                    entry->key, entry->value);
+            if (result == REGION_INSERTED) {
+                placed += 1;
+            } else if (result == REGION_FULL) {
+                /* Later duplicates of this key do not fit either, so they stay in order */
+                build->order[start + deferred] = build->order[i];
+                deferred += 1;
+            }
+        }
+        build->placed[region] = placed;
+        build->deferred[region] = deferred;
+    }
+    return NULL;
+}
+
+/**
+ * Run `phase` in `num_threads` threads and wait for all of them. Thread `i` is
+ * passed `args + i * arg_size`.
+ *
+ * The calling thread does the work of the first thread. If a thread cannot be
+ * started, its work is done by the calling thread as well.
+ */
+static void run_threads(void *args, size_t arg_size, size_t num_threads, void *(*phase)(void *)) {
+    assert(num_threads <= MAX_BUILD_THREADS);
+    unsigned char *arg = args;
+#ifdef HASHMAP_PTHREADS
+    pthread_t handles[MAX_BUILD_THREADS];
+    bool started[MAX_BUILD_THREADS];
+    for (size_t i = 1; i < num_threads; ++i) {
+        started[i] = pthread_create(&handles[i], NULL, phase, arg + i * arg_size) == 0;
+    }
+    phase(arg);
+    for (size_t i = 1; i < num_threads; ++i) {
+        if (started[i]) {
+            pthread_join(handles[i], NULL);
+        } else {
+            phase(arg + i * arg_size);
+        }
+    }
+#else
+    for (size_t i = 0; i < num_threads; ++i) {
+        phase(arg + i * arg_size);
+    }
+#endif
+}
+
+/**
+ * The number of threads to use for `nthreads` requested ones, see
+ * `hashmap_build_parallel`.
+ */
+static size_t num_build_threads(size_t nthreads) {
+#ifdef HASHMAP_PTHREADS
+    if (nthreads == 0) {
+        return 1;
+    }
+    return nthreads > MAX_BUILD_THREADS ? MAX_BUILD_THREADS : nthreads;
+#else
+    (void)nthreads;
+    return 1;
+#endif
+}
+
+Hashmap *hashmap_build_parallel(Hasher hasher, HashmapEntry *entries, size_t n, size_t nthreads) {
+    Hashmap *map = hashmap_create(hasher);
+    if (map == NULL) {
+        return NULL;
+    }
+    if (n == 0) {
+        return map;
+    }
+    if (!hashmap_reserve(map, n)) {
+        hashmap_destroy(map, NULL, NULL);
+        return NULL;
+    }
+
+    ParallelBuild build;
+    build.map = map;
+    build.entries = entries;
+    build.n = n;
+    build.num_threads = num_build_threads(nthreads);
+    /* A few regions per thread even out the work, but regions should not be tiny */
+    size_t capacity = map->table.capacity;
+    build.num_regions = 1;
+    while (build.num_regions < 4 * build.num_threads
+            && capacity / (2 * build.num_regions) >= MIN_BUILD_REGION_CAPACITY) {
+        build.num_regions *= 2;
+    }
+    build.region_capacity = capacity / build.num_regions;
+
+    /* Regions are powers of two, so they evenly divide the table */
+    size_t num_counts = build.num_threads * build.num_regions;
+    size_t scratch_size = n * sizeof(size_t) + (num_counts + 3 * build.num_regions + 1) * sizeof(size_t)
+            + n * sizeof(hash_t) + build.num_threads * sizeof(BuildThread);
+    unsigned char *scratch = map->allocator.alloc(scratch_size, map->allocator.context);
+    if (scratch == NULL) {
+        hashmap_destroy(map, NULL, NULL);
+        return NULL;
+    }
+    build.order = (size_t *)scratch;
+    build.counts = build.order + n;
+    build.region_starts = build.counts + num_counts;
+    build.placed = build.region_starts + build.num_regions + 1;
+    build.deferred = build.placed + build.num_regions;
+    BuildThread *threads = (BuildThread *)(build.deferred + build.num_regions);
+    build.hashes = (hash_t *)(threads + build.num_threads);
+    memset(build.counts, 0, num_counts * sizeof(size_t));
+    for (size_t i = 0; i < build.num_threads; ++i) {
+        threads[i] = (BuildThread) { &build, i };
+    }
+
+    run_threads(threads, sizeof(*threads), build.num_threads, build_hash);
+    build_partition(&build);
+    run_threads(threads, sizeof(*threads), build.num_threads, build_scatter);
+    run_threads(threads, sizeof(*threads), build.num_threads, build_place);
+
+    Table *table = &map->table;
+    for (size_t region = 0; region < build.num_regions; ++region) {
+        table->size += build.placed[region];
+    }
+    /* The keys that did not fit into their region spill over into the next ones */
+    for (size_t region = 0; region < build.num_regions; ++region) {
+        for (size_t i = 0; i < build.deferred[region]; ++i) {
+            size_t j = build.order[build.region_starts[region] + i];
+            hash_t hash = build.hashes[j];
+            size_t index;
+            if (!table_probe(map, table, entries[j].key, hash, table_index(table, hash), &index)) {
+                entry_init(map, table_entry(table, table_place(table, hash)), hash, entries[j].key, entries[j].value);
+            }
+        }
+    }
+
+    map->allocator.free(scratch, scratch_size, map->allocator.context);
+
+    VALIDATE_HASHMAP(map);
+    return map;
+}
+
+/**
+ * Remove the entry `hashmap_entry_find` found at `index` in `table`, whose key
+ * and value are in `to_remove`. See `hashmap_remove` for `entry`.
+ *
+ * Returns false if the pages the map shares with a clone could not be copied,
+ * in which case the entry is not removed.
+ */
+static bool hashmap_erase(Hashmap *map, unsigned char *to_remove, Table *table, size_t index, HashmapEntry *entry) {
+    assert(!map->read_only && "Mapped maps and clones are read-only");
+    if (!table_unshare_cluster(map, table, index)
+            || (map->ordered && !dense_unshare(map, &map->dense, slot_position(table_entry(table, index))))) {
+        return false;
+    }
+    if (entry != NULL) {
+        if (map->flat) {
+            /* The entry is about to be overwritten, so hand out a copy */
+            memcpy(map->removed, to_remove, map->entry_size);
+            to_remove = map->removed;
+        }
+        entry->key = entry_key(map, to_remove);
+        entry->value = entry_value(map, to_remove);
+    }
+
+    if (map->ordered) {
+        set_dense_live(&map->dense, slot_position(table_entry(table, index)), false);
+    }
+    size_t shifted = table_erase(table, index);
+    COUNT(map, backward_shifts, shifted);
+    if (table == &map->old_table && table->size == 0) {
+        /* That was the last entry that still had to be moved */
+        hashmap_migrate(map, 0);
+    }
+
+    decrease_capacity_if_necessary(map);
+    return true;
+}
+
+bool hashmap_remove(Hashmap *map, Key *key, HashmapEntry *entry) {
+    VALIDATE_HASHMAP(map);
+
+    hashmap_migrate(map, map->resize_step);
+
+    Table *table;
+    size_t index;
+    unsigned char *to_remove = hashmap_entry_find(map, key, &table, &index);
+    if (to_remove == NULL || !hashmap_erase(map, to_remove, table, index, entry)) {
+        return false;
+    }
+
+    VALIDATE_HASHMAP(map);
+    return true;
+}
+
+/**
+ * Same as `hashmap_remove`, for a key whose hash is already known.
+ */
+static bool hashmap_remove_hashed(Hashmap *map, Key *key, hash_t hash, HashmapEntry *entry) {
+    VALIDATE_HASHMAP(map);
+
+    hashmap_migrate(map, map->resize_step);
+
+    Table *table;
+    size_t index;
+    unsigned char *to_remove = hashmap_entry_find_hashed(map, key, hash, &table, &index);
+    if (to_remove == NULL || !hashmap_erase(map, to_remove, table, index, entry)) {
+        return false;
+    }
+
+    VALIDATE_HASHMAP(map);
+    return true;
+}
+
+bool hashmap_reserve(Hashmap *map, size_t n) {
+    VALIDATE_HASHMAP(map);
+
+    /* Ordered maps also need room for the new dense entries */
+    size_t size = hashmap_size(map);
+    bool dense_fits = !map->ordered || n <= size || n - size <= map->dense.capacity - map->dense.size;
+    if (n <= map->max_size && dense_fits) {
+        return true;
+    }
+
+    size_t new_capacity = hashmap_capacity_for_size(&map->sizing, n, HASHMAP_INITIAL_CAPACITY);
+    if (new_capacity == 0) {
+        return false;
+    }
+    return hashmap_resize(map, new_capacity, false);
+}
+
+bool hashmap_shrink_to_fit(Hashmap *map) {
+    VALIDATE_HASHMAP(map);
+
+    /* An explicit resize should not leave any work for later operations */
+    hashmap_migrate(map, (size_t)-1);
+
+    size_t size = hashmap_size(map);
+    size_t new_capacity;
+    if (size == 0) {
+        new_capacity = 0;
+    } else {
+        new_capacity = hashmap_capacity_for_size(&map->sizing, size, HASHMAP_INITIAL_CAPACITY);
+        assert(new_capacity != 0 && "The current size should always fit");
+    }
+
+    /* Ordered maps with removed entries still shrink their dense entries */
+    bool has_removed = map->ordered && map->dense.size != size;
+    if (new_capacity > map->table.capacity || (new_capacity == map->table.capacity && !has_removed)) {
+        return true;
+    }
+    return hashmap_resize(map, new_capacity, false);
+}
+
+size_t hashmap_size(Hashmap *map) {
+    return map->table.size + map->old_table.size;
+}
+
+size_t hashmap_capacity(Hashmap *map) {
+    return map->table.capacity;
+}
+
+void hashmap_probe_stats(Hashmap *map, HashmapProbeStats *stats) {
+    VALIDATE_HASHMAP(map);
+
+    size_t max = 0;
+    size_t total = 0;
+    Table *tables[] = { &map->table, &map->old_table };
+    for (size_t t = 0; t < sizeof(tables) / sizeof(tables[0]); ++t) {
+        Table *table = tables[t];
+        for (size_t i = 0; i < table->capacity; ++i) {
+            if (is_initialized(table, i)) {
+                size_t length = probe_distance(table, i) + 1;
+                total += length;
+                if (length > max) {
+                    max = length;
+                }
+            }
+        }
+    }
+
+    stats->max_probe_length = max;
+    size_t size = hashmap_size(map);
+    if (size == 0) {
+        stats->mean_probe_length = 0.0;
+    } else {
+        stats->mean_probe_length = (double)total / (double)size;
+    }
+}
+
+/**
+ * The longest run of consecutive initialized entries in a table, including
+ * runs that wrap around its end.
+ */
+static size_t table_max_cluster_length(Table *table) {
+    if (table->size == 0) {
+        return 0;
+    }
+    /* Start after an empty entry, so that no run is split at the start */
+    size_t mask = table->capacity - 1;
+    size_t start = 0;
+    while (is_initialized(table, start)) {
+        start += 1;
+    }
+    size_t max = 0;
+    size_t length = 0;
+    for (size_t i = 1; i <= table->capacity; ++i) {
+        if (is_initialized(table, (start + i) & mask)) {
+            length += 1;
+            if (length > max) {
+                max = length;
+            }
+        } else {
+            length = 0;
+        }
+    }
+    return max;
+}
+
+void hashmap_stats(Hashmap *map, HashmapStats *stats) {
+    VALIDATE_HASHMAP(map);
+
+#ifdef HASHMAP_STATS
+    *stats = map->stats;
+    stats->enabled = true;
+#else
+    memset(stats, 0, sizeof(*stats));
+    stats->enabled = false;
+#endif
+    stats->size = hashmap_size(map);
+    stats->capacity = map->table.capacity;
+    stats->load_factor = stats->capacity == 0 ? 0.0 : (double)stats->size / (double)stats->capacity;
+    stats->max_cluster_length = table_max_cluster_length(&map->table);
+    size_t old_cluster_length = table_max_cluster_length(&map->old_table);
+    if (old_cluster_length > stats->max_cluster_length) {
+        stats->max_cluster_length = old_cluster_length;
+    }
+}
+
+void hashmap_stats_reset(Hashmap *map) {
+#ifdef HASHMAP_STATS
+    memset(&map->stats, 0, sizeof(map->stats));
+#else
+    (void)map;
+#endif
+}
+
+void hashmap_iter_begin(Hashmap *map, HashmapIter *iter) {
+    VALIDATE_HASHMAP(map);
+
+    /* Finish resizing, so that only one table has to be looked at */
+    hashmap_migrate(map, (size_t)-1);
+
+    iter->map = map;
+    iter->index = 0;
+}
+
+bool hashmap_iter_next(HashmapIter *iter, HashmapEntry *entry) {
+    Hashmap *map = iter->map;
+    assert(!is_resizing(map) && "The map should not be modified while iterating");
+
+    unsigned char *next = NULL;
+    if (map->ordered) {
+        Dense *dense = &map->dense;
+        while (next == NULL && iter->index < dense->size) {
+            if (dense_live(dense, iter->index)) {
+                next = dense_entry(dense, iter->index);
+            }
+            iter->index += 1;
+        }
+    } else {
+        Table *table = &map->table;
+        while (next == NULL && iter->index < table->capacity) {
+            if (is_initialized(table, iter->index)) {
+                next = table_entry(table, iter->index);
+            }
+            iter->index += 1;
+        }
+    }
+
+    if (next == NULL) {
+        return false;
+    }
+    entry->key = entry_key(map, next);
+    entry->value = entry_value(map, next);
+    return true;
+}
+
+void hashmap_arena_stats(Hashmap *map, HashmapArenaStats *stats) {
+    stats->num_chunks = map->arena.num_chunks;
+    stats->allocated_bytes = map->arena.allocated_bytes;
+    stats->used_bytes = map->arena.used_bytes;
+}
+
+static void entry_destroy(Hashmap *map, unsigned char *entry, void (*destroy_key)(Key *), void (*destroy_value)(Value *)) {
+    if (destroy_key != NULL) {
+        destroy_key(entry_key(map, entry));
+    }
+    if (destroy_value != NULL) {
+        destroy_value(entry_value(map, entry));
+    }
+}
+
+static void table_destroy(Hashmap *map, Table *table, void (*destroy_key)(Key *), void (*destroy_value)(Value *)) {
+    /* The entries of ordered maps are destroyed in `dense` */
+    for (size_t i = 0; i < table->capacity && !map->ordered; ++i) {
+        if (is_initialized(table, i)) {
+            entry_destroy(map, table_entry(table, i), destroy_key, destroy_value);
+        }
+    }
+    table_free(map, table);
+}
+
+static void dense_destroy(Hashmap *map, Dense *dense, void (*destroy_key)(Key *), void (*destroy_value)(Value *)) {
+    for (size_t i = 0; i < dense->size; ++i) {
+        if (dense_live(dense, i)) {
+            entry_destroy(map, dense_entry(dense, i), destroy_key, destroy_value);
+        }
+    }
+    dense_free(map, dense);
+}
+
+void hashmap_destroy(Hashmap *map, void (*destroy_key)(Key *), void (*destroy_value)(Value *)) {
+    VALIDATE_HASHMAP(map);
+
+#ifdef HASHMAP_SNAPSHOTS
+    if (map->mapping != NULL) {
+        assert(destroy_key == NULL && destroy_value == NULL
+                && "The keys and values of mapped maps are in the file");
+        /* The tables are in the file as well */
+        munmap(map->mapping, map->mapping_size);
+        hashmap_free_header(map);
+        return;
+    }
+#endif
+
+    /* We first clean up all the keys and values */
+    table_destroy(map, &map->table, destroy_key, destroy_value);
+    table_destroy(map, &map->old_table, destroy_key, destroy_value);
+    dense_destroy(map, &map->dense, destroy_key, destroy_value);
+
+    /* Then we clean up the hash map itself */
+    arena_free(&map->arena, &map->allocator);
+    hashmap_free_header(map);
+}
+
+Hashmap *hashmap_clone(Hashmap *map) {
+    VALIDATE_HASHMAP(map);
+    assert(map->mapping == NULL && "Mapped maps cannot be cloned");
+
+    /* Only the current table is split into pages, see `hashmap_resize` */
+    hashmap_migrate(map, (size_t)-1);
+    if (!table_share(map, &map->table) || !dense_share(map, &map->dense)) {
+        return NULL;
+    }
+
+    Hashmap *clone = map->allocator.alloc(sizeof(*clone), map->allocator.context);
+    if (clone == NULL) {
+        return NULL;
+    }
+    *clone = *map;
+    clone->removed = NULL;
+    clone->read_only = true;
+#ifdef HASHMAP_STATS
+    memset(&clone->stats, 0, sizeof(clone->stats));
+#endif
+
+    /* Clones never remove entries, but all flat maps have the buffer */
+    if (map->flat) {
+        clone->removed = map->allocator.alloc(map->entry_size, map->allocator.context);
+        if (clone->removed == NULL) {
+            hashmap_free_header(clone);
+            return NULL;
+        }
+    }
+    size_t table_pages = num_pages(map->table.capacity, map->table.page_shift);
+    if (!pages_clone(map, map->table.pages, table_pages, &clone->table.pages)) {
+        hashmap_free_header(clone);
+        return NULL;
+    }
+    if (!pages_clone(map, map->dense.pages, num_pages(map->dense.capacity, map->dense.page_shift),
+                &clone->dense.pages)) {
+        if (clone->table.pages != NULL) {
+            pages_release(map, clone->table.pages, table_pages);
+        }
+        hashmap_free_header(clone);
+        return NULL;
+    }
+    arena_share(&clone->arena);
+
+    VALIDATE_HASHMAP(clone);
+    return clone;
+}
+
+/**
+ * The number of entries that may hold keys and values: the table entries or,
+ * in ordered maps, the dense entries. The old table is not included, so the
+ * map may not be resizing. See `stored_entry`.
+ */
+static size_t num_stored_entries(Hashmap *map) {
+    assert(!is_resizing(map));
+    return map->ordered ? map->dense.size : map->table.capacity;
+}
+
+/**
+ * The `i`-th entry that may hold a key and value, or NULL if it is not in use.
+ */
+static unsigned char *stored_entry(Hashmap *map, size_t i) {
+    if (map->ordered) {
+        return dense_live(&map->dense, i) ? dense_entry(&map->dense, i) : NULL;
+    }
+    return is_initialized(&map->table, i) ? table_entry(&map->table, i) : NULL;
+}
+
+/**
+ * A key of a map that is being frozen: its hash mixed to 64 bits, which
+ * determines its partition, bucket and slot (see `frozen_entry`), and its
+ * entry in the map.
+ */
+typedef struct FrozenItem {
+    uint64_t hash;
+    unsigned char *entry;
+} FrozenItem;
+
+/**
+ * The entries of a frozen map are placed with a minimal perfect hash function
+ * in the style of PTHash. The keys are split into partitions by their hash,
+ * and the keys of a partition into `buckets_per_partition` buckets of about
+ * `FROZEN_BUCKET_SIZE` keys. Every bucket has a pilot, which was chosen so
+ * that all keys of the bucket land in distinct slots of the partition that no
+ * other bucket uses, see `frozen_position`. Hence there are exactly as many
+ * slots as keys, and a lookup only looks at one of them.
+ *
+ * Partition `p` owns the slots from `partition_starts[p]` up to
+ * `partition_starts[p + 1]`, and the pilots from `p * buckets_per_partition`
+ * on.
+ *
+ * Keys with the same hash cannot be told apart by the function, so all but
+ * one of them are kept in `overflow`, sorted by hash.
+ */
+struct FrozenHashmap {
+    /*
+     * Hashes and compares the keys and owns the keys and values copied into
+     * its arena. Its tables are empty.
+     */
+    Hashmap *map;
+    size_t size;
+    size_t num_partitions;
+    size_t buckets_per_partition;
+    size_t *partition_starts;
+    uint32_t *pilots;
+    /* The slots, laid out like table entries */
+    unsigned char *entries;
+    size_t num_overflow;
+    unsigned char *overflow;
+    /* The size of the allocation that starts with the frozen map itself */
+    size_t allocation_size;
+};
+
+/**
+ * The state shared by the threads of `hashmap_freeze`. The threads take turns
+ * owning the partitions, so thread `t` builds the partitions `t`,
+ * `t + num_threads`, ...
+ */
+typedef struct FrozenBuild {
+    Hashmap *map;
+    FrozenHashmap *frozen;
+    size_t num_threads;
+    /* The keys grouped by partition, partition `p` starts at `item_starts[p]` */
+    FrozenItem *items;
+    size_t *item_starts;
+    size_t max_partition_size;
+    /* The number of distinct hashes in every partition, see `frozen_split` */
+    size_t *distinct;
+} FrozenBuild;
+
+/**
+ * A thread of `hashmap_freeze` and the scratch memory it builds partitions in.
+ */
+typedef struct FrozenThread {
+    FrozenBuild *build;
+    size_t thread;
+    FrozenItem *items;
+    size_t *bucket_starts;
+    uint64_t *bucket_order;
+    size_t *slots;
+    bool *taken;
+    /* Set if no pilot could be found for a bucket */
+    bool failed;
+} FrozenThread;
+
+/**
+ * The murmur3 64 bit finalizer, see `mix_hash`.
+ */
+static uint64_t frozen_mix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ * Map 32 random bits to [0, n) with a multiplication instead of a division.
+ */
+static size_t fast_range(uint32_t random, size_t n) {
+    assert((uint64_t)n <= (uint64_t)UINT32_MAX + 1);
+    return (size_t)(((uint64_t)random * n) >> 32);
+}
+
+static size_t frozen_partition(FrozenHashmap *frozen, uint64_t hash) {
+    return fast_range((uint32_t)(hash >> 32), frozen->num_partitions);
+}
+
+/**
+ * The bucket of a key within its partition.
+ */
+static size_t frozen_bucket(FrozenHashmap *frozen, uint64_t hash) {
+    return fast_range((uint32_t)hash, frozen->buckets_per_partition);
+}
+
+/**
+ * The slot of a key within its partition of `size` slots, given the pilot of
+ * its bucket.
+ */
+static size_t frozen_position(uint64_t hash, uint32_t pilot, size_t size) {
+    return fast_range((uint32_t)(frozen_mix(hash ^ (pilot * 0x9E3779B97F4A7C15ull)) >> 32), size);
+}
+
+/**
+ * The only entry that may hold the key with the given hash, apart from
+ * `overflow`. Returns NULL if the partition of the key is empty.
+ */
+static unsigned char *frozen_entry(FrozenHashmap *frozen, hash_t hash) {
+    uint64_t mixed = frozen_mix(hash);
+    size_t partition = frozen_partition(frozen, mixed);
+    size_t start = frozen->partition_starts[partition];
+    size_t size = frozen->partition_starts[partition + 1] - start;
+    if (size == 0) {
+        return NULL;
+    }
+    uint32_t pilot = frozen->pilots[partition * frozen->buckets_per_partition + frozen_bucket(frozen, mixed)];
+    return frozen->entries + (start + frozen_position(mixed, pilot, size)) * frozen->map->entry_size;
+}
+
+static int compare_items(const void *a, const void *b) {
+    uint64_t hash_a = ((const FrozenItem *)a)->hash;
+    uint64_t hash_b = ((const FrozenItem *)b)->hash;
+    return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+/**
+ * Sort the keys of a bucket by hash, so that keys with the same hash are next
+ * to each other. Buckets are usually tiny, so insertion sort is enough.
+ */
+static void frozen_sort_bucket(FrozenItem *items, size_t count) {
+    if (count > 16) {
+        qsort(items, count, sizeof(*items), compare_items);
+        return;
+    }
+    for (size_t i = 1; i < count; ++i) {
+        FrozenItem item = items[i];
+        size_t j = i;
+        for (; j > 0 && items[j - 1].hash > item.hash; --j) {
+            items[j] = items[j - 1];
+        }
+        items[j] = item;
+    }
+}
+
+/**
+ * Group the keys of a thread's partitions by bucket, with the keys of each
+ * bucket sorted by hash. Keys with the same hash as the previous one are moved
+ * to the end of the partition, and the number of the others is stored in
+ * `distinct`.
+ */
+static void *frozen_split(void *arg) {
+    FrozenThread *thread = arg;
+    FrozenBuild *build = thread->build;
+    FrozenHashmap *frozen = build->frozen;
+    size_t num_buckets = frozen->buckets_per_partition;
+    for (size_t partition = thread->thread; partition < frozen->num_partitions; partition += build->num_threads) {
+        FrozenItem *items = &build->items[build->item_starts[partition]];
+        size_t count = build->item_starts[partition + 1] - build->item_starts[partition];
+
+        /* Afterwards, `bucket_starts[b]` is where bucket `b + 1` starts */
+        size_t *bucket_starts = thread->bucket_starts;
+        memset(bucket_starts, 0, (num_buckets + 1) * sizeof(*bucket_starts));
+        for (size_t i = 0; i < count; ++i) {
+            bucket_starts[frozen_bucket(frozen, items[i].hash) + 1] += 1;
+        }
+        for (size_t bucket = 0; bucket < num_buckets; ++bucket) {
+            bucket_starts[bucket + 1] += bucket_starts[bucket];
+        }
+        for (size_t i = 0; i < count; ++i) {
+            thread->items[bucket_starts[frozen_bucket(frozen, items[i].hash)]++] = items[i];
+        }
+
+        size_t distinct = 0;
+        size_t duplicates = 0;
+        for (size_t bucket = 0; bucket < num_buckets; ++bucket) {
+            size_t start = bucket == 0 ? 0 : bucket_starts[bucket - 1];
+            FrozenItem *bucket_items = &thread->items[start];
+            size_t bucket_size = bucket_starts[bucket] - start;
+            frozen_sort_bucket(bucket_items, bucket_size);
+            for (size_t i = 0; i < bucket_size; ++i) {
+                if (i > 0 && bucket_items[i].hash == bucket_items[i - 1].hash) {
+                    duplicates += 1;
+                    items[count - duplicates] = bucket_items[i];
+                } else {
+                    items[distinct++] = bucket_items[i];
+                }
+            }
+        }
+        build->distinct[partition] = distinct;
+    }
+    return NULL;
+}
+
+static int compare_descending(const void *a, const void *b) {
+    uint64_t value_a = *(const uint64_t *)a;
+    uint64_t value_b = *(const uint64_t *)b;
+    return (value_a < value_b) - (value_a > value_b);
+}
+
+/**
+ * Find the pilots of a thread's partitions and copy their entries into the
+ * slots. Larger buckets are placed first, while most slots are still free.
+ */
+static void *frozen_place(void *arg) {
+    FrozenThread *thread = arg;
+    FrozenBuild *build = thread->build;
+    FrozenHashmap *frozen = build->frozen;
+    size_t entry_size = build->map->entry_size;
+    size_t num_buckets = frozen->buckets_per_partition;
+    for (size_t partition = thread->thread; partition < frozen->num_partitions; partition += build->num_threads) {
+        FrozenItem *items = &build->items[build->item_starts[partition]];
+        size_t size = build->distinct[partition];
+        size_t start = frozen->partition_starts[partition];
+        uint32_t *pilots = &frozen->pilots[partition * num_buckets];
+
+        size_t *bucket_starts = thread->bucket_starts;
+        memset(bucket_starts, 0, (num_buckets + 1) * sizeof(*bucket_starts));
+        for (size_t i = 0; i < size; ++i) {
+            bucket_starts[frozen_bucket(frozen, items[i].hash) + 1] += 1;
+        }
+        /* The size of each bucket in the high bits, so that sorting puts large buckets first */
+        size_t num_used = 0;
+        for (size_t bucket = 0; bucket < num_buckets; ++bucket) {
+            size_t bucket_size = bucket_starts[bucket + 1];
+            if (bucket_size != 0) {
+                thread->bucket_order[num_used++] = ((uint64_t)bucket_size << 32) | bucket;
+            }
+            bucket_starts[bucket + 1] += bucket_starts[bucket];
+            pilots[bucket] = 0;
+        }
+        qsort(thread->bucket_order, num_used, sizeof(*thread->bucket_order), compare_descending);
+
+        memset(thread->taken, 0, size * sizeof(*thread->taken));
+        for (size_t i = 0; i < num_used; ++i) {
+            size_t bucket = (size_t)(thread->bucket_order[i] & UINT32_MAX);
+            FrozenItem *bucket_items = &items[bucket_starts[bucket]];
+            size_t bucket_size = bucket_starts[bucket + 1] - bucket_starts[bucket];
+
+            uint32_t pilot = 0;
+            for (;;) {
+                size_t placed = 0;
+                while (placed < bucket_size) {
+                    size_t slot = frozen_position(bucket_items[placed].hash, pilot, size);
+                    if (thread->taken[slot]) {
+                        break;
+                    }
+                    thread->taken[slot] = true;
+                    thread->slots[placed++] = slot;
+                }
+                if (placed == bucket_size) {
+                    break;
+                }
+                for (size_t j = 0; j < placed; ++j) {
+                    thread->taken[thread->slots[j]] = false;
+                }
+                if (pilot == UINT32_MAX) {
+                    thread->failed = true;
+                    return NULL;
+                }
+                pilot += 1;
+            }
+
+            pilots[bucket] = pilot;
+            for (size_t j = 0; j < bucket_size; ++j) {
+                memcpy(frozen->entries + (start + thread->slots[j]) * entry_size, bucket_items[j].entry, entry_size);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int compare_entry_hashes(const void *a, const void *b) {
+    hash_t hash_a = entry_hash(a);
+    hash_t hash_b = entry_hash(b);
+    return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+/**
+ * Free the memory of a frozen map, but not its keys, values or `map`.
+ */
+static void frozen_free(FrozenHashmap *frozen) {
+    HashmapAllocator *allocator = &frozen->map->allocator;
+    if (frozen->num_overflow != 0) {
+        allocator->free(frozen->overflow, frozen->num_overflow * frozen->map->entry_size, allocator->context);
+    }
+    allocator->free(frozen, frozen->allocation_size, allocator->context);
+}
+
+/**
+ * Allocate a frozen map with the partitions and slots of `build`, see
+ * `FrozenHashmap`. The pilots and slots are filled in by `frozen_place`.
+ */
+static FrozenHashmap *frozen_alloc(FrozenBuild *build, size_t num_partitions, size_t buckets_per_partition) {
+    Hashmap *map = build->map;
+    size_t num_slots = 0;
+    for (size_t partition = 0; partition < num_partitions; ++partition) {
+        num_slots += build->distinct[partition];
+    }
+
+    size_t starts_offset = align_up(sizeof(FrozenHashmap), MAX_ALIGNMENT);
+    size_t pilots_offset = starts_offset + (num_partitions + 1) * sizeof(size_t);
+    size_t entries_offset = align_up(pilots_offset + num_partitions * buckets_per_partition * sizeof(uint32_t),
+            MAX_ALIGNMENT);
+    size_t allocation_size = entries_offset + num_slots * map->entry_size;
+    unsigned char *allocation = map->allocator.alloc(allocation_size, map->allocator.context);
+    if (allocation == NULL) {
+        return NULL;
+    }
+
+    FrozenHashmap *frozen = (FrozenHashmap *)allocation;
+    frozen->map = map;
+    frozen->size = hashmap_size(map);
+    frozen->num_partitions = num_partitions;
+    frozen->buckets_per_partition = buckets_per_partition;
+    frozen->partition_starts = (size_t *)(allocation + starts_offset);
+    frozen->pilots = (uint32_t *)(allocation + pilots_offset);
+    frozen->entries = allocation + entries_offset;
+    frozen->num_overflow = frozen->size - num_slots;
+    frozen->overflow = NULL;
+    frozen->allocation_size = allocation_size;
+
+    size_t start = 0;
+    for (size_t partition = 0; partition < num_partitions; ++partition) {
+        frozen->partition_starts[partition] = start;
+        start += build->distinct[partition];
+    }
+    frozen->partition_starts[num_partitions] = start;
+
+    if (frozen->num_overflow != 0) {
+        frozen->overflow = map->allocator.alloc(frozen->num_overflow * map->entry_size, map->allocator.context);
+        if (frozen->overflow == NULL) {
+            frozen->num_overflow = 0;
+            frozen_free(frozen);
+            return NULL;
+        }
+    }
+    return frozen;
+}
+
+/**
+ * Group the keys of the map by partition into `build->items`.
+ */
+static void frozen_partition_items(FrozenBuild *build, size_t num_partitions) {
+    Hashmap *map = build->map;
+    size_t *item_starts = build->item_starts;
+    memset(item_starts, 0, (num_partitions + 1) * sizeof(*item_starts));
+    for (size_t i = 0; i < num_stored_entries(map); ++i) {
+        unsigned char *entry = stored_entry(map, i);
+        if (entry != NULL) {
+            item_starts[frozen_partition(build->frozen, frozen_mix(entry_hash(entry))) + 1] += 1;
+        }
+    }
+    build->max_partition_size = 0;
+    for (size_t partition = 0; partition < num_partitions; ++partition) {
+        if (item_starts[partition + 1] > build->max_partition_size) {
+            build->max_partition_size = item_starts[partition + 1];
+        }
+        item_starts[partition + 1] += item_starts[partition];
+    }
+
+    /* Temporarily where the next key of each partition goes */
+    for (size_t i = 0; i < num_stored_entries(map); ++i) {
+        unsigned char *entry = stored_entry(map, i);
+        if (entry != NULL) {
+            uint64_t hash = frozen_mix(entry_hash(entry));
+            build->items[item_starts[frozen_partition(build->frozen, hash)]++] = (FrozenItem) { hash, entry };
+        }
+    }
+    for (size_t partition = num_partitions; partition > 0; --partition) {
+        item_starts[partition] = item_starts[partition - 1];
+    }
+    item_starts[0] = 0;
+}
+
+FrozenHashmap *hashmap_freeze(Hashmap *map, size_t nthreads) {
+    VALIDATE_HASHMAP(map);
+
+    /* Only `table` is frozen */
+    hashmap_migrate(map, (size_t)-1);
+
+    size_t n = hashmap_size(map);
+    size_t num_partitions = n / FROZEN_PARTITION_SIZE + 1;
+    size_t buckets_per_partition = n / num_partitions / FROZEN_BUCKET_SIZE + 1;
+
+    FrozenBuild build;
+    build.map = map;
+    build.num_threads = num_build_threads(nthreads);
+    if (build.num_threads > num_partitions) {
+        build.num_threads = num_partitions;
+    }
+
+    /* Only the partitioning is needed before the frozen map is allocated */
+    FrozenHashmap layout;
+    layout.num_partitions = num_partitions;
+    layout.buckets_per_partition = buckets_per_partition;
+    build.frozen = &layout;
+
+    size_t shared_size = n * sizeof(FrozenItem) + (2 * num_partitions + 1) * sizeof(size_t)
+            + build.num_threads * sizeof(FrozenThread);
+    unsigned char *shared = map->allocator.alloc(shared_size, map->allocator.context);
+    if (shared == NULL) {
+        return NULL;
+    }
+    build.items = (FrozenItem *)shared;
+    build.item_starts = (size_t *)(build.items + n);
+    build.distinct = build.item_starts + num_partitions + 1;
+    FrozenThread *threads = (FrozenThread *)(build.distinct + num_partitions);
+    frozen_partition_items(&build, num_partitions);
+
+    /* Every thread gets room for the largest partition */
+    size_t max_size = build.max_partition_size;
+    size_t thread_size = max_size * (sizeof(FrozenItem) + sizeof(size_t)) + (buckets_per_partition + 1) * sizeof(size_t)
+            + buckets_per_partition * sizeof(uint64_t) + align_up(max_size * sizeof(bool), MAX_ALIGNMENT);
+    size_t scratch_size = build.num_threads * thread_size;
+    unsigned char *scratch = map->allocator.alloc(scratch_size, map->allocator.context);
+    if (scratch == NULL) {
+        map->allocator.free(shared, shared_size, map->allocator.context);
+        return NULL;
+    }
+    for (size_t i = 0; i < build.num_threads; ++i) {
+        FrozenThread *thread = &threads[i];
+        thread->build = &build;
+        thread->thread = i;
+        thread->items = (FrozenItem *)(scratch + i * thread_size);
+        thread->bucket_starts = (size_t *)(thread->items + max_size);
+        thread->bucket_order = (uint64_t *)(thread->bucket_starts + buckets_per_partition + 1);
+        thread->slots = (size_t *)(thread->bucket_order + buckets_per_partition);
+        thread->taken = (bool *)(thread->slots + max_size);
+        thread->failed = false;
+    }
+
+    run_threads(threads, sizeof(*threads), build.num_threads, frozen_split);
+    FrozenHashmap *frozen = frozen_alloc(&build, num_partitions, buckets_per_partition);
+    if (frozen != NULL) {
+        build.frozen = frozen;
+        run_threads(threads, sizeof(*threads), build.num_threads, frozen_place);
+        for (size_t i = 0; i < build.num_threads; ++i) {
+            if (threads[i].failed) {
+                frozen_free(frozen);
+                frozen = NULL;
+                break;
+            }
+        }
+    }
+    if (frozen != NULL && frozen->num_overflow != 0) {
+        size_t copied = 0;
+        for (size_t partition = 0; partition < num_partitions; ++partition) {
+            for (size_t i = build.item_starts[partition] + build.distinct[partition];
+                    i < build.item_starts[partition + 1]; ++i) {
+                memcpy(frozen->overflow + copied * map->entry_size, build.items[i].entry, map->entry_size);
+                copied += 1;
+            }
+        }
+        assert(copied == frozen->num_overflow);
+        qsort(frozen->overflow, frozen->num_overflow, map->entry_size, compare_entry_hashes);
+    }
+
+    map->allocator.free(scratch, scratch_size, map->allocator.context);
+    map->allocator.free(shared, shared_size, map->allocator.context);
+    if (frozen == NULL) {
+        return NULL;
+    }
+
+    /* The frozen map holds the entries now, the map only keeps its keys and values alive */
+    if (map->mapping == NULL) {
+        table_free(map, &map->table);
+        dense_free(map, &map->dense);
+    } else {
+        table_init(map, &map->table, 0);
+        dense_init(map, &map->dense, 0);
+    }
+    map->max_size = hashmap_max_size(&map->sizing, 0);
+    map->min_size = hashmap_min_size(&map->sizing, 0);
+
+    VALIDATE_HASHMAP(map);
+    return frozen;
+}
+
+/**
+ * Look for a key whose hash equals that of another key, see `FrozenHashmap`.
+ */
+static Value *frozen_overflow_get(FrozenHashmap *frozen, Key *key, hash_t hash) {
+    size_t entry_size = frozen->map->entry_size;
+    size_t low = 0;
+    size_t high = frozen->num_overflow;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (entry_hash(frozen->overflow + middle * entry_size) < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (; low < frozen->num_overflow; ++low) {
+        unsigned char *entry = frozen->overflow + low * entry_size;
+        if (entry_hash(entry) != hash) {
+            break;
+        }
+        if (keys_equal(frozen->map, key, entry)) {
+            return entry_value(frozen->map, entry);
+        }
+    }
+    return NULL;
+}
+
+Value *frozen_hashmap_get(FrozenHashmap *frozen, Key *key) {
+    assert(key != NULL);
+
+    if (frozen->size == 0) {
+        return NULL;
+    }
+    Hashmap *map = frozen->map;
+    hash_t hash = hashmap_hash(map, key);
+    unsigned char *entry = frozen_entry(frozen, hash);
+    if (entry == NULL || entry_hash(entry) != hash) {
+        return NULL;
+    }
+    if (keys_equal(map, key, entry)) {
+        return entry_value(map, entry);
+    }
+    return frozen_overflow_get(frozen, key, hash);
+}
+
+size_t frozen_hashmap_size(FrozenHashmap *frozen) {
+    return frozen->size;
+}
+
+void frozen_hashmap_destroy(FrozenHashmap *frozen, void (*destroy_key)(Key *), void (*destroy_value)(Value *)) {
+    Hashmap *map = frozen->map;
+    size_t num_slots = frozen->partition_starts[frozen->num_partitions];
+    for (size_t i = 0; i < num_slots; ++i) {
+        entry_destroy(map, frozen->entries + i * map->entry_size, destroy_key, destroy_value);
+    }
+    for (size_t i = 0; i < frozen->num_overflow; ++i) {
+        entry_destroy(map, frozen->overflow + i * map->entry_size, destroy_key, destroy_value);
+    }
+    frozen_free(frozen);
+    hashmap_destroy(map, NULL, NULL);
+}
+
+#ifdef HASHMAP_SNAPSHOTS
+
+/**
+ * The start of a file written by `hashmap_save`.
+ *
+ * The sections of the file follow at the given offsets:
+ *  - The table entries, followed by its `capacity` control bytes and
+ *    `SNAPSHOT_MIRRORED_CTRL` mirrored ones, exactly as in a `Table`.
+ *  - In ordered maps, the first `dense_size` dense entries followed by their
+ *    live flags, as in a `Dense`.
+ *  - In non-flat maps, the bytes of the keys and values, each aligned to
+ *    `MAX_ALIGNMENT` and preceded by its size as a `uint64_t`. The entries
+ *    hold the offsets of the bytes in the file instead of pointers, see
+ *    `entry_pointer`.
+ *
+ * All offsets are from the start of the file, which is also where the header
+ * is written.
+ *
+ * All fields are 8 bytes large, so there is no padding. `checksum` is computed
+ * with `checksum` set to 0, see `snapshot_checksum`.
+ */
+typedef struct SnapshotHeader {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t checksum;
+    uint64_t file_size;
+    uint64_t flat;
+    uint64_t ordered;
+    /* The layout of the entries, see `hashmap_init_layout` */
+    uint64_t key_size;
+    uint64_t value_size;
+    uint64_t key_offset;
+    uint64_t value_offset;
+    uint64_t entry_size;
+    uint64_t slot_size;
+    double max_load_factor;
+    uint64_t size;
+    uint64_t capacity;
+    uint64_t table_offset;
+    uint64_t dense_size;
+    uint64_t dense_offset;
+    uint64_t data_offset;
+} SnapshotHeader;
+
+/**
+ * Writes a snapshot to a file in blocks of `SNAPSHOT_BLOCK_SIZE` bytes, and
+ * computes the checksum of everything after the header along the way.
+ *
+ * Once writing failed, `failed` is set and nothing more is written.
+ */
+typedef struct SnapshotWriter {
+    int fd;
+    unsigned char *buffer;
+    size_t used;
+    /* The offset in the file of the next byte, including those in `buffer` */
+    size_t offset;
+    uint64_t checksum;
+    bool failed;
+} SnapshotWriter;
+
+/**
+ * Write `length` bytes to the file at `offset`, regardless of the current
+ * offset of `fd`.
+ */
+static bool write_all(int fd, const void *data, size_t length, size_t offset) {
+    const unsigned char *bytes = data;
+    while (length > 0) {
+        ssize_t written = pwrite(fd, bytes, length, (off_t)offset);
+        if (written <= 0) {
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += written;
+        length -= (size_t)written;
+        offset += (size_t)written;
+    }
+    return true;
+}
+
+/**
+ * The checksum of `length` bytes, chained onto the checksum of the bytes
+ * before them. Blocks have to be `SNAPSHOT_BLOCK_SIZE` bytes large, except for
+ * the last one.
+ */
+static uint64_t snapshot_checksum(uint64_t checksum, const void *block, size_t length) {
+    return hashmap_hash_bytes(block, length, checksum);
+}
+
+static void snapshot_flush(SnapshotWriter *writer) {
+    if (writer->used == 0) {
+        return;
+    }
+    writer->checksum = snapshot_checksum(writer->checksum, writer->buffer, writer->used);
+    if (!writer->failed && !write_all(writer->fd, writer->buffer, writer->used, writer->offset - writer->used)) {
+        writer->failed = true;
+    }
+    writer->used = 0;
+}
+
+static void snapshot_write(SnapshotWriter *writer, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    while (length > 0) {
+        size_t count = SNAPSHOT_BLOCK_SIZE - writer->used;
+        if (count > length) {
+            count = length;
+        }
+        memcpy(writer->buffer + writer->used, bytes, count);
+        writer->used += count;
+        writer->offset += count;
+        bytes += count;
+        length -= count;
+        if (writer->used == SNAPSHOT_BLOCK_SIZE) {
+            snapshot_flush(writer);
+        }
+    }
+}
+
+/**
+ * Write zeros until the next byte is at `offset`.
+ */
+static void snapshot_pad(SnapshotWriter *writer, size_t offset) {
+    static const unsigned char zeros[SNAPSHOT_ALIGNMENT];
+    assert(writer->offset <= offset);
+    while (writer->offset < offset) {
+        size_t count = offset - writer->offset;
+        snapshot_write(writer, zeros, count < sizeof(zeros) ? count : sizeof(zeros));
+    }
+}
+
+/**
+ * Serialize a key or value of a non-flat map with `serialize`, or copy the
+ * `copy_size(data)` bytes at `data` if it is NULL. See `SerializeFunction`.
+ */
+static size_t snapshot_serialize(SerializeFunction serialize, SizeFunction copy_size, void *data,
+        void *buffer, size_t capacity) {
+    if (serialize != NULL) {
+        return serialize(data, buffer, capacity);
+    }
+    size_t size = copy_size(data);
+    if (size <= capacity && size != 0) {
+        memcpy(buffer, data, size);
+    }
+    return size;
+}
+
+/**
+ * Write the first `count` control bytes or live flags, which are split into
+ * pages if the map was cloned, see `SharedPage`.
+ */
+static void snapshot_write_flags(SnapshotWriter *writer, unsigned char *flags, SharedPage **pages, unsigned int shift,
+        size_t count) {
+    if (pages == NULL) {
+        snapshot_write(writer, flags, count);
+        return;
+    }
+    size_t page_slots = (size_t)1 << shift;
+    for (size_t i = 0; i < count; i += page_slots) {
+        snapshot_write(writer, pages[i >> shift]->flags, count - i < page_slots ? count - i : page_slots);
+    }
+}
+
+/**
+ * Write an entry of a non-flat map, with the offsets of its key and value in
+ * the file instead of the pointers.
+ */
+static void snapshot_write_offsets(SnapshotWriter *writer, Hashmap *map, unsigned char *entry,
+        uintptr_t key, uintptr_t value) {
+    assert(!map->flat && map->key_size == sizeof(key) && map->value_size == sizeof(value));
+    snapshot_write(writer, entry, map->key_offset);
+    snapshot_write(writer, &key, sizeof(key));
+    snapshot_write(writer, entry + map->key_offset + sizeof(key), map->value_offset - map->key_offset - sizeof(key));
+    snapshot_write(writer, &value, sizeof(value));
+    snapshot_write(writer, entry + map->value_offset + sizeof(value), map->entry_size - map->value_offset - sizeof(value));
+}
+
+/**
+ * Write the entries holding keys and values, see `stored_entry`. Unused
+ * entries are written as zeros. In non-flat maps, the keys and values are
+ * placed one after the other from `data_offset` on, see `snapshot_write_data`.
+ */
+static void snapshot_write_entries(SnapshotWriter *writer, Hashmap *map, SerializeFunction key_serializer,
+        SerializeFunction value_serializer, size_t data_offset) {
+    size_t data = data_offset;
+    for (size_t i = 0; i < num_stored_entries(map); ++i) {
+        unsigned char *entry = stored_entry(map, i);
+        if (entry == NULL) {
+            snapshot_pad(writer, writer->offset + map->entry_size);
+        } else if (map->flat) {
+            snapshot_write(writer, entry, map->entry_size);
+        } else {
+            size_t key_size = snapshot_serialize(key_serializer, map->key_copy_size, entry_key(map, entry), NULL, 0);
+            size_t value_size = snapshot_serialize(value_serializer, map->value_copy_size, entry_value(map, entry),
+                    NULL, 0);
+            uintptr_t key = data + align_up(sizeof(uint64_t), MAX_ALIGNMENT);
+            data = key + align_up(key_size, MAX_ALIGNMENT);
+            uintptr_t value = data + align_up(sizeof(uint64_t), MAX_ALIGNMENT);
+            data = value + align_up(value_size, MAX_ALIGNMENT);
+            snapshot_write_offsets(writer, map, entry, key, value);
+        }
+    }
+}
+
+/**
+ * Serialize a key or value into `*buffer` and write its size and bytes,
+ * aligned to `MAX_ALIGNMENT`. `*buffer` is grown if it is too small.
+ *
+ * Returns false if `*buffer` could not be grown.
+ */
+static bool snapshot_write_item(SnapshotWriter *writer, Hashmap *map, SerializeFunction serialize,
+        SizeFunction copy_size, void *data, unsigned char **buffer, size_t *capacity) {
+    size_t size = snapshot_serialize(serialize, copy_size, data, *buffer, *capacity);
+    if (size > *capacity) {
+        size_t new_capacity = *capacity;
+        while (new_capacity < size) {
+            new_capacity *= 2;
+        }
+        unsigned char *new_buffer = map->allocator.alloc(new_capacity, map->allocator.context);
+        if (new_buffer == NULL) {
+            return false;
+        }
+        map->allocator.free(*buffer, *capacity, map->allocator.context);
+        *buffer = new_buffer;
+        *capacity = new_capacity;
+        size_t serialized = snapshot_serialize(serialize, copy_size, data, *buffer, *capacity);
+        assert(serialized == size && "Serializers should always return the same size");
+    }
+    uint64_t stored_size = size;
+    snapshot_write(writer, &stored_size, sizeof(stored_size));
+    snapshot_pad(writer, align_up(writer->offset, MAX_ALIGNMENT));
+    snapshot_write(writer, *buffer, size);
+    snapshot_pad(writer, align_up(writer->offset, MAX_ALIGNMENT));
+    return true;
+}
 
 /**
- * The reciprocal of the maximum load factor of the hash map.
- *
- * The load factor (alpha) is the ratio of the number of entries to the capacity.
- * The reciprocal of the load factor is (1 / alpha).
+ * Write the keys and values of a non-flat map, in the same order as
+ * `snapshot_write_entries`.
  *
- * When the load factor exceeds this value, the hash map will be resized.
+ * Returns false if the memory for serializing them could not be allocated.
  */
-#define RECIPROCAL_LOAD_FACTOR 2
+static bool snapshot_write_data(SnapshotWriter *writer, Hashmap *map, SerializeFunction key_serializer,
+        SerializeFunction value_serializer) {
+    size_t capacity = 256;
+    unsigned char *buffer = map->allocator.alloc(capacity, map->allocator.context);
+    if (buffer == NULL) {
+        return false;
+    }
+    bool success = true;
+    for (size_t i = 0; success && i < num_stored_entries(map); ++i) {
+        unsigned char *entry = stored_entry(map, i);
+        if (entry != NULL) {
+            success = snapshot_write_item(writer, map, key_serializer, map->key_copy_size, entry_key(map, entry),
+                        &buffer, &capacity)
+                && snapshot_write_item(writer, map, value_serializer, map->value_copy_size, entry_value(map, entry),
+                        &buffer, &capacity);
+        }
+    }
+    map->allocator.free(buffer, capacity, map->allocator.context);
+    return success;
+}
 
-#define UNREACHABLE(msg)      \
-    do {                      \
-        assert(false && msg); \
-        abort();              \
-    } while (0)
+bool hashmap_save(Hashmap *map, int fd, SerializeFunction key_serializer, SerializeFunction value_serializer) {
+    VALIDATE_HASHMAP(map);
 
-typedef struct HashmapEntryInternal {
-    HashmapEntry entry;
-    hash_t hash;
-} HashmapEntryInternal;
+    if (!map->flat && ((key_serializer == NULL && map->key_copy_size == NULL)
+                || (value_serializer == NULL && map->value_copy_size == NULL))) {
+        return false;
+    }
 
-struct Hashmap {
-    size_t size;
-    size_t capacity;
-    HashFunction hash;
-    CompareFunction equal;
-    HashmapEntryInternal *entries;
-};
+    /* Only `table` is written */
+    hashmap_migrate(map, (size_t)-1);
+    Table *table = &map->table;
 
-static void mark_uninitialized(HashmapEntryInternal *entry) {
-    entry->entry.key = NULL;
-    entry->entry.value = NULL;
-}
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.flat = map->flat;
+    header.ordered = map->ordered;
+    header.key_size = map->key_size;
+    header.value_size = map->value_size;
+    header.key_offset = map->key_offset;
+    header.value_offset = map->value_offset;
+    header.entry_size = map->entry_size;
+    header.slot_size = map->slot_size;
+    header.max_load_factor = map->sizing.max_load_factor;
+    header.size = table->size;
+    header.capacity = table->capacity;
+    header.dense_size = map->ordered ? map->dense.size : 0;
 
-static bool is_initialized(HashmapEntryInternal *entry) {
-    bool initialized = (entry->entry.key != NULL);
-    assert((initialized || entry->entry.value == NULL)
-        && "When an entry is uninitialized, both key and value should be NULL");
-    return initialized;
-}
+    size_t table_offset = align_up(sizeof(header), SNAPSHOT_ALIGNMENT);
+    size_t table_bytes = table->capacity == 0 ? 0 : table->capacity * (map->slot_size + 1) + SNAPSHOT_MIRRORED_CTRL;
+    size_t dense_offset = align_up(table_offset + table_bytes, SNAPSHOT_ALIGNMENT);
+    size_t data_offset = align_up(dense_offset + header.dense_size * (map->entry_size + 1), SNAPSHOT_ALIGNMENT);
+    header.table_offset = table_offset;
+    header.dense_offset = dense_offset;
+    header.data_offset = data_offset;
 
-#ifdef CONSISTENCY_CHECKS
-static void validate_hashmap(Hashmap *map) {
-    /* We need to guard against infinite recursion */
-    static bool recursion_guard = false;
-    if (recursion_guard) {
-        return;
+    SnapshotWriter writer = { fd, NULL, 0, sizeof(header), SNAPSHOT_MAGIC, false };
+    writer.buffer = map->allocator.alloc(SNAPSHOT_BLOCK_SIZE, map->allocator.context);
+    if (writer.buffer == NULL) {
+        return false;
     }
-    recursion_guard = true;
-
-    assert(map->size <= map->capacity && "Size should never exceed the capacity");
-    assert(map->hash != NULL && "Hash function should never be NULL");
-    assert(map->equal != NULL && "Equality function should never be NULL");
+    /* The header is written again at the end, once the checksum is known */
+    writer.failed = !write_all(fd, &header, sizeof(header), 0);
 
-    if (map->capacity == 0) {
-        assert(map->entries == NULL && "If capacity is 0, entries should be NULL");
+    snapshot_pad(&writer, table_offset);
+    if (map->ordered) {
+        for (size_t i = 0; i < table->capacity; ++i) {
+            if (is_initialized(table, i)) {
+                snapshot_write(&writer, table_entry(table, i), map->slot_size);
+            } else {
+                snapshot_pad(&writer, writer.offset + map->slot_size);
+            }
+        }
     } else {
-        assert(map->entries != NULL && "If capacity is not 0, entries should not be NULL");
+        snapshot_write_entries(&writer, map, key_serializer, value_serializer, data_offset);
     }
-
-    unsigned int initialized_entries = 0;
-    for (size_t i = 0; i < map->capacity; ++i) {
-        HashmapEntryInternal *entry = &map->entries[i];
-        if (is_initialized(entry)) {
-            initialized_entries += 1;
-            assert(entry->hash == map->hash(entry->entry.key)
-                    && "Hash should match");
-            /* If the entry is initialized, we should be able to find it */
-            Value *value = hashmap_get(map, entry->entry.key);
-            assert(value == entry->entry.value
-                    && "Initialized entry should be retrievable");
+    if (table->capacity != 0) {
+        snapshot_write_flags(&writer, table->ctrl, table->pages, table->page_shift, table->capacity);
+        for (size_t i = 0; i < SNAPSHOT_MIRRORED_CTRL; ++i) {
+            snapshot_write(&writer, table_ctrl(table, i % table->capacity), 1);
         }
     }
-    assert(initialized_entries == map->size
-            && "Number of initialized entries should be equal to the size");
 
-    recursion_guard = false;
+    snapshot_pad(&writer, dense_offset);
+    if (map->ordered) {
+        snapshot_write_entries(&writer, map, key_serializer, value_serializer, data_offset);
+        snapshot_write_flags(&writer, (unsigned char *)map->dense.live, map->dense.pages, map->dense.page_shift,
+                map->dense.size);
+    }
+
+    snapshot_pad(&writer, data_offset);
+    bool success = map->flat || snapshot_write_data(&writer, map, key_serializer, value_serializer);
+    snapshot_flush(&writer);
+    map->allocator.free(writer.buffer, SNAPSHOT_BLOCK_SIZE, map->allocator.context);
+
+    header.file_size = writer.offset;
+    header.checksum = snapshot_checksum(writer.checksum, &header, sizeof(header));
+    /* The file may have been longer before, and its size has to match the header */
+    return success && !writer.failed && ftruncate(fd, (off_t)writer.offset) == 0
+        && write_all(fd, &header, sizeof(header), 0);
 }
-#endif
 
 /**
- * Initialize a hash map with a given capacity.
- *
- * Returns true if the initialization was successful, false otherwise.
- * If the initialization fails, the hash map is left in an undefined state.
+ * Whether the `length` bytes at `offset` are within a file of `file_size`
+ * bytes, without overflowing.
  */
-static bool hashmap_init_with_capacity(Hashmap *hashmap, Hasher hasher, size_t capacity) {
-    hashmap->size = 0;
-    hashmap->capacity = capacity;
-    hashmap->hash = hasher.hash;
-    hashmap->equal = hasher.equal;
+static bool snapshot_contains(uint64_t file_size, uint64_t offset, uint64_t length) {
+    return offset <= file_size && length <= file_size - offset;
+}
 
-    if (capacity == 0) {
-        hashmap->entries = NULL;
-    } else {
-        hashmap->entries = malloc(hashmap->capacity * sizeof(*hashmap->entries));
-        if (hashmap->entries == NULL) {
-            return false;
-        }
-        for (size_t i = 0; i < hashmap->capacity; ++i) {
-            mark_uninitialized(&hashmap->entries[i]);
-        }
+/**
+ * Whether `count` entries of `size` bytes with a control byte or live flag
+ * each, followed by `extra` bytes, are within a file of `file_size` bytes
+ * from `offset` on, without overflowing.
+ */
+static bool snapshot_contains_array(uint64_t file_size, uint64_t offset, uint64_t count, uint64_t size,
+        uint64_t extra) {
+    if (extra > file_size || size >= file_size || (count != 0 && count > (file_size - extra) / (size + 1))) {
+        return false;
     }
-
-    VALIDATE_HASHMAP(hashmap);
-
-    return true;
+    return snapshot_contains(file_size, offset, count * (size + 1) + extra);
 }
 
-static void hashmap_init(Hashmap *map, Hasher hasher) {
-    bool success = hashmap_init_with_capacity(map, hasher, 0);
-    assert(success && "initializing a hashmap with capacity 0 should always succeed");
-}
+/**
+ * Check the header and the checksum of a file written by `hashmap_save`.
+ */
+static bool snapshot_valid(const unsigned char *mapping, size_t file_size, SnapshotHeader *header) {
+    if (file_size < sizeof(*header)) {
+        return false;
+    }
+    memcpy(header, mapping, sizeof(*header));
+    if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION || header->file_size != file_size) {
+        return false;
+    }
 
-static HashmapEntryInternal *hashmap_entry_find(Hashmap *map, Key *key) {
-    VALIDATE_HASHMAP(map);
+    uint64_t checksum = SNAPSHOT_MAGIC;
+    for (size_t offset = sizeof(*header); offset < file_size; offset += SNAPSHOT_BLOCK_SIZE) {
+        size_t length = file_size - offset < SNAPSHOT_BLOCK_SIZE ? file_size - offset : SNAPSHOT_BLOCK_SIZE;
+        checksum = snapshot_checksum(checksum, mapping + offset, length);
+    }
+    SnapshotHeader unchecked = *header;
+    unchecked.checksum = 0;
+    if (snapshot_checksum(checksum, &unchecked, sizeof(unchecked)) != header->checksum) {
+        return false;
+    }
 
-    assert(key != NULL);
+    /* A file with a valid checksum was written by `hashmap_save`, but maybe by a different build */
+    uint64_t capacity = header->capacity;
+    return (capacity & (capacity - 1)) == 0 && header->size <= capacity
+        && header->slot_size <= header->entry_size
+        && snapshot_contains_array(file_size, header->table_offset, capacity, header->slot_size,
+                capacity == 0 ? 0 : SNAPSHOT_MIRRORED_CTRL)
+        && snapshot_contains_array(file_size, header->dense_offset, header->dense_size, header->entry_size, 0)
+        && header->data_offset <= file_size;
+}
 
-    if (map->capacity == 0) {
+/**
+ * Create a read-only map whose tables point into a valid file written by
+ * `hashmap_save`, see `hashmap_open_mapped`.
+ *
+ * Returns NULL if the file was written by a build with a different entry
+ * layout, or the map could not be created.
+ */
+static Hashmap *snapshot_map(Hasher hasher, const SnapshotHeader *header, unsigned char *mapping, size_t file_size) {
+    HashmapOptions options = {
+        .max_load_factor = header->max_load_factor,
+        .key_size = header->flat ? header->key_size : 0,
+        .value_size = header->flat ? header->value_size : 0,
+        .ordered = header->ordered != 0,
+    };
+    Hashmap *map = hashmap_create_with_options(hasher, options);
+    if (map == NULL) {
+        return NULL;
+    }
+    if (map->key_size != header->key_size || map->value_size != header->value_size
+            || map->key_offset != header->key_offset || map->value_offset != header->value_offset
+            || map->entry_size != header->entry_size || map->slot_size != header->slot_size) {
+        hashmap_destroy(map, NULL, NULL);
         return NULL;
     }
 
-    hash_t hash = map->hash(key);
-    size_t start_index = hash % map->capacity;
-
-#define LOOP_BODY                                       \
-        HashmapEntryInternal *entry = &map->entries[i]; \
-        if (!is_initialized(entry)) {                   \
-            return NULL;                                \
-        }                                               \
-        if (hash == entry->hash                         \
-                && map->equal(key, entry->entry.key)) { \
-            return entry;                               \
-        }
+    map->mapping = mapping;
+    map->mapping_size = file_size;
+    map->read_only = true;
 
-    for (size_t i = start_index; i < map->capacity; ++i) {
-        LOOP_BODY
+    Table *table = &map->table;
+    table->size = header->size;
+    table->capacity = header->capacity;
+    if (table->capacity != 0) {
+        table->entries = mapping + header->table_offset;
+        table->ctrl = (ctrl_t *)(table->entries + table->capacity * table->entry_size);
     }
+    map->max_size = hashmap_max_size(&map->sizing, table->capacity);
+    map->min_size = hashmap_min_size(&map->sizing, table->capacity);
 
-    for (size_t i = 0; i < start_index; ++i) {
-        LOOP_BODY
+    if (map->ordered) {
+        Dense *dense = &map->dense;
+        dense->size = header->dense_size;
+        /* Nothing is ever appended, see `Dense` */
+        dense->capacity = map->max_size;
+        dense->entries = mapping + header->dense_offset;
+        dense->live = (bool *)(dense->entries + dense->size * dense->entry_size);
     }
-
-#undef LOOP_BODY
-
-    return NULL;
+    return map;
 }
 
-static bool increase_capacity_if_necessary(Hashmap *map) {
-    VALIDATE_HASHMAP(map);
+/**
+ * Whether the key or value whose offset is stored at `field` in an entry of a
+ * mapped non-flat map, and its size before it, are within the data section of
+ * the file, see `SnapshotHeader`.
+ */
+static bool snapshot_item_valid(Hashmap *map, const unsigned char *field, uint64_t data_offset) {
+    uintptr_t offset;
+    memcpy(&offset, field, sizeof(offset));
+    size_t size_bytes = align_up(sizeof(uint64_t), MAX_ALIGNMENT);
+    if (offset % MAX_ALIGNMENT != 0 || offset < data_offset || offset - data_offset < size_bytes
+            || offset > map->mapping_size) {
+        return false;
+    }
+    uint64_t size;
+    memcpy(&size, map->mapping + offset - size_bytes, sizeof(size));
+    return snapshot_contains(map->mapping_size, offset, size);
+}
 
-    if ((map->size + 1) * RECIPROCAL_LOAD_FACTOR > map->capacity) {
-        size_t old_size = map->size;
-        size_t old_capacity = map->capacity;
-        HashmapEntryInternal *old_entries = map->entries;
-
-        Hasher hasher = {
-            .hash = map->hash,
-            .equal = map->equal,
-        };
-        size_t new_capacity;
-        if (old_capacity == 0) {
-            new_capacity = INITIAL_CAPACITY;
-        } else {
-            new_capacity = 2 * old_capacity;
-        }
-        bool success = hashmap_init_with_capacity(map, hasher, new_capacity);
-        if (!success) {
-            /* If the initialization fails, we revert to the old state */
-            map->size = old_size;
-            map->capacity = old_capacity;
-            map->hash = hasher.hash;
-            map->equal = hasher.equal;
-            map->entries = old_entries;
-
-            VALIDATE_HASHMAP(map);
+/**
+ * Whether every entry of a mapped map only refers to bytes within the file:
+ * the slots of ordered maps to dense entries, and the entries of non-flat maps
+ * to keys and values in the data section. Otherwise, a lookup could read past
+ * the end of the mapping.
+ */
+static bool snapshot_entries_valid(Hashmap *map, uint64_t data_offset) {
+    Table *table = &map->table;
+    for (size_t i = 0; map->ordered && i < table->capacity; ++i) {
+        if (is_initialized(table, i) && slot_position(table_entry(table, i)) >= map->dense.size) {
+            return false;
+        }
+    }
+    for (size_t i = 0; !map->flat && i < num_stored_entries(map); ++i) {
+        unsigned char *entry = stored_entry(map, i);
+        if (entry != NULL && (!snapshot_item_valid(map, entry + map->key_offset, data_offset)
+                    || !snapshot_item_valid(map, entry + map->value_offset, data_offset))) {
             return false;
         }
+    }
+    return true;
+}
 
-        /* And then copy all the elements into the newly allocated memory */
-        for (size_t i = 0; i < old_capacity; ++i) {
-            HashmapEntryInternal *entry = &old_entries[i];
-            if (is_initialized(entry)) {
-                bool inserted = hashmap_insert(map, entry->entry.key, entry->entry.value, NULL);
-                assert(inserted && "inserting an element into a larger map should always succeed");
-            }
+/**
+ * Whether `hasher` computes the hash cached in the first entry of the map.
+ */
+static bool snapshot_hasher_matches(Hashmap *map) {
+    Table *table = &map->table;
+    for (size_t i = 0; i < table->capacity; ++i) {
+        if (is_initialized(table, i)) {
+            unsigned char *entry = slot_entry(map, table_entry(table, i));
+            return hashmap_hash(map, entry_key(map, entry)) == entry_hash(entry);
         }
+    }
+    return true;
+}
 
-        assert(map->size == old_size
-                && "after moving, the size should still be the same");
+Hashmap *hashmap_open_mapped(Hasher hasher, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size <= 0 || (uintmax_t)status.st_size > SIZE_MAX) {
+        close(fd);
+        return NULL;
+    }
+    size_t file_size = (size_t)status.st_size;
+    void *mapping = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
 
-        free(old_entries);
+    SnapshotHeader header;
+    Hashmap *map = NULL;
+    if (snapshot_valid(mapping, file_size, &header)) {
+        map = snapshot_map(hasher, &header, mapping, file_size);
+    }
+    if (map == NULL) {
+        munmap(mapping, file_size);
+        return NULL;
+    }
+    if (!snapshot_entries_valid(map, header.data_offset) || !snapshot_hasher_matches(map)) {
+        /* Not `hashmap_destroy`, which would check the hashes */
+        hashmap_free_header(map);
+        munmap(mapping, file_size);
+        return NULL;
     }
 
     VALIDATE_HASHMAP(map);
-    return true;
+    return map;
 }
 
+#endif
+
+#ifdef HASHMAP_CONCURRENT
+
 /**
- * This is the djb2 string hash function
- * from http://www.cse.yorku.ca/~oz/hash.html
+ * A lookup counter, padded so that lookups in different threads usually do
+ * not write to the same cache line.
  */
-hash_t string_hash(void *key) {
-    unsigned char *str = (unsigned char *)key;
+typedef struct ReaderCounter {
+    size_t count;
+    unsigned char padding[CACHE_LINE_SIZE - sizeof(size_t)];
+} ReaderCounter;
+
+/**
+ * The hashmap is only changed while `lock` is held, and `sequence` is odd
+ * while it is being changed. A lookup reads `sequence`, probes the table and
+ * only trusts its result if `sequence` is still the same afterwards. Lookups
+ * only read the table with atomic loads, starting from `entries`, `ctrl` and
+ * `capacity`, which writers publish before making `sequence` even again.
+ *
+ * Lookups also register themselves in `readers`, in the counters of the
+ * current `epoch`. When the map frees memory, e.g. the old table after
+ * growing, it first moves on to the next epoch and waits until all lookups of
+ * the previous one are done, see `concurrent_hashmap_synchronize`. Hence a
+ * lookup can read the table even while it is being replaced. This is done by
+ * the allocator of `map`, see `concurrent_free`.
+ */
+struct ConcurrentHashmap {
+    Hashmap *map;
+    pthread_mutex_t lock;
+    size_t sequence;
+    /* The table of `map` as of the last write, see `concurrent_write_end` */
+    unsigned char *entries;
+    ctrl_t *ctrl;
+    size_t capacity;
+    size_t epoch;
+    /* The counters of the even and odd epochs */
+    ReaderCounter readers[2][READER_STRIPES];
+};
 
-    hash_t hash = 5381;
-    hash_t c;
+/**
+ * The counter a lookup in the current thread registers itself in.
+ *
+ * Threads are told apart by their stacks, which are far apart, so that
+ * lookups in different threads rarely share a counter.
+ */
+static size_t reader_stripe(void) {
+    unsigned char local;
+    uintptr_t address = (uintptr_t)&local;
+    return (size_t)((address >> 16) * 0x9E3779B1u >> 16) % READER_STRIPES;
+}
 
-    while ((c = *str++)) {
-        hash = ((hash << 5) + hash) + c;
+static size_t readers_in_epoch(ConcurrentHashmap *map, size_t parity) {
+    size_t count = 0;
+    for (size_t i = 0; i < READER_STRIPES; ++i) {
+        count += __atomic_load_n(&map->readers[parity][i].count, __ATOMIC_SEQ_CST);
     }
+    return count;
+}
 
-    return hash;
+/**
+ * Move on to the next epoch and wait until the lookups of the previous one are
+ * done. New lookups register in the next epoch, so this does not wait for
+ * them. Has to be called with the lock held, so that the epoch only moves on
+ * once at a time. This includes `concurrent_free`, so the map may only free
+ * memory while the lock is held, see `concurrent_hashmap_destroy`.
+ */
+static void concurrent_wait_for_readers(ConcurrentHashmap *map) {
+    size_t epoch = __atomic_load_n(&map->epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&map->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    while (readers_in_epoch(map, epoch & 1) != 0) {
+        sched_yield();
+    }
 }
 
-bool string_equal(void *key1, void *key2) {
-    return strcmp((char *)key1, (char *)key2) == 0;
+void concurrent_hashmap_synchronize(ConcurrentHashmap *map) {
+    pthread_mutex_lock(&map->lock);
+    concurrent_wait_for_readers(map);
+    pthread_mutex_unlock(&map->lock);
 }
 
-Hashmap *hashmap_create(Hasher hasher) {
-    Hashmap *hashmap = malloc(sizeof(*hashmap));
-    if (hashmap == NULL) {
+static void *concurrent_alloc(size_t size, void *context) {
+    (void)context;
+    return malloc(size);
+}
+
+/**
+ * Free memory of the map only once no lookup can be reading it anymore.
+ */
+static void concurrent_free(void *pointer, size_t size, void *context) {
+    (void)size;
+    /* The map only frees memory while the lock is held */
+    concurrent_wait_for_readers(context);
+    free(pointer);
+}
+
+ConcurrentHashmap *concurrent_hashmap_create(Hasher hasher) {
+    ConcurrentHashmap *map = malloc(sizeof(*map));
+    if (map == NULL) {
         return NULL;
     }
-    hashmap_init(hashmap, hasher);
+    memset(map, 0, sizeof(*map));
+    if (pthread_mutex_init(&map->lock, NULL) != 0) {
+        free(map);
+        return NULL;
+    }
+    HashmapAllocator allocator = {
+        .alloc = concurrent_alloc,
+        .free = concurrent_free,
+        .context = map,
+    };
+    map->map = hashmap_create_with_allocator(hasher, (HashmapOptions) { 0 }, allocator);
+    if (map->map == NULL) {
+        pthread_mutex_destroy(&map->lock);
+        free(map);
+        return NULL;
+    }
+    return map;
+}
 
-    VALIDATE_HASHMAP(hashmap);
-    return hashmap;
+/**
+ * Take the lock and make `sequence` odd, so that lookups from now on retry.
+ */
+static void concurrent_write_begin(ConcurrentHashmap *map) {
+    pthread_mutex_lock(&map->lock);
+    __atomic_store_n(&map->sequence, map->sequence + 1, __ATOMIC_RELAXED);
+    /* The changes to the map may not become visible before `sequence` */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 }
 
-bool hashmap_insert(Hashmap *map, Key *key, Value *value, Value **entry) {
-    VALIDATE_HASHMAP(map);
+/**
+ * Publish the table for lookups, make `sequence` even again and release the
+ * lock.
+ */
+static void concurrent_write_end(ConcurrentHashmap *map) {
+    Table *table = &map->map->table;
+    assert(table->pages == NULL && !is_resizing(map->map) && !map->map->flat
+            && "Lookups only probe a single table of pointers");
+    __atomic_store_n(&map->entries, table->entries, __ATOMIC_RELAXED);
+    __atomic_store_n(&map->ctrl, table->ctrl, __ATOMIC_RELAXED);
+    __atomic_store_n(&map->capacity, table->capacity, __ATOMIC_RELAXED);
+    __atomic_store_n(&map->sequence, map->sequence + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&map->lock);
+}
 
-    assert(key != NULL);
-    assert(value != NULL);
+bool concurrent_hashmap_insert(ConcurrentHashmap *map, Key *key, Value *value, Value **entry) {
+    concurrent_write_begin(map);
+    bool inserted = hashmap_insert(map->map, key, value, entry);
+    concurrent_write_end(map);
+    return inserted;
+}
 
-    bool success = increase_capacity_if_necessary(map);
-    if (!success) {
-        if (entry != NULL) {
-            *entry = NULL;
-        }
-        VALIDATE_HASHMAP(map);
+bool concurrent_hashmap_remove(ConcurrentHashmap *map, Key *key, HashmapEntry *entry) {
+    concurrent_write_begin(map);
+    bool removed = hashmap_remove(map->map, key, entry);
+    concurrent_write_end(map);
+    return removed;
+}
+
+size_t concurrent_hashmap_size(ConcurrentHashmap *map) {
+    pthread_mutex_lock(&map->lock);
+    size_t size = hashmap_size(map->map);
+    pthread_mutex_unlock(&map->lock);
+    return size;
+}
+
+/**
+ * Whether no writer started since `sequence` was read, so that everything
+ * read since then is consistent.
+ */
+static bool concurrent_unchanged(ConcurrentHashmap *map, size_t sequence) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&map->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+/**
+ * Look for a key like `table_probe` in the published table, while a writer
+ * may be changing it. `sequence` is the even sequence number read before.
+ *
+ * Everything is read with atomic loads and nothing that is read is trusted:
+ * the control bytes and hashes are only used to decide where to look next,
+ * and the probe gives up after looking at every entry once. Before the key of
+ * an entry is passed to the equality function, the sequence is checked again,
+ * so it is never called on a key that was read while the entry was being
+ * moved. Keys that are removed later are not freed yet, see
+ * `concurrent_hashmap_remove`.
+ *
+ * Returns false if a writer changed the table in the meantime. Otherwise,
+ * `*value` is set to the value of the key or NULL.
+ */
+static bool table_probe_concurrent(ConcurrentHashmap *map, size_t sequence, Key *key, hash_t hash, Value **value) {
+    Hashmap *hashmap = map->map;
+    unsigned char *entries = __atomic_load_n(&map->entries, __ATOMIC_RELAXED);
+    ctrl_t *ctrl = __atomic_load_n(&map->ctrl, __ATOMIC_RELAXED);
+    size_t capacity = __atomic_load_n(&map->capacity, __ATOMIC_RELAXED);
+    /* The three may come from different tables, don't look at them before */
+    if (!concurrent_unchanged(map, sequence)) {
         return false;
     }
 
-    hash_t hash = map->hash(key);
-    size_t start_index = hash % map->capacity;
+    *value = NULL;
+    if (capacity == 0) {
+        return true;
+    }
+    size_t mask = capacity - 1;
+    size_t preferred_index = hash & mask;
+    ctrl_t tag = hashmap_hash_tag(hash);
+    for (size_t distance = 0; distance <= mask; ++distance) {
+        size_t i = (preferred_index + distance) & mask;
+        ctrl_t current_ctrl = __atomic_load_n(&ctrl[i], __ATOMIC_RELAXED);
+        if (current_ctrl == CTRL_EMPTY) {
+            break;
+        }
+        unsigned char *entry = entries + i * hashmap->slot_size;
+        hash_t other_hash = __atomic_load_n((hash_t *)entry, __ATOMIC_RELAXED);
+        if (((i - other_hash) & mask) < distance) {
+            /* Because of the Robin Hood ordering, our key cannot come later */
+            break;
+        }
+        if (current_ctrl == tag && other_hash == hash) {
+            Key *other_key = __atomic_load_n((Key **)(entry + hashmap->key_offset), __ATOMIC_RELAXED);
+            Value *other_value = __atomic_load_n((Value **)(entry + hashmap->value_offset), __ATOMIC_RELAXED);
+            if (!concurrent_unchanged(map, sequence)) {
+                return false;
+            }
+            COUNT(hashmap, equal_calls, 1);
+            if (hashmap->equal(key, other_key)) {
+                *value = other_value;
+                return true;
+            }
+        }
+    }
+    return concurrent_unchanged(map, sequence);
+}
+
+Value *concurrent_hashmap_get(ConcurrentHashmap *map, Key *key) {
+    assert(key != NULL);
 
-#define INSERT_IF_POSSIBLE                                                \
-        HashmapEntryInternal *bucket = &map->entries[i];                  \
-                                                                          \
-        if (!is_initialized(bucket)) {                                    \
-            /* We found a free slot to insert our new entry */            \
-                                                                          \
-            bucket->entry.key = key;                                      \
-            bucket->entry.value = value;                                  \
-            bucket->hash = hash;                                          \
-            map->size += 1;                                               \
-                                                                          \
-            if (entry != NULL) {                                          \
-                *entry = bucket->entry.value;                             \
-            }                                                             \
-                                                                          \
-            VALIDATE_HASHMAP(map);                                        \
-            return true;                                                  \
-        }                                                                 \
-                                                                          \
-        if (hash == bucket->hash && map->equal(key, bucket->entry.key)) { \
-            /* An entry with the same key already exists */               \
-            if (entry != NULL) {                                          \
-                *entry = bucket->entry.value;                             \
-            }                                                             \
-                                                                          \
-            VALIDATE_HASHMAP(map);                                        \
-            return false;                                                 \
+    hash_t hash = hashmap_hash(map->map, key);
+    size_t stripe = reader_stripe();
+    for (size_t attempt = 0; attempt < CONCURRENT_GET_ATTEMPTS; ++attempt) {
+        size_t epoch = __atomic_load_n(&map->epoch, __ATOMIC_SEQ_CST);
+        size_t *readers = &map->readers[epoch & 1][stripe].count;
+        __atomic_fetch_add(readers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&map->epoch, __ATOMIC_SEQ_CST) != epoch) {
+            /* A writer may already be waiting for the lookups of this epoch */
+            __atomic_fetch_sub(readers, 1, __ATOMIC_SEQ_CST);
+            continue;
         }
 
-    for (size_t i = start_index; i < map->capacity; ++i) {
-        INSERT_IF_POSSIBLE
-    }
+        Value *value = NULL;
+        bool consistent = false;
+        size_t sequence = __atomic_load_n(&map->sequence, __ATOMIC_ACQUIRE);
+        if (sequence % 2 == 0) {
+            consistent = table_probe_concurrent(map, sequence, key, hash, &value);
+        }
 
-    for (size_t i = 0; i < start_index; ++i) {
-        INSERT_IF_POSSIBLE
+        /* Never wait for a writer while registered, it may be waiting for us */
+        __atomic_fetch_sub(readers, 1, __ATOMIC_SEQ_CST);
+        if (consistent) {
+            return value;
+        }
+        sched_yield();
     }
 
-#undef INSERT_IF_POSSIBLE
+    /* The map keeps changing, wait for the writers instead */
+    pthread_mutex_lock(&map->lock);
+    Value *value = hashmap_get_hashed(map->map, key, hash);
+    pthread_mutex_unlock(&map->lock);
+    return value;
+}
 
-    UNREACHABLE("Unreachable: There should always be some capacity left");
+void concurrent_hashmap_destroy(ConcurrentHashmap *map, void (*destroy_key)(Key *), void (*destroy_value)(Value *)) {
+    /* Freeing the tables waits for readers, which needs the lock */
+    pthread_mutex_lock(&map->lock);
+    hashmap_destroy(map->map, destroy_key, destroy_value);
+    pthread_mutex_unlock(&map->lock);
+    pthread_mutex_destroy(&map->lock);
+    free(map);
 }
 
-Value *hashmap_get(Hashmap *map, Key *key) {
-    assert(key != NULL);
+#endif
 
-    HashmapEntryInternal *entry = hashmap_entry_find(map, key);
-    if (entry == NULL) {
-        return NULL;
-    } else {
-        return entry->entry.value;
+#ifdef HASHMAP_PTHREADS
+
+/**
+ * A shard of a `ShardedHashmap`, padded to whole cache lines so that threads
+ * working on different shards do not write to the same cache line.
+ */
+typedef struct Shard {
+    pthread_mutex_t lock;
+    Hashmap *map;
+    unsigned char padding[CACHE_LINE_SIZE - (sizeof(pthread_mutex_t) + sizeof(Hashmap *)) % CACHE_LINE_SIZE];
+} Shard;
+
+struct ShardedHashmap {
+    /* Aligned to a cache line, see `Shard` */
+    Shard *shards;
+    size_t num_shards;
+    /* The number of hash bits that select the shard, see `shard_index` */
+    unsigned int shard_bits;
+};
+
+/**
+ * The shard a key with the given hash belongs to.
+ *
+ * The index into the table of a shard is taken from the low bits of the hash,
+ * and its control bytes from the top 7 bits (see `hashmap_hash_tag`). The shard is
+ * taken from the top bits of the hash multiplied by a large odd number
+ * instead, which depend on all bits of the hash, so that the keys of a shard
+ * still spread over its whole table and have all control bytes.
+ */
+static size_t shard_index(ShardedHashmap *map, hash_t hash) {
+    if (map->shard_bits == 0) {
+        return 0;
     }
+    return (size_t)(((uint64_t)hash * 0x9E3779B97F4A7C15ull) >> (64 - map->shard_bits));
 }
 
-bool hashmap_remove(Hashmap *map, Key *key, HashmapEntry *entry) {
-    VALIDATE_HASHMAP(map);
+static void sharded_free(ShardedHashmap *map, size_t num_shards) {
+    for (size_t i = 0; i < num_shards; ++i) {
+        pthread_mutex_destroy(&map->shards[i].lock);
+        hashmap_destroy(map->shards[i].map, NULL, NULL);
+    }
+    free(map->shards);
+    free(map);
+}
 
-    HashmapEntryInternal *to_remove = hashmap_entry_find(map, key);
-    if (to_remove == NULL) {
-        return false;
+ShardedHashmap *sharded_hashmap_create(Hasher hasher, size_t num_shards) {
+    if (num_shards == 0 || num_shards > MAX_SHARDS) {
+        return NULL;
     }
 
-    if (entry != NULL) {
-        *entry = to_remove->entry;
-    }
-
-    HashmapEntryInternal *to_replace = to_remove;
-
-#define LOOP_BODY                                                                         \
-        if (!is_initialized(current)) {                                                   \
-            mark_uninitialized(to_replace);                                               \
-            map->size -= 1;                                                               \
-                                                                                          \
-            VALIDATE_HASHMAP(map);                                                        \
-            return true;                                                                  \
-        }                                                                                 \
-                                                                                          \
-        /* This cast is safe because current is always within the bounds */               \
-        size_t current_index = (size_t)(current - map->entries);                          \
-        size_t to_replace_index = (size_t)(to_replace - map->entries);                    \
-        size_t preferred_index = current->hash % map->capacity;                           \
-        if (to_replace_index < current_index) {                                           \
-            /* No wrap-around */                                                          \
-            if (preferred_index <= to_replace_index || preferred_index > current_index) { \
-                *to_replace = *current;                                                   \
-                to_replace = current;                                                     \
-            }                                                                             \
-        } else {                                                                          \
-            /* We wrapped around */                                                       \
-            assert(to_replace_index > current_index);                                     \
-            if (preferred_index > current_index && preferred_index <= to_replace_index) { \
-                *to_replace = *current;                                                   \
-                to_replace = current;                                                     \
-            }                                                                             \
-        }
-
-    HashmapEntryInternal *end = map->entries + map->capacity;
-    for (HashmapEntryInternal *current = to_remove + 1; current != end; ++current) {
-        LOOP_BODY
-    }
-
-    end = to_remove;
-    for (HashmapEntryInternal *current = map->entries; current != end; ++current) {
-        LOOP_BODY
-    }
-#undef LOOP_BODY
-    
-    UNREACHABLE("Unreachable: The hashmap is never completely full");
+    ShardedHashmap *map = malloc(sizeof(*map));
+    if (map == NULL) {
+        return NULL;
+    }
+    map->shard_bits = 0;
+    while (((size_t)1 << map->shard_bits) < num_shards) {
+        map->shard_bits += 1;
+    }
+    map->num_shards = (size_t)1 << map->shard_bits;
+
+    void *shards;
+    if (posix_memalign(&shards, CACHE_LINE_SIZE, map->num_shards * sizeof(Shard)) != 0) {
+        free(map);
+        return NULL;
+    }
+    map->shards = shards;
+    for (size_t i = 0; i < map->num_shards; ++i) {
+        Shard *shard = &map->shards[i];
+        shard->map = hashmap_create(hasher);
+        if (shard->map == NULL) {
+            sharded_free(map, i);
+            return NULL;
+        }
+        if (pthread_mutex_init(&shard->lock, NULL) != 0) {
+            hashmap_destroy(shard->map, NULL, NULL);
+            sharded_free(map, i);
+            return NULL;
+        }
+    }
+    return map;
 }
 
-size_t hashmap_size(Hashmap *map) {
-    return map->size;
+/**
+ * Hash the key and lock the shard it belongs to.
+ */
+static Shard *shard_lock(ShardedHashmap *map, Key *key, hash_t *hash) {
+    assert(key != NULL);
+    /* All shards hash the same way */
+    *hash = hashmap_hash(map->shards[0].map, key);
+    Shard *shard = &map->shards[shard_index(map, *hash)];
+    pthread_mutex_lock(&shard->lock);
+    return shard;
 }
 
-void hashmap_destroy(Hashmap *map, void (*destroy_key)(Key *), void (*destroy_value)(Value *)) {
-    VALIDATE_HASHMAP(map);
+bool sharded_hashmap_insert(ShardedHashmap *map, Key *key, Value *value, Value **entry) {
+    hash_t hash;
+    Shard *shard = shard_lock(map, key, &hash);
+    bool inserted = hashmap_insert_hashed(shard->map, key, hash, value, entry);
+    pthread_mutex_unlock(&shard->lock);
+    return inserted;
+}
 
-    /* We first clean up all the keys and values */
-    for (size_t i = 0; i < map->capacity; ++i) {
-        HashmapEntryInternal *entry = &map->entries[i];
-        if (is_initialized(entry)) {
-            if (destroy_key != NULL) {
-                destroy_key(entry->entry.key);
-            }
-            if (destroy_value != NULL) {
-                destroy_value(entry->entry.value);
-            }
-        }
+Value *sharded_hashmap_get(ShardedHashmap *map, Key *key) {
+    hash_t hash;
+    Shard *shard = shard_lock(map, key, &hash);
+    Value *value = hashmap_get_hashed(shard->map, key, hash);
+    pthread_mutex_unlock(&shard->lock);
+    return value;
+}
+
+bool sharded_hashmap_remove(ShardedHashmap *map, Key *key, HashmapEntry *entry) {
+    hash_t hash;
+    Shard *shard = shard_lock(map, key, &hash);
+    bool removed = hashmap_remove_hashed(shard->map, key, hash, entry);
+    pthread_mutex_unlock(&shard->lock);
+    return removed;
+}
+
+size_t sharded_hashmap_size(ShardedHashmap *map) {
+    size_t size = 0;
+    for (size_t i = 0; i < map->num_shards; ++i) {
+        Shard *shard = &map->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        size += hashmap_size(shard->map);
+        pthread_mutex_unlock(&shard->lock);
     }
+    return size;
+}
 
-    /* Then we clean up the hash map itself */
-    free(map->entries);
+size_t sharded_hashmap_num_shards(ShardedHashmap *map) {
+    return map->num_shards;
+}
+
+void sharded_hashmap_destroy(ShardedHashmap *map, void (*destroy_key)(Key *), void (*destroy_value)(Value *)) {
+    for (size_t i = 0; i < map->num_shards; ++i) {
+        Shard *shard = &map->shards[i];
+        pthread_mutex_destroy(&shard->lock);
+        hashmap_destroy(shard->map, destroy_key, destroy_value);
+    }
+    free(map->shards);
     free(map);
 }
 
+#endif
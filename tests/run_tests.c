@@ -1,10 +1,16 @@
+/* For mkstemp, pread and pwrite */
+#define _DEFAULT_SOURCE
 
 #include <hashmap.h>
+#include <hashmap_typed.h>
 
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define COLOR_STRING(string, color) "\033[" color "m" string "\033[0m"
 
@@ -130,89 +136,2299 @@ static bool uint_equals(void *key1, void *key2) {
     return *(unsigned int *)key1 == *(unsigned int *)key2;
 }
 
+/**
+ * Convert an unsigned integer to a string.
+ *
+ * The caller is responsible for freeing the returned string.
+ * If the conversion fails, NULL is returned.
+ */
+static char *uint_to_string(unsigned int n) {
+    int length = snprintf(NULL, 0, "%d", n);
+    assert(length > 0);
+    char *key = malloc((size_t)length + 1);
+    if (key == NULL) {
+        return NULL;
+    }
+    int num_written = snprintf(key, (size_t)length + 1, "%d", n);
+    assert(num_written == length);
+
+    return key;
+}
+
 /**
  * Insert n key-value pairs with the same hash and remove them again.
  */
-static result_t insert_remove_colliding(unsigned int n) {
+static result_t insert_remove_colliding(unsigned int n) {
+    Hasher hasher = {
+        .hash = return_0,
+        .equal = uint_equals
+    };
+
+    Hashmap *map = hashmap_create(hasher);
+    ASSERT(map != NULL);
+
+    /* Insert n key-value pairs with the same hash */
+    for (unsigned int i = 0; i < n; ++i) {
+        unsigned int *key_val = malloc(sizeof(i));
+        ASSERT(key_val != NULL);
+        *key_val = i;
+
+        /* Insert the i-th key-value pair */
+        Value *entry = NULL;
+        bool success = hashmap_insert(map, key_val, key_val, &entry);
+        ASSERT(success);
+        ASSERT(entry != NULL);
+        ASSERT(entry == key_val);
+
+        /* Verify that the entry is indeed in the map */
+        entry = hashmap_get(map, key_val);
+        ASSERT(entry != NULL);
+        ASSERT(entry == key_val);
+
+        /* Verfiy the size of the map */
+        size_t size = hashmap_size(map);
+        ASSERT(size == i + 1);
+    }
+
+    /* Remove the entries again */
+    for (unsigned int i = 0; i < n; ++i) {
+        /* Remove the i-th key-value pair */
+        HashmapEntry removed_entry;
+        bool success = hashmap_remove(map, &i, &removed_entry);
+        ASSERT(success);
+        ASSERT(removed_entry.key != NULL);
+        ASSERT(*(unsigned int *)removed_entry.key == i);
+        ASSERT(removed_entry.value != NULL);
+        ASSERT(*(unsigned int *)removed_entry.value == i);
+        ASSERT(removed_entry.key == removed_entry.value);
+
+        /* We only need to free once because the key and value are the same */
+        free(removed_entry.key);
+
+        /* Verify that the entry is no longer in the map */
+        Value *got = hashmap_get(map, &i);
+        ASSERT(got == NULL);
+
+        /* Verify the size of the map */
+        size_t size = hashmap_size(map);
+        ASSERT(size == n - i - 1);
+    }
+
+    /* We don't need to free because there are no entries left */
+    hashmap_destroy(map, NULL, NULL);
+
+    return SUCCESS;
+}
+
+static hash_t identity_hash(void *key) {
+    return *(unsigned int *)key;
+}
+
+/**
+ * With colliding keys, the i-th inserted key has probe length i + 1.
+ */
+static result_t probe_stats_colliding(unsigned int n) {
+    Hasher hasher = {
+        .hash = return_0,
+        .equal = uint_equals
+    };
+
+    unsigned int *keys = malloc((n + 1) * sizeof(*keys));
+    ASSERT(keys != NULL);
+
+    Hashmap *map = hashmap_create(hasher);
+    ASSERT(map != NULL);
+
+    HashmapProbeStats stats;
+    hashmap_probe_stats(map, &stats);
+    ASSERT(stats.max_probe_length == 0);
+    ASSERT(stats.mean_probe_length == 0.0);
+
+    for (unsigned int i = 0; i < n; ++i) {
+        keys[i] = i;
+        bool success = hashmap_insert(map, &keys[i], &keys[i], NULL);
+        ASSERT(success);
+    }
+
+    hashmap_probe_stats(map, &stats);
+    ASSERT(stats.max_probe_length == n);
+    ASSERT(stats.mean_probe_length == (double)(n + 1) / 2.0);
+
+    /* Removing the first key shifts all others back by one */
+    bool success = hashmap_remove(map, &keys[0], NULL);
+    ASSERT(success);
+    hashmap_probe_stats(map, &stats);
+    ASSERT(stats.max_probe_length == n - 1);
+
+    /* Misses have to stop despite every entry having the same hash */
+    keys[n] = n;
+    ASSERT(hashmap_get(map, &keys[n]) == NULL);
+
+    hashmap_destroy(map, NULL, NULL);
+    free(keys);
+
+    return SUCCESS;
+}
+
+/**
+ * The fields of `hashmap_stats` that are always computed, and the counters if
+ * they are enabled.
+ */
+static result_t stats_colliding(unsigned int n) {
+    Hasher hasher = {
+        .hash = return_0,
+        .equal = uint_equals
+    };
+
+    unsigned int *keys = malloc(n * sizeof(*keys));
+    ASSERT(keys != NULL);
+
+    Hashmap *map = hashmap_create(hasher);
+    ASSERT(map != NULL);
+
+    HashmapStats stats;
+    hashmap_stats(map, &stats);
+    ASSERT(stats.size == 0);
+    ASSERT(stats.max_cluster_length == 0);
+    ASSERT(stats.resizes == 0);
+
+    for (unsigned int i = 0; i < n; ++i) {
+        keys[i] = i;
+        bool success = hashmap_insert(map, &keys[i], &keys[i], NULL);
+        ASSERT(success);
+    }
+
+    hashmap_stats(map, &stats);
+    ASSERT(stats.size == n);
+    ASSERT(stats.capacity >= n);
+    ASSERT(stats.load_factor == (double)n / (double)stats.capacity);
+    /* All keys have the same preferred index */
+    ASSERT(stats.max_cluster_length == n);
+#ifdef HASHMAP_STATS
+    ASSERT(stats.enabled);
+    ASSERT(stats.resizes >= 1);
+    uint64_t misses = 0;
+    for (size_t i = 0; i < HASHMAP_PROBE_HISTOGRAM_SIZE; ++i) {
+        misses += stats.miss_probe_lengths[i];
+    }
+    ASSERT(misses == n);
+#else
+    ASSERT(!stats.enabled);
+    ASSERT(stats.hash_calls == 0);
+#endif
+
+    hashmap_stats_reset(map);
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT(hashmap_get(map, &keys[i]) == &keys[i]);
+    }
+    bool success = hashmap_remove(map, &keys[0], NULL);
+    ASSERT(success);
+
+    hashmap_stats(map, &stats);
+    ASSERT(stats.size == n - 1);
+    ASSERT(stats.max_cluster_length == n - 1);
+#ifdef HASHMAP_STATS
+    ASSERT(stats.resizes == 0);
+    ASSERT(stats.hash_calls == n + 1);
+    /* The i-th key is found after looking at i + 1 entries */
+    for (size_t i = 0; i < HASHMAP_PROBE_HISTOGRAM_SIZE - 1; ++i) {
+        uint64_t expected = (uint64_t)(i < n) + (uint64_t)(i == 0);
+        ASSERT(stats.hit_probe_lengths[i] == expected);
+    }
+    uint64_t long_hits = n > HASHMAP_PROBE_HISTOGRAM_SIZE - 1 ? n - (HASHMAP_PROBE_HISTOGRAM_SIZE - 1) : 0;
+    ASSERT(stats.hit_probe_lengths[HASHMAP_PROBE_HISTOGRAM_SIZE - 1] == long_hits);
+    /* Removing the first key shifts all others back by one */
+    ASSERT(stats.backward_shifts == n - 1);
+#endif
+
+    hashmap_destroy(map, NULL, NULL);
+    free(keys);
+    return SUCCESS;
+}
+
+static result_t options_invalid(void) {
+    HashmapOptions options = { 0 };
+
+    options.max_load_factor = 1.0;
+    ASSERT(hashmap_create_with_options(STRING_HASHER, options) == NULL);
+    options.max_load_factor = -0.5;
+    ASSERT(hashmap_create_with_options(STRING_HASHER, options) == NULL);
+
+    options.max_load_factor = 0.0;
+    options.growth_factor = 1.0;
+    ASSERT(hashmap_create_with_options(STRING_HASHER, options) == NULL);
+
+    /* Values can only be stored inline if keys are */
+    options.growth_factor = 0.0;
+    options.value_size = sizeof(int);
+    ASSERT(hashmap_create_with_options(STRING_HASHER, options) == NULL);
+
+    /* Flat maps cannot own their keys */
+    options.key_size = sizeof(int);
+    options.key_copy_size = string_size;
+    ASSERT(hashmap_create_with_options(STRING_HASHER, options) == NULL);
+    options.key_size = 0;
+    options.key_copy_size = NULL;
+
+    /* Ordered maps cannot resize incrementally */
+    options.ordered = true;
+    options.resize_step = 1;
+    ASSERT(hashmap_create_with_options(STRING_HASHER, options) == NULL);
+    options.ordered = false;
+    options.resize_step = 0;
+
+    /* Only maps of pointers can scan their entries */
+    options.scan_entries = true;
+    options.ordered = true;
+    ASSERT(hashmap_create_with_options(STRING_HASHER, options) == NULL);
+    options.ordered = false;
+    options.key_size = sizeof(int);
+    ASSERT(hashmap_create_with_options(STRING_HASHER, options) == NULL);
+    options.key_size = 0;
+    options.scan_entries = false;
+
+    /* Only flat maps may leave out the hash and equality functions */
+    options.value_size = 0;
+    Hasher no_hasher = { .hash = NULL, .equal = NULL };
+    ASSERT(hashmap_create_with_options(no_hasher, options) == NULL);
+
+    return SUCCESS;
+}
+
+/**
+ * Insert n keys into a map created with the given options, checking that the
+ * maximum load factor is respected and returning how often the map grew.
+ */
+static result_t insert_with_options(HashmapOptions options, unsigned int n, unsigned int *num_resizes) {
+    Hasher hasher = {
+        .hash = identity_hash,
+        .equal = uint_equals
+    };
+
+    unsigned int *keys = malloc(n * sizeof(*keys));
+    ASSERT(keys != NULL);
+
+    Hashmap *map = hashmap_create_with_options(hasher, options);
+    ASSERT(map != NULL);
+
+    *num_resizes = 0;
+    size_t capacity = hashmap_capacity(map);
+    for (unsigned int i = 0; i < n; ++i) {
+        keys[i] = i;
+        bool success = hashmap_insert(map, &keys[i], &keys[i], NULL);
+        ASSERT(success);
+
+        size_t new_capacity = hashmap_capacity(map);
+        if (new_capacity != capacity) {
+            ASSERT(capacity == 0 || new_capacity >= capacity * 2);
+            *num_resizes += 1;
+            capacity = new_capacity;
+        }
+        ASSERT((double)hashmap_size(map) <= (double)capacity * options.max_load_factor);
+    }
+
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT(hashmap_get(map, &i) == &keys[i]);
+    }
+
+    hashmap_destroy(map, NULL, NULL);
+    free(keys);
+
+    return SUCCESS;
+}
+
+static result_t options_initial_capacity(unsigned int n) {
+    HashmapOptions options = {
+        .initial_capacity = n,
+        .max_load_factor = 0.875,
+    };
+    unsigned int num_resizes;
+    ASSERT(insert_with_options(options, n, &num_resizes) == SUCCESS);
+    /* The map was big enough from the start */
+    ASSERT(num_resizes == 0);
+
+    return SUCCESS;
+}
+
+static result_t options_load_factor(double max_load_factor, unsigned int n) {
+    HashmapOptions options = {
+        .max_load_factor = max_load_factor,
+    };
+    unsigned int num_resizes;
+    ASSERT(insert_with_options(options, n, &num_resizes) == SUCCESS);
+
+    return SUCCESS;
+}
+
+static result_t options_growth_factor(unsigned int n) {
+    HashmapOptions options = {
+        .max_load_factor = 0.5,
+        .growth_factor = 3.0,
+    };
+    unsigned int num_resizes_by_4;
+    ASSERT(insert_with_options(options, n, &num_resizes_by_4) == SUCCESS);
+
+    options.growth_factor = 2.0;
+    unsigned int num_resizes_by_2;
+    ASSERT(insert_with_options(options, n, &num_resizes_by_2) == SUCCESS);
+
+    /* A growth factor of 3 is rounded up to 4, so the map resizes less */
+    ASSERT(num_resizes_by_4 < num_resizes_by_2);
+
+    return SUCCESS;
+}
+
+static result_t reserve_shrink_to_fit(unsigned int n) {
+    Hasher hasher = {
+        .hash = identity_hash,
+        .equal = uint_equals
+    };
+
+    unsigned int *keys = malloc(n * sizeof(*keys));
+    ASSERT(keys != NULL);
+
+    Hashmap *map = hashmap_create(hasher);
+    ASSERT(map != NULL);
+
+    /* After reserving, inserting n keys should not change the capacity */
+    ASSERT(hashmap_reserve(map, n));
+    size_t reserved_capacity = hashmap_capacity(map);
+    ASSERT(n == 0 || reserved_capacity > n);
+    for (unsigned int i = 0; i < n; ++i) {
+        keys[i] = i;
+        ASSERT(hashmap_insert(map, &keys[i], &keys[i], NULL));
+        ASSERT(hashmap_capacity(map) == reserved_capacity);
+    }
+
+    /* Reserving less than the capacity does nothing */
+    ASSERT(hashmap_reserve(map, n / 2));
+    ASSERT(hashmap_capacity(map) == reserved_capacity);
+
+    /* Remove all but a tenth of the keys, which should not shrink the map */
+    for (unsigned int i = n / 10; i < n; ++i) {
+        ASSERT(hashmap_remove(map, &keys[i], NULL));
+    }
+    ASSERT(hashmap_capacity(map) == reserved_capacity);
+
+    ASSERT(hashmap_shrink_to_fit(map));
+    ASSERT(hashmap_capacity(map) <= reserved_capacity);
+    ASSERT(n < 100 || hashmap_capacity(map) < reserved_capacity);
+    for (unsigned int i = 0; i < n; ++i) {
+        Value *expected = i < n / 10 ? &keys[i] : NULL;
+        ASSERT(hashmap_get(map, &keys[i]) == expected);
+    }
+
+    /* Shrinking an empty map frees everything */
+    for (unsigned int i = 0; i < n / 10; ++i) {
+        ASSERT(hashmap_remove(map, &keys[i], NULL));
+    }
+    ASSERT(hashmap_shrink_to_fit(map));
+    ASSERT(hashmap_capacity(map) == 0);
+
+    /* And the map is still usable afterwards */
+    if (n > 0) {
+        ASSERT(hashmap_insert(map, &keys[0], &keys[0], NULL));
+        ASSERT(hashmap_get(map, &keys[0]) == &keys[0]);
+    }
+
+    hashmap_destroy(map, NULL, NULL);
+    free(keys);
+
+    return SUCCESS;
+}
+
+static result_t automatic_shrink(unsigned int n) {
+    Hasher hasher = {
+        .hash = identity_hash,
+        .equal = uint_equals
+    };
+    HashmapOptions options = {
+        .max_load_factor = 0.8,
+        .min_load_factor = 0.2,
+    };
+
+    unsigned int *keys = malloc(n * sizeof(*keys));
+    ASSERT(keys != NULL);
+
+    Hashmap *map = hashmap_create_with_options(hasher, options);
+    ASSERT(map != NULL);
+
+    for (unsigned int i = 0; i < n; ++i) {
+        keys[i] = i;
+        ASSERT(hashmap_insert(map, &keys[i], &keys[i], NULL));
+    }
+    size_t full_capacity = hashmap_capacity(map);
+
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT(hashmap_remove(map, &keys[i], NULL));
+
+        /* Well below the minimum load factor, the map should have shrunk */
+        if (hashmap_size(map) == n / 10) {
+            ASSERT(hashmap_capacity(map) <= full_capacity / 4);
+        }
+
+        /* The remaining keys are still there */
+        if (i + 1 < n) {
+            ASSERT(hashmap_get(map, &keys[i + 1]) == &keys[i + 1]);
+            ASSERT(hashmap_get(map, &keys[n - 1]) == &keys[n - 1]);
+        }
+    }
+    ASSERT(hashmap_capacity(map) <= 8);
+
+    hashmap_destroy(map, NULL, NULL);
+    free(keys);
+
+    /* The minimum load factor has to leave room after growing */
+    options.min_load_factor = 0.5;
+    ASSERT(hashmap_create_with_options(hasher, options) == NULL);
+
+    return SUCCESS;
+}
+
+/**
+ * Insert and remove keys while the map resizes incrementally, checking after
+ * every operation that exactly the expected keys are in the map.
+ */
+static result_t incremental_resize(unsigned int n, size_t resize_step) {
+    Hasher hasher = {
+        .hash = identity_hash,
+        .equal = uint_equals
+    };
+    HashmapOptions options = {
+        .min_load_factor = 0.1,
+        .resize_step = resize_step,
+    };
+
+    unsigned int *keys = malloc(n * sizeof(*keys));
+    bool *present = calloc(n, sizeof(*present));
+    ASSERT(keys != NULL);
+    ASSERT(present != NULL);
+
+    Hashmap *map = hashmap_create_with_options(hasher, options);
+    ASSERT(map != NULL);
+
+    size_t size = 0;
+    for (unsigned int i = 0; i < n; ++i) {
+        keys[i] = i;
+        ASSERT(hashmap_insert(map, &keys[i], &keys[i], NULL));
+        present[i] = true;
+        size += 1;
+
+        /* Inserting an existing key fails, even if it is in the old table */
+        if (present[i / 3]) {
+            Value *existing = NULL;
+            ASSERT(!hashmap_insert(map, &keys[i / 3], &keys[i / 3], &existing));
+            ASSERT(existing == &keys[i / 3]);
+        }
+
+        /* Remove some keys along the way */
+        if (i % 3 == 0 && i >= 5 && present[i - 5]) {
+            HashmapEntry removed;
+            ASSERT(hashmap_remove(map, &keys[i - 5], &removed));
+            ASSERT(removed.key == &keys[i - 5]);
+            present[i - 5] = false;
+            size -= 1;
+        }
+
+        ASSERT(hashmap_size(map) == size);
+        ASSERT(hashmap_get(map, &keys[i]) == &keys[i]);
+        ASSERT(hashmap_get(map, &keys[i / 2]) == (present[i / 2] ? &keys[i / 2] : NULL));
+    }
+
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT(hashmap_get(map, &keys[i]) == (present[i] ? &keys[i] : NULL));
+    }
+
+    /* Remove everything again, which makes the map shrink incrementally */
+    size_t full_capacity = hashmap_capacity(map);
+    for (unsigned int i = 0; i < n; ++i) {
+        if (present[i]) {
+            ASSERT(hashmap_remove(map, &keys[i], NULL));
+            present[i] = false;
+            size -= 1;
+            ASSERT(hashmap_size(map) == size);
+        }
+        if (i + 1 < n) {
+            ASSERT(hashmap_get(map, &keys[n - 1]) == (present[n - 1] ? &keys[n - 1] : NULL));
+        }
+    }
+    ASSERT(n < 100 || hashmap_capacity(map) < full_capacity);
+
+    hashmap_destroy(map, NULL, NULL);
+    free(present);
+    free(keys);
+
+    return SUCCESS;
+}
+
+/**
+ * Keys that are still in the old table when the map is destroyed should be
+ * destroyed as well.
+ */
+static result_t incremental_resize_destroy(unsigned int n) {
+    HashmapOptions options = {
+        .resize_step = 1,
+    };
+    Hashmap *map = hashmap_create_with_options(STRING_HASHER, options);
+    ASSERT(map != NULL);
+
+    for (unsigned int i = 0; i < n; ++i) {
+        char *key = uint_to_string(i);
+        ASSERT(key != NULL);
+        ASSERT(hashmap_insert(map, key, key, NULL));
+    }
+    ASSERT(hashmap_size(map) == n);
+
+    /* Reserving finishes the incremental resize */
+    ASSERT(hashmap_reserve(map, 4 * n));
+    ASSERT(hashmap_size(map) == n);
+
+    for (unsigned int i = n; i < 2 * n; ++i) {
+        char *key = uint_to_string(i);
+        ASSERT(key != NULL);
+        ASSERT(hashmap_insert(map, key, key, NULL));
+    }
+
+    /* Leak sanitizer catches keys that are not destroyed */
+    hashmap_destroy(map, free, NULL);
+
+    return SUCCESS;
+}
+
+static result_t hash_bytes(void) {
+    unsigned char data[100];
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = (unsigned char)i;
+    }
+
+    /* Every prefix of the data should have a different hash */
+    hash_t hashes[sizeof(data) + 1];
+    for (size_t length = 0; length <= sizeof(data); ++length) {
+        hashes[length] = hashmap_hash_bytes(data, length, 0);
+        ASSERT(hashes[length] == hashmap_hash_bytes(data, length, 0));
+        ASSERT(hashes[length] != hashmap_hash_bytes(data, length, 1));
+        for (size_t i = 0; i < length; ++i) {
+            ASSERT(hashes[i] != hashes[length]);
+        }
+    }
+
+    /* Changing any single bit should change the hash */
+    for (size_t bit = 0; bit < 8 * 20; ++bit) {
+        data[bit / 8] ^= (unsigned char)(1 << (bit % 8));
+        ASSERT(hashmap_hash_bytes(data, 20, 0) != hashes[20]);
+        data[bit / 8] ^= (unsigned char)(1 << (bit % 8));
+    }
+
+    char string[] = "a string key";
+    ASSERT(string_hash(string) == hashmap_hash_bytes(string, strlen(string), 0));
+    uint64_t seed = 42;
+    ASSERT(string_hash_seeded(string, &seed) == hashmap_hash_bytes(string, strlen(string), seed));
+
+    return SUCCESS;
+}
+
+static result_t seeded_string_hasher(unsigned int n) {
+    uint64_t seed = 0x0123456789abcdefull;
+    Hashmap *map = hashmap_create(STRING_HASHER_SEEDED(&seed));
+    ASSERT(map != NULL);
+
+    for (unsigned int i = 0; i < n; ++i) {
+        char *key = uint_to_string(i);
+        ASSERT(key != NULL);
+        ASSERT(hashmap_insert(map, key, key, NULL));
+    }
+
+    char buffer[32];
+    for (unsigned int i = 0; i < 2 * n; ++i) {
+        snprintf(buffer, sizeof(buffer), "%u", i);
+        char *value = hashmap_get(map, buffer);
+        ASSERT((value != NULL) == (i < n));
+        ASSERT(value == NULL || strcmp(value, buffer) == 0);
+    }
+
+    hashmap_destroy(map, free, NULL);
+
+    return SUCCESS;
+}
+
+/**
+ * Keys and values are copied from a reused buffer into the arena of the map,
+ * which is freed all at once. The leak sanitizer catches anything that is not.
+ */
+static result_t owned_strings(unsigned int n) {
+    HashmapOptions options = {
+        .key_copy_size = string_size,
+        .value_copy_size = string_size,
+    };
+    Hashmap *map = hashmap_create_with_options(STRING_HASHER, options);
+    ASSERT(map != NULL);
+
+    HashmapArenaStats stats;
+    hashmap_arena_stats(map, &stats);
+    ASSERT(stats.num_chunks == 0 && stats.allocated_bytes == 0 && stats.used_bytes == 0);
+
+    char key[32];
+    char value[32];
+    size_t used_bytes = 0;
+    for (unsigned int i = 0; i < n; ++i) {
+        snprintf(key, sizeof(key), "key %u", i);
+        snprintf(value, sizeof(value), "value %u", i);
+        Value *entry;
+        ASSERT(hashmap_insert(map, key, value, &entry));
+        ASSERT(entry != value && strcmp(entry, value) == 0);
+        used_bytes += strlen(key) + 1 + strlen(value) + 1;
+
+        /* Existing keys are not copied again */
+        ASSERT(!hashmap_insert(map, key, value, NULL));
+    }
+
+    hashmap_arena_stats(map, &stats);
+    ASSERT(stats.used_bytes == used_bytes);
+    ASSERT(stats.allocated_bytes >= used_bytes);
+    /* Chunks grow geometrically, so there are only logarithmically many */
+    ASSERT(stats.num_chunks <= 1 + 2 * (size_t)(n / 1000 + 1));
+
+    for (unsigned int i = 0; i < n; ++i) {
+        snprintf(key, sizeof(key), "key %u", i);
+        snprintf(value, sizeof(value), "value %u", i);
+        char *found = hashmap_get(map, key);
+        ASSERT(found != NULL && strcmp(found, value) == 0);
+    }
+
+    /* Removed keys stay valid until the map is destroyed */
+    snprintf(key, sizeof(key), "key %u", 0);
+    HashmapEntry removed;
+    ASSERT(n == 0 || hashmap_remove(map, key, &removed));
+    ASSERT(n == 0 || (removed.key != key && strcmp(removed.key, key) == 0));
+
+    /* Batches copy their keys as well */
+    Key *keys[2] = { "batch key 1", "batch key 2" };
+    Value *values[2] = { "batch value 1", "batch value 2" };
+    ASSERT(hashmap_insert_many(map, keys, values, 2, NULL));
+    char *found = hashmap_get(map, "batch key 2");
+    ASSERT(found != NULL && found != values[1] && strcmp(found, values[1]) == 0);
+
+    hashmap_destroy(map, NULL, NULL);
+
+    return SUCCESS;
+}
+
+/**
+ * An allocator that keeps track of the memory in use and fails once
+ * `remaining` allocations have been made.
+ */
+typedef struct CountingAllocator {
+    size_t live_bytes;
+    size_t num_allocations;
+    size_t remaining;
+} CountingAllocator;
+
+static void *counting_alloc(size_t size, void *context) {
+    CountingAllocator *allocator = context;
+    if (allocator->remaining == 0) {
+        return NULL;
+    }
+    allocator->remaining -= 1;
+    allocator->live_bytes += size;
+    allocator->num_allocations += 1;
+    return malloc(size);
+}
+
+static void counting_free(void *pointer, size_t size, void *context) {
+    CountingAllocator *allocator = context;
+    assert(allocator->live_bytes >= size);
+    allocator->live_bytes -= size;
+    free(pointer);
+}
+
+/**
+ * All memory of the map, including the keys it owns, goes through the
+ * allocator, and a failed allocation leaves the map unchanged.
+ */
+static result_t custom_allocator(unsigned int n) {
+    CountingAllocator counting = { 0, 0, (size_t)-1 };
+    HashmapAllocator allocator = {
+        .alloc = counting_alloc,
+        .free = counting_free,
+        .context = &counting,
+    };
+    HashmapOptions options = { .key_copy_size = string_size };
+
+    HashmapAllocator invalid = allocator;
+    invalid.free = NULL;
+    ASSERT(hashmap_create_with_allocator(STRING_HASHER, options, invalid) == NULL);
+    ASSERT(counting.num_allocations == 0);
+
+    Hashmap *map = hashmap_create_with_allocator(STRING_HASHER, options, allocator);
+    ASSERT(map != NULL);
+    ASSERT(counting.num_allocations == 1 && counting.live_bytes > 0);
+
+    char key[32];
+    for (unsigned int i = 0; i < n; ++i) {
+        snprintf(key, sizeof(key), "key %u", i);
+        ASSERT(hashmap_insert(map, key, "value", NULL));
+    }
+
+    /* Insert until growing the map fails */
+    counting.remaining = 0;
+    unsigned int num_inserted = n;
+    size_t capacity = hashmap_capacity(map);
+    for (;;) {
+        snprintf(key, sizeof(key), "key %u", num_inserted);
+        Value *entry;
+        if (!hashmap_insert(map, key, "value", &entry)) {
+            ASSERT(entry == NULL);
+            break;
+        }
+        num_inserted += 1;
+    }
+    ASSERT(hashmap_size(map) == num_inserted);
+    ASSERT(hashmap_capacity(map) == capacity);
+    for (unsigned int i = 0; i < num_inserted; ++i) {
+        snprintf(key, sizeof(key), "key %u", i);
+        ASSERT(hashmap_get(map, key) != NULL);
+    }
+    snprintf(key, sizeof(key), "key %u", num_inserted);
+    ASSERT(hashmap_get(map, key) == NULL);
+
+    counting.remaining = (size_t)-1;
+    ASSERT(hashmap_insert(map, key, "value", NULL));
+    ASSERT(hashmap_get(map, key) != NULL);
+
+    hashmap_destroy(map, NULL, NULL);
+    ASSERT(counting.live_bytes == 0);
+
+    return SUCCESS;
+}
+
+/**
+ * A table of more than 2 MB is mapped in huge pages, smaller allocations come
+ * from malloc.
+ */
+static result_t huge_page_allocator(unsigned int n) {
+    size_t threshold = (size_t)1 << 20;
+    HashmapOptions options = { .initial_capacity = 200000 };
+    Hashmap *map = hashmap_create_with_allocator(STRING_HASHER, options, HUGE_PAGE_ALLOCATOR(&threshold));
+    ASSERT(map != NULL);
+
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT(hashmap_insert(map, uint_to_string(i), uint_to_string(i), NULL));
+    }
+    for (unsigned int i = 0; i < n; ++i) {
+        char *key = uint_to_string(i);
+        char *value = hashmap_get(map, key);
+        ASSERT(value != NULL && strcmp(value, key) == 0);
+        free(key);
+    }
+    ASSERT(hashmap_shrink_to_fit(map));
+    ASSERT(hashmap_size(map) == n);
+
+    hashmap_destroy(map, free, free);
+
+    return SUCCESS;
+}
+
+/**
+ * Count the words of a buffer that contains NUL bytes in a flat map, without
+ * copying the words.
+ */
+static result_t slice_word_count(void) {
+    static const char text[] = "the quick\0brown fox\0 the quick fox the  end";
+    HashmapOptions options = {
+        .key_size = sizeof(Slice),
+        .value_size = sizeof(unsigned int),
+    };
+    Hashmap *map = hashmap_create_with_options(SLICE_HASHER, options);
+    ASSERT(map != NULL);
+
+    /* Split at spaces, `sizeof(text) - 1` leaves out the terminator */
+    size_t start = 0;
+    for (size_t i = 0; i <= sizeof(text) - 1; ++i) {
+        if (i == sizeof(text) - 1 || text[i] == ' ') {
+            Slice word = { .data = &text[start], .length = i - start };
+            unsigned int one = 1;
+            Value *count;
+            if (!hashmap_insert(map, &word, &one, &count)) {
+                ASSERT(count != NULL);
+                *(unsigned int *)count += 1;
+            }
+            start = i + 1;
+        }
+    }
+
+    /* "the", "quick\0brown", "fox\0", "quick", "fox", "" and "end" */
+    ASSERT(hashmap_size(map) == 7);
+
+    char the[] = "the";
+    Slice key = { .data = the, .length = strlen(the) };
+    unsigned int *count = hashmap_get(map, &key);
+    ASSERT(count != NULL && *count == 3);
+
+    key = (Slice) { .data = "quick\0brown", .length = 11 };
+    count = hashmap_get(map, &key);
+    ASSERT(count != NULL && *count == 1);
+    key.length = 5;
+    count = hashmap_get(map, &key);
+    ASSERT(count != NULL && *count == 1);
+    key.length = 4;
+    ASSERT(hashmap_get(map, &key) == NULL);
+
+    key = (Slice) { .data = NULL, .length = 0 };
+    count = hashmap_get(map, &key);
+    ASSERT(count != NULL && *count == 1);
+
+    /* Slices hash like strings with the same characters */
+    key = (Slice) { .data = the, .length = strlen(the) };
+    ASSERT(slice_hash(&key) == string_hash(the));
+    uint64_t seed = 7;
+    ASSERT(slice_hash_seeded(&key, &seed) == string_hash_seeded(the, &seed));
+
+    hashmap_destroy(map, NULL, NULL);
+
+    return SUCCESS;
+}
+
+/**
+ * Count the keys of a flat map of unsigned integers that an iteration visits,
+ * checking that every key has the value twice its key.
+ */
+static result_t count_visited(Hashmap *map, unsigned int n, unsigned int *visited, size_t *num_visited) {
+    memset(visited, 0, n * sizeof(*visited) + 1);
+    *num_visited = 0;
+
+    HashmapIter iter;
+    HashmapEntry entry;
+    hashmap_iter_begin(map, &iter);
+    while (hashmap_iter_next(&iter, &entry)) {
+        unsigned int key = *(unsigned int *)entry.key;
+        ASSERT(key < n && *(unsigned int *)entry.value == 2 * key);
+        /* Lookups are allowed while iterating */
+        ASSERT(hashmap_get(map, &key) == entry.value);
+        visited[key] += 1;
+        *num_visited += 1;
+    }
+    ASSERT(!hashmap_iter_next(&iter, &entry));
+
+    return SUCCESS;
+}
+
+/**
+ * Every key is visited exactly once, also when the iteration starts during an
+ * incremental resize and after removing keys.
+ */
+static result_t iterate(unsigned int n, HashmapOptions options) {
+    options.key_size = sizeof(unsigned int);
+    options.value_size = sizeof(unsigned int);
+    Hasher hasher = { .hash = NULL, .equal = NULL };
+    Hashmap *map = hashmap_create_with_options(hasher, options);
+    ASSERT(map != NULL);
+
+    for (unsigned int i = 0; i < n; ++i) {
+        unsigned int value = 2 * i;
+        ASSERT(hashmap_insert(map, &i, &value, NULL));
+    }
+
+    unsigned int *visited = malloc(n * sizeof(*visited) + 1);
+    ASSERT(visited != NULL);
+    size_t num_visited;
+    ASSERT(count_visited(map, n, visited, &num_visited) == SUCCESS);
+    ASSERT(num_visited == n);
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT(visited[i] == 1);
+    }
+
+    for (unsigned int i = 0; i < n; i += 2) {
+        ASSERT(hashmap_remove(map, &i, NULL));
+    }
+    ASSERT(count_visited(map, n, visited, &num_visited) == SUCCESS);
+    ASSERT(num_visited == n / 2);
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT(visited[i] == i % 2);
+    }
+
+    free(visited);
+    hashmap_destroy(map, NULL, NULL);
+
+    return SUCCESS;
+}
+
+/**
+ * Check that an ordered map visits exactly the given keys in the given order.
+ */
+static result_t check_order(Hashmap *map, unsigned int *expected, size_t n) {
+    ASSERT(hashmap_size(map) == n);
+
+    HashmapIter iter;
+    HashmapEntry entry;
+    hashmap_iter_begin(map, &iter);
+    for (size_t i = 0; i < n; ++i) {
+        ASSERT(hashmap_iter_next(&iter, &entry));
+        ASSERT(*(unsigned int *)entry.key == expected[i]);
+        ASSERT(entry.value == entry.key);
+    }
+    ASSERT(!hashmap_iter_next(&iter, &entry));
+
+    return SUCCESS;
+}
+
+/**
+ * An ordered map keeps its keys in insertion order through removals, its
+ * dense entries being compacted, growing, shrinking and batch insertions.
+ */
+static result_t ordered_map(unsigned int n) {
+    Hasher hasher = {
+        .hash = identity_hash,
+        .equal = uint_equals
+    };
+    HashmapOptions options = { .ordered = true, .min_load_factor = 0.2 };
+    Hashmap *map = hashmap_create_with_options(hasher, options);
+    ASSERT(map != NULL);
+
+    unsigned int *keys = malloc(3 * n * sizeof(*keys) + 1);
+    unsigned int *expected = malloc((3 * n + 1) * sizeof(*expected));
+    ASSERT(keys != NULL && expected != NULL);
+    for (unsigned int i = 0; i < 3 * n; ++i) {
+        keys[i] = i;
+    }
+
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT(hashmap_insert(map, &keys[i], &keys[i], NULL));
+        expected[i] = i;
+    }
+    ASSERT(check_order(map, expected, n) == SUCCESS);
+
+    /* Removing every third key keeps the order, reinserting appends the key */
+    size_t size = 0;
+    for (unsigned int i = 0; i < n; ++i) {
+        if (i % 3 == 0) {
+            ASSERT(hashmap_remove(map, &keys[i], NULL));
+        } else {
+            expected[size++] = i;
+        }
+    }
+    ASSERT(check_order(map, expected, size) == SUCCESS);
+    if (n > 1) {
+        ASSERT(hashmap_insert(map, &keys[0], &keys[0], NULL));
+        expected[size++] = 0;
+        ASSERT(!hashmap_insert(map, &keys[1], &keys[1], NULL));
+    }
+    ASSERT(check_order(map, expected, size) == SUCCESS);
+
+    /* Replacing the oldest key over and over compacts without growing */
+    size_t capacity = hashmap_capacity(map);
+    size_t first = 0;
+    for (unsigned int i = n; i < 2 * n; ++i) {
+        if (first < size) {
+            ASSERT(hashmap_remove(map, &expected[first], NULL));
+            first += 1;
+        }
+        ASSERT(hashmap_insert(map, &keys[i], &keys[i], NULL));
+        expected[size++] = i;
+    }
+    ASSERT(n < 1000 || hashmap_capacity(map) == capacity);
+    ASSERT(check_order(map, expected + first, size - first) == SUCCESS);
+
+    /* Batches append in order as well */
+    Key **key_pointers = malloc(n * sizeof(*key_pointers) + 1);
+    ASSERT(key_pointers != NULL);
+    for (unsigned int i = 0; i < n; ++i) {
+        key_pointers[i] = &keys[2 * n + i];
+        expected[size++] = 2 * n + i;
+    }
+    ASSERT(hashmap_insert_many(map, key_pointers, key_pointers, n, NULL));
+    ASSERT(check_order(map, expected + first, size - first) == SUCCESS);
+    free(key_pointers);
+
+    /* Removing all but the last 10 keys shrinks the map */
+    while (size - first > 10) {
+        ASSERT(hashmap_remove(map, &expected[first], NULL));
+        first += 1;
+    }
+    ASSERT(n < 1000 || hashmap_capacity(map) < capacity);
+    ASSERT(check_order(map, expected + first, size - first) == SUCCESS);
+    ASSERT(hashmap_shrink_to_fit(map));
+    ASSERT(check_order(map, expected + first, size - first) == SUCCESS);
+    for (size_t i = first; i < size; ++i) {
+        ASSERT(hashmap_get(map, &expected[i]) == &keys[expected[i]]);
+    }
+
+    hashmap_destroy(map, NULL, NULL);
+    free(expected);
+    free(keys);
+
+    return SUCCESS;
+}
+
+/**
+ * Every 256 consecutive keys have the same hash, so that long clusters spill
+ * over into the next region of `hashmap_build_parallel`.
+ */
+static hash_t grouped_hash(void *key) {
+    return *(unsigned int *)key / 256;
+}
+
+/**
+ * Build a map from `n` pairs whose keys repeat after `distinct` keys. Only the
+ * first pair of every key should be inserted, like with `hashmap_insert`.
+ */
+static result_t build_parallel(Hasher hasher, unsigned int n, unsigned int distinct, size_t nthreads) {
+    unsigned int *keys = malloc(n * sizeof(*keys) + 1);
+    unsigned int *values = malloc(n * sizeof(*values) + 1);
+    HashmapEntry *entries = malloc(n * sizeof(*entries) + 1);
+    ASSERT(keys != NULL && values != NULL && entries != NULL);
+    for (unsigned int i = 0; i < n; ++i) {
+        keys[i] = i % distinct;
+        values[i] = i;
+        entries[i] = (HashmapEntry) { &keys[i], &values[i] };
+    }
+
+    Hashmap *map = hashmap_build_parallel(hasher, entries, n, nthreads);
+    ASSERT(map != NULL);
+    ASSERT(hashmap_size(map) == (n < distinct ? n : distinct));
+    for (unsigned int i = 0; i < n; ++i) {
+        Value *value = hashmap_get(map, &keys[i]);
+        ASSERT(value == &values[keys[i]]);
+    }
+    unsigned int missing = n + distinct;
+    ASSERT(hashmap_get(map, &missing) == NULL);
+
+    /* The map can be used like any other */
+    ASSERT(hashmap_insert(map, &missing, &missing, NULL));
+    for (unsigned int i = 0; i < n && i < distinct; i += 2) {
+        ASSERT(hashmap_remove(map, &keys[i], NULL));
+    }
+    ASSERT(hashmap_get(map, &missing) == &missing);
+
+    hashmap_destroy(map, NULL, NULL);
+    free(entries);
+    free(values);
+    free(keys);
+
+    return SUCCESS;
+}
+
+typedef struct ConcurrentTest {
+    ConcurrentHashmap *map;
+    unsigned int *keys;
+    unsigned int n;
+    /* Set by the writer once it is done */
+    bool done;
+    /* The number of lookups of the readers that returned a wrong value */
+    size_t failures;
+} ConcurrentTest;
+
+/**
+ * Look up the keys below `n`, which are never removed, until the writer is
+ * done.
+ */
+static void *concurrent_reader(void *arg) {
+    ConcurrentTest *test = arg;
+    size_t failures = 0;
+    while (!__atomic_load_n(&test->done, __ATOMIC_ACQUIRE)) {
+        for (unsigned int i = 0; i < test->n; ++i) {
+            if (concurrent_hashmap_get(test->map, &test->keys[i]) != &test->keys[i]) {
+                failures += 1;
+            }
+        }
+    }
+    __atomic_fetch_add(&test->failures, failures, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/**
+ * Lookups of keys that stay in the map always find them, while another thread
+ * inserts and removes other keys and the map grows several times.
+ */
+static result_t concurrent_map(unsigned int n, size_t num_readers) {
+    Hasher hasher = {
+        .hash = identity_hash,
+        .equal = uint_equals
+    };
+    ConcurrentTest test = { concurrent_hashmap_create(hasher), NULL, n, false, 0 };
+    ASSERT(test.map != NULL);
+    test.keys = malloc(16 * n * sizeof(*test.keys) + 1);
+    ASSERT(test.keys != NULL);
+    for (unsigned int i = 0; i < 16 * n; ++i) {
+        test.keys[i] = i;
+    }
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT(concurrent_hashmap_insert(test.map, &test.keys[i], &test.keys[i], NULL));
+    }
+
+    pthread_t readers[8];
+    ASSERT(num_readers <= 8);
+    for (size_t i = 0; i < num_readers; ++i) {
+        ASSERT(pthread_create(&readers[i], NULL, concurrent_reader, &test) == 0);
+    }
+
+    /* Every key is removed again right after the next one is inserted */
+    for (unsigned int i = n; i < 16 * n; ++i) {
+        ASSERT(concurrent_hashmap_insert(test.map, &test.keys[i], &test.keys[i], NULL));
+        ASSERT(concurrent_hashmap_get(test.map, &test.keys[i]) == &test.keys[i]);
+        if ((i - n) % 2 == 1) {
+            ASSERT(concurrent_hashmap_remove(test.map, &test.keys[i - 1], NULL));
+            ASSERT(concurrent_hashmap_get(test.map, &test.keys[i - 1]) == NULL);
+        }
+    }
+    concurrent_hashmap_synchronize(test.map);
+
+    __atomic_store_n(&test.done, true, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < num_readers; ++i) {
+        ASSERT(pthread_join(readers[i], NULL) == 0);
+    }
+    ASSERT(test.failures == 0);
+    ASSERT(concurrent_hashmap_size(test.map) == n + 15 * n / 2);
+
+    concurrent_hashmap_destroy(test.map, NULL, NULL);
+    free(test.keys);
+
+    return SUCCESS;
+}
+
+typedef struct ShardedTest {
+    ShardedHashmap *map;
+    unsigned int *keys;
+    unsigned int n;
+    size_t thread;
+    /* Whether the thread removes keys instead of inserting them */
+    bool remove;
+    /* The number of keys the thread inserted or removed */
+    size_t count;
+} ShardedTest;
+
+/**
+ * Either insert all keys below `n`, starting at a different key in every
+ * thread, or remove the keys whose remainder modulo 4 is the thread's number.
+ */
+static void *sharded_worker(void *arg) {
+    ShardedTest *test = arg;
+    if (test->remove) {
+        for (unsigned int i = (unsigned int)test->thread; i < test->n; i += 4) {
+            test->count += sharded_hashmap_remove(test->map, &test->keys[i], NULL);
+        }
+    } else {
+        for (unsigned int i = 0; i < test->n; ++i) {
+            unsigned int key = (i + (unsigned int)test->thread * 97) % test->n;
+            test->count += sharded_hashmap_insert(test->map, &test->keys[key], &test->keys[key], NULL);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Run `sharded_worker` in four threads at once.
+ *
+ * Returns the number of keys they inserted or removed in total.
+ */
+static size_t run_sharded_workers(ShardedHashmap *map, unsigned int *keys, unsigned int n, bool remove) {
+    ShardedTest tests[4];
+    pthread_t threads[4];
+    bool started[4];
+    for (size_t i = 0; i < 4; ++i) {
+        tests[i] = (ShardedTest) { map, keys, n, i, remove, 0 };
+        started[i] = pthread_create(&threads[i], NULL, sharded_worker, &tests[i]) == 0;
+        if (!started[i]) {
+            sharded_worker(&tests[i]);
+        }
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        count += tests[i].count;
+    }
+    return count;
+}
+
+/**
+ * Four threads insert the same keys at the same time, and then remove them.
+ */
+static result_t sharded_map(unsigned int n, size_t num_shards) {
+    Hasher hasher = {
+        .hash = identity_hash,
+        .equal = uint_equals
+    };
+    ASSERT(sharded_hashmap_create(hasher, 0) == NULL);
+    ShardedHashmap *map = sharded_hashmap_create(hasher, num_shards);
+    ASSERT(map != NULL);
+    size_t expected_shards = 1;
+    while (expected_shards < num_shards) {
+        expected_shards *= 2;
+    }
+    ASSERT(sharded_hashmap_num_shards(map) == expected_shards);
+
+    unsigned int *keys = malloc(n * sizeof(*keys) + 1);
+    ASSERT(keys != NULL);
+    for (unsigned int i = 0; i < n; ++i) {
+        keys[i] = i;
+    }
+
+    /* Every key is only inserted by one of the threads */
+    ASSERT(run_sharded_workers(map, keys, n, false) == n);
+    ASSERT(sharded_hashmap_size(map) == n);
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT(sharded_hashmap_get(map, &keys[i]) == &keys[i]);
+    }
+
+    ASSERT(run_sharded_workers(map, keys, n, true) == n);
+    ASSERT(sharded_hashmap_size(map) == 0);
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT(sharded_hashmap_get(map, &keys[i]) == NULL);
+    }
+
+    sharded_hashmap_destroy(map, NULL, NULL);
+    free(keys);
+
+    return SUCCESS;
+}
+
+static void add_uint(Value *existing, Value *value) {
+    *(unsigned int *)existing += *(unsigned int *)value;
+}
+
+/**
+ * Count how often each key below `n / 4` occurs among `n` keys with upserts
+ * into a flat map, and check the counts with single lookups through
+ * `hashmap_entry`, also while the map resizes incrementally.
+ */
+static result_t upsert_counts(unsigned int n, size_t resize_step) {
+    HashmapOptions options = {
+        .key_size = sizeof(unsigned int),
+        .value_size = sizeof(unsigned int),
+        .resize_step = resize_step,
+    };
+    Hasher hasher = { .hash = NULL, .equal = NULL };
+    Hashmap *map = hashmap_create_with_options(hasher, options);
+    ASSERT(map != NULL);
+
+    unsigned int distinct = n / 4 + 1;
+    unsigned int one = 1;
+    for (unsigned int i = 0; i < n; ++i) {
+        unsigned int key = i % distinct;
+        HashmapEntryState state = hashmap_upsert(map, &key, &one, add_uint);
+        ASSERT(state == (i < distinct ? HASHMAP_VACANT : HASHMAP_OCCUPIED));
+    }
+    ASSERT(hashmap_size(map) == (n < distinct ? n : distinct));
+
+    for (unsigned int key = 0; key < distinct && key < n; ++key) {
+        HashmapSlot slot;
+        ASSERT(hashmap_entry(map, &key, &slot) == HASHMAP_OCCUPIED);
+        unsigned int *count = hashmap_slot_value(&slot);
+        ASSERT(*count == n / distinct + (key < n % distinct));
+        /* Flat values can be changed in place or replaced */
+        *count += 1;
+        ASSERT(*(unsigned int *)hashmap_get(map, &key) == n / distinct + (key < n % distinct) + 1);
+        ASSERT(hashmap_entry(map, &key, &slot) == HASHMAP_OCCUPIED);
+        ASSERT(hashmap_slot_set_value(&slot, &key));
+        ASSERT(*(unsigned int *)hashmap_get(map, &key) == key);
+    }
+
+    /* A vacant slot is inserted into like with `hashmap_insert` */
+    unsigned int missing = distinct;
+    unsigned int value = 42;
+    HashmapSlot slot;
+    ASSERT(hashmap_entry(map, &missing, &slot) == HASHMAP_VACANT);
+    Value *entry;
+    ASSERT(hashmap_slot_insert(&slot, &value, &entry));
+    ASSERT(*(unsigned int *)entry == 42);
+    ASSERT(*(unsigned int *)hashmap_get(map, &missing) == 42);
+    ASSERT(!hashmap_insert(map, &missing, &one, &entry));
+    ASSERT(*(unsigned int *)entry == 42);
+
+    hashmap_destroy(map, NULL, NULL);
+
+    return SUCCESS;
+}
+
+/**
+ * Replacing the value of a key in a map that owns its values copies the new
+ * value and leaves the old copy valid.
+ */
+static result_t entry_owned_values(void) {
+    HashmapOptions options = {
+        .key_copy_size = string_size,
+        .value_copy_size = string_size,
+    };
+    Hashmap *map = hashmap_create_with_options(STRING_HASHER, options);
+    ASSERT(map != NULL);
+
+    char value[32] = "first";
+    ASSERT(hashmap_insert(map, "key", value, NULL));
+
+    HashmapSlot slot;
+    ASSERT(hashmap_entry(map, "key", &slot) == HASHMAP_OCCUPIED);
+    char *old = hashmap_slot_value(&slot);
+    ASSERT(old != value && strcmp(old, "first") == 0);
+    strcpy(value, "second");
+    ASSERT(hashmap_slot_set_value(&slot, value));
+    char *new = hashmap_get(map, "key");
+    ASSERT(new != value && new != old && strcmp(new, "second") == 0);
+    ASSERT(strcmp(old, "first") == 0);
+
+    hashmap_destroy(map, NULL, NULL);
+
+    return SUCCESS;
+}
+
+/**
+ * Serialize a string with its terminator, see `SerializeFunction`.
+ */
+static size_t serialize_string(void *data, void *buffer, size_t capacity) {
+    size_t size = strlen(data) + 1;
+    if (size <= capacity) {
+        memcpy(buffer, data, size);
+    }
+    return size;
+}
+
+/**
+ * Save the map to a new temporary file, whose path is written to `path`.
+ */
+static result_t save_to_temporary(Hashmap *map, char *path, SerializeFunction key_serializer,
+        SerializeFunction value_serializer) {
+    strcpy(path, "/tmp/hashmap_test_XXXXXX");
+    int fd = mkstemp(path);
+    ASSERT(fd >= 0);
+    bool saved = hashmap_save(map, fd, key_serializer, value_serializer);
+    close(fd);
+    if (!saved) {
+        unlink(path);
+    }
+    ASSERT(saved);
+    return SUCCESS;
+}
+
+/**
+ * Save a map of n owned strings without every third key and open it again.
+ * The mapped map has to find the same keys and iterate in the same order.
+ */
+static result_t snapshot_strings(unsigned int n, bool ordered, bool serialize) {
+    HashmapOptions options = {
+        .key_copy_size = string_size,
+        .value_copy_size = string_size,
+        .ordered = ordered,
+    };
+    Hashmap *map = hashmap_create_with_options(STRING_HASHER, options);
+    ASSERT(map != NULL);
+
+    char key[32];
+    char value[32];
+    for (unsigned int i = 0; i < n; ++i) {
+        snprintf(key, sizeof(key), "key %u", i);
+        snprintf(value, sizeof(value), "value %u", i);
+        ASSERT(hashmap_insert(map, key, value, NULL));
+    }
+    for (unsigned int i = 0; i < n; i += 3) {
+        snprintf(key, sizeof(key), "key %u", i);
+        ASSERT(hashmap_remove(map, key, NULL));
+    }
+
+    char path[32];
+    SerializeFunction serializer = serialize ? serialize_string : NULL;
+    ASSERT(save_to_temporary(map, path, serializer, serializer) == SUCCESS);
+    Hashmap *mapped = hashmap_open_mapped(STRING_HASHER, path);
+    unlink(path);
+    ASSERT(mapped != NULL);
+
+    ASSERT(hashmap_size(mapped) == hashmap_size(map));
+    for (unsigned int i = 0; i < n + 10; ++i) {
+        snprintf(key, sizeof(key), "key %u", i);
+        snprintf(value, sizeof(value), "value %u", i);
+        char *found = hashmap_get(mapped, key);
+        if (i % 3 == 0 || i >= n) {
+            ASSERT(found == NULL);
+        } else {
+            ASSERT(found != NULL && strcmp(found, value) == 0);
+        }
+    }
+
+    HashmapIter iter;
+    HashmapIter mapped_iter;
+    HashmapEntry entry;
+    HashmapEntry mapped_entry;
+    hashmap_iter_begin(map, &iter);
+    hashmap_iter_begin(mapped, &mapped_iter);
+    while (hashmap_iter_next(&iter, &entry)) {
+        ASSERT(hashmap_iter_next(&mapped_iter, &mapped_entry));
+        ASSERT(strcmp(entry.key, mapped_entry.key) == 0 && strcmp(entry.value, mapped_entry.value) == 0);
+    }
+    ASSERT(!hashmap_iter_next(&mapped_iter, &mapped_entry));
+
+    hashmap_destroy(mapped, NULL, NULL);
+    hashmap_destroy(map, NULL, NULL);
+
+    return SUCCESS;
+}
+
+/**
+ * Flat maps are saved as they are, and keys whose bytes are hashed need no
+ * hasher at all.
+ */
+static result_t snapshot_flat(unsigned int n) {
+    HashmapOptions options = {
+        .key_size = sizeof(unsigned int),
+        .value_size = sizeof(unsigned int),
+    };
+    Hasher hasher = { .hash = NULL, .equal = NULL };
+    Hashmap *map = hashmap_create_with_options(hasher, options);
+    ASSERT(map != NULL);
+    for (unsigned int i = 0; i < n; ++i) {
+        unsigned int value = 2 * i;
+        ASSERT(hashmap_insert(map, &i, &value, NULL));
+    }
+
+    char path[32];
+    ASSERT(save_to_temporary(map, path, NULL, NULL) == SUCCESS);
+
+    /* Saving again overwrites the file from the start, whatever its offset and size */
+    int fd = open(path, O_RDWR);
+    ASSERT(fd >= 0);
+    off_t size = lseek(fd, 0, SEEK_END);
+    ASSERT(size > 0 && pwrite(fd, "garbage", 7, size + 100) == 7);
+    bool saved = hashmap_save(map, fd, NULL, NULL);
+    close(fd);
+    hashmap_destroy(map, NULL, NULL);
+    ASSERT(saved);
+
+    Hashmap *mapped = hashmap_open_mapped(hasher, path);
+    unlink(path);
+    ASSERT(mapped != NULL);
+
+    ASSERT(hashmap_size(mapped) == n);
+    for (unsigned int i = 0; i < 2 * n; ++i) {
+        unsigned int *found = hashmap_get(mapped, &i);
+        ASSERT(i < n ? found != NULL && *found == 2 * i : found == NULL);
+    }
+    hashmap_destroy(mapped, NULL, NULL);
+
+    return SUCCESS;
+}
+
+/**
+ * Maps that cannot be saved, and files that cannot be opened.
+ */
+static result_t snapshot_invalid(void) {
+    char path[32];
+    ASSERT(hashmap_open_mapped(STRING_HASHER, "/nonexistent/hashmap") == NULL);
+
+    /* Without serializers, only the pointers would be known */
+    Hashmap *map = hashmap_create(STRING_HASHER);
+    ASSERT(map != NULL);
+    ASSERT(hashmap_insert(map, "key", "value", NULL));
+    strcpy(path, "/tmp/hashmap_test_XXXXXX");
+    int fd = mkstemp(path);
+    ASSERT(fd >= 0);
+    ASSERT(!hashmap_save(map, fd, NULL, NULL));
+    close(fd);
+    unlink(path);
+
+    ASSERT(save_to_temporary(map, path, serialize_string, serialize_string) == SUCCESS);
+    hashmap_destroy(map, NULL, NULL);
+
+    /* The keys were hashed differently */
+    uint64_t seed = 1;
+    ASSERT(hashmap_open_mapped(STRING_HASHER_SEEDED(&seed), path) == NULL);
+
+    /* Any corrupted byte is caught by the checksum */
+    fd = open(path, O_RDWR);
+    ASSERT(fd >= 0);
+    off_t size = lseek(fd, 0, SEEK_END);
+    ASSERT(size > 0);
+    for (off_t offset = 0; offset < size; offset += size / 7 + 1) {
+        unsigned char byte;
+        ASSERT(pread(fd, &byte, 1, offset) == 1);
+        byte ^= 0x10;
+        ASSERT(pwrite(fd, &byte, 1, offset) == 1);
+        ASSERT(hashmap_open_mapped(STRING_HASHER, path) == NULL);
+        byte ^= 0x10;
+        ASSERT(pwrite(fd, &byte, 1, offset) == 1);
+    }
+    ASSERT(ftruncate(fd, size - 1) == 0);
+    ASSERT(hashmap_open_mapped(STRING_HASHER, path) == NULL);
+    close(fd);
+    unlink(path);
+
+    return SUCCESS;
+}
+
+/**
+ * Freeze a flat map of n keys without every third key. Every key has to be
+ * found with its value, whatever its hash.
+ */
+static result_t frozen_flat(Hasher hasher, unsigned int n, size_t nthreads) {
+    HashmapOptions options = {
+        .key_size = sizeof(unsigned int),
+        .value_size = sizeof(unsigned int),
+    };
+    Hashmap *map = hashmap_create_with_options(hasher, options);
+    ASSERT(map != NULL);
+    for (unsigned int i = 0; i < n; ++i) {
+        unsigned int value = 2 * i;
+        ASSERT(hashmap_insert(map, &i, &value, NULL));
+    }
+    for (unsigned int i = 0; i < n; i += 3) {
+        ASSERT(hashmap_remove(map, &i, NULL));
+    }
+    size_t size = hashmap_size(map);
+
+    FrozenHashmap *frozen = hashmap_freeze(map, nthreads);
+    ASSERT(frozen != NULL);
+    ASSERT(frozen_hashmap_size(frozen) == size);
+    for (unsigned int i = 0; i < 2 * n + 10; ++i) {
+        unsigned int *found = frozen_hashmap_get(frozen, &i);
+        if (i % 3 == 0 || i >= n) {
+            ASSERT(found == NULL);
+        } else {
+            ASSERT(found != NULL && *found == 2 * i);
+        }
+    }
+    frozen_hashmap_destroy(frozen, NULL, NULL);
+
+    return SUCCESS;
+}
+
+/**
+ * The keys and values a map owns are kept alive by the frozen map.
+ */
+static result_t frozen_strings(unsigned int n, bool ordered) {
+    HashmapOptions options = {
+        .key_copy_size = string_size,
+        .value_copy_size = string_size,
+        .ordered = ordered,
+    };
+    Hashmap *map = hashmap_create_with_options(STRING_HASHER, options);
+    ASSERT(map != NULL);
+
+    char key[32];
+    char value[32];
+    for (unsigned int i = 0; i < n; ++i) {
+        snprintf(key, sizeof(key), "key %u", i);
+        snprintf(value, sizeof(value), "value %u", i);
+        ASSERT(hashmap_insert(map, key, value, NULL));
+    }
+
+    FrozenHashmap *frozen = hashmap_freeze(map, 2);
+    ASSERT(frozen != NULL);
+    ASSERT(frozen_hashmap_size(frozen) == n);
+    for (unsigned int i = 0; i < n + 10; ++i) {
+        snprintf(key, sizeof(key), "key %u", i);
+        snprintf(value, sizeof(value), "value %u", i);
+        char *found = frozen_hashmap_get(frozen, key);
+        ASSERT(i < n ? found != NULL && strcmp(found, value) == 0 : found == NULL);
+    }
+    frozen_hashmap_destroy(frozen, NULL, NULL);
+
+    return SUCCESS;
+}
+
+/**
+ * Check that a flat map holds exactly the keys below `n` with the values
+ * `2 * key`, as the maps of `clone_flat` did when they were cloned.
+ */
+static result_t check_cloned(Hashmap *map, unsigned int n) {
+    ASSERT(hashmap_size(map) == n);
+    for (unsigned int i = 0; i < 2 * n + 10; ++i) {
+        unsigned int *found = hashmap_get(map, &i);
+        ASSERT(i < n ? found != NULL && *found == 2 * i : found == NULL);
+    }
+    return SUCCESS;
+}
+
+/**
+ * A clone of a flat map keeps its entries while the map removes keys,
+ * changes values and grows, and outlives the map. Clones of clones share the
+ * same pages.
+ */
+static result_t clone_flat(Hasher hasher, unsigned int n, size_t resize_step) {
+    HashmapOptions options = {
+        .key_size = sizeof(unsigned int),
+        .value_size = sizeof(unsigned int),
+        .resize_step = resize_step,
+    };
+    Hashmap *map = hashmap_create_with_options(hasher, options);
+    ASSERT(map != NULL);
+    for (unsigned int i = 0; i < n; ++i) {
+        unsigned int value = 2 * i;
+        ASSERT(hashmap_insert(map, &i, &value, NULL));
+    }
+
+    Hashmap *clone = hashmap_clone(map);
+    ASSERT(clone != NULL);
+    ASSERT(check_cloned(clone, n) == SUCCESS);
+
+    unsigned int one = 1;
+    for (unsigned int i = 0; i < n; ++i) {
+        if (i % 3 == 0) {
+            ASSERT(hashmap_remove(map, &i, NULL));
+        } else if (i % 3 == 1) {
+            ASSERT(hashmap_upsert(map, &i, &one, add_uint) == HASHMAP_OCCUPIED);
+        }
+    }
+    Hashmap *clone_of_clone = hashmap_clone(clone);
+    ASSERT(clone_of_clone != NULL);
+
+    /* Half of the new keys in a batch, which copies all pages at once */
+    unsigned int *keys = malloc(n * sizeof(*keys) + 1);
+    Key **key_pointers = malloc(n * sizeof(*key_pointers) + 1);
+    ASSERT(keys != NULL && key_pointers != NULL);
+    for (unsigned int i = 0; i < n; ++i) {
+        keys[i] = n + i;
+        key_pointers[i] = &keys[i];
+    }
+    for (unsigned int i = 0; i < n / 2; ++i) {
+        ASSERT(hashmap_insert(map, &keys[i], &keys[i], NULL));
+    }
+    Hashmap *late_clone = hashmap_clone(map);
+    ASSERT(late_clone != NULL);
+    ASSERT(hashmap_insert_many(map, &key_pointers[n / 2], (Value **)&key_pointers[n / 2], n - n / 2, NULL));
+
+    ASSERT(hashmap_size(map) == n - (n + 2) / 3 + n);
+    for (unsigned int i = 0; i < 2 * n + 10; ++i) {
+        unsigned int *found = hashmap_get(map, &i);
+        if (i >= 2 * n || (i < n && i % 3 == 0)) {
+            ASSERT(found == NULL);
+        } else {
+            ASSERT(found != NULL && *found == (i >= n ? i : 2 * i + (i % 3 == 1)));
+        }
+    }
+    ASSERT(hashmap_size(late_clone) == n - (n + 2) / 3 + n / 2);
+    hashmap_destroy(late_clone, NULL, NULL);
+    ASSERT(check_cloned(clone, n) == SUCCESS);
+    ASSERT(check_cloned(clone_of_clone, n) == SUCCESS);
+
+    hashmap_destroy(map, NULL, NULL);
+    ASSERT(check_cloned(clone, n) == SUCCESS);
+    hashmap_destroy(clone, NULL, NULL);
+    ASSERT(check_cloned(clone_of_clone, n) == SUCCESS);
+    hashmap_destroy(clone_of_clone, NULL, NULL);
+    free(keys);
+    free(key_pointers);
+
+    return SUCCESS;
+}
+
+/**
+ * The keys and values a map owns are kept alive by its clones, which keep the
+ * order of an ordered map.
+ */
+static result_t clone_strings(unsigned int n, bool ordered) {
+    HashmapOptions options = {
+        .key_copy_size = string_size,
+        .value_copy_size = string_size,
+        .ordered = ordered,
+    };
+    Hashmap *map = hashmap_create_with_options(STRING_HASHER, options);
+    ASSERT(map != NULL);
+
+    char key[32];
+    char value[32];
+    for (unsigned int i = 0; i < n; ++i) {
+        snprintf(key, sizeof(key), "key %u", i);
+        snprintf(value, sizeof(value), "value %u", i);
+        ASSERT(hashmap_insert(map, key, value, NULL));
+    }
+    Hashmap *clone = hashmap_clone(map);
+    ASSERT(clone != NULL);
+
+    for (unsigned int i = 0; i < 2 * n; ++i) {
+        snprintf(key, sizeof(key), "key %u", i);
+        snprintf(value, sizeof(value), "changed %u", i);
+        HashmapSlot slot;
+        if (i % 3 == 0) {
+            ASSERT(hashmap_remove(map, key, NULL) == (i < n));
+        } else if (hashmap_entry(map, key, &slot) == HASHMAP_OCCUPIED) {
+            ASSERT(hashmap_slot_set_value(&slot, value));
+        } else {
+            ASSERT(hashmap_slot_insert(&slot, value, NULL));
+        }
+    }
+    hashmap_destroy(map, NULL, NULL);
+
+    ASSERT(hashmap_size(clone) == n);
+    for (unsigned int i = 0; i < n + 10; ++i) {
+        snprintf(key, sizeof(key), "key %u", i);
+        snprintf(value, sizeof(value), "value %u", i);
+        char *found = hashmap_get(clone, key);
+        ASSERT(i < n ? found != NULL && strcmp(found, value) == 0 : found == NULL);
+    }
+    if (ordered) {
+        HashmapIter iter;
+        HashmapEntry entry;
+        hashmap_iter_begin(clone, &iter);
+        for (unsigned int i = 0; i < n; ++i) {
+            snprintf(key, sizeof(key), "key %u", i);
+            ASSERT(hashmap_iter_next(&iter, &entry));
+            ASSERT(strcmp(entry.key, key) == 0);
+        }
+        ASSERT(!hashmap_iter_next(&iter, &entry));
+    }
+    hashmap_destroy(clone, NULL, NULL);
+
+    return SUCCESS;
+}
+
+typedef struct CloneTest {
+    Hashmap *clone;
+    unsigned int n;
+    /* Set by the writer once it is done */
+    bool done;
+    /* The number of lookups in the clone that returned a wrong value */
+    size_t failures;
+} CloneTest;
+
+/**
+ * Look up all keys of the clone until the writer is done, then destroy it.
+ */
+static void *clone_reader(void *arg) {
+    CloneTest *test = arg;
+    size_t failures = 0;
+    do {
+        for (unsigned int i = 0; i < 2 * test->n; ++i) {
+            unsigned int *found = hashmap_get(test->clone, &i);
+            failures += i < test->n ? found == NULL || *found != 2 * i : found != NULL;
+        }
+    } while (!__atomic_load_n(&test->done, __ATOMIC_ACQUIRE));
+    hashmap_destroy(test->clone, NULL, NULL);
+    test->failures = failures;
+    return NULL;
+}
+
+/**
+ * A clone can be read from and destroyed in another thread while the map
+ * replaces all of its keys.
+ */
+static result_t clone_concurrent(unsigned int n) {
+    HashmapOptions options = {
+        .key_size = sizeof(unsigned int),
+        .value_size = sizeof(unsigned int),
+    };
+    Hasher hasher = { .hash = identity_hash, .equal = uint_equals };
+    Hashmap *map = hashmap_create_with_options(hasher, options);
+    ASSERT(map != NULL);
+    for (unsigned int i = 0; i < n; ++i) {
+        unsigned int value = 2 * i;
+        ASSERT(hashmap_insert(map, &i, &value, NULL));
+    }
+
+    CloneTest test = { hashmap_clone(map), n, false, 0 };
+    ASSERT(test.clone != NULL);
+    pthread_t reader;
+    ASSERT(pthread_create(&reader, NULL, clone_reader, &test) == 0);
+
+    for (unsigned int i = 0; i < n; ++i) {
+        unsigned int key = n + i;
+        ASSERT(hashmap_insert(map, &key, &key, NULL));
+        ASSERT(hashmap_remove(map, &i, NULL));
+    }
+    __atomic_store_n(&test.done, true, __ATOMIC_RELEASE);
+    ASSERT(pthread_join(reader, NULL) == 0);
+    ASSERT(test.failures == 0);
+
+    ASSERT(hashmap_size(map) == n);
+    hashmap_destroy(map, NULL, NULL);
+
+    return SUCCESS;
+}
+
+/**
+ * Insert the keys 0, 2, 4, ... with single insertions and then all keys below
+ * 2 * n in batches, so that every other key in a batch already exists.
+ */
+static result_t batch_insert_get(unsigned int n, size_t resize_step) {
     Hasher hasher = {
-        .hash = return_0,
+        .hash = identity_hash,
         .equal = uint_equals
     };
+    HashmapOptions options = {
+        .resize_step = resize_step,
+    };
+    Hashmap *map = hashmap_create_with_options(hasher, options);
+    ASSERT(map != NULL);
 
-    Hashmap *map = hashmap_create(hasher);
+    unsigned int *keys = malloc(2 * n * sizeof(*keys) + 1);
+    Key **key_pointers = malloc(2 * n * sizeof(*key_pointers) + 1);
+    Value **values = malloc(2 * n * sizeof(*values) + 1);
+    bool *inserted = malloc(2 * n * sizeof(*inserted) + 1);
+    ASSERT(keys != NULL && key_pointers != NULL && values != NULL && inserted != NULL);
+    for (unsigned int i = 0; i < 2 * n; ++i) {
+        keys[i] = i;
+        key_pointers[i] = &keys[i];
+    }
+
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT(hashmap_insert(map, &keys[2 * i], &keys[2 * i], NULL));
+    }
+
+    /* Odd sized batches, so that they do not line up with the prefetching */
+    unsigned int batch = 7;
+    for (unsigned int start = 0; start < 2 * n; start += batch) {
+        unsigned int count = 2 * n - start < batch ? 2 * n - start : batch;
+        ASSERT(hashmap_insert_many(map, &key_pointers[start], (Value **)&key_pointers[start], count, &inserted[start]));
+        for (unsigned int i = start; i < start + count; ++i) {
+            ASSERT(inserted[i] == (i % 2 == 1));
+        }
+        ASSERT(hashmap_insert_many(map, &key_pointers[start], (Value **)&key_pointers[start], 1, NULL));
+    }
+    ASSERT(hashmap_size(map) == 2 * n);
+
+    hashmap_get_many(map, key_pointers, 2 * n, values);
+    for (unsigned int i = 0; i < 2 * n; ++i) {
+        ASSERT(values[i] == &keys[i]);
+    }
+
+    /* A key that is repeated within a batch is only inserted once */
+    unsigned int extra = 2 * n;
+    Key *repeated[] = { &extra, &extra };
+    bool repeated_inserted[2];
+    ASSERT(hashmap_insert_many(map, repeated, repeated, 2, repeated_inserted));
+    ASSERT(repeated_inserted[0] && !repeated_inserted[1]);
+    ASSERT(hashmap_size(map) == 2 * n + 1);
+
+    unsigned int missing = 2 * n + 1;
+    Key *lookups[] = { &missing, &extra };
+    Value *found[2];
+    hashmap_get_many(map, lookups, 2, found);
+    ASSERT(found[0] == NULL && found[1] == &extra);
+
+    hashmap_destroy(map, NULL, NULL);
+    free(inserted);
+    free(values);
+    free(key_pointers);
+    free(keys);
+
+    return SUCCESS;
+}
+
+/**
+ * Insert n keys into a map that scans its entries on lookup, remove every
+ * other one and look all of them up, also in a clone of the map.
+ */
+static result_t scanned_map(Hasher hasher, unsigned int n, size_t resize_step) {
+    HashmapOptions options = {
+        .resize_step = resize_step,
+        .scan_entries = true,
+    };
+    Hashmap *map = hashmap_create_with_options(hasher, options);
     ASSERT(map != NULL);
 
-    /* Insert n key-value pairs with the same hash */
+    unsigned int *keys = malloc(n * sizeof(*keys) + 1);
+    ASSERT(keys != NULL);
     for (unsigned int i = 0; i < n; ++i) {
-        unsigned int *key_val = malloc(sizeof(i));
-        ASSERT(key_val != NULL);
-        *key_val = i;
+        keys[i] = i;
+        ASSERT(hashmap_insert(map, &keys[i], &keys[i], NULL));
+    }
+    for (unsigned int i = 0; i < n; i += 2) {
+        ASSERT(hashmap_remove(map, &i, NULL));
+    }
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT(hashmap_get(map, &i) == (i % 2 == 1 ? &keys[i] : NULL));
+    }
 
-        /* Insert the i-th key-value pair */
-        Value *entry = NULL;
-        bool success = hashmap_insert(map, key_val, key_val, &entry);
-        ASSERT(success);
-        ASSERT(entry != NULL);
-        ASSERT(entry == key_val);
+    /* Shared pages are probed with the control bytes */
+    Hashmap *clone = hashmap_clone(map);
+    ASSERT(clone != NULL);
+    for (unsigned int i = 0; i < n; i += 2) {
+        ASSERT(hashmap_insert(map, &keys[i], &keys[i], NULL));
+    }
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT(hashmap_get(map, &i) == &keys[i]);
+        ASSERT(hashmap_get(clone, &i) == (i % 2 == 1 ? &keys[i] : NULL));
+    }
+    unsigned int missing = n;
+    ASSERT(hashmap_get(map, &missing) == NULL);
 
-        /* Verify that the entry is indeed in the map */
-        entry = hashmap_get(map, key_val);
-        ASSERT(entry != NULL);
-        ASSERT(entry == key_val);
+    hashmap_destroy(clone, NULL, NULL);
+    hashmap_destroy(map, NULL, NULL);
+    free(keys);
 
-        /* Verfiy the size of the map */
-        size_t size = hashmap_size(map);
-        ASSERT(size == i + 1);
+    return SUCCESS;
+}
+
+typedef struct Point {
+    uint64_t x;
+    uint32_t y;
+    uint32_t z;
+} Point;
+
+/**
+ * A flat map with integer keys and struct values, hashed and compared by
+ * their bytes. The keys and values only live on the stack while inserting.
+ */
+static result_t flat_map(unsigned int n, size_t resize_step) {
+    Hasher hasher = { .hash = NULL, .equal = NULL };
+    HashmapOptions options = {
+        .key_size = sizeof(uint64_t),
+        .value_size = sizeof(Point),
+        .min_load_factor = 0.2,
+        .resize_step = resize_step,
+    };
+    Hashmap *map = hashmap_create_with_options(hasher, options);
+    ASSERT(map != NULL);
+
+    for (unsigned int i = 0; i < n; ++i) {
+        uint64_t key = (uint64_t)i << 32;
+        Point point = { .x = key, .y = i, .z = 2 * i };
+        Value *entry = NULL;
+        ASSERT(hashmap_insert(map, &key, &point, &entry));
+        ASSERT(entry != NULL && entry != &point);
+        ASSERT(memcmp(entry, &point, sizeof(point)) == 0);
+
+        /* Inserting again keeps the old value */
+        Point other = { .x = 0, .y = 0, .z = 0 };
+        ASSERT(!hashmap_insert(map, &key, &other, &entry));
+        ASSERT(((Point *)entry)->y == i);
+    }
+    ASSERT(hashmap_size(map) == n);
+
+    for (unsigned int i = 0; i < 2 * n; ++i) {
+        uint64_t key = (uint64_t)i << 32;
+        Point *point = hashmap_get(map, &key);
+        if (i < n) {
+            ASSERT(point != NULL);
+            ASSERT(point->x == key && point->y == i && point->z == 2 * i);
+            /* Values can be modified in place */
+            point->z += 1;
+        } else {
+            ASSERT(point == NULL);
+        }
     }
 
-    /* Remove the entries again */
+    for (unsigned int i = 0; i < n; i += 2) {
+        uint64_t key = (uint64_t)i << 32;
+        HashmapEntry removed;
+        ASSERT(hashmap_remove(map, &key, &removed));
+        ASSERT(removed.key != &key && *(uint64_t *)removed.key == key);
+        ASSERT(((Point *)removed.value)->z == 2 * i + 1);
+        ASSERT(!hashmap_remove(map, &key, NULL));
+    }
+    ASSERT(hashmap_size(map) == n / 2);
+
     for (unsigned int i = 0; i < n; ++i) {
-        /* Remove the i-th key-value pair */
-        HashmapEntry removed_entry;
-        bool success = hashmap_remove(map, &i, &removed_entry);
-        ASSERT(success);
-        ASSERT(removed_entry.key != NULL);
-        ASSERT(*(unsigned int *)removed_entry.key == i);
-        ASSERT(removed_entry.value != NULL);
-        ASSERT(*(unsigned int *)removed_entry.value == i);
-        ASSERT(removed_entry.key == removed_entry.value);
+        uint64_t key = (uint64_t)i << 32;
+        ASSERT((hashmap_get(map, &key) != NULL) == (i % 2 == 1));
+    }
 
-        /* We only need to free once because the key and value are the same */
-        free(removed_entry.key);
+    hashmap_destroy(map, NULL, NULL);
 
-        /* Verify that the entry is no longer in the map */
-        Value *got = hashmap_get(map, &i);
-        ASSERT(got == NULL);
+    return SUCCESS;
+}
 
-        /* Verify the size of the map */
-        size_t size = hashmap_size(map);
-        ASSERT(size == n - i - 1);
+#define NAME_SIZE 16
+
+static hash_t name_hash(void *key) {
+    const char *name = key;
+    hash_t hash = 0;
+    for (size_t i = 0; i < NAME_SIZE && name[i] != '\0'; ++i) {
+        hash = hash * 31 + (unsigned char)(name[i] | 0x20);
     }
+    return hash;
+}
+
+static bool name_equal(void *key1, void *key2) {
+    const char *name1 = key1;
+    const char *name2 = key2;
+    for (size_t i = 0; i < NAME_SIZE; ++i) {
+        if ((name1[i] | 0x20) != (name2[i] | 0x20)) {
+            return false;
+        }
+        if (name1[i] == '\0') {
+            return true;
+        }
+    }
+    return true;
+}
+
+/**
+ * A flat set of fixed size, case insensitive names with a custom hasher.
+ */
+static result_t flat_set_with_hasher(void) {
+    Hasher hasher = { .hash = name_hash, .equal = name_equal };
+    HashmapOptions options = { .key_size = NAME_SIZE };
+    Hashmap *map = hashmap_create_with_options(hasher, options);
+    ASSERT(map != NULL);
+
+    char name[NAME_SIZE] = "alice";
+    ASSERT(hashmap_insert(map, name, NULL, NULL));
+    strcpy(name, "bob");
+    ASSERT(hashmap_insert(map, name, NULL, NULL));
+    strcpy(name, "ALICE");
+    ASSERT(!hashmap_insert(map, name, NULL, NULL));
+    ASSERT(hashmap_get(map, name) != NULL);
+    strcpy(name, "carol");
+    ASSERT(hashmap_get(map, name) == NULL);
+    ASSERT(hashmap_size(map) == 2);
+
+    strcpy(name, "Bob");
+    HashmapEntry removed;
+    ASSERT(hashmap_remove(map, name, &removed));
+    ASSERT(strcmp(removed.key, "bob") == 0);
+    ASSERT(hashmap_size(map) == 1);
 
-    /* We don't need to free because there are no entries left */
     hashmap_destroy(map, NULL, NULL);
 
     return SUCCESS;
 }
 
+static hash_t u64_hash(uint64_t key) {
+    return (hash_t)(key ^ (key >> 32));
+}
+
+static bool u64_equal(uint64_t key1, uint64_t key2) {
+    return key1 == key2;
+}
+
+static hash_t colliding_hash(unsigned int key) {
+    (void)key;
+    return 0;
+}
+
+static bool unsigned_equal(unsigned int key1, unsigned int key2) {
+    return key1 == key2;
+}
+
+HASHMAP_DEFINE(U64Map, uint64_t, uint64_t, u64_hash, u64_equal)
+HASHMAP_DEFINE(CollidingMap, unsigned int, unsigned int, colliding_hash, unsigned_equal)
+/* The void pointer hashers work with typed maps as well */
+HASHMAP_DEFINE(StringMap, Key *, Value *, string_hash, string_equal)
+
+static result_t typed_map(unsigned int n) {
+    U64Map *map = U64Map_create();
+    ASSERT(map != NULL);
+
+    for (unsigned int i = 0; i < n; ++i) {
+        uint64_t *entry = NULL;
+        ASSERT(U64Map_insert(map, (uint64_t)i << 32, i, &entry));
+        ASSERT(entry != NULL && *entry == i);
+        ASSERT(!U64Map_insert(map, (uint64_t)i << 32, 0, &entry));
+        ASSERT(*entry == i);
+    }
+    ASSERT(U64Map_size(map) == n);
+    ASSERT(U64Map_capacity(map) >= n);
+
+    for (unsigned int i = 0; i < 2 * n; ++i) {
+        uint64_t *value = U64Map_get(map, (uint64_t)i << 32);
+        ASSERT((value != NULL) == (i < n));
+        ASSERT(value == NULL || *value == i);
+    }
+
+    for (unsigned int i = 0; i < n; i += 2) {
+        U64Map_entry removed;
+        ASSERT(U64Map_remove(map, (uint64_t)i << 32, &removed));
+        ASSERT(removed.key == (uint64_t)i << 32 && removed.value == i);
+        ASSERT(!U64Map_remove(map, (uint64_t)i << 32, NULL));
+    }
+    ASSERT(U64Map_size(map) == n / 2);
+
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT((U64Map_get(map, (uint64_t)i << 32) != NULL) == (i % 2 == 1));
+    }
+
+    U64Map_destroy(map, NULL, NULL);
+
+    return SUCCESS;
+}
+
 /**
- * Convert an unsigned integer to a string.
- *
- * The caller is responsible for freeing the returned string.
- * If the conversion fails, NULL is returned.
+ * With all keys colliding, every entry is in one cluster that wraps around the
+ * end of the table, which stresses Robin Hood insertion and backward shifting.
  */
-static char *uint_to_string(unsigned int n) {
-    int length = snprintf(NULL, 0, "%d", n);
-    assert(length > 0);
-    char *key = malloc((size_t)length + 1);
-    if (key == NULL) {
-        return NULL;
+static result_t typed_map_colliding(unsigned int n) {
+    CollidingMap *map = CollidingMap_create();
+    ASSERT(map != NULL);
+    ASSERT(CollidingMap_reserve(map, n));
+    size_t capacity = CollidingMap_capacity(map);
+
+    for (unsigned int i = 0; i < n; ++i) {
+        ASSERT(CollidingMap_insert(map, i, i + 1, NULL));
     }
-    int num_written = snprintf(key, (size_t)length + 1, "%d", n);
-    assert(num_written == length);
+    ASSERT(CollidingMap_capacity(map) == capacity);
 
-    return key;
+    for (unsigned int i = 0; i < n; ++i) {
+        unsigned int *value = CollidingMap_get(map, i);
+        ASSERT(value != NULL && *value == i + 1);
+    }
+
+    /* Remove in a scrambled order, `n` must not be a multiple of 7 */
+    for (unsigned int i = 0; i < n; ++i) {
+        unsigned int key = (i * 7) % n;
+        ASSERT(CollidingMap_remove(map, key, NULL));
+        ASSERT(CollidingMap_get(map, key) == NULL);
+        if (i + 1 < n) {
+            unsigned int next = ((i + 1) * 7) % n;
+            unsigned int *value = CollidingMap_get(map, next);
+            ASSERT(value != NULL && *value == next + 1);
+        }
+    }
+    ASSERT(CollidingMap_size(map) == 0);
+
+    CollidingMap_destroy(map, NULL, NULL);
+
+    return SUCCESS;
+}
+
+static void free_key(Key *key) {
+    free(key);
+}
+
+static result_t typed_map_strings(unsigned int n) {
+    StringMap *map = StringMap_create();
+    ASSERT(map != NULL);
+
+    for (unsigned int i = 0; i < n; ++i) {
+        char *key = uint_to_string(i);
+        ASSERT(key != NULL);
+        ASSERT(StringMap_insert(map, key, key, NULL));
+    }
+
+    char buffer[32];
+    for (unsigned int i = 0; i < n; ++i) {
+        snprintf(buffer, sizeof(buffer), "%u", i);
+        Value **value = StringMap_get(map, buffer);
+        ASSERT(value != NULL && strcmp(*value, buffer) == 0);
+    }
+
+    /* Leak sanitizer catches keys that are not destroyed */
+    StringMap_destroy(map, free_key, NULL);
+
+    return SUCCESS;
+}
+
+/**
+ * Typed maps take the same options as `Hashmap`, and all their memory goes
+ * through the allocator.
+ */
+static result_t typed_map_options(unsigned int n, size_t resize_step) {
+    CountingAllocator counting = { 0, 0, (size_t)-1 };
+    HashmapAllocator allocator = {
+        .alloc = counting_alloc,
+        .free = counting_free,
+        .context = &counting,
+    };
+
+    HashmapOptions invalid = { .key_size = sizeof(uint64_t) };
+    ASSERT(U64Map_create_with_allocator(invalid, allocator) == NULL);
+    invalid = (HashmapOptions) { .ordered = true };
+    ASSERT(U64Map_create_with_allocator(invalid, allocator) == NULL);
+    invalid = (HashmapOptions) { .scan_entries = true };
+    ASSERT(U64Map_create_with_allocator(invalid, allocator) == NULL);
+    invalid = (HashmapOptions) { .max_load_factor = 1.5 };
+    ASSERT(U64Map_create_with_allocator(invalid, allocator) == NULL);
+    invalid = (HashmapOptions) { .max_load_factor = 0.5, .growth_factor = 2, .min_load_factor = 0.3 };
+    ASSERT(U64Map_create_with_allocator(invalid, allocator) == NULL);
+    ASSERT(counting.num_allocations == 0);
+
+    HashmapOptions options = {
+        .initial_capacity = n,
+        .max_load_factor = 0.5,
+        .growth_factor = 3,
+        .min_load_factor = 0.05,
+        .resize_step = resize_step,
+    };
+    U64Map *map = U64Map_create_with_allocator(options, allocator);
+    ASSERT(map != NULL);
+    size_t initial_capacity = U64Map_capacity(map);
+    ASSERT((double)n <= 0.5 * (double)initial_capacity);
+
+    /* The growth factor is rounded up to 4 */
+    size_t capacity = initial_capacity;
+    for (unsigned int i = 0; i < 4 * n; ++i) {
+        ASSERT(U64Map_insert(map, (uint64_t)i << 32, i, NULL));
+        if (U64Map_capacity(map) != capacity) {
+            ASSERT(U64Map_capacity(map) == 4 * capacity);
+            capacity = U64Map_capacity(map);
+        }
+        ASSERT((double)U64Map_size(map) <= 0.5 * (double)capacity);
+    }
+    ASSERT(n == 0 || capacity > initial_capacity);
+    for (unsigned int i = 0; i < 4 * n; ++i) {
+        uint64_t *value = U64Map_get(map, (uint64_t)i << 32);
+        ASSERT(value != NULL && *value == i);
+    }
+
+    /* Shrinks once fewer than 5% of the entries are used */
+    for (unsigned int i = 0; i < 4 * n; ++i) {
+        if (i % 100 != 0) {
+            ASSERT(U64Map_remove(map, (uint64_t)i << 32, NULL));
+        }
+    }
+    ASSERT(n < 100 || U64Map_capacity(map) < capacity);
+    for (unsigned int i = 0; i < 4 * n; ++i) {
+        ASSERT((U64Map_get(map, (uint64_t)i << 32) != NULL) == (i % 100 == 0));
+    }
+
+    /* A failed allocation leaves the map unchanged */
+    counting.remaining = 0;
+    size_t size = U64Map_size(map);
+    unsigned int key = 4 * n;
+    for (;;) {
+        uint64_t *entry;
+        if (!U64Map_insert(map, (uint64_t)key << 32, key, &entry)) {
+            ASSERT(entry == NULL);
+            break;
+        }
+        key += 1;
+        size += 1;
+    }
+    ASSERT(U64Map_size(map) == size);
+    ASSERT(U64Map_get(map, (uint64_t)key << 32) == NULL);
+    counting.remaining = (size_t)-1;
+
+    U64Map_destroy(map, NULL, NULL);
+    ASSERT(counting.live_bytes == 0);
+
+    return SUCCESS;
+}
+
+#ifndef CONSISTENCY_CHECKS
+/* The consistency checks call the hash function themselves, so the number of
+ * hash calls can only be tested without them. */
+
+static unsigned int num_hash_calls = 0;
+
+static hash_t counting_uint_hash(void *key) {
+    num_hash_calls += 1;
+    return *(unsigned int *)key;
+}
+
+/**
+ * Growing the map should reuse the cached hashes instead of calling the hash
+ * function again for every entry that is moved.
+ */
+static result_t no_rehash_on_growth(unsigned int n) {
+    Hasher hasher = {
+        .hash = counting_uint_hash,
+        .equal = uint_equals
+    };
+
+    unsigned int *keys = malloc(n * sizeof(*keys));
+    ASSERT(keys != NULL);
+
+    Hashmap *map = hashmap_create(hasher);
+    ASSERT(map != NULL);
+
+    num_hash_calls = 0;
+    for (unsigned int i = 0; i < n; ++i) {
+        keys[i] = i;
+        bool success = hashmap_insert(map, &keys[i], &keys[i], NULL);
+        ASSERT(success);
+
+        /* Exactly one hash call per insert, even if the map had to grow */
+        ASSERT(num_hash_calls == i + 1);
+    }
+
+    /* All keys should still be retrievable after growing */
+    for (unsigned int i = 0; i < n; ++i) {
+        Value *got = hashmap_get(map, &i);
+        ASSERT(got == &keys[i]);
+    }
+
+    hashmap_destroy(map, NULL, NULL);
+    free(keys);
+
+    return SUCCESS;
 }
+#endif
 
 static result_t insert_get_remove_n(unsigned int n) {
     Hashmap *map = hashmap_create(STRING_HASHER);
@@ -349,6 +2565,148 @@ int main(void) {
     TEST(insert_remove_colliding(500));
 #endif
 
+    TEST(probe_stats_colliding(1));
+    TEST(probe_stats_colliding(100));
+    TEST(stats_colliding(1));
+    TEST(stats_colliding(100));
+
+    TEST(options_invalid());
+    TEST(options_initial_capacity(1));
+    TEST(options_initial_capacity(100));
+    TEST(options_initial_capacity(1000));
+    TEST(options_load_factor(0.1, 1000));
+    TEST(options_load_factor(0.5, 1000));
+    TEST(options_load_factor(0.99, 1000));
+    TEST(options_growth_factor(1000));
+
+    TEST(reserve_shrink_to_fit(0));
+    TEST(reserve_shrink_to_fit(10));
+    TEST(reserve_shrink_to_fit(1000));
+    TEST(automatic_shrink(1000));
+
+    TEST(incremental_resize(10, 1));
+    TEST(incremental_resize(1000, 1));
+    TEST(incremental_resize(1000, 2));
+    TEST(incremental_resize(1000, 16));
+    TEST(incremental_resize_destroy(100));
+
+    TEST(hash_bytes());
+    TEST(seeded_string_hasher(1000));
+    TEST(slice_word_count());
+    TEST(owned_strings(0));
+    TEST(owned_strings(1000));
+#ifndef CONSISTENCY_CHECKS
+    TEST(owned_strings(100000));
+#endif
+    TEST(custom_allocator(0));
+    TEST(custom_allocator(1000));
+    TEST(huge_page_allocator(0));
+    TEST(huge_page_allocator(1000));
+
+    TEST(iterate(0, (HashmapOptions) { 0 }));
+    TEST(iterate(1000, (HashmapOptions) { 0 }));
+    TEST(iterate(1000, (HashmapOptions) { .resize_step = 1 }));
+    TEST(iterate(1000, (HashmapOptions) { .ordered = true }));
+    TEST(ordered_map(0));
+    TEST(ordered_map(1));
+    TEST(ordered_map(1000));
+
+    Hasher uint_hasher = { .hash = identity_hash, .equal = uint_equals };
+    Hasher grouped_hasher = { .hash = grouped_hash, .equal = uint_equals };
+    TEST(build_parallel(uint_hasher, 0, 1, 4));
+    TEST(build_parallel(uint_hasher, 1, 1, 4));
+    TEST(build_parallel(uint_hasher, 1000, 1000, 0));
+    TEST(build_parallel(uint_hasher, 1000, 300, 4));
+    TEST(build_parallel(grouped_hasher, 1000, 300, 4));
+#ifndef CONSISTENCY_CHECKS
+    /* Large enough for several regions per thread */
+    TEST(build_parallel(uint_hasher, 300000, 300000, 1));
+    TEST(build_parallel(uint_hasher, 300000, 200000, 7));
+    TEST(build_parallel(grouped_hasher, 300000, 200000, 16));
+#endif
+
+    TEST(concurrent_map(2, 0));
+    TEST(concurrent_map(100, 4));
+    TEST(concurrent_map(1000, 4));
+
+    TEST(sharded_map(0, 1));
+    TEST(sharded_map(1000, 1));
+    TEST(sharded_map(1000, 5));
+    TEST(sharded_map(100000, 64));
+
+    TEST(upsert_counts(0, 0));
+    TEST(upsert_counts(1, 0));
+    TEST(upsert_counts(1000, 0));
+    TEST(upsert_counts(1000, 1));
+    TEST(entry_owned_values());
+
+    TEST(snapshot_strings(0, false, false));
+    TEST(snapshot_strings(1000, false, false));
+    TEST(snapshot_strings(1000, false, true));
+    TEST(snapshot_strings(1000, true, false));
+    TEST(snapshot_flat(0));
+    TEST(snapshot_flat(1000));
+    TEST(snapshot_invalid());
+
+    Hasher colliding_hasher = { .hash = return_0, .equal = uint_equals };
+    Hasher bytes_hasher = { .hash = NULL, .equal = NULL };
+    TEST(frozen_flat(bytes_hasher, 0, 1));
+    TEST(frozen_flat(bytes_hasher, 1, 1));
+    TEST(frozen_flat(bytes_hasher, 1000, 1));
+    TEST(frozen_flat(uint_hasher, 1000, 4));
+    TEST(frozen_flat(grouped_hasher, 1000, 4));
+    TEST(frozen_flat(colliding_hasher, 100, 1));
+    TEST(frozen_strings(0, false));
+    TEST(frozen_strings(1000, false));
+    TEST(frozen_strings(1000, true));
+#ifndef CONSISTENCY_CHECKS
+    /* Large enough for several partitions per thread */
+    TEST(frozen_flat(bytes_hasher, 300000, 1));
+    TEST(frozen_flat(uint_hasher, 300000, 2));
+    TEST(frozen_flat(grouped_hasher, 300000, 3));
+#endif
+
+    TEST(clone_flat(bytes_hasher, 0, 0));
+    TEST(clone_flat(bytes_hasher, 1, 0));
+    TEST(clone_flat(bytes_hasher, 1000, 0));
+    TEST(clone_flat(bytes_hasher, 1000, 3));
+    /* Clusters that cross pages */
+    TEST(clone_flat(grouped_hasher, 3000, 0));
+    TEST(clone_strings(0, false));
+    TEST(clone_strings(1000, false));
+    TEST(clone_strings(1000, true));
+    TEST(clone_concurrent(1000));
+
+    TEST(batch_insert_get(0, 0));
+    TEST(batch_insert_get(1, 0));
+    TEST(batch_insert_get(1000, 0));
+    TEST(batch_insert_get(1000, 1));
+    TEST(batch_insert_get(1000, 4));
+
+    TEST(scanned_map(uint_hasher, 0, 0));
+    TEST(scanned_map(uint_hasher, 1000, 0));
+    TEST(scanned_map(uint_hasher, 1000, 2));
+    TEST(scanned_map(grouped_hasher, 1000, 0));
+
+    TEST(flat_map(0, 0));
+    TEST(flat_map(1000, 0));
+    TEST(flat_map(1000, 3));
+    TEST(flat_set_with_hasher());
+
+    TEST(typed_map(0));
+    TEST(typed_map(1000));
+    TEST(typed_map(100000));
+    TEST(typed_map_colliding(1));
+    TEST(typed_map_colliding(200));
+    TEST(typed_map_strings(1000));
+    TEST(typed_map_options(0, 0));
+    TEST(typed_map_options(1000, 0));
+    TEST(typed_map_options(1000, 3));
+
+#ifndef CONSISTENCY_CHECKS
+    TEST(no_rehash_on_growth(1000));
+#endif
+
     TEST(insert_get_remove_n(0));
     TEST(insert_get_remove_n(1));
     TEST(insert_get_remove_n(10));